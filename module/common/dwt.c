@@ -0,0 +1,124 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * DWT cycle counter of the Cortex-M3 core, shared by the module
+ * measurement code.
+ *
+ * The counter rate is measured against the system timer the first time it
+ * is asked for, which busy-waits for DWT_CALIBRATE_MS; later callers get
+ * the cached result, so a module pays for the calibration once however many
+ * of its files time things.
+ *
+ * Board files are copied side by side without headers, so users declare the
+ * functions they call.  Host harnesses do not build this file: they provide
+ * the same functions on their simulated clock.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <nuttx/clock.h>
+
+#define DEMCR                       (*(volatile uint32_t *)0xe000edfc)
+#define DEMCR_TRCENA                (1 << 24)
+#define DWT_CTRL                    (*(volatile uint32_t *)0xe0001000)
+#define DWT_CTRL_CYCCNTENA          (1 << 0)
+#define DWT_CYCCNT                  (*(volatile uint32_t *)0xe0001004)
+
+#define DWT_CALIBRATE_MS            100
+
+static bool dwt_enabled;
+static uint32_t dwt_hz;
+
+/**
+ * @brief Start the cycle counter, if not running yet
+ */
+void dwt_enable(void)
+{
+    if (dwt_enabled)
+        return;
+
+    DEMCR |= DEMCR_TRCENA;
+    DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+    dwt_enabled = true;
+}
+
+/**
+ * @brief Read the cycle counter
+ *
+ * @return Core cycles, free running
+ */
+uint32_t dwt_cycles(void)
+{
+    return DWT_CYCCNT;
+}
+
+/**
+ * @brief Rate of the cycle counter, measured on first call
+ *
+ * Starts the counter if needed.  The window opens and closes on a tick
+ * edge, so the result is good to a few cycles per tick of the window.
+ *
+ * @return Core clock in Hz
+ */
+uint32_t dwt_clock_hz(void)
+{
+    uint32_t ticks = MSEC2TICK(DWT_CALIBRATE_MS);
+    uint32_t start_tick;
+    uint32_t start;
+
+    if (dwt_hz)
+        return dwt_hz;
+
+    dwt_enable();
+
+    start_tick = clock_systimer();
+    while (clock_systimer() == start_tick);
+
+    start_tick = clock_systimer();
+    start = DWT_CYCCNT;
+    while (clock_systimer() - start_tick < ticks);
+
+    dwt_hz = (uint64_t)(DWT_CYCCNT - start) * 1000000 /
+             (ticks * USEC_PER_TICK);
+
+    return dwt_hz;
+}
+
+/**
+ * @brief Rate of the cycle counter in whole cycles per microsecond
+ *
+ * @return Cycles per microsecond, at least 1
+ */
+uint32_t dwt_cycles_per_us(void)
+{
+    uint32_t cpu = dwt_clock_hz() / 1000000;
+
+    return cpu ? cpu : 1;
+}
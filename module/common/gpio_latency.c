@@ -0,0 +1,455 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * GPIO interrupt latency harness.
+ *
+ * An output line is wired to an input line with an interrupt on both
+ * edges.  For every sample the harness toggles the output, and the
+ * interrupt path reports back through two hooks, each taking a
+ * cycle-counter timestamp:
+ *
+ * - gpio_latency_mark() on entry to the interrupt handler;
+ * - gpio_latency_event() when the handler hands its Greybus event on
+ *   (HID report callback, Greybus request, ...).
+ *
+ * Latencies are counted from the timestamp taken just before the output is
+ * written, so they include the GPIO write itself, and are accumulated into
+ * log-linear histograms, four buckets per power of two nanoseconds.
+ *
+ * In GPIO_LATENCY_ATTACH mode the harness owns the input and attaches its
+ * own handler, which only has a handler stage.  Otherwise the input
+ * belongs to a driver that calls both hooks from its handler; the
+ * hooks return at once when no run is in progress.  Such drivers usually
+ * unmask their interrupt only once the AP has connected, so the harness
+ * first toggles the output once a second until an event gets through.
+ *
+ * The harness is shared by the modules whose interrupt paths it measures.
+ * It also builds on the host (GPIO_HOST) against the simulated GPIO bank in
+ * tutorial-gpio/host/gpio_sim.c.
+ */
+
+#include <errno.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nuttx/config.h>
+#include <nuttx/clock.h>
+#include <nuttx/gpio.h>
+#include <nuttx/util.h>
+
+/* gpio_latency_run() flags */
+#define GPIO_LATENCY_ATTACH         0x01
+
+/* Stages, as numbered by gpio_latency_stats() */
+#define GPIO_LATENCY_HANDLER        0
+#define GPIO_LATENCY_EVENT          1
+#define GPIO_LATENCY_STAGES         2
+
+#define GPIO_LATENCY_SAMPLES        256
+/* Default time left between samples; must exceed any input debounce */
+#define GPIO_LATENCY_GAP_MS         2
+#define GPIO_LATENCY_TIMEOUT_MS     1000
+/* Edges sent for a driver to come up before giving up, one per timeout */
+#define GPIO_LATENCY_WARMUP         60
+#define GPIO_LATENCY_BUCKETS        124
+
+/* Cycle counter, see dwt.c; host builds count simulator nanoseconds */
+uint32_t dwt_cycles(void);
+uint32_t dwt_cycles_per_us(void);
+
+static const char *gpio_latency_stage_names[] = {
+    "handler", "event",
+};
+
+struct gpio_latency_hist {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t bucket[GPIO_LATENCY_BUCKETS];
+};
+
+static struct {
+    volatile bool armed;
+    int irq;
+    uint32_t edge;
+    volatile uint32_t stamp[GPIO_LATENCY_STAGES];
+    volatile uint8_t seen;
+    /** Stage whose timestamp ends a sample */
+    uint8_t last;
+    sem_t done;
+
+    uint32_t cycles_per_us;
+    uint32_t timeouts[GPIO_LATENCY_STAGES];
+    struct gpio_latency_hist hist[GPIO_LATENCY_STAGES];
+} lat;
+
+static void gpio_latency_stamp(int irq, unsigned int stage)
+{
+    uint32_t now = dwt_cycles();
+
+    if (!lat.armed || irq != lat.irq || lat.seen & (1 << stage))
+        return;
+
+    lat.stamp[stage] = now;
+    lat.seen |= 1 << stage;
+
+    if (stage == lat.last)
+        sem_post(&lat.done);
+}
+
+/**
+ * @brief Interrupt handler entry hook
+ *
+ * @param irq Interrupt number, same as the GPIO number
+ */
+void gpio_latency_mark(int irq)
+{
+    gpio_latency_stamp(irq, GPIO_LATENCY_HANDLER);
+}
+
+/**
+ * @brief Greybus event hook, called when the handler passes its event on
+ *
+ * @param irq Interrupt number, same as the GPIO number
+ */
+void gpio_latency_event(int irq)
+{
+    gpio_latency_stamp(irq, GPIO_LATENCY_EVENT);
+}
+
+static int gpio_latency_irq(int irq, void *context)
+{
+    gpio_latency_mark(irq);
+    return 0;
+}
+
+/**
+ * @brief Histogram bucket of a latency: exact below 4 ns, then four
+ * buckets per power of two
+ */
+static unsigned int gpio_latency_bucket(uint32_t ns)
+{
+    unsigned int msb;
+
+    if (ns < 4)
+        return ns;
+
+    msb = 31 - __builtin_clz(ns);
+    return (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+}
+
+/**
+ * @brief Lowest latency falling into a bucket
+ */
+static uint32_t gpio_latency_bucket_ns(unsigned int bucket)
+{
+    if (bucket < 4)
+        return bucket;
+
+    return (uint32_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+static void gpio_latency_add(unsigned int stage, uint32_t cycles)
+{
+    struct gpio_latency_hist *h = &lat.hist[stage];
+    uint32_t ns = (uint64_t)cycles * 1000 / lat.cycles_per_us;
+
+    if (!h->count || ns < h->min)
+        h->min = ns;
+    if (ns > h->max)
+        h->max = ns;
+    h->sum += ns;
+    h->count++;
+    h->bucket[gpio_latency_bucket(ns)]++;
+}
+
+/**
+ * @brief Upper bound of the latency below which a share of samples fall
+ *
+ * @param per_mille Share of the samples, in 1/1000
+ */
+static uint32_t gpio_latency_percentile(const struct gpio_latency_hist *h,
+                                        unsigned int per_mille)
+{
+    uint32_t want = ((uint64_t)h->count * per_mille + 999) / 1000;
+    uint32_t seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < GPIO_LATENCY_BUCKETS - 1; i++) {
+        seen += h->bucket[i];
+        if (seen >= want)
+            break;
+    }
+
+    return gpio_latency_bucket_ns(i + 1) < h->max ?
+           gpio_latency_bucket_ns(i + 1) : h->max;
+}
+
+static void gpio_latency_report(void)
+{
+    const struct gpio_latency_hist *h;
+    unsigned int stage;
+    unsigned int i;
+
+    for (stage = 0; stage <= lat.last; stage++) {
+        h = &lat.hist[stage];
+
+        printf("gpio_latency: edge to %s: %u samples, %u timeouts\n",
+               gpio_latency_stage_names[stage], h->count, lat.timeouts[stage]);
+        if (!h->count)
+            continue;
+
+        printf("gpio_latency:   min %u avg %u max %u ns, "
+               "p50 %u p99 %u p99.9 %u ns\n", h->min,
+               (uint32_t)(h->sum / h->count), h->max,
+               gpio_latency_percentile(h, 500),
+               gpio_latency_percentile(h, 990),
+               gpio_latency_percentile(h, 999));
+
+        for (i = 0; i < GPIO_LATENCY_BUCKETS; i++) {
+            if (h->bucket[i])
+                printf("gpio_latency:   %9u ns %7u\n",
+                       gpio_latency_bucket_ns(i), h->bucket[i]);
+        }
+    }
+}
+
+/**
+ * @brief Wait for the last stage of a sample
+ *
+ * @return 0 when it was seen, -ETIMEDOUT otherwise
+ */
+static int gpio_latency_wait(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (GPIO_LATENCY_TIMEOUT_MS % 1000) * 1000000;
+    ts.tv_sec += GPIO_LATENCY_TIMEOUT_MS / 1000 + ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+
+    while (sem_timedwait(&lat.done, &ts)) {
+        if (errno != EINTR)
+            return -ETIMEDOUT;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Toggle the output and wait for its edge to go through all stages
+ *
+ * @return 0 on success, -ETIMEDOUT otherwise
+ */
+static int gpio_latency_sample(uint8_t out, uint8_t level)
+{
+    int ret;
+
+    lat.seen = 0;
+    lat.armed = true;
+
+    lat.edge = dwt_cycles();
+    gpio_set_value(out, level);
+
+    ret = gpio_latency_wait();
+    lat.armed = false;
+
+    /* A late hook may have posted after the timeout */
+    while (!sem_trywait(&lat.done));
+
+    return ret;
+}
+
+/**
+ * @brief Run the harness
+ *
+ * @param out Output line, wired to the input
+ * @param in Input line
+ * @param samples Number of edges, alternately rising and falling
+ * @param gap_ms Time between samples
+ * @param flags GPIO_LATENCY_ATTACH to attach the harness's own handler to
+ *              the input, otherwise the input's driver calls the hooks
+ * @return 0 if every sample went through every stage, -ETIMEDOUT if some
+ *         did not, other negative errno on error
+ */
+int gpio_latency_run(uint8_t out, uint8_t in, unsigned int samples,
+                     unsigned int gap_ms, unsigned int flags)
+{
+    bool attach = flags & GPIO_LATENCY_ATTACH;
+    uint32_t timeouts = 0;
+    unsigned int stage;
+    unsigned int i;
+    uint8_t level;
+    int ret;
+
+    if (out == in || out >= gpio_line_count() || in >= gpio_line_count())
+        return -EINVAL;
+
+    memset(&lat, 0, sizeof(lat));
+    lat.irq = in;
+    lat.last = attach ? GPIO_LATENCY_HANDLER : GPIO_LATENCY_EVENT;
+    lat.cycles_per_us = dwt_cycles_per_us();
+    sem_init(&lat.done, 0, 0);
+
+    ret = gpio_activate(out);
+    if (ret)
+        goto out;
+
+    if (attach) {
+        ret = gpio_activate(in);
+        if (ret)
+            goto out_in;
+
+        gpio_direction_in(in);
+        gpio_irq_mask(in);
+        gpio_irq_settriggering(in, IRQ_TYPE_EDGE_BOTH);
+        gpio_irq_attach(in, gpio_latency_irq);
+    }
+
+    /* Start from the input's current level so the first write is an edge */
+    level = gpio_get_value(in);
+    gpio_direction_out(out, level);
+    usleep(gap_ms * 1000);
+
+    if (attach)
+        gpio_irq_unmask(in);
+
+    printf("gpio_latency: GPIO%u -> GPIO%u, %u samples %u ms apart, "
+           "%s handler\n", out, in, samples, gap_ms,
+           attach ? "harness" : "driver");
+
+    for (i = 0; !attach && i < GPIO_LATENCY_WARMUP; i++) {
+        level = !level;
+        if (!gpio_latency_sample(out, level))
+            break;
+
+        if (!i)
+            printf("gpio_latency: waiting for the driver of GPIO%u\n", in);
+    }
+
+    if (i == GPIO_LATENCY_WARMUP) {
+        printf("gpio_latency: no event from GPIO%u\n", in);
+        ret = -ETIMEDOUT;
+        goto out_out;
+    }
+
+    usleep(gap_ms * 1000);
+
+    for (i = 0; i < samples; i++) {
+        level = !level;
+        if (gpio_latency_sample(out, level))
+            timeouts++;
+
+        for (stage = 0; stage <= lat.last; stage++) {
+            if (lat.seen & (1 << stage))
+                gpio_latency_add(stage, lat.stamp[stage] - lat.edge);
+            else
+                lat.timeouts[stage]++;
+        }
+
+        usleep(gap_ms * 1000);
+    }
+
+    gpio_latency_report();
+    ret = timeouts ? -ETIMEDOUT : 0;
+
+out_out:
+    if (attach) {
+        gpio_irq_mask(in);
+        gpio_irq_attach(in, NULL);
+        gpio_deactivate(in);
+    }
+out_in:
+    gpio_deactivate(out);
+out:
+    sem_destroy(&lat.done);
+    return ret;
+}
+
+/**
+ * @brief Number and range of the latencies recorded for a stage in the
+ * last run
+ *
+ * @param stage 0 for the handler, 1 for the event
+ * @param min_ns Lowest latency, may be NULL
+ * @param max_ns Highest latency, may be NULL
+ * @return Number of samples
+ */
+uint32_t gpio_latency_stats(unsigned int stage, uint32_t *min_ns,
+                            uint32_t *max_ns)
+{
+    if (stage >= GPIO_LATENCY_STAGES)
+        return 0;
+
+    if (min_ns)
+        *min_ns = lat.hist[stage].min;
+    if (max_ns)
+        *max_ns = lat.hist[stage].max;
+
+    return lat.hist[stage].count;
+}
+
+/**
+ * @brief Task entry point
+ *
+ * @param argc Argument count
+ * @param argv Output line, input line, then optionally the sample count,
+ *             the time between samples in ms, and "attach" to attach the
+ *             harness's own handler
+ * @return 0 if every sample went through every stage
+ */
+int gpio_latency_main(int argc, char *argv[])
+{
+    unsigned int args[] = { GPIO_LATENCY_SAMPLES, GPIO_LATENCY_GAP_MS };
+    unsigned int flags = 0;
+    unsigned int n = 0;
+    int i;
+
+    if (argc < 3) {
+        printf("usage: %s out in [samples [gap_ms]] [attach]\n", argv[0]);
+        return -EINVAL;
+    }
+
+    for (i = 3; i < argc; i++) {
+        if (!strcmp(argv[i], "attach"))
+            flags |= GPIO_LATENCY_ATTACH;
+        else if (n < ARRAY_SIZE(args))
+            args[n++] = atoi(argv[i]);
+    }
+
+    return gpio_latency_run(atoi(argv[1]), atoi(argv[2]), args[0], args[1],
+                            flags);
+}
@@ -30,6 +30,7 @@
 
 #include <syslog.h>
 #include <errno.h>
+#include <sched.h>
 
 #include <nuttx/config.h>
 #include <nuttx/device.h>
@@ -38,6 +39,18 @@
 #include <nuttx/hid.h>
 #include <nuttx/util.h>
 
+/*
+ * Measure page-up interrupt latency once the AP has connected, with a spare
+ * GPIO1 wired to GPIO0.  Samples are spaced beyond the 250 ms debounce.
+ */
+/* #define GPIO_LATENCY */
+
+#ifdef GPIO_LATENCY
+int gpio_latency_main(int argc, char *argv[]);
+
+static char *gpio_latency_argv[] = { "1", "0", "64", "300", NULL };
+#endif
+
 static struct device_resource eink_board_resources[] = {
     {
         .name  = "eink pageup",
@@ -85,4 +98,9 @@ void ara_module_init(void)
 
     device_table_register(&module_device_table);
     module_driver_register();
+
+#ifdef GPIO_LATENCY
+    task_create("gpio_latency", SCHED_PRIORITY_DEFAULT, 2048,
+                gpio_latency_main, gpio_latency_argv);
+#endif
 }
@@ -57,6 +57,10 @@ struct hid_btn_desc_s {
     int keycode;
 };
 
+/* Interrupt latency hooks, see common/gpio_latency.c */
+void gpio_latency_mark(int irq);
+void gpio_latency_event(int irq);
+
 struct hid_btn_desc_s buttons[] = {
     {.keycode = KEYCODE_PAGEUP},
     {.keycode = KEYCODE_PAGEDOWN}
@@ -195,6 +199,8 @@ static int eink_handle_btn_irq_event(int irq, FAR void *context)
     struct button_info *btn_info = NULL;
     int value;
 
+    gpio_latency_mark(irq);
+
     if (!dev || !device_get_private(dev)) {
         return ERROR;
     }
@@ -216,6 +222,7 @@ static int eink_handle_btn_irq_event(int irq, FAR void *context)
         kbd.keycode = btn_info->last_keystate ? btn_info->keycode : 0;
 
         if (info->event_callback) {
+            gpio_latency_event(irq);
             info->event_callback(dev, HID_INPUT_REPORT, (uint8_t*)&kbd,
                                  sizeof(struct hid_kbd_data));
        }
@@ -2,6 +2,8 @@ config		= config
 manifest	= manifest.mnfs
 board-files	= board.c
 board-files	+= eink.c
+board-files	+= ../common/gpio_latency.c
+board-files	+= ../common/dwt.c
 
 vendor_id	= 0xfffb0004
 product_id	= 0xfffd0002
@@ -28,6 +28,9 @@
 
 #include <syslog.h>
 #include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #include <nuttx/config.h>
 #include <nuttx/device.h>
@@ -37,6 +40,24 @@
 #define SD_POWER_EN_PIN    9 /* GPIO 9 */
 #define SD_CARD_DETECT_PIN 22 /* GPIO 22 */
 
+/*
+ * Debounce the card-detect line for the module's own block layer; the line
+ * is then taken from the board driver, which stops reporting hot-plug
+ */
+/* #define SDIO_CARD_DETECT */
+
+/* The board can switch the card I/O lines to 1.8 V: allow UHS-I modes */
+/* #define SDIO_UHS */
+
+/* Run the block I/O throughput benchmark at boot */
+/* #define SDIO_BENCH */
+
+/*
+ * Let the AP read the block layer trace over CPort 8; the CPort 8 entries
+ * of manifest.mnfs must be uncommented as well
+ */
+/* #define SDIO_TRACE */
+
 static struct device_resource sdio_board_resources[] = {
     {
         .name  = "sdio_gpio_power",
@@ -44,12 +65,14 @@ static struct device_resource sdio_board_resources[] = {
         .start = SD_POWER_EN_PIN,
         .count = 1,
     },
+#ifndef SDIO_CARD_DETECT
     {
         .name  = "sdio_gpio_cd",
         .type  = DEVICE_RESOURCE_TYPE_GPIO,
         .start = SD_CARD_DETECT_PIN,
         .count = 1,
     },
+#endif
 };
 
 static struct device devices[] = {
@@ -68,6 +91,17 @@ static struct device_table sdio_device_table = {
     .device_count = ARRAY_SIZE(devices),
 };
 
+#ifdef SDIO_CARD_DETECT
+static void sdio_card_event(bool present, bool returned, void *arg)
+{
+    extern void sdio_blk_card_event(bool present, bool returned);
+
+    lowsyslog("SD card %s%s\n", present ? "inserted" : "removed",
+              returned ? " (returned)" : "");
+    sdio_blk_card_event(present, returned);
+}
+#endif
+
 void ara_module_early_init(void)
 {
 }
@@ -75,9 +109,40 @@ void ara_module_early_init(void)
 void ara_module_init(void)
 {
     extern struct device_driver sdio_board_driver;
+#ifdef SDIO_TRACE
+    extern int sdio_trace_register(unsigned int cport, unsigned int bundle);
+#endif
+#ifdef SDIO_CARD_DETECT
+    extern int sdio_cd_init(uint8_t gpio, bool active_low,
+                            void (*callback)(bool, bool, void *), void *arg);
+#endif
+#ifdef SDIO_UHS
+    extern void sdio_blk_set_uhs(bool enable);
+#endif
+#ifdef SDIO_BENCH
+    extern int sdio_bench_main(int argc, char *argv[]);
+#endif
 
     lowsyslog("SDIO board module init\n");
 
     device_table_register(&sdio_device_table);
     device_register_driver(&sdio_board_driver);
+
+#ifdef SDIO_TRACE
+    if (sdio_trace_register(8, 8))
+        lowsyslog("sdio: failed to register trace driver\n");
+#endif
+
+#ifdef SDIO_UHS
+    sdio_blk_set_uhs(true);
+#endif
+
+#ifdef SDIO_CARD_DETECT
+    sdio_cd_init(SD_CARD_DETECT_PIN, true, sdio_card_event, NULL);
+#endif
+
+#ifdef SDIO_BENCH
+    task_create("sdio_bench", SCHED_PRIORITY_DEFAULT, 2048, sdio_bench_main,
+                NULL);
+#endif
 }
@@ -0,0 +1,135 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Subset of the NuttX SDIO host controller interface used by the module
+ * block layer, implemented by the card emulator (../sdio_emu.c).
+ */
+
+#ifndef _SDIO_HOST_NUTTX_DEVICE_SDIO_H_
+#define _SDIO_HOST_NUTTX_DEVICE_SDIO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nuttx/device.h>
+
+#define HC_SDIO_CAP_NONREMOVABLE        (1 << 0)
+#define HC_SDIO_CAP_4_BIT_DATA          (1 << 1)
+#define HC_SDIO_CAP_8_BIT_DATA          (1 << 2)
+#define HC_SDIO_CAP_MMC_HS              (1 << 3)
+#define HC_SDIO_CAP_SD_HS               (1 << 4)
+#define HC_SDIO_CAP_ERASE               (1 << 5)
+#define HC_SDIO_CAP_1_2V_DDR            (1 << 6)
+#define HC_SDIO_CAP_1_8V_DDR            (1 << 7)
+#define HC_SDIO_CAP_POWER_OFF_CARD      (1 << 8)
+#define HC_SDIO_CAP_UHS_SDR12           (1 << 9)
+#define HC_SDIO_CAP_UHS_SDR25           (1 << 10)
+#define HC_SDIO_CAP_UHS_SDR50           (1 << 11)
+#define HC_SDIO_CAP_UHS_SDR104          (1 << 12)
+#define HC_SDIO_CAP_UHS_DDR50           (1 << 13)
+
+#define HC_SDIO_POWER_OFF               0x00
+#define HC_SDIO_POWER_UP                0x01
+#define HC_SDIO_POWER_ON                0x02
+#define HC_SDIO_POWER_UNDEFINED         0x03
+
+#define HC_SDIO_BUS_WIDTH_1             0x00
+#define HC_SDIO_BUS_WIDTH_4             0x02
+#define HC_SDIO_BUS_WIDTH_8             0x03
+
+#define HC_SDIO_TIMING_LEGACY           0x00
+#define HC_SDIO_TIMING_MMC_HS           0x01
+#define HC_SDIO_TIMING_SD_HS            0x02
+#define HC_SDIO_TIMING_UHS_SDR12        0x03
+#define HC_SDIO_TIMING_UHS_SDR25        0x04
+#define HC_SDIO_TIMING_UHS_SDR50        0x05
+#define HC_SDIO_TIMING_UHS_SDR104       0x06
+#define HC_SDIO_TIMING_UHS_DDR50        0x07
+
+#define HC_SDIO_SIGNAL_VOLTAGE_330      0x00
+#define HC_SDIO_SIGNAL_VOLTAGE_180      0x01
+#define HC_SDIO_SIGNAL_VOLTAGE_120      0x02
+
+#define HC_SDIO_RSP_NONE                0x00
+#define HC_SDIO_RSP_R1_R5_R6_R7         0x01
+#define HC_SDIO_RSP_R1B                 0x02
+#define HC_SDIO_RSP_R2                  0x03
+#define HC_SDIO_RSP_R3_R4               0x04
+
+#define HC_SDIO_CMD_AC                  0x00
+#define HC_SDIO_CMD_ADTC                0x01
+#define HC_SDIO_CMD_BC                  0x02
+#define HC_SDIO_CMD_BCR                 0x03
+
+struct sdio_cap {
+    uint32_t caps;
+    uint32_t ocr;
+    uint32_t f_min;
+    uint32_t f_max;
+    uint16_t max_blk_count;
+    uint16_t max_blk_size;
+};
+
+struct sdio_ios {
+    uint32_t clock;
+    uint32_t vdd;
+    uint8_t bus_mode;
+    uint8_t power_mode;
+    uint8_t bus_width;
+    uint8_t timing;
+    uint8_t signal_voltage;
+    uint8_t drv_type;
+};
+
+struct sdio_cmd {
+    uint8_t cmd;
+    uint8_t cmd_flags;
+    uint8_t cmd_type;
+    uint32_t cmd_arg;
+    uint16_t data_blocks;
+    uint16_t data_blksz;
+    uint32_t *resp;
+};
+
+struct sdio_transfer {
+    uint16_t blocks;
+    uint16_t blksz;
+    uint8_t *data;
+    size_t dlen;
+    void *dma;
+};
+
+int device_sdio_get_capabilities(struct device *dev, struct sdio_cap *cap);
+int device_sdio_set_ios(struct device *dev, struct sdio_ios *ios);
+int device_sdio_send_cmd(struct device *dev, struct sdio_cmd *cmd);
+int device_sdio_write(struct device *dev, struct sdio_transfer *transfer);
+int device_sdio_read(struct device *dev, struct sdio_transfer *transfer);
+
+#endif /* _SDIO_HOST_NUTTX_DEVICE_SDIO_H_ */
@@ -0,0 +1,716 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * SD memory card emulator for host builds of the SDIO module tools.
+ *
+ * Implements the NuttX SDIO host controller interface on top of an image
+ * file mapped into memory, and models the card closely enough for the
+ * module block layer to identify it, negotiate bus width and speed, and
+ * move data with single- and multi-block commands.
+ *
+ * Time is virtual: every command, bus transfer and flash operation advances
+ * a clock by its modelled cost, and the system timer follows that clock.
+ * The model has a command cost, a read access time, a flash page read on
+ * every new page, page programming (with a read-modify-write penalty for
+ * pages the host only partly writes) and an allocation unit erase whenever
+ * writes move to a different unit.  Programming keeps the card busy, which
+ * the block layer sees through CMD13 and R1b.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <nuttx/clock.h>
+#include <nuttx/device.h>
+#include <nuttx/device_sdio.h>
+
+#include "sdio_emu.h"
+
+#define EMU_BLOCK_SIZE          512
+
+/* Flash geometry: 16 KiB pages, 4 MiB allocation units */
+#define EMU_PAGE_BLOCKS         32
+#define EMU_AU_BLOCKS           8192
+
+/* ACMD41 polls answered busy after power-up */
+#define EMU_OCR_BUSY_POLLS      3
+
+#define EMU_RCA                 0x1234
+
+/* OCR */
+#define EMU_OCR_VDD             0x00ff8000
+#define EMU_OCR_S18             (1 << 24)
+#define EMU_OCR_CCS             (1 << 30)
+#define EMU_OCR_BUSY            (1u << 31)
+
+/* R1 card status */
+#define EMU_R1_ILLEGAL_COMMAND  (1 << 22)
+#define EMU_R1_ADDRESS_ERROR    (1 << 30)
+#define EMU_R1_READY_FOR_DATA   (1 << 8)
+#define EMU_R1_APP_CMD          (1 << 5)
+
+enum emu_state {
+    EMU_IDLE,
+    EMU_READY,
+    EMU_IDENT,
+    EMU_STBY,
+    EMU_TRAN,
+    EMU_DATA,
+    EMU_RCV,
+    EMU_PRG,
+    EMU_DIS,
+};
+
+/**
+ * @brief Data phase announced by the last command
+ */
+struct emu_xfer {
+    bool active;
+    bool write;
+    /** CMD17/CMD24: ends without CMD12 */
+    bool single;
+    /** Next block of a read or write */
+    uint32_t lba;
+    /** Blocks announced by the host */
+    uint32_t left;
+    /** Register contents for CMD6/ACMD51 reads, if reg_len is set */
+    uint8_t reg[64];
+    uint16_t reg_len;
+    /** Flash page the transfer is in, and blocks written to it so far */
+    uint32_t page;
+    uint32_t page_blocks;
+};
+
+struct emu_card {
+    struct sdio_emu_config config;
+    struct sdio_emu_timing timing;
+    struct sdio_emu_stats stats;
+    struct sdio_ios ios;
+    struct device dev;
+    bool open;
+
+    int fd;
+    uint8_t *image;
+
+    enum emu_state state;
+    bool app_cmd;
+    bool hcs;
+    bool s18a;
+    bool bus_4bit;
+    int ocr_polls;
+    uint8_t access_mode;
+
+    struct emu_xfer xfer;
+    uint32_t last_au;
+    uint64_t busy_until;
+
+    uint64_t now;
+};
+
+static struct emu_card emu;
+
+uint64_t sdio_emu_time_ns(void)
+{
+    return emu.now;
+}
+
+uint32_t clock_systimer(void)
+{
+    return emu.now / (USEC_PER_TICK * 1000);
+}
+
+/* Stand-ins for common/dwt.c: one cycle per nanosecond */
+void dwt_enable(void)
+{
+}
+
+uint32_t dwt_cycles(void)
+{
+    return emu.now;
+}
+
+uint32_t dwt_cycles_per_us(void)
+{
+    return 1000;
+}
+
+struct sdio_emu_timing *sdio_emu_timing(void)
+{
+    return &emu.timing;
+}
+
+const struct sdio_emu_stats *sdio_emu_stats(void)
+{
+    return &emu.stats;
+}
+
+void sdio_emu_reset_stats(void)
+{
+    memset(&emu.stats, 0, sizeof(emu.stats));
+}
+
+/**
+ * @brief Time to clock bits over the bus
+ *
+ * @param bits Bits per line
+ */
+static uint64_t emu_bus_ns(uint64_t bits)
+{
+    uint64_t clock = emu.ios.clock ? emu.ios.clock : 400000;
+
+    if (emu.ios.timing == HC_SDIO_TIMING_UHS_DDR50)
+        clock *= 2;
+
+    return bits * 1000000000ull / clock;
+}
+
+static uint64_t emu_data_ns(uint32_t bytes)
+{
+    uint32_t width = emu.ios.bus_width == HC_SDIO_BUS_WIDTH_4 ? 4 : 1;
+
+    /* start bit, data, CRC16 and end bit on each line */
+    return emu_bus_ns(bytes * 8 / width + 18);
+}
+
+static enum emu_state emu_current_state(void)
+{
+    if (emu.state == EMU_PRG && emu.now >= emu.busy_until)
+        emu.state = EMU_TRAN;
+
+    return emu.state;
+}
+
+static uint32_t emu_r1(uint32_t errors)
+{
+    enum emu_state state = emu_current_state();
+    uint32_t r1 = errors | state << 9;
+
+    if (state != EMU_PRG && !emu.xfer.active)
+        r1 |= EMU_R1_READY_FOR_DATA;
+    if (emu.app_cmd)
+        r1 |= EMU_R1_APP_CMD;
+
+    return r1;
+}
+
+/**
+ * @brief Program the page the write stream has been filling
+ *
+ * @return Time the card is busy for it
+ */
+static uint64_t emu_program_page(void)
+{
+    uint32_t au = emu.xfer.page * EMU_PAGE_BLOCKS / EMU_AU_BLOCKS;
+    uint64_t busy = emu.timing.page_program;
+
+    if (!emu.xfer.page_blocks)
+        return 0;
+
+    if (emu.xfer.page_blocks < EMU_PAGE_BLOCKS) {
+        busy += emu.timing.page_read;
+        emu.stats.partial_pages++;
+    }
+
+    if (au != emu.last_au) {
+        busy += emu.timing.au_erase;
+        emu.stats.au_erases++;
+        emu.last_au = au;
+    }
+
+    emu.stats.pages_programmed++;
+    emu.stats.busy_ns += busy;
+    emu.xfer.page_blocks = 0;
+
+    return busy;
+}
+
+/**
+ * @brief End the data phase, leaving the card programming if it wrote
+ */
+static void emu_end_xfer(void)
+{
+    uint64_t busy;
+
+    if (emu.xfer.write) {
+        busy = emu_program_page();
+        emu.busy_until = emu.now + busy;
+        emu.state = busy ? EMU_PRG : EMU_TRAN;
+    } else {
+        emu.state = EMU_TRAN;
+    }
+
+    emu.xfer.active = false;
+}
+
+static void emu_r2_csd(uint32_t *resp)
+{
+    uint32_t c_size = emu.config.blocks / 1024 - 1;
+
+    /* CSD 2.0: TRAN_SPEED 25 MHz, READ_BL_LEN 9, C_SIZE */
+    resp[0] = 1u << 30 | 0x0e << 16 | 0x32;
+    resp[1] = 0x5b590000 | (c_size >> 16);
+    resp[2] = c_size << 16 | 0x7f80;
+    resp[3] = 0x0a400000;
+}
+
+static void emu_r2_cid(uint32_t *resp)
+{
+    /* Manufacturer 0x7e, "EM" "SDEMU" */
+    resp[0] = 0x7e454d53;
+    resp[1] = 0x44454d55;
+    resp[2] = 0x10000001;
+    resp[3] = 0x00010000;
+}
+
+/**
+ * @brief CMD6 switch function status
+ */
+static void emu_switch(uint32_t arg)
+{
+    uint8_t *st = emu.xfer.reg;
+    uint8_t mode = arg & 0xf;
+    uint16_t support = 0x8003;
+
+    if (emu.ios.signal_voltage == HC_SDIO_SIGNAL_VOLTAGE_180)
+        support |= 0x0017;
+
+    memset(st, 0, 64);
+    st[1] = 100;                        /* max current, mA */
+    st[12] = support >> 8;
+    st[13] = support & 0xff;
+
+    if (mode == 0xf || !(support & (1 << mode))) {
+        st[16] = mode == 0xf ? emu.access_mode : 0xf;
+    } else {
+        st[16] = mode;
+        if (arg & (1u << 31))
+            emu.access_mode = mode;
+    }
+
+    emu.xfer.reg_len = 64;
+}
+
+static void emu_scr(void)
+{
+    uint8_t *scr = emu.xfer.reg;
+
+    memset(scr, 0, 8);
+    scr[0] = 0x02;                      /* SD 2.00 */
+    scr[1] = 0x05;                      /* 1-bit and 4-bit */
+    scr[2] = 0x80;                      /* SD 3.00 */
+
+    emu.xfer.reg_len = 8;
+}
+
+static int emu_app_cmd(struct sdio_cmd *cmd, uint32_t *resp)
+{
+    uint32_t arg = cmd->cmd_arg;
+
+    switch (cmd->cmd) {
+    case 6:
+        emu.bus_4bit = (arg & 3) == 2;
+        resp[0] = emu_r1(0);
+        return 0;
+
+    case 41:
+        if (emu.state != EMU_IDLE && emu.state != EMU_READY)
+            return -EIO;
+
+        emu.hcs = !!(arg & EMU_OCR_CCS);
+        resp[0] = EMU_OCR_VDD;
+        if (!(arg & EMU_OCR_VDD))
+            return 0;
+
+        if (++emu.ocr_polls > EMU_OCR_BUSY_POLLS) {
+            emu.state = EMU_READY;
+            emu.s18a = emu.config.uhs && (arg & EMU_OCR_S18);
+            resp[0] |= EMU_OCR_BUSY | EMU_OCR_CCS;
+            if (emu.s18a)
+                resp[0] |= EMU_OCR_S18;
+        }
+        return 0;
+
+    case 51:
+        if (emu_current_state() != EMU_TRAN)
+            return -EIO;
+        emu_scr();
+        emu.xfer.active = true;
+        emu.xfer.write = false;
+        emu.state = EMU_DATA;
+        resp[0] = emu_r1(0);
+        return 0;
+
+    default:
+        return -EIO;
+    }
+}
+
+static int emu_cmd(struct sdio_cmd *cmd, uint32_t *resp)
+{
+    uint32_t arg = cmd->cmd_arg;
+    enum emu_state state = emu_current_state();
+
+    switch (cmd->cmd) {
+    case 0:
+        emu.state = EMU_IDLE;
+        emu.ocr_polls = 0;
+        emu.access_mode = 0;
+        emu.bus_4bit = false;
+        emu.xfer.active = false;
+        return 0;
+
+    case 2:
+        if (state != EMU_READY)
+            return -EIO;
+        emu.state = EMU_IDENT;
+        emu_r2_cid(resp);
+        return 0;
+
+    case 3:
+        if (state != EMU_IDENT && state != EMU_STBY)
+            return -EIO;
+        emu.state = EMU_STBY;
+        resp[0] = EMU_RCA << 16 | (emu_r1(0) & 0x1fff);
+        return 0;
+
+    case 6:
+        if (state != EMU_TRAN)
+            return -EIO;
+        emu_switch(arg);
+        emu.xfer.active = true;
+        emu.xfer.write = false;
+        emu.state = EMU_DATA;
+        resp[0] = emu_r1(0);
+        return 0;
+
+    case 7:
+        if (arg >> 16 != EMU_RCA) {
+            if (state == EMU_TRAN)
+                emu.state = EMU_STBY;
+            return 0;
+        }
+        if (state != EMU_STBY)
+            return -EIO;
+        resp[0] = emu_r1(0);
+        emu.state = EMU_TRAN;
+        return 0;
+
+    case 8:
+        if (state != EMU_IDLE)
+            return -EIO;
+        resp[0] = arg & 0xfff;
+        return 0;
+
+    case 9:
+        if (state != EMU_STBY || arg >> 16 != EMU_RCA)
+            return -EIO;
+        emu_r2_csd(resp);
+        return 0;
+
+    case 11:
+        if (state != EMU_READY || !emu.s18a)
+            return -EIO;
+        resp[0] = emu_r1(0);
+        return 0;
+
+    case 12:
+        resp[0] = emu_r1(0);
+        if (state == EMU_DATA || state == EMU_RCV)
+            emu_end_xfer();
+        /* R1b: the host waits for the card to finish programming */
+        if (emu.state == EMU_PRG && emu.busy_until > emu.now)
+            emu.now = emu.busy_until;
+        emu_current_state();
+        return 0;
+
+    case 13:
+        if (arg >> 16 != EMU_RCA)
+            return -EIO;
+        resp[0] = emu_r1(0);
+        return 0;
+
+    case 16:
+        if (state != EMU_TRAN)
+            return -EIO;
+        resp[0] = arg == EMU_BLOCK_SIZE ? emu_r1(0) :
+                                          emu_r1(EMU_R1_ILLEGAL_COMMAND);
+        return 0;
+
+    case 17:
+    case 18:
+    case 24:
+    case 25:
+        if (state != EMU_TRAN)
+            return -EIO;
+        if (arg >= emu.config.blocks ||
+            arg + cmd->data_blocks > emu.config.blocks) {
+            resp[0] = emu_r1(EMU_R1_ADDRESS_ERROR);
+            return 0;
+        }
+        resp[0] = emu_r1(0);
+        emu.xfer.active = true;
+        emu.xfer.write = cmd->cmd >= 24;
+        emu.xfer.lba = arg;
+        emu.xfer.single = cmd->cmd == 17 || cmd->cmd == 24;
+        emu.xfer.left = emu.xfer.single ? 1 : cmd->data_blocks;
+        emu.xfer.reg_len = 0;
+        emu.xfer.page = UINT32_MAX;
+        emu.xfer.page_blocks = 0;
+        emu.state = emu.xfer.write ? EMU_RCV : EMU_DATA;
+        if (!emu.xfer.write)
+            emu.now += emu.timing.read_access;
+        return 0;
+
+    case 55:
+        if (arg >> 16 != EMU_RCA && state != EMU_IDLE && state != EMU_READY)
+            return -EIO;
+        emu.app_cmd = true;
+        resp[0] = emu_r1(0);
+        return 0;
+
+    default:
+        return -EIO;
+    }
+}
+
+int device_sdio_send_cmd(struct device *dev, struct sdio_cmd *cmd)
+{
+    uint32_t resp[4] = { 0 };
+    bool app = emu.app_cmd && cmd->cmd != 55;
+    int resp_bits;
+    int ret;
+
+    if (!emu.open || emu.ios.power_mode != HC_SDIO_POWER_ON)
+        return -ENODEV;
+
+    resp_bits = cmd->cmd_flags == HC_SDIO_RSP_NONE ? 0 :
+                cmd->cmd_flags == HC_SDIO_RSP_R2 ? 136 : 48;
+    emu.now += emu.timing.cmd_overhead + emu_bus_ns(48 + resp_bits);
+    emu.stats.commands++;
+
+    if (app) {
+        emu.app_cmd = false;
+        ret = emu_app_cmd(cmd, resp);
+    } else {
+        if (cmd->cmd != 55)
+            emu.app_cmd = false;
+        ret = emu_cmd(cmd, resp);
+    }
+    if (ret)
+        return ret;
+
+    if (cmd->resp)
+        memcpy(cmd->resp, resp, cmd->cmd_flags == HC_SDIO_RSP_R2 ?
+                                sizeof(resp) : sizeof(resp[0]));
+
+    return 0;
+}
+
+static int emu_data(struct sdio_transfer *transfer, bool write)
+{
+    uint32_t i;
+
+    if (!emu.open || !emu.xfer.active || emu.xfer.write != write)
+        return -EIO;
+
+    /* Register reads (CMD6, ACMD51) */
+    if (emu.xfer.reg_len) {
+        if (transfer->blocks != 1 || transfer->blksz != emu.xfer.reg_len)
+            return -EINVAL;
+        memcpy(transfer->data, emu.xfer.reg, emu.xfer.reg_len);
+        emu.now += emu_data_ns(emu.xfer.reg_len);
+        emu.xfer.reg_len = 0;
+        emu_end_xfer();
+        return 0;
+    }
+
+    if (transfer->blksz != EMU_BLOCK_SIZE || transfer->blocks > emu.xfer.left)
+        return -EINVAL;
+
+    for (i = 0; i < transfer->blocks; i++) {
+        uint8_t *block = emu.image + (size_t)emu.xfer.lba * EMU_BLOCK_SIZE;
+        uint32_t page = emu.xfer.lba / EMU_PAGE_BLOCKS;
+
+        if (page != emu.xfer.page) {
+            if (write)
+                emu.now += emu_program_page();
+            else
+                emu.now += emu.timing.page_read;
+            emu.xfer.page = page;
+        }
+
+        if (write) {
+            memcpy(block, transfer->data + i * EMU_BLOCK_SIZE, EMU_BLOCK_SIZE);
+            emu.xfer.page_blocks++;
+            emu.stats.blocks_written++;
+        } else {
+            memcpy(transfer->data + i * EMU_BLOCK_SIZE, block, EMU_BLOCK_SIZE);
+            emu.stats.blocks_read++;
+        }
+
+        emu.now += emu_data_ns(EMU_BLOCK_SIZE);
+        emu.xfer.lba++;
+        emu.xfer.left--;
+    }
+
+    /* Single-block transfers end with their block, multi-block ones on CMD12 */
+    if (emu.xfer.single && !emu.xfer.left)
+        emu_end_xfer();
+
+    return 0;
+}
+
+int device_sdio_read(struct device *dev, struct sdio_transfer *transfer)
+{
+    return emu_data(transfer, false);
+}
+
+int device_sdio_write(struct device *dev, struct sdio_transfer *transfer)
+{
+    return emu_data(transfer, true);
+}
+
+int device_sdio_get_capabilities(struct device *dev, struct sdio_cap *cap)
+{
+    memset(cap, 0, sizeof(*cap));
+    cap->caps = emu.config.caps;
+    cap->ocr = EMU_OCR_VDD;
+    cap->f_min = 400000;
+    cap->f_max = emu.config.f_max;
+    cap->max_blk_count = emu.config.max_blk_count;
+    cap->max_blk_size = EMU_BLOCK_SIZE;
+
+    return 0;
+}
+
+int device_sdio_set_ios(struct device *dev, struct sdio_ios *ios)
+{
+    if (ios->power_mode != HC_SDIO_POWER_ON) {
+        emu.state = EMU_IDLE;
+        emu.xfer.active = false;
+        emu.s18a = false;
+        emu.access_mode = 0;
+    }
+
+    if (ios->bus_width == HC_SDIO_BUS_WIDTH_4 && !emu.bus_4bit &&
+        ios->power_mode == HC_SDIO_POWER_ON)
+        fprintf(stderr, "sdio_emu: host set 4-bit bus before ACMD6\n");
+
+    emu.ios = *ios;
+
+    return 0;
+}
+
+struct device *device_open(const char *type, unsigned int id)
+{
+    if (strcmp(type, DEVICE_TYPE_SDIO_HW) || id || emu.open || !emu.image)
+        return NULL;
+
+    emu.open = true;
+    emu.dev.type = type;
+    emu.dev.id = id;
+
+    return &emu.dev;
+}
+
+void device_close(struct device *dev)
+{
+    emu.open = false;
+}
+
+/**
+ * @brief Map the card image and reset the card
+ *
+ * @param config Card and host description
+ * @return 0 on success, negative errno on error
+ */
+int sdio_emu_init(const struct sdio_emu_config *config)
+{
+    struct stat st;
+    size_t size;
+
+    memset(&emu, 0, sizeof(emu));
+    emu.config = *config;
+    emu.config.blocks &= ~1023u;
+    if (!emu.config.blocks)
+        return -EINVAL;
+    if (!emu.config.max_blk_count)
+        emu.config.max_blk_count = 1;
+
+    emu.timing.cmd_overhead = 10000;
+    emu.timing.read_access = 100000;
+    emu.timing.page_read = 60000;
+    emu.timing.page_program = 500000;
+    emu.timing.au_erase = 2000000;
+
+    size = (size_t)emu.config.blocks * EMU_BLOCK_SIZE;
+
+    emu.fd = open(config->image, O_RDWR | O_CREAT, 0644);
+    if (emu.fd < 0)
+        return -errno;
+
+    if (fstat(emu.fd, &st) || (st.st_size < size && ftruncate(emu.fd, size)))
+        goto err_close;
+
+    emu.image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, emu.fd,
+                     0);
+    if (emu.image == MAP_FAILED) {
+        emu.image = NULL;
+        goto err_close;
+    }
+
+    emu.last_au = UINT32_MAX;
+
+    return 0;
+
+err_close:
+    close(emu.fd);
+    return -errno;
+}
+
+/**
+ * @brief Write the image back and unmap it
+ */
+void sdio_emu_exit(void)
+{
+    if (!emu.image)
+        return;
+
+    msync(emu.image, (size_t)emu.config.blocks * EMU_BLOCK_SIZE, MS_SYNC);
+    munmap(emu.image, (size_t)emu.config.blocks * EMU_BLOCK_SIZE);
+    close(emu.fd);
+    emu.image = NULL;
+}
@@ -0,0 +1,91 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SDIO_EMU_H_
+#define _SDIO_EMU_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Emulated card and host controller
+ */
+struct sdio_emu_config {
+    /** Backing image file, created or grown to the card size */
+    const char *image;
+    /** Card size in 512-byte blocks, rounded down to 512 KiB */
+    uint32_t blocks;
+    /** Host controller capabilities (HC_SDIO_CAP_*) */
+    uint32_t caps;
+    /** Highest bus clock the host supports */
+    uint32_t f_max;
+    /** Largest block count of one transfer */
+    uint16_t max_blk_count;
+    /** Card accepts 1.8 V signaling and UHS-I modes */
+    bool uhs;
+};
+
+/**
+ * @brief Flash timing of the emulated card, in nanoseconds
+ */
+struct sdio_emu_timing {
+    /** Host controller and driver cost of one command */
+    uint32_t cmd_overhead;
+    /** Access time of a command that reads data */
+    uint32_t read_access;
+    /** Reading a flash page not yet in the card's buffer */
+    uint32_t page_read;
+    /** Programming one flash page */
+    uint32_t page_program;
+    /** Erasing an allocation unit before writing into a new one */
+    uint32_t au_erase;
+};
+
+/**
+ * @brief Emulator counters
+ */
+struct sdio_emu_stats {
+    uint32_t commands;
+    uint32_t blocks_read;
+    uint32_t blocks_written;
+    uint32_t pages_programmed;
+    /** Pages programmed while only partly written by the host */
+    uint32_t partial_pages;
+    uint32_t au_erases;
+    /** Time the card spent busy programming */
+    uint64_t busy_ns;
+};
+
+int sdio_emu_init(const struct sdio_emu_config *config);
+void sdio_emu_exit(void);
+struct sdio_emu_timing *sdio_emu_timing(void);
+const struct sdio_emu_stats *sdio_emu_stats(void);
+void sdio_emu_reset_stats(void);
+uint64_t sdio_emu_time_ns(void);
+
+#endif /* _SDIO_EMU_H_ */
@@ -0,0 +1,304 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host build of the SDIO module tools, running against the card emulator.
+ *
+ * The module block layer, cache, tracing and benchmark are built unchanged
+ * with the stand-in headers in include/; sdio_emu.c also stands in for
+ * common/dwt.c:
+ *
+ *   cc -O2 -Imodule/sdio/host/include -Imodule/sdio/host \
+ *      -o sdio_host module/sdio/host/sdio_host.c module/sdio/host/sdio_emu.c \
+ *      module/sdio/sdio_blk.c module/sdio/sdio_cache.c \
+ *      module/sdio/sdio_trace.c module/sdio/sdio_bench.c
+ *
+ * Usage: sdio_host [-s size_mib] [-n max_blk_count] [-f f_max_hz] [-u]
+ *                  image {bench|check}
+ *
+ * "bench" runs the on-module benchmark.  "check" runs random reads and
+ * writes through the cache against a reference copy and verifies the card
+ * contents after every sync, follows card-detect events, then compares
+ * small writes with and without the cache.  All times are emulated card
+ * time.  -u makes the card, the host controller and the block layer
+ * (sdio_blk_set_uhs()) UHS-I capable.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nuttx/device_sdio.h>
+
+#include "sdio_emu.h"
+
+/* Region exercised by "check" */
+#define CHECK_LBA           4096
+#define CHECK_BLOCKS        2048
+#define CHECK_OPS           20000
+
+struct sdio_blk;
+struct sdio_cache;
+
+struct sdio_blk *sdio_blk_open(void);
+void sdio_blk_set_uhs(bool enable);
+void sdio_blk_close(struct sdio_blk *blk);
+void sdio_blk_card_event(bool present, bool returned);
+int sdio_blk_read(struct sdio_blk *blk, uint32_t lba, uint32_t count,
+                  uint8_t *buf);
+int sdio_blk_write(struct sdio_blk *blk, uint32_t lba, uint32_t count,
+                   const uint8_t *buf);
+struct sdio_cache *sdio_cache_alloc(struct sdio_blk *blk);
+int sdio_cache_free(struct sdio_cache *c);
+int sdio_cache_read(struct sdio_cache *c, uint32_t lba, uint32_t count,
+                    uint8_t *buf);
+int sdio_cache_write(struct sdio_cache *c, uint32_t lba, uint32_t count,
+                     const uint8_t *buf);
+int sdio_cache_sync(struct sdio_cache *c);
+void sdio_cache_report(struct sdio_cache *c);
+int sdio_bench_main(int argc, char *argv[]);
+
+static int check_card(struct sdio_blk *blk, const uint8_t *ref)
+{
+    uint8_t buf[64 * 512];
+    uint32_t i;
+
+    for (i = 0; i < CHECK_BLOCKS; i += 64) {
+        if (sdio_blk_read(blk, CHECK_LBA + i, 64, buf))
+            return -1;
+        if (memcmp(buf, ref + i * 512, sizeof(buf))) {
+            fprintf(stderr, "check: card differs near block %u\n",
+                    CHECK_LBA + i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Emulated time of 256 single-block writes, 4 KiB apart in pairs
+ *
+ * @param commands Set to the number of card commands they took
+ */
+static uint64_t check_small_writes(struct sdio_blk *blk,
+                                   struct sdio_cache *cache, uint8_t *buf,
+                                   uint32_t *commands)
+{
+    uint64_t start = sdio_emu_time_ns();
+    uint32_t start_commands = sdio_emu_stats()->commands;
+    uint32_t i;
+
+    for (i = 0; i < 256; i++) {
+        uint32_t lba = CHECK_LBA + (i / 2) * 8 + i % 2;
+
+        if (cache)
+            sdio_cache_write(cache, lba, 1, buf);
+        else
+            sdio_blk_write(blk, lba, 1, buf);
+    }
+    if (cache)
+        sdio_cache_sync(cache);
+
+    *commands = sdio_emu_stats()->commands - start_commands;
+    return sdio_emu_time_ns() - start;
+}
+
+static int check(void)
+{
+    struct sdio_cache *cache;
+    struct sdio_blk *blk;
+    uint8_t *ref;
+    uint8_t buf[32 * 512];
+    uint64_t direct, cached;
+    uint32_t direct_cmds, cached_cmds;
+    uint32_t lba, n, i;
+    int op;
+    int ret = -1;
+
+    blk = sdio_blk_open();
+    if (!blk)
+        return -1;
+
+    ref = malloc(CHECK_BLOCKS * 512);
+    cache = sdio_cache_alloc(blk);
+    if (!ref || !cache)
+        goto out;
+
+    srand(1);
+    for (i = 0; i < CHECK_BLOCKS * 512; i++)
+        ref[i] = rand();
+    if (sdio_blk_write(blk, CHECK_LBA, 64, ref))
+        goto out;
+    for (i = 64; i < CHECK_BLOCKS; i += 64) {
+        if (sdio_blk_write(blk, CHECK_LBA + i, 64, ref + i * 512))
+            goto out;
+    }
+
+    for (i = 0; i < CHECK_OPS; i++) {
+        n = 1 + rand() % (rand() % 4 ? 6 : 31);
+        lba = rand() % (CHECK_BLOCKS - n + 1);
+        op = rand() % 16;
+
+        if (op < 7) {
+            uint32_t b;
+
+            for (b = 0; b < n * 512; b++)
+                buf[b] = rand();
+            memcpy(ref + lba * 512, buf, n * 512);
+            if (sdio_cache_write(cache, CHECK_LBA + lba, n, buf))
+                goto out;
+        } else if (op < 15) {
+            if (sdio_cache_read(cache, CHECK_LBA + lba, n, buf))
+                goto out;
+            if (memcmp(buf, ref + lba * 512, n * 512)) {
+                fprintf(stderr, "check: read mismatch at op %u\n", i);
+                goto out;
+            }
+        } else {
+            if (sdio_cache_sync(cache) || check_card(blk, ref))
+                goto out;
+        }
+    }
+
+    if (sdio_cache_sync(cache) || check_card(blk, ref))
+        goto out;
+
+    printf("check: %u operations, data intact\n", CHECK_OPS);
+    sdio_cache_report(cache);
+
+    /* Transfers fail while the slot is empty and bring the card back */
+    sdio_blk_card_event(false, false);
+    if (sdio_blk_read(blk, CHECK_LBA, 1, buf) != -ENODEV) {
+        fprintf(stderr, "check: read from an empty slot\n");
+        goto out;
+    }
+    sdio_blk_card_event(true, true);
+    if (sdio_blk_read(blk, CHECK_LBA, 1, buf) || memcmp(buf, ref, 512))
+        goto out;
+    sdio_blk_card_event(true, false);
+    if (check_card(blk, ref))
+        goto out;
+    printf("check: card-detect events followed\n");
+
+    direct = check_small_writes(blk, NULL, buf, &direct_cmds);
+    cached = check_small_writes(blk, cache, buf, &cached_cmds);
+    printf("check: 256 single-block writes: %llu us in %u commands direct, "
+           "%llu us in %u commands cached\n",
+           (unsigned long long)direct / 1000, direct_cmds,
+           (unsigned long long)cached / 1000, cached_cmds);
+
+    ret = 0;
+
+out:
+    if (cache)
+        sdio_cache_free(cache);
+    free(ref);
+    sdio_blk_close(blk);
+    return ret;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s size_mib] [-n max_blk_count] [-f f_max_hz] "
+            "[-u] image {bench|check}\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sdio_emu_config config = {
+        .blocks = 2048 * 2048,
+        .caps = HC_SDIO_CAP_4_BIT_DATA | HC_SDIO_CAP_SD_HS,
+        .f_max = 50000000,
+        .max_blk_count = 64,
+    };
+    const struct sdio_emu_stats *stats;
+    int ret;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:n:f:u")) != -1) {
+        switch (c) {
+        case 's':
+            config.blocks = strtoul(optarg, NULL, 0) * 2048;
+            break;
+        case 'n':
+            config.max_blk_count = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            config.f_max = strtoul(optarg, NULL, 0);
+            break;
+        case 'u':
+            config.uhs = true;
+            sdio_blk_set_uhs(true);
+            config.caps |= HC_SDIO_CAP_UHS_SDR12 | HC_SDIO_CAP_UHS_SDR25 |
+                           HC_SDIO_CAP_UHS_SDR50 | HC_SDIO_CAP_UHS_DDR50;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    config.image = argv[optind];
+    ret = sdio_emu_init(&config);
+    if (ret) {
+        fprintf(stderr, "cannot open %s: %s\n", config.image, strerror(-ret));
+        return 1;
+    }
+
+    if (!strcmp(argv[optind + 1], "bench")) {
+        ret = sdio_bench_main(0, NULL);
+    } else if (!strcmp(argv[optind + 1], "check")) {
+        ret = check();
+    } else {
+        usage(argv[0]);
+        ret = -1;
+    }
+
+    stats = sdio_emu_stats();
+    printf("sdio_emu: %u commands, %u blocks read, %u written, "
+           "%u pages programmed (%u partial), %u AU erases, "
+           "%llu ms busy, %llu ms total\n",
+           stats->commands, stats->blocks_read, stats->blocks_written,
+           stats->pages_programmed, stats->partial_pages, stats->au_erases,
+           (unsigned long long)stats->busy_ns / 1000000,
+           (unsigned long long)sdio_emu_time_ns() / 1000000);
+
+    sdio_emu_exit();
+
+    return ret ? 1 : 0;
+}
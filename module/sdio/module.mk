@@ -1,6 +1,12 @@
 config		= config
 manifest	= manifest.mnfs
 board-files	= board.c
+board-files	+= sdio_blk.c
+board-files	+= sdio_bench.c
+board-files	+= sdio_cd.c
+board-files	+= sdio_cache.c
+board-files	+= sdio_trace.c
+board-files	+= ../common/dwt.c
 
 vendor_id	= 0x00000000
 product_id	= 0x00000000
@@ -0,0 +1,323 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Block I/O throughput benchmark for the SDIO module.
+ *
+ * Runs sequential and random reads and writes at several transfer sizes
+ * against the card in the slot and reports MB/s (10^6 bytes per second)
+ * and IOPS for each, timed with the core cycle counter.  Writes
+ * are destructive and confined to a scratch area of the card; they are
+ * only run when SDIO_BENCH_WRITE is set.
+ *
+ * The benchmark talks to the card through the module block layer, so the
+ * SDIO bundle must be idle while it runs.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <nuttx/util.h>
+
+/* Scratch area: 64 MiB starting 1 GiB into the card */
+#define SDIO_BENCH_LBA              (0x40000000 / 512)
+#define SDIO_BENCH_SPAN             (0x4000000 / 512)
+
+/* Data moved by each sequential run, and transfers per random run */
+#define SDIO_BENCH_SEQ_BYTES        (4 * 1024 * 1024)
+#define SDIO_BENCH_RAND_OPS         256
+
+#define SDIO_BENCH_MAX_BLOCKS       64
+
+/* Set to 1 to also run the (destructive) write tests */
+#define SDIO_BENCH_WRITE            0
+
+/* Segment size of the multi-segment runs */
+#define SDIO_BENCH_SEG_BLOCKS       8
+
+/* Cycle counter, see common/dwt.c */
+void dwt_enable(void);
+uint32_t dwt_cycles(void);
+uint32_t dwt_cycles_per_us(void);
+
+struct sdio_blk;
+
+struct sdio_blk_seg {
+    uint8_t *data;
+    uint32_t blocks;
+};
+
+struct sdio_blk *sdio_blk_open(void);
+void sdio_blk_close(struct sdio_blk *blk);
+uint32_t sdio_blk_capacity(struct sdio_blk *blk);
+uint32_t sdio_blk_max_blocks(struct sdio_blk *blk);
+int sdio_blk_read(struct sdio_blk *blk, uint32_t lba, uint32_t count,
+                  uint8_t *buf);
+int sdio_blk_write(struct sdio_blk *blk, uint32_t lba, uint32_t count,
+                   const uint8_t *buf);
+int sdio_blk_readv(struct sdio_blk *blk, uint32_t lba,
+                   const struct sdio_blk_seg *seg, int nseg);
+int sdio_blk_writev(struct sdio_blk *blk, uint32_t lba,
+                    const struct sdio_blk_seg *seg, int nseg);
+void *sdio_blk_alloc_buf(uint32_t blocks);
+void sdio_blk_free_buf(void *buf);
+
+struct sdio_cache;
+
+struct sdio_cache *sdio_cache_alloc(struct sdio_blk *blk);
+int sdio_cache_free(struct sdio_cache *c);
+int sdio_cache_read(struct sdio_cache *c, uint32_t lba, uint32_t count,
+                    uint8_t *buf);
+int sdio_cache_write(struct sdio_cache *c, uint32_t lba, uint32_t count,
+                     const uint8_t *buf);
+int sdio_cache_sync(struct sdio_cache *c);
+void sdio_cache_report(struct sdio_cache *c);
+
+void sdio_trace_reset(void);
+void sdio_trace_dump(void);
+
+static const uint32_t sdio_bench_counts[] = { 1, 8, 64 };
+
+/**
+ * @brief One benchmark run
+ */
+struct sdio_bench_run {
+    bool write;
+    bool random;
+    /** Split each transfer into SDIO_BENCH_SEG_BLOCKS segments */
+    bool multiseg;
+    /** Go through the block cache; writes are synced at the end */
+    struct sdio_cache *cache;
+    uint32_t count;
+};
+
+static uint32_t sdio_bench_seed = 0x2545f491;
+
+static uint32_t sdio_bench_rand(void)
+{
+    /* xorshift32 */
+    sdio_bench_seed ^= sdio_bench_seed << 13;
+    sdio_bench_seed ^= sdio_bench_seed >> 17;
+    sdio_bench_seed ^= sdio_bench_seed << 5;
+    return sdio_bench_seed;
+}
+
+/**
+ * @brief Move one transfer of a run
+ *
+ * @param blk Block device
+ * @param run What to run
+ * @param lba First block
+ * @param buf Transfer buffer, run->count blocks
+ * @return 0 on success, negative errno on error
+ */
+static int sdio_bench_xfer(struct sdio_blk *blk,
+                           const struct sdio_bench_run *run, uint32_t lba,
+                           uint8_t *buf)
+{
+    struct sdio_blk_seg seg[SDIO_BENCH_MAX_BLOCKS / SDIO_BENCH_SEG_BLOCKS];
+    int nseg;
+    int i;
+
+    if (run->cache) {
+        return run->write ? sdio_cache_write(run->cache, lba, run->count, buf) :
+                            sdio_cache_read(run->cache, lba, run->count, buf);
+    }
+
+    if (!run->multiseg) {
+        return run->write ? sdio_blk_write(blk, lba, run->count, buf) :
+                            sdio_blk_read(blk, lba, run->count, buf);
+    }
+
+    /* Interleave the segments so that none of them are adjacent in memory */
+    nseg = run->count / SDIO_BENCH_SEG_BLOCKS;
+    for (i = 0; i < nseg; i++) {
+        seg[i].blocks = SDIO_BENCH_SEG_BLOCKS;
+        seg[i].data = buf + ((i * 3) % nseg) * SDIO_BENCH_SEG_BLOCKS * 512;
+    }
+
+    return run->write ? sdio_blk_writev(blk, lba, seg, nseg) :
+                        sdio_blk_readv(blk, lba, seg, nseg);
+}
+
+/**
+ * @brief Execute and report one run
+ *
+ * @param blk Block device
+ * @param base First block of the scratch area
+ * @param span Size of the scratch area, in blocks
+ * @param run What to run
+ * @param buf Transfer buffer, run->count blocks
+ * @return 0 on success, negative errno on the first failing transfer
+ */
+static int sdio_bench_exec(struct sdio_blk *blk, uint32_t base, uint32_t span,
+                           const struct sdio_bench_run *run, uint8_t *buf)
+{
+    uint32_t ops;
+    uint32_t lba = base;
+    uint32_t last;
+    uint32_t now;
+    uint64_t cycles = 0;
+    uint64_t us;
+    uint32_t rate;
+    uint32_t i;
+    int ret = 0;
+
+    if (run->random) {
+        ops = SDIO_BENCH_RAND_OPS;
+    } else {
+        ops = SDIO_BENCH_SEQ_BYTES / (run->count * 512);
+    }
+
+    last = dwt_cycles();
+
+    for (i = 0; i < ops; i++) {
+        if (run->random) {
+            lba = base + (sdio_bench_rand() % (span / run->count)) * run->count;
+        }
+
+        ret = sdio_bench_xfer(blk, run, lba, buf);
+
+        /* Added up per transfer: a whole run can outlast a counter wrap */
+        now = dwt_cycles();
+        cycles += now - last;
+        last = now;
+
+        if (ret)
+            break;
+
+        if (!run->random) {
+            lba += run->count;
+            if (lba + run->count > base + span)
+                lba = base;
+        }
+    }
+
+    if (!ret && run->cache && run->write) {
+        ret = sdio_cache_sync(run->cache);
+        cycles += dwt_cycles() - last;
+    }
+
+    us = cycles / dwt_cycles_per_us();
+    if (!us)
+        us = 1;
+
+    /* Bytes per microsecond is MB/s; kept in hundredths */
+    rate = (uint64_t)i * run->count * 512 * 100 / us;
+    printf("sdio_bench: %-5s %-10s %3u blk%s: %4u.%02u MB/s %6u IOPS%s\n",
+           run->write ? "write" : "read",
+           run->random ? "random" : "sequential", run->count,
+           run->multiseg ? " multi-seg" : run->cache ? " cached" : "",
+           rate / 100, rate % 100, (uint32_t)(i * 1000000ULL / us),
+           ret ? " (aborted)" : "");
+
+    return ret;
+}
+
+int sdio_bench_main(int argc, char *argv[])
+{
+    struct sdio_bench_run run = { 0 };
+    struct sdio_blk *blk;
+    uint32_t base = SDIO_BENCH_LBA;
+    uint32_t span = SDIO_BENCH_SPAN;
+    uint8_t *buf;
+    int w, r;
+    size_t c;
+    int ret = 0;
+
+    dwt_enable();
+
+    blk = sdio_blk_open();
+    if (!blk) {
+        printf("sdio_bench: no card\n");
+        return -1;
+    }
+
+    /* Small cards: use the second half of the card */
+    if (base + span > sdio_blk_capacity(blk)) {
+        span = sdio_blk_capacity(blk) / 2;
+        base = span;
+    }
+
+    buf = sdio_blk_alloc_buf(SDIO_BENCH_MAX_BLOCKS);
+    if (!buf) {
+        ret = -1;
+        goto out;
+    }
+    memset(buf, 0xa5, SDIO_BENCH_MAX_BLOCKS * 512);
+
+    printf("sdio_bench: blocks %u..%u\n", base, base + span - 1);
+
+    /* Leave card initialization out of the command latency histograms */
+    sdio_trace_reset();
+
+    for (w = 0; w <= SDIO_BENCH_WRITE; w++) {
+        for (r = 0; r <= 1; r++) {
+            for (c = 0; c < ARRAY_SIZE(sdio_bench_counts); c++) {
+                run.write = w;
+                run.random = r;
+                run.count = sdio_bench_counts[c];
+                run.multiseg = false;
+                if (run.count > sdio_blk_max_blocks(blk))
+                    continue;
+                if (sdio_bench_exec(blk, base, span, &run, buf))
+                    ret = -1;
+            }
+
+            run.count = SDIO_BENCH_MAX_BLOCKS;
+            run.multiseg = true;
+            if (sdio_bench_exec(blk, base, span, &run, buf))
+                ret = -1;
+        }
+    }
+
+    /* Single-block sequential access through the cache */
+    run.random = false;
+    run.multiseg = false;
+    run.count = 1;
+    run.cache = sdio_cache_alloc(blk);
+    if (run.cache) {
+        for (w = 0; w <= SDIO_BENCH_WRITE; w++) {
+            run.write = w;
+            if (sdio_bench_exec(blk, base, span, &run, buf))
+                ret = -1;
+        }
+        sdio_cache_report(run.cache);
+        if (sdio_cache_free(run.cache))
+            ret = -1;
+    }
+
+    sdio_trace_dump();
+
+    sdio_blk_free_buf(buf);
+out:
+    sdio_blk_close(blk);
+    return ret;
+}
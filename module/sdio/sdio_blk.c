@@ -0,0 +1,1100 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Minimal SD memory card block layer on top of the bridge SDIO host
+ * controller.
+ *
+ * This is used by the on-module tools (benchmark, cache) to talk to the
+ * card directly, without going through the Greybus SDIO protocol: it
+ * identifies and selects the card, then moves 512-byte blocks with
+ * single-block (CMD17/CMD24) or multi-block (CMD18/CMD25) transfers.
+ * Transfers may be described as a list of segments, which are moved under a
+ * single multi-block command.
+ *
+ * The Greybus SDIO driver owns the host controller while the AP uses it, so
+ * a block device can only be opened when the SDIO bundle is idle.
+ *
+ * Transfers and card initialization are serialized by a per-device lock.
+ * Card-detect events only leave a note for the next transfer, which brings
+ * the card back (or fails with -ENODEV while the slot is empty) in the
+ * caller's thread.
+ */
+
+#include <errno.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <nuttx/config.h>
+#include <nuttx/device.h>
+#include <nuttx/device_sdio.h>
+#include <nuttx/kmalloc.h>
+
+#include <arch/irq.h>
+
+#ifdef CONFIG_MM_BUFRAM_ALLOCATOR
+#include <nuttx/bufram.h>
+#endif
+
+#define SDIO_BLK_SIZE               512
+
+#define SDIO_BLK_INIT_CLOCK         400000
+#define SDIO_BLK_DEFAULT_CLOCK      25000000
+#define SDIO_BLK_HS_CLOCK           50000000
+#define SDIO_BLK_SDR50_CLOCK        100000000
+#define SDIO_BLK_VDD                (1 << 20)   /* 3.2-3.3V OCR bit */
+#define SDIO_BLK_OCR_WINDOW         0x00ff8000  /* 2.7-3.6V */
+
+/* Power-off hold and power-up ramp times, SD Physical Layer 6.4.1 */
+#define SDIO_BLK_POWER_OFF_US       1000
+#define SDIO_BLK_POWER_UP_US        1000
+
+/* Signal voltage switch settling time */
+#define SDIO_BLK_1V8_SETTLE_US      5000
+
+/* ACMD41 keeps the card busy for up to 1 s */
+#define SDIO_BLK_OCR_RETRIES        100
+#define SDIO_BLK_OCR_DELAY_US       10000
+
+/* Time allowed for a program cycle to complete */
+#define SDIO_BLK_BUSY_RETRIES       50000
+
+/* SD commands */
+#define SD_GO_IDLE_STATE            0
+#define SD_ALL_SEND_CID             2
+#define SD_SEND_RELATIVE_ADDR       3
+#define SD_SELECT_CARD              7
+#define SD_SWITCH_FUNC              6
+#define SD_SEND_IF_COND             8
+#define SD_SEND_CSD                 9
+#define SD_STOP_TRANSMISSION        12
+#define SD_VOLTAGE_SWITCH           11
+#define SD_SEND_STATUS              13
+#define SD_SET_BLOCKLEN             16
+#define SD_READ_SINGLE_BLOCK        17
+#define SD_READ_MULTIPLE_BLOCK      18
+#define SD_WRITE_BLOCK              24
+#define SD_WRITE_MULTIPLE_BLOCK     25
+#define SD_APP_CMD                  55
+#define SD_APP_SET_BUS_WIDTH        6
+#define SD_APP_OP_COND              41
+#define SD_APP_SEND_SCR             51
+
+#define SD_IF_COND_PATTERN          0x1aa
+#define SD_OCR_BUSY                 (1u << 31)
+#define SD_OCR_CCS                  (1 << 30)
+#define SD_OCR_S18                  (1 << 24)
+
+/* SCR fields */
+#define SD_SCR_SPEC(scr)            ((scr)[0] & 0xf)
+#define SD_SCR_BUS_WIDTH_4          (1 << 2)
+#define SD_SCR_BUS_WIDTHS(scr)      ((scr)[1] & 0xf)
+
+/* CMD6 access mode (function group 1) */
+#define SD_SWITCH_CHECK             0u
+#define SD_SWITCH_SET               1u
+#define SD_SWITCH_STATUS_SIZE       64
+#define SD_SWITCH_GRP1_SUPPORT(st)  (((st)[12] << 8) | (st)[13])
+#define SD_SWITCH_GRP1_RESULT(st)   ((st)[16] & 0xf)
+#define SD_ACCESS_SDR12             0
+#define SD_ACCESS_HS                1   /* SDR25 at 1.8 V */
+#define SD_ACCESS_SDR50             2
+#define SD_ACCESS_SDR104            3
+#define SD_ACCESS_DDR50             4
+
+/* R1 card status */
+#define SD_R1_READY_FOR_DATA        (1 << 8)
+#define SD_R1_STATE(r1)             (((r1) >> 9) & 0xf)
+#define SD_R1_STATE_TRAN            4
+#define SD_R1_ERRORS                0xfdf90008
+
+/* Card-detect event waiting for the next transfer */
+#define SDIO_BLK_EVENT_NONE         0
+#define SDIO_BLK_EVENT_REMOVED      1
+#define SDIO_BLK_EVENT_RETURNED     2
+#define SDIO_BLK_EVENT_INSERTED     3
+
+/* Data phase record ids for sdio_trace_record() */
+#define SDIO_TRACE_DATA_READ        64
+#define SDIO_TRACE_DATA_WRITE       65
+
+uint32_t sdio_trace_now(void);
+void sdio_trace_record(uint8_t id, uint16_t blocks, uint32_t issue,
+                       uint32_t done);
+
+/**
+ * @brief One contiguous piece of a multi-segment transfer
+ */
+struct sdio_blk_seg {
+    /** Data, blocks * 512 bytes */
+    uint8_t *data;
+    uint32_t blocks;
+};
+
+/**
+ * @brief SD card attached to the bridge host controller
+ */
+struct sdio_blk {
+    /** Held by transfers and card initialization */
+    sem_t lock;
+    struct device *dev;
+    struct sdio_cap cap;
+    struct sdio_ios ios;
+    /** Relative card address, pre-shifted for the command argument */
+    uint32_t rca;
+    /** Card OCR, as returned by the last ACMD41 */
+    uint32_t ocr;
+    /** Capacity, in blocks */
+    uint32_t blocks;
+    /** SDHC/SDXC cards are addressed by block, SDSC cards by byte */
+    bool block_addr;
+    /** SDIO_BLK_EVENT_*, set by sdio_blk_card_event() */
+    uint8_t event;
+};
+
+/* Block device currently open, for card-detect events */
+static struct sdio_blk *sdio_blk_current;
+
+/* Board can switch the card I/O lines to 1.8 V, see sdio_blk_set_uhs() */
+static bool sdio_blk_uhs;
+
+/**
+ * @brief Send one command and wait for its response
+ *
+ * @param blk Block device
+ * @param opcode Command index
+ * @param arg Command argument
+ * @param flags Response type (HC_SDIO_RSP_*)
+ * @param type Command type (HC_SDIO_CMD_*)
+ * @param blocks Number of data blocks that follow, 0 for none
+ * @param blksz Size of the data blocks
+ * @param resp Response buffer (4 words for R2, 1 otherwise), may be NULL
+ * @return 0 on success, negative errno on error
+ */
+static int sdio_blk_cmd_blksz(struct sdio_blk *blk, uint8_t opcode,
+                              uint32_t arg, uint8_t flags, uint8_t type,
+                              uint16_t blocks, uint16_t blksz, uint32_t *resp)
+{
+    uint32_t r[4] = { 0 };
+    struct sdio_cmd cmd = {
+        .cmd        = opcode,
+        .cmd_flags  = flags,
+        .cmd_type   = type,
+        .cmd_arg    = arg,
+        .data_blocks = blocks,
+        .data_blksz = blksz,
+        .resp       = r,
+    };
+    uint32_t issue;
+    int ret;
+
+    issue = sdio_trace_now();
+    ret = device_sdio_send_cmd(blk->dev, &cmd);
+    sdio_trace_record(opcode, blocks, issue, sdio_trace_now());
+    if (ret)
+        return ret;
+
+    if (resp)
+        memcpy(resp, r, flags == HC_SDIO_RSP_R2 ? sizeof(r) : sizeof(r[0]));
+
+    /* R1 responses carry the error bits of the card status */
+    if ((flags == HC_SDIO_RSP_R1_R5_R6_R7 || flags == HC_SDIO_RSP_R1B) &&
+        opcode != SD_SEND_RELATIVE_ADDR && opcode != SD_SEND_IF_COND &&
+        (r[0] & SD_R1_ERRORS))
+        return -EIO;
+
+    return 0;
+}
+
+/**
+ * @brief Send one command, with 512-byte data blocks if any
+ */
+static int sdio_blk_cmd(struct sdio_blk *blk, uint8_t opcode, uint32_t arg,
+                        uint8_t flags, uint8_t type, uint16_t blocks,
+                        uint32_t *resp)
+{
+    return sdio_blk_cmd_blksz(blk, opcode, arg, flags, type, blocks,
+                              blocks ? SDIO_BLK_SIZE : 0, resp);
+}
+
+/**
+ * @brief Send an application-specific command (CMD55 + ACMDn)
+ */
+static int sdio_blk_acmd(struct sdio_blk *blk, uint8_t opcode, uint32_t arg,
+                         uint8_t flags, uint8_t type, uint16_t blocks,
+                         uint32_t *resp)
+{
+    int ret;
+
+    ret = sdio_blk_cmd(blk, SD_APP_CMD, blk->rca, HC_SDIO_RSP_R1_R5_R6_R7,
+                       HC_SDIO_CMD_AC, 0, NULL);
+    if (ret)
+        return ret;
+
+    return sdio_blk_cmd(blk, opcode, arg, flags, type, blocks, resp);
+}
+
+/**
+ * @brief Apply the current bus settings to the host controller
+ */
+static int sdio_blk_set_ios(struct sdio_blk *blk)
+{
+    return device_sdio_set_ios(blk->dev, &blk->ios);
+}
+
+/**
+ * @brief Wait for the card to leave the programming state
+ */
+static int sdio_blk_wait_ready(struct sdio_blk *blk)
+{
+    uint32_t status;
+    int retries;
+    int ret;
+
+    for (retries = 0; retries < SDIO_BLK_BUSY_RETRIES; retries++) {
+        ret = sdio_blk_cmd(blk, SD_SEND_STATUS, blk->rca,
+                           HC_SDIO_RSP_R1_R5_R6_R7, HC_SDIO_CMD_AC, 0,
+                           &status);
+        if (ret)
+            return ret;
+
+        if ((status & SD_R1_READY_FOR_DATA) &&
+            SD_R1_STATE(status) == SD_R1_STATE_TRAN)
+            return 0;
+    }
+
+    return -ETIMEDOUT;
+}
+
+/**
+ * @brief Extract the capacity from the CSD register
+ *
+ * @param csd CSD, most significant word first
+ * @return Capacity in 512-byte blocks
+ */
+static uint32_t sdio_blk_csd_blocks(const uint32_t *csd)
+{
+    uint32_t c_size;
+    uint32_t mult;
+    uint32_t read_bl_len;
+
+    if ((csd[0] >> 30) == 1) {
+        /* CSD 2.0: C_SIZE[69:48], 512 KiB units */
+        c_size = ((csd[1] & 0x3f) << 16) | (csd[2] >> 16);
+        return (c_size + 1) << 10;
+    }
+
+    /* CSD 1.0: C_SIZE[73:62], C_SIZE_MULT[49:47], READ_BL_LEN[83:80] */
+    read_bl_len = (csd[1] >> 16) & 0xf;
+    c_size = ((csd[1] & 0x3ff) << 2) | (csd[2] >> 30);
+    mult = (csd[2] >> 15) & 0x7;
+
+    return ((c_size + 1) << (mult + 2)) << read_bl_len >> 9;
+}
+
+/**
+ * @brief Read a short data register (SCR, switch status) after its command
+ *
+ * @param blk Block device
+ * @param app True for an application-specific command
+ * @param opcode Command index
+ * @param arg Command argument
+ * @param buf Destination
+ * @param len Register size in bytes, sent as a single block
+ * @return 0 on success, negative errno on error
+ */
+static int sdio_blk_read_reg(struct sdio_blk *blk, bool app, uint8_t opcode,
+                             uint32_t arg, uint8_t *buf, uint16_t len)
+{
+    struct sdio_transfer transfer;
+    uint32_t issue;
+    int ret;
+
+    if (app) {
+        ret = sdio_blk_cmd(blk, SD_APP_CMD, blk->rca, HC_SDIO_RSP_R1_R5_R6_R7,
+                           HC_SDIO_CMD_AC, 0, NULL);
+        if (ret)
+            return ret;
+    }
+
+    ret = sdio_blk_cmd_blksz(blk, opcode, arg, HC_SDIO_RSP_R1_R5_R6_R7,
+                             HC_SDIO_CMD_ADTC, 1, len, NULL);
+    if (ret)
+        return ret;
+
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.blocks = 1;
+    transfer.blksz = len;
+    transfer.data = buf;
+    transfer.dlen = len;
+
+    issue = sdio_trace_now();
+    ret = device_sdio_read(blk->dev, &transfer);
+    sdio_trace_record(SDIO_TRACE_DATA_READ, 1, issue, sdio_trace_now());
+
+    return ret;
+}
+
+/**
+ * @brief Power-cycle the card
+ *
+ * The card may have been left powered (and, after a UHS session, at 1.8 V
+ * signaling) by a previous user, so always start from power off.  The board
+ * driver drives the power enable GPIO from the power mode.
+ */
+static int sdio_blk_power_cycle(struct sdio_blk *blk)
+{
+    int ret;
+
+    blk->ios.power_mode = HC_SDIO_POWER_OFF;
+    blk->ios.vdd = 0;
+    blk->ios.clock = 0;
+    blk->ios.bus_width = HC_SDIO_BUS_WIDTH_1;
+    blk->ios.timing = HC_SDIO_TIMING_LEGACY;
+    blk->ios.signal_voltage = HC_SDIO_SIGNAL_VOLTAGE_330;
+    ret = sdio_blk_set_ios(blk);
+    if (ret)
+        return ret;
+    usleep(SDIO_BLK_POWER_OFF_US);
+
+    blk->ios.power_mode = HC_SDIO_POWER_UP;
+    blk->ios.vdd = SDIO_BLK_VDD;
+    ret = sdio_blk_set_ios(blk);
+    if (ret)
+        return ret;
+    usleep(SDIO_BLK_POWER_UP_US);
+
+    /* The clock runs from POWER_ON: the card needs 74 cycles before CMD0 */
+    blk->ios.power_mode = HC_SDIO_POWER_ON;
+    blk->ios.clock = SDIO_BLK_INIT_CLOCK;
+    ret = sdio_blk_set_ios(blk);
+    if (ret)
+        return ret;
+    usleep(1000);
+
+    return 0;
+}
+
+/**
+ * @brief Whether the host and board allow UHS-I operation
+ */
+static bool sdio_blk_host_uhs(struct sdio_blk *blk)
+{
+    return sdio_blk_uhs &&
+           (blk->cap.caps & HC_SDIO_CAP_4_BIT_DATA) &&
+           (blk->cap.caps & (HC_SDIO_CAP_UHS_SDR12 | HC_SDIO_CAP_UHS_SDR25 |
+                             HC_SDIO_CAP_UHS_SDR50 | HC_SDIO_CAP_UHS_DDR50));
+}
+
+/**
+ * @brief Switch the card and host to 1.8 V signaling (CMD11)
+ */
+static int sdio_blk_voltage_switch(struct sdio_blk *blk)
+{
+    int ret;
+
+    ret = sdio_blk_cmd(blk, SD_VOLTAGE_SWITCH, 0, HC_SDIO_RSP_R1_R5_R6_R7,
+                       HC_SDIO_CMD_AC, 0, NULL);
+    if (ret)
+        return ret;
+
+    blk->ios.signal_voltage = HC_SDIO_SIGNAL_VOLTAGE_180;
+    ret = sdio_blk_set_ios(blk);
+    if (ret)
+        return ret;
+
+    usleep(SDIO_BLK_1V8_SETTLE_US);
+
+    return 0;
+}
+
+/**
+ * @brief Pick the fastest access mode supported by card, host and board
+ *
+ * @param blk Block device
+ * @param support Card function group 1 support bits
+ * @param timing Host timing for the selected mode
+ * @param clock Bus clock for the selected mode
+ * @return Access mode, or -1 to stay at default speed
+ */
+static int sdio_blk_pick_mode(struct sdio_blk *blk, uint16_t support,
+                              uint8_t *timing, uint32_t *clock)
+{
+    uint32_t caps = blk->cap.caps;
+
+    /*
+     * SDR104 is not offered: it needs sampling point tuning (CMD19), which
+     * the host controller interface does not provide.
+     */
+    if (blk->ios.signal_voltage == HC_SDIO_SIGNAL_VOLTAGE_180) {
+        if ((support & (1 << SD_ACCESS_SDR50)) &&
+            (caps & HC_SDIO_CAP_UHS_SDR50)) {
+            *timing = HC_SDIO_TIMING_UHS_SDR50;
+            *clock = SDIO_BLK_SDR50_CLOCK;
+            return SD_ACCESS_SDR50;
+        }
+        if ((support & (1 << SD_ACCESS_DDR50)) &&
+            (caps & HC_SDIO_CAP_UHS_DDR50)) {
+            *timing = HC_SDIO_TIMING_UHS_DDR50;
+            *clock = SDIO_BLK_HS_CLOCK;
+            return SD_ACCESS_DDR50;
+        }
+        if ((support & (1 << SD_ACCESS_HS)) &&
+            (caps & HC_SDIO_CAP_UHS_SDR25)) {
+            *timing = HC_SDIO_TIMING_UHS_SDR25;
+            *clock = SDIO_BLK_HS_CLOCK;
+            return SD_ACCESS_HS;
+        }
+        *timing = HC_SDIO_TIMING_UHS_SDR12;
+        *clock = SDIO_BLK_DEFAULT_CLOCK;
+        return -1;
+    }
+
+    if ((support & (1 << SD_ACCESS_HS)) && (caps & HC_SDIO_CAP_SD_HS)) {
+        *timing = HC_SDIO_TIMING_SD_HS;
+        *clock = SDIO_BLK_HS_CLOCK;
+        return SD_ACCESS_HS;
+    }
+
+    *timing = HC_SDIO_TIMING_LEGACY;
+    *clock = SDIO_BLK_DEFAULT_CLOCK;
+    return -1;
+}
+
+/**
+ * @brief Negotiate bus width and access mode, then apply them to the host
+ */
+static int sdio_blk_set_speed(struct sdio_blk *blk)
+{
+    uint8_t *buf;
+    uint16_t support;
+    uint32_t clock;
+    uint8_t timing;
+    int mode;
+    int ret;
+
+    buf = zalloc(SD_SWITCH_STATUS_SIZE);
+    if (!buf)
+        return -ENOMEM;
+
+    /* SCR: supported bus widths, and whether CMD6 exists (SD 1.10+) */
+    ret = sdio_blk_read_reg(blk, true, SD_APP_SEND_SCR, 0, buf, 8);
+    if (ret)
+        goto out;
+
+    if ((blk->cap.caps & HC_SDIO_CAP_4_BIT_DATA) &&
+        (SD_SCR_BUS_WIDTHS(buf) & SD_SCR_BUS_WIDTH_4)) {
+        ret = sdio_blk_acmd(blk, SD_APP_SET_BUS_WIDTH, 2,
+                            HC_SDIO_RSP_R1_R5_R6_R7, HC_SDIO_CMD_AC, 0, NULL);
+        if (ret)
+            goto out;
+        blk->ios.bus_width = HC_SDIO_BUS_WIDTH_4;
+    }
+
+    mode = -1;
+    timing = blk->ios.timing;
+    clock = SDIO_BLK_DEFAULT_CLOCK;
+
+    if (SD_SCR_SPEC(buf) >= 1) {
+        ret = sdio_blk_read_reg(blk, false, SD_SWITCH_FUNC,
+                                SD_SWITCH_CHECK << 31 | 0x00ffffff, buf,
+                                SD_SWITCH_STATUS_SIZE);
+        if (ret)
+            goto out;
+
+        support = SD_SWITCH_GRP1_SUPPORT(buf);
+        mode = sdio_blk_pick_mode(blk, support, &timing, &clock);
+    }
+
+    if (mode >= 0) {
+        ret = sdio_blk_read_reg(blk, false, SD_SWITCH_FUNC,
+                                SD_SWITCH_SET << 31 | 0x00fffff0 | mode, buf,
+                                SD_SWITCH_STATUS_SIZE);
+        if (ret)
+            goto out;
+
+        /* The card reports 0xf if it refused the switch */
+        if (SD_SWITCH_GRP1_RESULT(buf) != mode) {
+            timing = blk->ios.timing;
+            clock = SDIO_BLK_DEFAULT_CLOCK;
+        }
+    }
+
+    if (clock > blk->cap.f_max)
+        clock = blk->cap.f_max;
+
+    blk->ios.timing = timing;
+    blk->ios.clock = clock;
+    ret = sdio_blk_set_ios(blk);
+
+out:
+    free(buf);
+    return ret;
+}
+
+/**
+ * @brief Identify the card and bring it to the transfer state
+ */
+static int sdio_blk_card_init(struct sdio_blk *blk)
+{
+    uint32_t resp[4];
+    uint32_t arg;
+    int retries;
+    int ret;
+
+    ret = sdio_blk_power_cycle(blk);
+    if (ret)
+        return ret;
+
+    ret = sdio_blk_cmd(blk, SD_GO_IDLE_STATE, 0, HC_SDIO_RSP_NONE,
+                       HC_SDIO_CMD_BC, 0, NULL);
+    if (ret)
+        return ret;
+
+    /* Only version 2.00 cards answer CMD8, and only those may be SDHC */
+    arg = 0;
+    ret = sdio_blk_cmd(blk, SD_SEND_IF_COND, SD_IF_COND_PATTERN,
+                       HC_SDIO_RSP_R1_R5_R6_R7, HC_SDIO_CMD_BCR, 0, resp);
+    if (!ret && (resp[0] & 0xfff) == SD_IF_COND_PATTERN) {
+        arg = SD_OCR_CCS;
+        if (sdio_blk_host_uhs(blk))
+            arg |= SD_OCR_S18;
+    }
+
+    arg |= SDIO_BLK_OCR_WINDOW;
+
+    for (retries = 0; retries < SDIO_BLK_OCR_RETRIES; retries++) {
+        ret = sdio_blk_acmd(blk, SD_APP_OP_COND, arg, HC_SDIO_RSP_R3_R4,
+                            HC_SDIO_CMD_BCR, 0, &blk->ocr);
+        if (ret)
+            return ret;
+        if (blk->ocr & SD_OCR_BUSY)
+            break;
+        usleep(SDIO_BLK_OCR_DELAY_US);
+    }
+    if (!(blk->ocr & SD_OCR_BUSY))
+        return -ETIMEDOUT;
+
+    blk->block_addr = !!(blk->ocr & SD_OCR_CCS);
+
+    /* S18A: the card accepted 1.8 V signaling */
+    if ((arg & SD_OCR_S18) && blk->block_addr && (blk->ocr & SD_OCR_S18)) {
+        ret = sdio_blk_voltage_switch(blk);
+        if (ret)
+            return ret;
+    }
+
+    ret = sdio_blk_cmd(blk, SD_ALL_SEND_CID, 0, HC_SDIO_RSP_R2,
+                       HC_SDIO_CMD_BCR, 0, resp);
+    if (ret)
+        return ret;
+
+    ret = sdio_blk_cmd(blk, SD_SEND_RELATIVE_ADDR, 0, HC_SDIO_RSP_R1_R5_R6_R7,
+                       HC_SDIO_CMD_BCR, 0, resp);
+    if (ret)
+        return ret;
+    blk->rca = resp[0] & 0xffff0000;
+
+    ret = sdio_blk_cmd(blk, SD_SEND_CSD, blk->rca, HC_SDIO_RSP_R2,
+                       HC_SDIO_CMD_AC, 0, resp);
+    if (ret)
+        return ret;
+    blk->blocks = sdio_blk_csd_blocks(resp);
+
+    ret = sdio_blk_cmd(blk, SD_SELECT_CARD, blk->rca, HC_SDIO_RSP_R1B,
+                       HC_SDIO_CMD_AC, 0, NULL);
+    if (ret)
+        return ret;
+
+    if (!blk->block_addr) {
+        ret = sdio_blk_cmd(blk, SD_SET_BLOCKLEN, SDIO_BLK_SIZE,
+                           HC_SDIO_RSP_R1_R5_R6_R7, HC_SDIO_CMD_AC, 0, NULL);
+        if (ret)
+            return ret;
+    }
+
+    return sdio_blk_set_speed(blk);
+}
+
+/**
+ * @brief Bring back a card that was briefly removed, see sdio_blk_resume()
+ */
+static int sdio_blk_card_resume(struct sdio_blk *blk)
+{
+    uint32_t status;
+    int ret;
+
+    ret = sdio_blk_cmd(blk, SD_SEND_STATUS, blk->rca, HC_SDIO_RSP_R1_R5_R6_R7,
+                       HC_SDIO_CMD_AC, 0, &status);
+    if (!ret && SD_R1_STATE(status) == SD_R1_STATE_TRAN)
+        return 0;
+
+    lowsyslog("sdio_blk: card lost its state, reinitializing\n");
+
+    return sdio_blk_card_init(blk);
+}
+
+/**
+ * @brief Capacity of the card
+ *
+ * @param blk Block device
+ * @return Number of 512-byte blocks
+ */
+uint32_t sdio_blk_capacity(struct sdio_blk *blk)
+{
+    return blk->blocks;
+}
+
+/**
+ * @brief Largest number of blocks a single transfer may carry
+ *
+ * @param blk Block device
+ * @return Maximum block count
+ */
+uint32_t sdio_blk_max_blocks(struct sdio_blk *blk)
+{
+    return blk->cap.max_blk_count ? blk->cap.max_blk_count : 1;
+}
+
+/**
+ * @brief Issue one read or write command and move its data
+ *
+ * The data phase of a multi-block command is fed segment by segment, one
+ * host controller transfer per segment, so buffers that are not contiguous
+ * (e.g. a chain of UniPro receive buffers) need no bounce buffer and still
+ * cost a single command.  This is not scatter-gather DMA: the controller
+ * sees each segment as a separate transfer.  The command covers at most
+ * max_blk_count blocks; *seg and *off are advanced past the blocks that
+ * were transferred.
+ */
+static int sdio_blk_xfer_cmd(struct sdio_blk *blk, bool write, uint32_t lba,
+                             uint32_t count, const struct sdio_blk_seg **seg,
+                             uint32_t *off)
+{
+    struct sdio_transfer transfer;
+    uint32_t addr = blk->block_addr ? lba : lba * SDIO_BLK_SIZE;
+    uint32_t left = count;
+    uint32_t issue;
+    uint32_t n;
+    uint8_t opcode;
+    int stop;
+    int ret;
+
+    if (write) {
+        opcode = count > 1 ? SD_WRITE_MULTIPLE_BLOCK : SD_WRITE_BLOCK;
+    } else {
+        opcode = count > 1 ? SD_READ_MULTIPLE_BLOCK : SD_READ_SINGLE_BLOCK;
+    }
+
+    ret = sdio_blk_cmd(blk, opcode, addr, HC_SDIO_RSP_R1_R5_R6_R7,
+                       HC_SDIO_CMD_ADTC, count, NULL);
+    if (ret)
+        return ret;
+
+    while (left) {
+        n = (*seg)->blocks - *off;
+        if (n > left)
+            n = left;
+
+        memset(&transfer, 0, sizeof(transfer));
+        transfer.blocks = n;
+        transfer.blksz = SDIO_BLK_SIZE;
+        transfer.data = (*seg)->data + *off * SDIO_BLK_SIZE;
+        transfer.dlen = n * SDIO_BLK_SIZE;
+
+        issue = sdio_trace_now();
+        ret = write ? device_sdio_write(blk->dev, &transfer) :
+                      device_sdio_read(blk->dev, &transfer);
+        sdio_trace_record(write ? SDIO_TRACE_DATA_WRITE : SDIO_TRACE_DATA_READ,
+                          n, issue, sdio_trace_now());
+        if (ret)
+            break;
+
+        left -= n;
+        *off += n;
+        if (*off == (*seg)->blocks) {
+            (*seg)++;
+            *off = 0;
+        }
+    }
+
+    if (count > 1) {
+        stop = sdio_blk_cmd(blk, SD_STOP_TRANSMISSION, 0, HC_SDIO_RSP_R1B,
+                            HC_SDIO_CMD_AC, 0, NULL);
+        if (!ret)
+            ret = stop;
+    }
+
+    if (!ret && write)
+        ret = sdio_blk_wait_ready(blk);
+
+    return ret;
+}
+
+/**
+ * @brief Move a segment list, splitting it into as few commands as possible
+ */
+static int sdio_blk_xfer_locked(struct sdio_blk *blk, bool write,
+                                uint32_t lba, const struct sdio_blk_seg *seg,
+                                int nseg)
+{
+    uint32_t max = sdio_blk_max_blocks(blk);
+    uint32_t total = 0;
+    uint32_t off = 0;
+    uint32_t count;
+    int ret;
+    int i;
+
+    for (i = 0; i < nseg; i++) {
+        if (!seg[i].blocks || !seg[i].data)
+            return -EINVAL;
+        total += seg[i].blocks;
+    }
+
+    if (!total || lba + total > blk->blocks || lba + total < lba)
+        return -EINVAL;
+
+    while (total) {
+        count = total > max ? max : total;
+
+        ret = sdio_blk_xfer_cmd(blk, write, lba, count, &seg, &off);
+        if (ret)
+            return ret;
+
+        lba += count;
+        total -= count;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Act on the card-detect event left since the last transfer
+ *
+ * Called with the lock held.
+ *
+ * @return 0 if the card can be used, negative errno otherwise
+ */
+static int sdio_blk_settle(struct sdio_blk *blk)
+{
+    irqstate_t flags;
+    uint8_t event;
+    int ret;
+
+    flags = irqsave();
+    event = blk->event;
+    if (event != SDIO_BLK_EVENT_REMOVED)
+        blk->event = SDIO_BLK_EVENT_NONE;
+    irqrestore(flags);
+
+    switch (event) {
+    case SDIO_BLK_EVENT_REMOVED:
+        return -ENODEV;
+    case SDIO_BLK_EVENT_RETURNED:
+        ret = sdio_blk_card_resume(blk);
+        break;
+    case SDIO_BLK_EVENT_INSERTED:
+        ret = sdio_blk_card_init(blk);
+        break;
+    default:
+        return 0;
+    }
+
+    if (ret) {
+        lowsyslog("sdio_blk: card not usable after insertion: %d\n", ret);
+
+        /* Try again on the next transfer, unless the card went away */
+        flags = irqsave();
+        if (blk->event == SDIO_BLK_EVENT_NONE)
+            blk->event = SDIO_BLK_EVENT_INSERTED;
+        irqrestore(flags);
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Move a segment list, with the card brought back first if needed
+ */
+static int sdio_blk_xfer(struct sdio_blk *blk, bool write, uint32_t lba,
+                         const struct sdio_blk_seg *seg, int nseg)
+{
+    int ret;
+
+    sem_wait(&blk->lock);
+
+    ret = sdio_blk_settle(blk);
+    if (!ret)
+        ret = sdio_blk_xfer_locked(blk, write, lba, seg, nseg);
+
+    sem_post(&blk->lock);
+
+    return ret;
+}
+
+/**
+ * @brief Read blocks from the card
+ *
+ * @param blk Block device
+ * @param lba First block
+ * @param count Number of blocks
+ * @param buf Destination, count * 512 bytes
+ * @return 0 on success, negative errno on error
+ */
+int sdio_blk_read(struct sdio_blk *blk, uint32_t lba, uint32_t count,
+                  uint8_t *buf)
+{
+    struct sdio_blk_seg seg = { .data = buf, .blocks = count };
+
+    return sdio_blk_xfer(blk, false, lba, &seg, 1);
+}
+
+/**
+ * @brief Write blocks to the card
+ *
+ * @param blk Block device
+ * @param lba First block
+ * @param count Number of blocks
+ * @param buf Source, count * 512 bytes
+ * @return 0 on success, negative errno on error
+ */
+int sdio_blk_write(struct sdio_blk *blk, uint32_t lba, uint32_t count,
+                   const uint8_t *buf)
+{
+    struct sdio_blk_seg seg = { .data = (uint8_t *)buf, .blocks = count };
+
+    return sdio_blk_xfer(blk, true, lba, &seg, 1);
+}
+
+/**
+ * @brief Read consecutive blocks into a list of buffers
+ *
+ * @param blk Block device
+ * @param lba First block
+ * @param seg Destination segments, filled in order
+ * @param nseg Number of segments
+ * @return 0 on success, negative errno on error
+ */
+int sdio_blk_readv(struct sdio_blk *blk, uint32_t lba,
+                   const struct sdio_blk_seg *seg, int nseg)
+{
+    return sdio_blk_xfer(blk, false, lba, seg, nseg);
+}
+
+/**
+ * @brief Write a list of buffers to consecutive blocks
+ *
+ * @param blk Block device
+ * @param lba First block
+ * @param seg Source segments, written in order
+ * @param nseg Number of segments
+ * @return 0 on success, negative errno on error
+ */
+int sdio_blk_writev(struct sdio_blk *blk, uint32_t lba,
+                    const struct sdio_blk_seg *seg, int nseg)
+{
+    return sdio_blk_xfer(blk, true, lba, seg, nseg);
+}
+
+/**
+ * @brief Allocate a transfer buffer
+ *
+ * @param blocks Size of the buffer, in blocks
+ * @return The buffer, or NULL
+ */
+void *sdio_blk_alloc_buf(uint32_t blocks)
+{
+#ifdef CONFIG_MM_BUFRAM_ALLOCATOR
+    return bufram_alloc(blocks * SDIO_BLK_SIZE);
+#else
+    return malloc(blocks * SDIO_BLK_SIZE);
+#endif
+}
+
+/**
+ * @brief Release a buffer returned by sdio_blk_alloc_buf()
+ *
+ * @param buf Buffer
+ */
+void sdio_blk_free_buf(void *buf)
+{
+#ifdef CONFIG_MM_BUFRAM_ALLOCATOR
+    bufram_free(buf);
+#else
+    free(buf);
+#endif
+}
+
+/**
+ * @brief Allow UHS-I modes
+ *
+ * Only boards that can switch the card I/O lines to 1.8 V may enable this;
+ * UHS modes are then negotiated with cards and hosts that support them.
+ * Takes effect at the next card initialization.
+ *
+ * @param enable True to allow UHS-I modes
+ */
+void sdio_blk_set_uhs(bool enable)
+{
+    sdio_blk_uhs = enable;
+}
+
+/**
+ * @brief Open the host controller and initialize the card
+ *
+ * @return The block device, or NULL if there is no usable card
+ */
+struct sdio_blk *sdio_blk_open(void)
+{
+    struct sdio_blk *blk;
+    irqstate_t flags;
+    int ret;
+
+    blk = zalloc(sizeof(*blk));
+    if (!blk)
+        return NULL;
+
+    sem_init(&blk->lock, 0, 1);
+
+    blk->dev = device_open(DEVICE_TYPE_SDIO_HW, 0);
+    if (!blk->dev) {
+        lowsyslog("sdio_blk: cannot open host controller\n");
+        goto err_free;
+    }
+
+    ret = device_sdio_get_capabilities(blk->dev, &blk->cap);
+    if (ret)
+        goto err_close;
+
+    ret = sdio_blk_card_init(blk);
+    if (ret) {
+        lowsyslog("sdio_blk: card initialization failed: %d\n", ret);
+        goto err_close;
+    }
+
+    lowsyslog("sdio_blk: %s card, %u blocks, %u Hz, %u-bit, %s V\n",
+              blk->block_addr ? "SDHC" : "SDSC", blk->blocks, blk->ios.clock,
+              blk->ios.bus_width == HC_SDIO_BUS_WIDTH_4 ? 4 : 1,
+              blk->ios.signal_voltage == HC_SDIO_SIGNAL_VOLTAGE_180 ?
+              "1.8" : "3.3");
+
+    flags = irqsave();
+    sdio_blk_current = blk;
+    irqrestore(flags);
+
+    return blk;
+
+err_close:
+    device_close(blk->dev);
+err_free:
+    sem_destroy(&blk->lock);
+    free(blk);
+    return NULL;
+}
+
+/**
+ * @brief Bring a card back after it was reported removed and reinserted
+ *
+ * A short contact loss does not reset the card: if it still answers its
+ * relative address in the transfer state, it is the same card with the same
+ * settings and the (slow) identification is skipped.  Otherwise the card is
+ * initialized from scratch.
+ *
+ * @param blk Block device
+ * @return 0 on success, negative errno if the card cannot be used
+ */
+int sdio_blk_resume(struct sdio_blk *blk)
+{
+    int ret;
+
+    sem_wait(&blk->lock);
+    ret = sdio_blk_card_resume(blk);
+    sem_post(&blk->lock);
+
+    return ret;
+}
+
+/**
+ * @brief Note a debounced card-detect event for the next transfer
+ *
+ * Nothing is done here: the next transfer takes a returned card through
+ * sdio_blk_resume(), gives any other insertion a full initialization, and
+ * fails with -ENODEV while the slot is empty.  Events are dropped while no
+ * block device is open: the next sdio_blk_open() initializes whatever card
+ * is there.  Safe to call from any context.
+ *
+ * @param present True if a card is now in the slot
+ * @param returned True if the card was only briefly removed
+ */
+void sdio_blk_card_event(bool present, bool returned)
+{
+    struct sdio_blk *blk;
+    irqstate_t flags;
+
+    flags = irqsave();
+
+    blk = sdio_blk_current;
+    if (blk) {
+        if (!present)
+            blk->event = SDIO_BLK_EVENT_REMOVED;
+        else if (!returned || blk->event == SDIO_BLK_EVENT_INSERTED)
+            blk->event = SDIO_BLK_EVENT_INSERTED;
+        else
+            blk->event = SDIO_BLK_EVENT_RETURNED;
+    }
+
+    irqrestore(flags);
+}
+
+/**
+ * @brief Power the card down and release the host controller
+ *
+ * @param blk Block device
+ */
+void sdio_blk_close(struct sdio_blk *blk)
+{
+    irqstate_t flags;
+
+    flags = irqsave();
+    if (sdio_blk_current == blk)
+        sdio_blk_current = NULL;
+    irqrestore(flags);
+
+    sem_wait(&blk->lock);
+
+    blk->ios.power_mode = HC_SDIO_POWER_OFF;
+    sdio_blk_set_ios(blk);
+    device_close(blk->dev);
+    sem_destroy(&blk->lock);
+    free(blk);
+}
@@ -0,0 +1,603 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Block cache for the SDIO module block layer.
+ *
+ * Small writes are held in a fixed arena of cache lines and written back
+ * together: adjacent dirty blocks, including runs that continue into the
+ * next line, go to the card as one multi-block command on eviction or on an
+ * explicit sync.  Sequential reads are detected and prefetch a growing
+ * number of lines ahead of the reader.  Large requests bypass the cache.
+ *
+ * Nothing is written to the card before sdio_cache_sync() (or eviction), so
+ * callers must sync before reporting a write barrier as complete.
+ *
+ * Only callers of the module block layer go through the cache: today the
+ * benchmark and the host check.  Greybus SDIO traffic from the AP is handled
+ * by the SDIO protocol driver in NuttX, straight on the host controller, and
+ * gets none of this.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <nuttx/kmalloc.h>
+
+#define SDIO_CACHE_BLOCK_SIZE       512
+
+/* Arena: SDIO_CACHE_LINES lines of SDIO_CACHE_LINE_BLOCKS blocks (32 KiB) */
+#define SDIO_CACHE_LINE_BLOCKS      8
+#define SDIO_CACHE_LINES            8
+
+/* Maximum read-ahead, in lines; at most half the arena */
+#define SDIO_CACHE_RA_MAX           4
+
+/* Requests of this many blocks or more go straight to the card */
+#define SDIO_CACHE_BYPASS           16
+
+#define SDIO_CACHE_LINE_BYTES \
+    (SDIO_CACHE_LINE_BLOCKS * SDIO_CACHE_BLOCK_SIZE)
+#define SDIO_CACHE_MASK(first, n)   ((((1u << (n)) - 1) << (first)))
+
+struct sdio_blk;
+
+struct sdio_blk_seg {
+    uint8_t *data;
+    uint32_t blocks;
+};
+
+uint32_t sdio_blk_capacity(struct sdio_blk *blk);
+int sdio_blk_read(struct sdio_blk *blk, uint32_t lba, uint32_t count,
+                  uint8_t *buf);
+int sdio_blk_write(struct sdio_blk *blk, uint32_t lba, uint32_t count,
+                   const uint8_t *buf);
+int sdio_blk_readv(struct sdio_blk *blk, uint32_t lba,
+                   const struct sdio_blk_seg *seg, int nseg);
+int sdio_blk_writev(struct sdio_blk *blk, uint32_t lba,
+                    const struct sdio_blk_seg *seg, int nseg);
+void *sdio_blk_alloc_buf(uint32_t blocks);
+void sdio_blk_free_buf(void *buf);
+
+/**
+ * @brief One cache line
+ */
+struct sdio_cache_line {
+    /** First block of the line */
+    uint32_t tag;
+    /** Blocks holding valid data */
+    uint32_t valid;
+    /** Blocks not yet written to the card */
+    uint32_t dirty;
+    /** LRU stamp */
+    uint32_t used;
+    bool in_use;
+    uint8_t *data;
+};
+
+/**
+ * @brief Cache statistics, in blocks unless noted
+ */
+struct sdio_cache_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t prefetched;
+    uint32_t written;
+    /** Write commands issued by write-back */
+    uint32_t flushes;
+    uint32_t bypassed;
+};
+
+/**
+ * @brief Block cache in front of one block device
+ */
+struct sdio_cache {
+    struct sdio_blk *blk;
+    uint32_t capacity;
+    uint8_t *arena;
+    struct sdio_cache_line line[SDIO_CACHE_LINES];
+    uint32_t clock;
+    /** Block following the last read, to detect sequential access */
+    uint32_t next_lba;
+    /** Current read-ahead, in lines */
+    uint32_t ra;
+    struct sdio_cache_stats stats;
+};
+
+static struct sdio_cache_line *sdio_cache_find(struct sdio_cache *c,
+                                               uint32_t tag)
+{
+    int i;
+
+    for (i = 0; i < SDIO_CACHE_LINES; i++) {
+        if (c->line[i].in_use && c->line[i].tag == tag)
+            return &c->line[i];
+    }
+
+    return NULL;
+}
+
+static void sdio_cache_touch(struct sdio_cache *c, struct sdio_cache_line *l)
+{
+    l->used = ++c->clock;
+}
+
+/**
+ * @brief Number of consecutive set bits in mask, starting at bit first
+ */
+static uint32_t sdio_cache_run(uint32_t mask, uint32_t first)
+{
+    uint32_t n = 0;
+
+    while (first + n < SDIO_CACHE_LINE_BLOCKS && (mask & (1u << (first + n))))
+        n++;
+
+    return n;
+}
+
+static uint32_t sdio_cache_first(uint32_t mask)
+{
+    uint32_t i;
+
+    for (i = 0; i < SDIO_CACHE_LINE_BLOCKS; i++) {
+        if (mask & (1u << i))
+            break;
+    }
+
+    return i;
+}
+
+/**
+ * @brief Write back the first dirty run of a line
+ *
+ * A run that reaches the end of the line continues into the next line if
+ * that one is dirty from its first block, so adjacent dirty blocks are
+ * written with a single command whatever lines they sit in.
+ */
+static int sdio_cache_flush_run(struct sdio_cache *c,
+                                struct sdio_cache_line *l)
+{
+    struct sdio_blk_seg seg[SDIO_CACHE_LINES];
+    struct sdio_cache_line *seg_line[SDIO_CACHE_LINES];
+    uint32_t seg_mask[SDIO_CACHE_LINES];
+    uint32_t first = sdio_cache_first(l->dirty);
+    uint32_t lba = l->tag + first;
+    uint32_t total = 0;
+    uint32_t n;
+    int nseg = 0;
+    int ret;
+    int i;
+
+    while (l && nseg < SDIO_CACHE_LINES) {
+        n = sdio_cache_run(l->dirty, first);
+        seg[nseg].data = l->data + first * SDIO_CACHE_BLOCK_SIZE;
+        seg[nseg].blocks = n;
+        seg_line[nseg] = l;
+        seg_mask[nseg] = SDIO_CACHE_MASK(first, n);
+        nseg++;
+        total += n;
+
+        if (first + n < SDIO_CACHE_LINE_BLOCKS)
+            break;
+
+        l = sdio_cache_find(c, l->tag + SDIO_CACHE_LINE_BLOCKS);
+        if (!l || !(l->dirty & 1))
+            break;
+        first = 0;
+    }
+
+    ret = sdio_blk_writev(c->blk, lba, seg, nseg);
+    if (ret)
+        return ret;
+
+    /* Only clean the lines once the data is safely on the card */
+    for (i = 0; i < nseg; i++)
+        seg_line[i]->dirty &= ~seg_mask[i];
+
+    c->stats.written += total;
+    c->stats.flushes++;
+
+    return 0;
+}
+
+static int sdio_cache_flush_line(struct sdio_cache *c,
+                                 struct sdio_cache_line *l)
+{
+    int ret;
+
+    while (l->dirty) {
+        ret = sdio_cache_flush_run(c, l);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Get an empty line for a tag, evicting the least recently used one
+ *
+ * @param c Cache
+ * @param tag First block of the line
+ * @param ret Set to the error if the evicted line could not be written back
+ * @return The line, or NULL on error
+ */
+static struct sdio_cache_line *sdio_cache_alloc_line(struct sdio_cache *c,
+                                                     uint32_t tag, int *ret)
+{
+    struct sdio_cache_line *l = NULL;
+    int i;
+
+    for (i = 0; i < SDIO_CACHE_LINES; i++) {
+        if (!c->line[i].in_use) {
+            l = &c->line[i];
+            break;
+        }
+        if (!l || c->line[i].used < l->used)
+            l = &c->line[i];
+    }
+
+    if (l->in_use) {
+        *ret = sdio_cache_flush_line(c, l);
+        if (*ret)
+            return NULL;
+    }
+
+    l->tag = tag;
+    l->valid = 0;
+    l->dirty = 0;
+    l->in_use = true;
+    sdio_cache_touch(c, l);
+
+    *ret = 0;
+    return l;
+}
+
+/**
+ * @brief Bring the line holding a missed block in, with read-ahead
+ */
+static int sdio_cache_fill(struct sdio_cache *c, uint32_t tag,
+                           bool sequential)
+{
+    struct sdio_blk_seg seg[SDIO_CACHE_RA_MAX + 1];
+    struct sdio_cache_line *lines[SDIO_CACHE_RA_MAX + 1];
+    struct sdio_cache_line *l;
+    uint32_t first;
+    uint32_t blocks;
+    uint32_t n;
+    uint32_t t;
+    int nlines;
+    int ret;
+    int i;
+
+    /* Partially written line: read only the blocks it does not hold */
+    l = sdio_cache_find(c, tag);
+    if (l) {
+        blocks = c->capacity - tag;
+        if (blocks > SDIO_CACHE_LINE_BLOCKS)
+            blocks = SDIO_CACHE_LINE_BLOCKS;
+
+        for (first = 0; first < blocks; first += n) {
+            n = sdio_cache_run(~l->valid & SDIO_CACHE_MASK(0, blocks), first);
+            if (!n) {
+                n = 1;
+                continue;
+            }
+            ret = sdio_blk_read(c->blk, tag + first, n,
+                                l->data + first * SDIO_CACHE_BLOCK_SIZE);
+            if (ret)
+                return ret;
+            l->valid |= SDIO_CACHE_MASK(first, n);
+        }
+        return 0;
+    }
+
+    /* Grow the read-ahead while the reader stays sequential */
+    if (!sequential) {
+        c->ra = 0;
+    } else if (!c->ra) {
+        c->ra = 1;
+    } else if (c->ra < SDIO_CACHE_RA_MAX) {
+        c->ra *= 2;
+        if (c->ra > SDIO_CACHE_RA_MAX)
+            c->ra = SDIO_CACHE_RA_MAX;
+    }
+
+    blocks = 0;
+    for (nlines = 0; (uint32_t)nlines <= c->ra; nlines++) {
+        t = tag + nlines * SDIO_CACHE_LINE_BLOCKS;
+        if (t >= c->capacity || (nlines && sdio_cache_find(c, t)))
+            break;
+
+        n = c->capacity - t;
+        if (n > SDIO_CACHE_LINE_BLOCKS)
+            n = SDIO_CACHE_LINE_BLOCKS;
+        /* Only the first line may be short; stop prefetching at the end */
+        if (nlines && n < SDIO_CACHE_LINE_BLOCKS)
+            break;
+
+        lines[nlines] = sdio_cache_alloc_line(c, t, &ret);
+        if (!lines[nlines])
+            goto err;
+
+        seg[nlines].data = lines[nlines]->data;
+        seg[nlines].blocks = n;
+        blocks += n;
+    }
+
+    ret = sdio_blk_readv(c->blk, tag, seg, nlines);
+    if (ret)
+        goto err;
+
+    for (i = 0; i < nlines; i++)
+        lines[i]->valid = SDIO_CACHE_MASK(0, seg[i].blocks);
+
+    c->stats.prefetched += blocks - seg[0].blocks;
+
+    return 0;
+
+err:
+    for (i = 0; i < nlines; i++)
+        lines[i]->in_use = false;
+    return ret;
+}
+
+/**
+ * @brief Read blocks through the cache
+ *
+ * @param c Cache
+ * @param lba First block
+ * @param count Number of blocks
+ * @param buf Destination, count * 512 bytes
+ * @return 0 on success, negative errno on error
+ */
+int sdio_cache_read(struct sdio_cache *c, uint32_t lba, uint32_t count,
+                    uint8_t *buf)
+{
+    struct sdio_cache_line *l;
+    bool sequential = lba == c->next_lba;
+    uint32_t b;
+    uint32_t off;
+    int ret;
+    int i;
+
+    if (!count || lba + count > c->capacity || lba + count < lba)
+        return -EINVAL;
+
+    c->next_lba = lba + count;
+
+    if (count >= SDIO_CACHE_BYPASS) {
+        ret = sdio_blk_read(c->blk, lba, count, buf);
+        if (ret)
+            return ret;
+
+        /* Blocks not written back yet are newer than what the card has */
+        for (i = 0; i < SDIO_CACHE_LINES; i++) {
+            l = &c->line[i];
+            if (!l->in_use || !l->dirty)
+                continue;
+            for (off = 0; off < SDIO_CACHE_LINE_BLOCKS; off++) {
+                b = l->tag + off;
+                if ((l->dirty & (1u << off)) && b >= lba && b < lba + count)
+                    memcpy(buf + (b - lba) * SDIO_CACHE_BLOCK_SIZE,
+                           l->data + off * SDIO_CACHE_BLOCK_SIZE,
+                           SDIO_CACHE_BLOCK_SIZE);
+            }
+        }
+
+        c->stats.bypassed += count;
+        return 0;
+    }
+
+    for (b = lba; b < lba + count; b++) {
+        off = b % SDIO_CACHE_LINE_BLOCKS;
+        l = sdio_cache_find(c, b - off);
+        if (!l || !(l->valid & (1u << off))) {
+            c->stats.misses++;
+            ret = sdio_cache_fill(c, b - off, sequential);
+            if (ret)
+                return ret;
+            l = sdio_cache_find(c, b - off);
+            /* Further misses in this request continue the same stream */
+            sequential = true;
+        } else {
+            c->stats.hits++;
+        }
+
+        memcpy(buf, l->data + off * SDIO_CACHE_BLOCK_SIZE,
+               SDIO_CACHE_BLOCK_SIZE);
+        buf += SDIO_CACHE_BLOCK_SIZE;
+        sdio_cache_touch(c, l);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write blocks through the cache
+ *
+ * Small writes are only stored in the cache; see sdio_cache_sync().
+ *
+ * @param c Cache
+ * @param lba First block
+ * @param count Number of blocks
+ * @param buf Source, count * 512 bytes
+ * @return 0 on success, negative errno on error
+ */
+int sdio_cache_write(struct sdio_cache *c, uint32_t lba, uint32_t count,
+                     const uint8_t *buf)
+{
+    struct sdio_cache_line *l;
+    uint32_t mask;
+    uint32_t b;
+    uint32_t off;
+    int ret;
+    int i;
+
+    if (!count || lba + count > c->capacity || lba + count < lba)
+        return -EINVAL;
+
+    if (count >= SDIO_CACHE_BYPASS) {
+        ret = sdio_blk_write(c->blk, lba, count, buf);
+        if (ret)
+            return ret;
+
+        /* The card now has newer data than any cached copy */
+        for (i = 0; i < SDIO_CACHE_LINES; i++) {
+            l = &c->line[i];
+            if (!l->in_use)
+                continue;
+            for (off = 0; off < SDIO_CACHE_LINE_BLOCKS; off++) {
+                b = l->tag + off;
+                if (b >= lba && b < lba + count) {
+                    mask = ~(1u << off);
+                    l->valid &= mask;
+                    l->dirty &= mask;
+                }
+            }
+        }
+
+        c->stats.bypassed += count;
+        return 0;
+    }
+
+    for (b = lba; b < lba + count; b++) {
+        off = b % SDIO_CACHE_LINE_BLOCKS;
+        l = sdio_cache_find(c, b - off);
+        if (!l) {
+            l = sdio_cache_alloc_line(c, b - off, &ret);
+            if (!l)
+                return ret;
+        }
+
+        memcpy(l->data + off * SDIO_CACHE_BLOCK_SIZE, buf,
+               SDIO_CACHE_BLOCK_SIZE);
+        buf += SDIO_CACHE_BLOCK_SIZE;
+        l->valid |= 1u << off;
+        l->dirty |= 1u << off;
+        sdio_cache_touch(c, l);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write all cached data back to the card
+ *
+ * Lines are written back in block order so that dirty runs spanning lines
+ * are merged into single commands.
+ *
+ * @param c Cache
+ * @return 0 on success, negative errno on error
+ */
+int sdio_cache_sync(struct sdio_cache *c)
+{
+    struct sdio_cache_line *l;
+    int ret;
+    int i;
+
+    for (;;) {
+        l = NULL;
+        for (i = 0; i < SDIO_CACHE_LINES; i++) {
+            if (c->line[i].in_use && c->line[i].dirty &&
+                (!l || c->line[i].tag < l->tag))
+                l = &c->line[i];
+        }
+        if (!l)
+            return 0;
+
+        ret = sdio_cache_flush_run(c, l);
+        if (ret)
+            return ret;
+    }
+}
+
+/**
+ * @brief Print the cache statistics
+ *
+ * @param c Cache
+ */
+void sdio_cache_report(struct sdio_cache *c)
+{
+    lowsyslog("sdio_cache: %u hits, %u misses, %u prefetched, "
+              "%u written in %u commands, %u bypassed\n",
+              c->stats.hits, c->stats.misses, c->stats.prefetched,
+              c->stats.written, c->stats.flushes, c->stats.bypassed);
+}
+
+/**
+ * @brief Create a cache in front of a block device
+ *
+ * @param blk Block device
+ * @return The cache, or NULL if the arena cannot be allocated
+ */
+struct sdio_cache *sdio_cache_alloc(struct sdio_blk *blk)
+{
+    struct sdio_cache *c;
+    int i;
+
+    c = zalloc(sizeof(*c));
+    if (!c)
+        return NULL;
+
+    c->arena = sdio_blk_alloc_buf(SDIO_CACHE_LINES * SDIO_CACHE_LINE_BLOCKS);
+    if (!c->arena) {
+        free(c);
+        return NULL;
+    }
+
+    c->blk = blk;
+    c->capacity = sdio_blk_capacity(blk);
+    for (i = 0; i < SDIO_CACHE_LINES; i++)
+        c->line[i].data = c->arena + i * SDIO_CACHE_LINE_BYTES;
+
+    return c;
+}
+
+/**
+ * @brief Write back and release a cache
+ *
+ * @param c Cache
+ * @return 0 on success, negative errno if data could not be written back
+ *         (the cache is released anyway)
+ */
+int sdio_cache_free(struct sdio_cache *c)
+{
+    int ret;
+
+    ret = sdio_cache_sync(c);
+
+    sdio_blk_free_buf(c->arena);
+    free(c);
+
+    return ret;
+}
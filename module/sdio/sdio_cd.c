@@ -0,0 +1,223 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Debounced card-detect for the SD slot.
+ *
+ * The card-detect switch bounces for tens of milliseconds on insertion, and
+ * every edge that gets through would start a card initialization that costs
+ * hundreds of milliseconds.  The line interrupt only timestamps the edge and
+ * queues a one-shot check; the check waits until the line has been quiet for
+ * the debounce period after the last edge, then reads the level once, so
+ * exactly one event is reported per real state change and nothing runs
+ * while the slot is left alone.
+ *
+ * The line interrupt is taken from the SDIO board driver: a board that
+ * starts this (SDIO_CARD_DETECT in board.c) does not give the board driver
+ * its card-detect resource, and hot-plug is no longer reported to the AP.
+ *
+ * A card that comes back within SDIO_CD_RETURN_MS of its removal is reported
+ * as returned, so the consumer can check whether the card kept its state
+ * (e.g. a momentary contact loss) before running a full initialization.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <syslog.h>
+
+#include <nuttx/clock.h>
+#include <nuttx/gpio.h>
+#include <nuttx/wqueue.h>
+
+#include <arch/irq.h>
+
+/* Time the line must be quiet before its level is accepted */
+#define SDIO_CD_DEBOUNCE_MS     50
+
+/* Removal shorter than this reports the card as returned */
+#define SDIO_CD_RETURN_MS       2000
+
+/**
+ * @brief Card-detect event callback
+ *
+ * @param present True if a card is now in the slot
+ * @param returned True if the card was removed less than SDIO_CD_RETURN_MS
+ *                 before this insertion
+ * @param arg Callback argument
+ */
+typedef void (*sdio_cd_callback)(bool present, bool returned, void *arg);
+
+/**
+ * @brief Card-detect state
+ */
+struct sdio_cd_info {
+    uint8_t gpio;
+    bool active_low;
+    sdio_cd_callback callback;
+    void *arg;
+    struct work_s work;
+    /** A check is queued */
+    volatile bool pending;
+    /** Time of the last edge */
+    volatile uint32_t edge;
+    /** Last reported state */
+    bool present;
+    /** Time of the last reported removal */
+    uint32_t removed;
+    bool removed_valid;
+};
+
+static struct sdio_cd_info sdio_cd;
+
+static bool sdio_cd_sample(void)
+{
+    return !!gpio_get_value(sdio_cd.gpio) != sdio_cd.active_low;
+}
+
+static void sdio_cd_worker(void *arg)
+{
+    irqstate_t flags;
+    bool returned = false;
+    bool level;
+    uint32_t quiet;
+    uint32_t now;
+
+    flags = irqsave();
+
+    now = clock_systimer();
+    quiet = now - sdio_cd.edge;
+
+    /* Still bouncing: check again once the last edge is old enough */
+    if (quiet < MSEC2TICK(SDIO_CD_DEBOUNCE_MS)) {
+        work_queue(HPWORK, &sdio_cd.work, sdio_cd_worker, NULL,
+                   MSEC2TICK(SDIO_CD_DEBOUNCE_MS) - quiet);
+        irqrestore(flags);
+        return;
+    }
+
+    sdio_cd.pending = false;
+    irqrestore(flags);
+
+    level = sdio_cd_sample();
+    if (level == sdio_cd.present)
+        return;
+
+    sdio_cd.present = level;
+
+    if (level) {
+        returned = sdio_cd.removed_valid &&
+                   now - sdio_cd.removed < MSEC2TICK(SDIO_CD_RETURN_MS);
+        sdio_cd.removed_valid = false;
+    } else {
+        sdio_cd.removed = now;
+        sdio_cd.removed_valid = true;
+    }
+
+    if (sdio_cd.callback)
+        sdio_cd.callback(level, returned, sdio_cd.arg);
+}
+
+static int sdio_cd_irq(int irq, void *context)
+{
+    sdio_cd.edge = clock_systimer();
+
+    if (!sdio_cd.pending) {
+        sdio_cd.pending = true;
+        work_queue(HPWORK, &sdio_cd.work, sdio_cd_worker, NULL,
+                   MSEC2TICK(SDIO_CD_DEBOUNCE_MS));
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Current debounced state of the slot
+ *
+ * @return True if a card is present
+ */
+bool sdio_cd_present(void)
+{
+    return sdio_cd.present;
+}
+
+/**
+ * @brief Start watching the card-detect line
+ *
+ * The initial state of the slot is reported through the callback if a card
+ * is already present.
+ *
+ * @param gpio Card-detect GPIO
+ * @param active_low True if the line reads low with a card in the slot
+ * @param callback Event callback, called from the high-priority work queue
+ * @param arg Callback argument
+ * @return 0 on success, negative errno on error
+ */
+int sdio_cd_init(uint8_t gpio, bool active_low, sdio_cd_callback callback,
+                 void *arg)
+{
+    irqstate_t flags;
+    int ret;
+
+    sdio_cd.gpio = gpio;
+    sdio_cd.active_low = active_low;
+    sdio_cd.callback = callback;
+    sdio_cd.arg = arg;
+    sdio_cd.present = false;
+    sdio_cd.removed_valid = false;
+
+    ret = gpio_activate(gpio);
+    if (ret)
+        return ret;
+
+    gpio_direction_in(gpio);
+    gpio_irq_mask(gpio);
+    gpio_irq_settriggering(gpio, IRQ_TYPE_EDGE_BOTH);
+    gpio_irq_attach(gpio, sdio_cd_irq);
+
+    /* The initial level is debounced like an edge */
+    flags = irqsave();
+    sdio_cd_irq(gpio, NULL);
+    gpio_irq_unmask(gpio);
+    irqrestore(flags);
+
+    return 0;
+}
+
+/**
+ * @brief Stop watching the card-detect line
+ */
+void sdio_cd_deinit(void)
+{
+    gpio_irq_mask(sdio_cd.gpio);
+    gpio_irq_attach(sdio_cd.gpio, NULL);
+    work_cancel(HPWORK, &sdio_cd.work);
+    sdio_cd.pending = false;
+    gpio_deactivate(sdio_cd.gpio);
+}
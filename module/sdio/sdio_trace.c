@@ -0,0 +1,442 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Per-command latency tracing for the SDIO module block layer.
+ *
+ * Every command the block layer sends, and every data phase it runs, is
+ * stamped with the core cycle counter on issue and on completion.  Each
+ * record updates a log2 histogram for its command and is kept in a small
+ * ring of recent records.  The command phase is the card and controller
+ * answering, the data phase is the transfer itself, and CMD13 time after
+ * writes is the card programming flash, so the histograms show which of
+ * these a slow transfer is waiting on.
+ *
+ * sdio_trace_dump() prints everything on the debug console.  Debug builds
+ * (SDIO_TRACE in board.c) also let the AP read the same data through a
+ * vendor Greybus protocol on CPort 8.
+ *
+ * Only the module's own block layer is traced: the tools in this module
+ * (benchmark, cache) go through it, while production Greybus SDIO traffic
+ * from the AP is handled by the SDIO protocol driver in NuttX and does not
+ * show up here.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <nuttx/config.h>
+#include <nuttx/clock.h>
+#include <nuttx/util.h>
+
+#ifdef CONFIG_GREYBUS
+#include <nuttx/greybus/greybus.h>
+#include <nuttx/greybus/types.h>
+#endif
+
+/* Record ids above the 6-bit command index space; see sdio_blk.c */
+#define SDIO_TRACE_DATA_READ        64
+#define SDIO_TRACE_DATA_WRITE       65
+
+/* Histogram bucket n counts durations of [2^n, 2^(n+1)) cycles */
+#define SDIO_TRACE_BUCKETS          32
+
+/* Number of recent records kept */
+#define SDIO_TRACE_RING             32
+
+#define SDIO_TRACE_VERSION_MAJOR    0
+#define SDIO_TRACE_VERSION_MINOR    1
+
+/* Operation types of the vendor protocol */
+#define SDIO_TRACE_TYPE_PROTOCOL_VERSION    0x01
+#define SDIO_TRACE_TYPE_INFO                0x02
+#define SDIO_TRACE_TYPE_HISTOGRAM           0x03
+#define SDIO_TRACE_TYPE_RECORDS             0x04
+#define SDIO_TRACE_TYPE_RESET               0x05
+
+/* Cycle counter, see common/dwt.c; host builds count emulator nanoseconds */
+void dwt_enable(void);
+uint32_t dwt_cycles(void);
+uint32_t dwt_cycles_per_us(void);
+
+/**
+ * @brief Latency histogram of one command or data phase
+ */
+struct sdio_trace_hist {
+    uint8_t id;
+    const char *name;
+    uint32_t count;
+    uint64_t sum;
+    uint32_t max;
+    uint32_t bucket[SDIO_TRACE_BUCKETS];
+};
+
+/**
+ * @brief One traced command
+ */
+struct sdio_trace_rec {
+    uint8_t id;
+    uint16_t blocks;
+    uint32_t issue;
+    uint32_t done;
+};
+
+/* Commands not listed here are accounted under "other", the last entry */
+static struct sdio_trace_hist sdio_trace_hist[] = {
+    { .id = 17,                     .name = "CMD17 read single" },
+    { .id = 18,                     .name = "CMD18 read multiple" },
+    { .id = 24,                     .name = "CMD24 write single" },
+    { .id = 25,                     .name = "CMD25 write multiple" },
+    { .id = 12,                     .name = "CMD12 stop" },
+    { .id = 13,                     .name = "CMD13 status" },
+    { .id = SDIO_TRACE_DATA_READ,   .name = "data read" },
+    { .id = SDIO_TRACE_DATA_WRITE,  .name = "data write" },
+    { .id = 0xff,                   .name = "other" },
+};
+
+static struct sdio_trace_rec sdio_trace_ring[SDIO_TRACE_RING];
+static uint32_t sdio_trace_head;
+
+static uint32_t sdio_trace_log2(uint32_t v)
+{
+    uint32_t n = 0;
+
+    while (v >>= 1)
+        n++;
+
+    return n;
+}
+
+/**
+ * @brief Timestamp for sdio_trace_record()
+ *
+ * @return Core cycle count
+ */
+uint32_t sdio_trace_now(void)
+{
+    dwt_enable();
+
+    return dwt_cycles();
+}
+
+/**
+ * @brief Account one command or data phase
+ *
+ * @param id Command index, or SDIO_TRACE_DATA_READ/WRITE for a data phase
+ * @param blocks Number of data blocks moved or announced
+ * @param issue Cycle stamp taken before issuing it
+ * @param done Cycle stamp taken on completion
+ */
+void sdio_trace_record(uint8_t id, uint16_t blocks, uint32_t issue,
+                       uint32_t done)
+{
+    struct sdio_trace_hist *hist;
+    struct sdio_trace_rec *rec;
+    uint32_t cycles = done - issue;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(sdio_trace_hist) - 1; i++) {
+        if (sdio_trace_hist[i].id == id)
+            break;
+    }
+    hist = &sdio_trace_hist[i];
+
+    hist->count++;
+    hist->sum += cycles;
+    if (cycles > hist->max)
+        hist->max = cycles;
+    hist->bucket[sdio_trace_log2(cycles)]++;
+
+    rec = &sdio_trace_ring[sdio_trace_head++ % SDIO_TRACE_RING];
+    rec->id = id;
+    rec->blocks = blocks;
+    rec->issue = issue;
+    rec->done = done;
+}
+
+/**
+ * @brief Clear all histograms and the record ring
+ */
+void sdio_trace_reset(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(sdio_trace_hist); i++) {
+        sdio_trace_hist[i].count = 0;
+        sdio_trace_hist[i].sum = 0;
+        sdio_trace_hist[i].max = 0;
+        memset(sdio_trace_hist[i].bucket, 0,
+               sizeof(sdio_trace_hist[i].bucket));
+    }
+
+    sdio_trace_head = 0;
+}
+
+/**
+ * @brief Upper bound of the bucket holding the given percentile
+ */
+static uint32_t sdio_trace_percentile(const struct sdio_trace_hist *hist,
+                                      uint32_t pct)
+{
+    uint32_t target = (hist->count * pct + 99) / 100;
+    uint32_t seen = 0;
+    int i;
+
+    for (i = 0; i < SDIO_TRACE_BUCKETS - 1; i++) {
+        seen += hist->bucket[i];
+        if (seen >= target && (2u << i) - 1 < hist->max)
+            return (2u << i) - 1;
+        if (seen >= target)
+            break;
+    }
+
+    return hist->max;
+}
+
+/**
+ * @brief Print the histograms and the recent records on the debug console
+ *
+ * Histogram lines are "bucket_us count", where bucket_us is the upper bound
+ * of the bucket; record lines are "cmd blocks start_us duration_us" with
+ * start times relative to the oldest record.  Both are meant to be easy to
+ * pick out of a console log with a script.
+ */
+void sdio_trace_dump(void)
+{
+    const struct sdio_trace_hist *hist;
+    const struct sdio_trace_rec *rec;
+    uint32_t cpu = dwt_cycles_per_us();
+    uint32_t first;
+    uint32_t start;
+    uint32_t n;
+    int i, b;
+
+    lowsyslog("sdio_trace: %u cycles/us\n", cpu);
+
+    for (i = 0; i < ARRAY_SIZE(sdio_trace_hist); i++) {
+        hist = &sdio_trace_hist[i];
+        if (!hist->count)
+            continue;
+
+        lowsyslog("sdio_trace: %s: n %u mean %u p50 %u p99 %u max %u us\n",
+                  hist->name, hist->count,
+                  (uint32_t)(hist->sum / hist->count / cpu),
+                  sdio_trace_percentile(hist, 50) / cpu,
+                  sdio_trace_percentile(hist, 99) / cpu, hist->max / cpu);
+
+        for (b = 0; b < SDIO_TRACE_BUCKETS; b++) {
+            if (hist->bucket[b])
+                lowsyslog("sdio_trace:   %u %u\n", ((2u << b) - 1) / cpu,
+                          hist->bucket[b]);
+        }
+    }
+
+    n = sdio_trace_head < SDIO_TRACE_RING ? sdio_trace_head : SDIO_TRACE_RING;
+    first = sdio_trace_head - n;
+    start = sdio_trace_ring[first % SDIO_TRACE_RING].issue;
+    for (i = 0; i < n; i++) {
+        rec = &sdio_trace_ring[(first + i) % SDIO_TRACE_RING];
+        lowsyslog("sdio_trace: rec %u %u %u %u\n", rec->id, rec->blocks,
+                  (rec->issue - start) / cpu, (rec->done - rec->issue) / cpu);
+    }
+}
+
+#ifdef CONFIG_GREYBUS
+struct sdio_trace_proto_version_response {
+    __u8 major;
+    __u8 minor;
+} __packed;
+
+struct sdio_trace_info_response {
+    /** Unit of all durations and timestamps */
+    __le32 cycles_per_us;
+    /** Number of histograms, the last one accounts unlisted commands */
+    __u8 histograms;
+    /** Buckets per histogram */
+    __u8 buckets;
+    /** Records kept in the ring */
+    __u8 ring;
+    __u8 pad;
+} __packed;
+
+struct sdio_trace_histogram_request {
+    __u8 index;
+} __packed;
+
+struct sdio_trace_histogram_response {
+    /** Command index, 64/65 for data read/write, 0xff for other */
+    __u8 id;
+    __u8 pad[3];
+    __le32 count;
+    __le64 sum;
+    __le32 max;
+    /** Bucket n counts durations of [2^n, 2^(n+1)) cycles */
+    __le32 bucket[SDIO_TRACE_BUCKETS];
+} __packed;
+
+struct sdio_trace_record {
+    __u8 id;
+    __u8 pad;
+    __le16 blocks;
+    __le32 issue;
+    __le32 done;
+} __packed;
+
+struct sdio_trace_records_response {
+    __le16 count;
+    __u8 pad[2];
+    /** Oldest first */
+    struct sdio_trace_record records[0];
+} __packed;
+
+static uint8_t sdio_trace_protocol_version(struct gb_operation *operation)
+{
+    struct sdio_trace_proto_version_response *response;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    response->major = SDIO_TRACE_VERSION_MAJOR;
+    response->minor = SDIO_TRACE_VERSION_MINOR;
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t sdio_trace_info(struct gb_operation *operation)
+{
+    struct sdio_trace_info_response *response;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    response->cycles_per_us = cpu_to_le32(dwt_cycles_per_us());
+    response->histograms = ARRAY_SIZE(sdio_trace_hist);
+    response->buckets = SDIO_TRACE_BUCKETS;
+    response->ring = SDIO_TRACE_RING;
+    response->pad = 0;
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t sdio_trace_histogram(struct gb_operation *operation)
+{
+    struct sdio_trace_histogram_request *request;
+    struct sdio_trace_histogram_response *response;
+    const struct sdio_trace_hist *hist;
+    int i;
+
+    if (gb_operation_get_request_payload_size(operation) < sizeof(*request))
+        return GB_OP_INVALID;
+
+    request = gb_operation_get_request_payload(operation);
+    if (request->index >= ARRAY_SIZE(sdio_trace_hist))
+        return GB_OP_INVALID;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    hist = &sdio_trace_hist[request->index];
+    memset(response, 0, sizeof(*response));
+    response->id = hist->id;
+    response->count = cpu_to_le32(hist->count);
+    response->sum = cpu_to_le64(hist->sum);
+    response->max = cpu_to_le32(hist->max);
+    for (i = 0; i < SDIO_TRACE_BUCKETS; i++)
+        response->bucket[i] = cpu_to_le32(hist->bucket[i]);
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t sdio_trace_records(struct gb_operation *operation)
+{
+    struct sdio_trace_records_response *response;
+    const struct sdio_trace_rec *rec;
+    uint32_t first;
+    uint32_t n;
+    int i;
+
+    n = sdio_trace_head < SDIO_TRACE_RING ? sdio_trace_head : SDIO_TRACE_RING;
+    first = sdio_trace_head - n;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response) +
+                                           n * sizeof(response->records[0]));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    response->count = cpu_to_le16(n);
+    response->pad[0] = response->pad[1] = 0;
+    for (i = 0; i < n; i++) {
+        rec = &sdio_trace_ring[(first + i) % SDIO_TRACE_RING];
+        response->records[i].id = rec->id;
+        response->records[i].pad = 0;
+        response->records[i].blocks = cpu_to_le16(rec->blocks);
+        response->records[i].issue = cpu_to_le32(rec->issue);
+        response->records[i].done = cpu_to_le32(rec->done);
+    }
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t sdio_trace_gb_reset(struct gb_operation *operation)
+{
+    sdio_trace_reset();
+    return GB_OP_SUCCESS;
+}
+
+static struct gb_operation_handler sdio_trace_handlers[] = {
+    GB_HANDLER(SDIO_TRACE_TYPE_PROTOCOL_VERSION, sdio_trace_protocol_version),
+    GB_HANDLER(SDIO_TRACE_TYPE_INFO, sdio_trace_info),
+    GB_HANDLER(SDIO_TRACE_TYPE_HISTOGRAM, sdio_trace_histogram),
+    GB_HANDLER(SDIO_TRACE_TYPE_RECORDS, sdio_trace_records),
+    GB_HANDLER(SDIO_TRACE_TYPE_RESET, sdio_trace_gb_reset),
+};
+
+static struct gb_driver sdio_trace_driver = {
+    .op_handlers = sdio_trace_handlers,
+    .op_handlers_count = ARRAY_SIZE(sdio_trace_handlers),
+};
+
+/**
+ * @brief Export the trace to the AP on a vendor protocol CPort
+ *
+ * The AP reads a consistent snapshot only while the block layer is idle;
+ * records updated during a read may come back torn.
+ *
+ * @param cport CPort of the vendor protocol in the manifest
+ * @param bundle Bundle of the CPort
+ * @return 0 on success, negative errno on error
+ */
+int sdio_trace_register(unsigned int cport, unsigned int bundle)
+{
+    return gb_register_driver(cport, bundle, &sdio_trace_driver);
+}
+#endif
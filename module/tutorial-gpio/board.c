@@ -29,6 +29,18 @@
  */
 
 #include <syslog.h>
+#include <sched.h>
+
+/* Measure GPIO interrupt latency at boot, with GPIO1 wired to GPIO2 */
+/* #define GPIO_LATENCY */
+
+int gpio_bulk_register(unsigned int cport, unsigned int bundle);
+int gpio_capture_register(unsigned int cport, unsigned int bundle);
+int gpio_latency_main(int argc, char *argv[]);
+
+#ifdef GPIO_LATENCY
+static char *gpio_latency_argv[] = { "1", "2", "1024", "2", "attach", NULL };
+#endif
 
 void ara_module_early_init(void)
 {
@@ -37,4 +49,15 @@ void ara_module_early_init(void)
 void ara_module_init(void)
 {
     lowsyslog("GPIO Tutorial Module init\n");
+
+    if (gpio_bulk_register(2, 2))
+        lowsyslog("gpio: failed to register bulk GPIO driver\n");
+
+    if (gpio_capture_register(3, 3))
+        lowsyslog("gpio: failed to register capture driver\n");
+
+#ifdef GPIO_LATENCY
+    task_create("gpio_latency", SCHED_PRIORITY_DEFAULT, 2048,
+                gpio_latency_main, gpio_latency_argv);
+#endif
 }
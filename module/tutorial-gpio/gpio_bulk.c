@@ -0,0 +1,433 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Bulk GPIO operations over a vendor Greybus protocol (CPort 2).
+ *
+ * The standard Greybus GPIO protocol (CPort 1) changes one line per
+ * operation, which limits AP-driven bit-banging to a few kHz.  Here one
+ * request sets, reads or changes the direction of any set of lines 0-31 by
+ * mask, and WAVEFORM plays a list of (mask, value, delay) steps on the
+ * module, timed against the DWT cycle counter.
+ *
+ * Step deadlines are counted from the start of the waveform, so delays do
+ * not accumulate drift.  Delays of a tick or more sleep first and busy-wait
+ * the rest.  With GPIO_BULK_WAVE_ATOMIC, interrupts stay masked for the
+ * whole waveform, so its delays may add up to GPIO_BULK_MAX_ATOMIC_US and
+ * it may write at most GPIO_BULK_MAX_ATOMIC_WRITES lines, repeats included:
+ * with zero delays the writes alone set the time spent masked.  The
+ * response reports how late the worst step was applied.
+ *
+ * SET, GET and WAVEFORM only act on lines DIRECTION has activated.
+ *
+ * Lines within one step are written one after the other, so they change a
+ * few hundred nanoseconds apart, not simultaneously.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <nuttx/clock.h>
+#include <nuttx/gpio.h>
+#include <nuttx/greybus/greybus.h>
+#include <nuttx/greybus/types.h>
+#include <nuttx/util.h>
+
+#include <arch/irq.h>
+
+#define GPIO_BULK_VERSION_MAJOR     0
+#define GPIO_BULK_VERSION_MINOR     1
+
+/* Operation types */
+#define GPIO_BULK_TYPE_PROTOCOL_VERSION 0x01
+#define GPIO_BULK_TYPE_LINE_COUNT       0x02
+#define GPIO_BULK_TYPE_DIRECTION        0x03
+#define GPIO_BULK_TYPE_SET              0x04
+#define GPIO_BULK_TYPE_GET              0x05
+#define GPIO_BULK_TYPE_WAVEFORM         0x06
+
+/* Waveform flags */
+#define GPIO_BULK_WAVE_ATOMIC       0x01
+
+#define GPIO_BULK_MAX_STEPS         128
+#define GPIO_BULK_MAX_WAVE_US       1000000
+#define GPIO_BULK_MAX_ATOMIC_US     1000
+/* A line write takes a few hundred ns: about 300 us more at most */
+#define GPIO_BULK_MAX_ATOMIC_WRITES 1024
+/* Other waveforms hold the Greybus receive thread for their whole length */
+#define GPIO_BULK_MAX_WRITES        65536
+
+struct gpio_bulk_proto_version_response {
+    __u8 major;
+    __u8 minor;
+} __packed;
+
+struct gpio_bulk_line_count_response {
+    __u8 count;
+} __packed;
+
+struct gpio_bulk_direction_request {
+    __le32 mask;
+    /** 1 for output, 0 for input */
+    __le32 output;
+    /** Initial level of the new outputs */
+    __le32 value;
+} __packed;
+
+struct gpio_bulk_set_request {
+    __le32 mask;
+    __le32 value;
+} __packed;
+
+struct gpio_bulk_get_request {
+    __le32 mask;
+} __packed;
+
+struct gpio_bulk_get_response {
+    __le32 value;
+} __packed;
+
+struct gpio_bulk_step {
+    __le32 mask;
+    __le32 value;
+    /** Time to the next step */
+    __le32 delay_us;
+} __packed;
+
+struct gpio_bulk_waveform_request {
+    __le16 count;
+    /** Times the steps are played; 0 and 1 both mean once */
+    __le16 repeat;
+    __u8 flags;
+    __u8 pad[3];
+    struct gpio_bulk_step steps[0];
+} __packed;
+
+struct gpio_bulk_waveform_response {
+    __le32 elapsed_us;
+    /** Worst delay between a step's deadline and its last line written */
+    __le32 max_late_ns;
+} __packed;
+
+static uint32_t gpio_bulk_lines;
+static uint32_t gpio_bulk_active;
+static uint32_t gpio_bulk_cycles_per_us;
+
+/* Cycle counter, see common/dwt.c */
+uint32_t dwt_cycles(void);
+uint32_t dwt_cycles_per_us(void);
+
+static bool gpio_bulk_valid_mask(uint32_t mask)
+{
+    return mask && !(mask & ~gpio_bulk_lines);
+}
+
+static bool gpio_bulk_active_mask(uint32_t mask)
+{
+    return mask && !(mask & ~gpio_bulk_active);
+}
+
+static void gpio_bulk_set(uint32_t mask, uint32_t value)
+{
+    uint8_t line;
+
+    for (line = 0; mask; line++, mask >>= 1, value >>= 1) {
+        if (mask & 1)
+            gpio_set_value(line, value & 1);
+    }
+}
+
+/**
+ * @brief Wait until the cycle counter reaches a deadline
+ *
+ * @param deadline Cycle counter value
+ * @param can_sleep Sleep through whole ticks before busy-waiting
+ */
+static void gpio_bulk_wait(uint32_t deadline, bool can_sleep)
+{
+    int32_t left = deadline - dwt_cycles();
+    uint32_t us;
+
+    if (left <= 0)
+        return;
+
+    us = left / gpio_bulk_cycles_per_us;
+    if (can_sleep && us >= 2 * USEC_PER_TICK)
+        usleep(us - USEC_PER_TICK);
+
+    while ((int32_t)(deadline - dwt_cycles()) > 0);
+}
+
+static uint8_t gpio_bulk_protocol_version(struct gb_operation *operation)
+{
+    struct gpio_bulk_proto_version_response *response;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    response->major = GPIO_BULK_VERSION_MAJOR;
+    response->minor = GPIO_BULK_VERSION_MINOR;
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t gpio_bulk_line_count(struct gb_operation *operation)
+{
+    struct gpio_bulk_line_count_response *response;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    response->count = gpio_line_count() < 32 ? gpio_line_count() : 32;
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t gpio_bulk_direction(struct gb_operation *operation)
+{
+    struct gpio_bulk_direction_request *req =
+        gb_operation_get_request_payload(operation);
+    uint32_t mask;
+    uint32_t output;
+    uint32_t value;
+    uint8_t line;
+
+    if (gb_operation_get_request_payload_size(operation) < sizeof(*req))
+        return GB_OP_INVALID;
+
+    mask = le32_to_cpu(req->mask);
+    output = le32_to_cpu(req->output);
+    value = le32_to_cpu(req->value);
+    if (!gpio_bulk_valid_mask(mask))
+        return GB_OP_INVALID;
+
+    for (line = 0; line < 32; line++) {
+        if (!(mask & (1u << line)))
+            continue;
+
+        if (!(gpio_bulk_active & (1u << line))) {
+            if (gpio_activate(line))
+                return GB_OP_UNKNOWN_ERROR;
+            gpio_bulk_active |= 1u << line;
+        }
+
+        if (output & (1u << line))
+            gpio_direction_out(line, !!(value & (1u << line)));
+        else
+            gpio_direction_in(line);
+    }
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t gpio_bulk_set_value(struct gb_operation *operation)
+{
+    struct gpio_bulk_set_request *req =
+        gb_operation_get_request_payload(operation);
+
+    if (gb_operation_get_request_payload_size(operation) < sizeof(*req))
+        return GB_OP_INVALID;
+
+    if (!gpio_bulk_active_mask(le32_to_cpu(req->mask)))
+        return GB_OP_INVALID;
+
+    gpio_bulk_set(le32_to_cpu(req->mask), le32_to_cpu(req->value));
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t gpio_bulk_get_value(struct gb_operation *operation)
+{
+    struct gpio_bulk_get_request *req =
+        gb_operation_get_request_payload(operation);
+    struct gpio_bulk_get_response *response;
+    uint32_t mask;
+    uint32_t value = 0;
+    uint8_t line;
+
+    if (gb_operation_get_request_payload_size(operation) < sizeof(*req))
+        return GB_OP_INVALID;
+
+    mask = le32_to_cpu(req->mask);
+    if (!gpio_bulk_active_mask(mask))
+        return GB_OP_INVALID;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    for (line = 0; line < 32; line++) {
+        if (mask & (1u << line) && gpio_get_value(line))
+            value |= 1u << line;
+    }
+
+    response->value = cpu_to_le32(value);
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t gpio_bulk_waveform(struct gb_operation *operation)
+{
+    struct gpio_bulk_waveform_request *req =
+        gb_operation_get_request_payload(operation);
+    struct gpio_bulk_waveform_response *response;
+    const struct gpio_bulk_step *step;
+    uint32_t cpu = gpio_bulk_cycles_per_us;
+    uint64_t total_us = 0;
+    uint32_t writes = 0;
+    uint32_t max_late = 0;
+    uint32_t deadline;
+    uint32_t start;
+    uint32_t late;
+    uint16_t count;
+    uint16_t repeat;
+    uint16_t r;
+    uint16_t i;
+    irqstate_t flags = 0;
+    bool atomic;
+
+    if (gb_operation_get_request_payload_size(operation) < sizeof(*req))
+        return GB_OP_INVALID;
+
+    count = le16_to_cpu(req->count);
+    repeat = le16_to_cpu(req->repeat);
+    if (!repeat)
+        repeat = 1;
+    atomic = req->flags & GPIO_BULK_WAVE_ATOMIC;
+
+    if (!count || count > GPIO_BULK_MAX_STEPS ||
+        gb_operation_get_request_payload_size(operation) <
+        sizeof(*req) + count * sizeof(*step))
+        return GB_OP_INVALID;
+
+    for (i = 0; i < count; i++) {
+        if (!gpio_bulk_active_mask(le32_to_cpu(req->steps[i].mask)))
+            return GB_OP_INVALID;
+        total_us += le32_to_cpu(req->steps[i].delay_us);
+        writes += __builtin_popcount(le32_to_cpu(req->steps[i].mask));
+    }
+
+    total_us *= repeat;
+    if (total_us > (atomic ? GPIO_BULK_MAX_ATOMIC_US : GPIO_BULK_MAX_WAVE_US))
+        return GB_OP_INVALID;
+
+    writes *= repeat;
+    if (writes > (atomic ? GPIO_BULK_MAX_ATOMIC_WRITES : GPIO_BULK_MAX_WRITES))
+        return GB_OP_INVALID;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    if (atomic)
+        flags = irqsave();
+
+    start = deadline = dwt_cycles();
+
+    for (r = 0; r < repeat; r++) {
+        for (i = 0; i < count; i++) {
+            step = &req->steps[i];
+
+            gpio_bulk_wait(deadline, !atomic);
+            gpio_bulk_set(le32_to_cpu(step->mask), le32_to_cpu(step->value));
+
+            late = dwt_cycles() - deadline;
+            if (late > max_late)
+                max_late = late;
+
+            deadline += le32_to_cpu(step->delay_us) * cpu;
+        }
+    }
+
+    /* The last step lasts its delay too */
+    gpio_bulk_wait(deadline, !atomic);
+
+    if (atomic)
+        irqrestore(flags);
+
+    response->elapsed_us =
+        cpu_to_le32((uint64_t)(dwt_cycles() - start) / cpu);
+    response->max_late_ns = cpu_to_le32((uint64_t)max_late * 1000 / cpu);
+
+    return GB_OP_SUCCESS;
+}
+
+static int gpio_bulk_init(unsigned int cport, struct gb_bundle *bundle)
+{
+    uint8_t count = gpio_line_count();
+
+    gpio_bulk_lines = count >= 32 ? 0xffffffff : (1u << count) - 1;
+    gpio_bulk_cycles_per_us = dwt_cycles_per_us();
+
+    return 0;
+}
+
+static void gpio_bulk_disconnected(unsigned int cport)
+{
+    uint8_t line;
+
+    for (line = 0; line < 32; line++) {
+        if (gpio_bulk_active & (1u << line))
+            gpio_deactivate(line);
+    }
+
+    gpio_bulk_active = 0;
+}
+
+static struct gb_operation_handler gpio_bulk_handlers[] = {
+    GB_HANDLER(GPIO_BULK_TYPE_PROTOCOL_VERSION, gpio_bulk_protocol_version),
+    GB_HANDLER(GPIO_BULK_TYPE_LINE_COUNT, gpio_bulk_line_count),
+    GB_HANDLER(GPIO_BULK_TYPE_DIRECTION, gpio_bulk_direction),
+    GB_HANDLER(GPIO_BULK_TYPE_SET, gpio_bulk_set_value),
+    GB_HANDLER(GPIO_BULK_TYPE_GET, gpio_bulk_get_value),
+    GB_HANDLER(GPIO_BULK_TYPE_WAVEFORM, gpio_bulk_waveform),
+};
+
+static struct gb_driver gpio_bulk_driver = {
+    .init = gpio_bulk_init,
+    .disconnected = gpio_bulk_disconnected,
+    .op_handlers = gpio_bulk_handlers,
+    .op_handlers_count = ARRAY_SIZE(gpio_bulk_handlers),
+};
+
+/**
+ * @brief Register the bulk GPIO protocol on a CPort
+ *
+ * @param cport CPort of the vendor protocol in the manifest
+ * @param bundle Bundle of the CPort
+ * @return 0 on success, negative errno on error
+ */
+int gpio_bulk_register(unsigned int cport, unsigned int bundle)
+{
+    return gb_register_driver(cport, bundle, &gpio_bulk_driver);
+}
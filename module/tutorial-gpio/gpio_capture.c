@@ -0,0 +1,541 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * GPIO edge capture, streamed to the AP over a vendor Greybus protocol
+ * (CPort 3).
+ *
+ * The standard Greybus GPIO protocol sends one IRQ_EVENT request per edge,
+ * without a timestamp, so the AP cannot tell when an edge happened nor
+ * keep up with fast signals.  Here the interrupt handler only stores the
+ * line, its level and the DWT cycle counter in a ring; the high-priority
+ * work queue sends the events in EVENTS requests of up to batch events,
+ * as soon as a batch is full or every flush interval.  The AP gets
+ * logic-analyzer style traces and can measure frequencies and pulse widths
+ * to the cycle.
+ *
+ * Timestamps count cycles since START, extended to 64 bits by the worker,
+ * which runs at least every flush interval, well within a counter wrap.
+ * When the ring is full new edges are dropped and counted, so every batch
+ * holds consecutive edges and the AP knows where the gaps are.
+ *
+ * The level is read in the handler, after the edge: a pulse shorter than
+ * the interrupt latency may report the level after the next edge.
+ */
+
+#include <errno.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <nuttx/clock.h>
+#include <nuttx/gpio.h>
+#include <nuttx/greybus/greybus.h>
+#include <nuttx/greybus/types.h>
+#include <nuttx/util.h>
+#include <nuttx/wqueue.h>
+
+#include <arch/irq.h>
+
+#define GPIO_CAPTURE_VERSION_MAJOR  0
+#define GPIO_CAPTURE_VERSION_MINOR  1
+
+/* Operation types */
+#define GPIO_CAPTURE_TYPE_PROTOCOL_VERSION  0x01
+#define GPIO_CAPTURE_TYPE_CONFIGURE         0x02
+#define GPIO_CAPTURE_TYPE_START             0x03
+#define GPIO_CAPTURE_TYPE_STOP              0x04
+#define GPIO_CAPTURE_TYPE_STATUS            0x05
+#define GPIO_CAPTURE_TYPE_EVENTS            0x06
+
+/* Events the ring holds, a power of two */
+#define GPIO_CAPTURE_RING           1024
+#define GPIO_CAPTURE_MAX_FLUSH_MS   1000
+
+/* Largest EVENTS payload */
+#define GPIO_CAPTURE_MAX_PAYLOAD    1024
+#define GPIO_CAPTURE_MAX_BATCH      \
+    ((GPIO_CAPTURE_MAX_PAYLOAD - sizeof(struct gpio_capture_events_request)) / \
+     sizeof(struct gpio_capture_event))
+
+struct gpio_capture_proto_version_response {
+    __u8 major;
+    __u8 minor;
+} __packed;
+
+struct gpio_capture_configure_request {
+    /** Lines 0-31 to capture */
+    __le32 mask;
+    /** IRQ_TYPE_EDGE_RISING, _FALLING or _BOTH */
+    __u8 trigger;
+    __u8 pad;
+    /** Most events per EVENTS request */
+    __le16 batch;
+    /** Longest time an event waits before being sent */
+    __le16 flush_ms;
+} __packed;
+
+struct gpio_capture_configure_response {
+    /** Events the ring holds */
+    __le16 capacity;
+    /** Largest batch allowed */
+    __le16 max_batch;
+} __packed;
+
+struct gpio_capture_start_response {
+    /** Timestamp unit */
+    __le32 clock_hz;
+} __packed;
+
+struct gpio_capture_status_response {
+    __le32 events;
+    __le32 dropped;
+    __le16 pending;
+    __u8 running;
+    __u8 pad;
+} __packed;
+
+struct gpio_capture_event {
+    /** Cycles after the base of the request */
+    __le32 offset;
+    __u8 line;
+    __u8 level;
+} __packed;
+
+struct gpio_capture_events_request {
+    /** Requests sent since START, to spot lost ones */
+    __le32 seq;
+    /** Edges dropped so far because the ring was full */
+    __le32 dropped;
+    /** Cycles from START to the first event */
+    __le64 base;
+    __le16 count;
+    __u8 pad[2];
+    struct gpio_capture_event events[0];
+} __packed;
+
+/**
+ * @brief Edge as stored by the interrupt handler
+ */
+struct gpio_capture_edge {
+    uint32_t cycles;
+    uint8_t line;
+    uint8_t level;
+};
+
+/**
+ * @brief Capture state
+ */
+static struct {
+    sem_t lock;
+    unsigned int cport;
+
+    bool configured;
+    bool running;
+    uint32_t mask;
+    uint8_t trigger;
+    uint16_t batch;
+    uint32_t flush_ticks;
+
+    /** Edges stored by the handler and consumed by the worker, free running */
+    struct gpio_capture_edge ring[GPIO_CAPTURE_RING];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t dropped;
+    volatile bool kicked;
+
+    struct work_s work;
+    /** Cycle counter rate, as measured */
+    uint32_t clock_hz;
+    /** Cycle counter value last accounted for, and its extended value */
+    uint32_t last_cycles;
+    uint64_t now_cycles;
+    uint32_t seq;
+    uint32_t events;
+} capture;
+
+static void gpio_capture_worker(void *arg);
+
+/* Cycle counter, see common/dwt.c */
+uint32_t dwt_cycles(void);
+uint32_t dwt_clock_hz(void);
+
+static int gpio_capture_irq(int irq, void *context)
+{
+    uint32_t now = dwt_cycles();
+    struct gpio_capture_edge *edge;
+    uint32_t used = capture.head - capture.tail;
+
+    if (used == GPIO_CAPTURE_RING) {
+        capture.dropped++;
+        return 0;
+    }
+
+    edge = &capture.ring[capture.head % GPIO_CAPTURE_RING];
+    edge->cycles = now;
+    edge->line = irq;
+    edge->level = gpio_get_value(irq);
+    capture.head++;
+
+    /* A full batch: run the worker now instead of at the next flush */
+    if (used + 1 >= capture.batch && !capture.kicked) {
+        capture.kicked = true;
+        work_cancel(HPWORK, &capture.work);
+        work_queue(HPWORK, &capture.work, gpio_capture_worker, NULL, 0);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Send the edges stored up to head; called with the lock held
+ *
+ * @param head Ring head read together with now
+ * @param now Cycle counter when head was read
+ */
+static void gpio_capture_send(uint32_t head, uint32_t now)
+{
+    struct gpio_capture_events_request *req;
+    struct gpio_capture_edge *edge;
+    struct gb_operation *op;
+    uint32_t last;
+    uint64_t ext;
+    uint64_t base = 0;
+    uint32_t count;
+    uint32_t i;
+
+    while (capture.tail != head) {
+        count = head - capture.tail;
+        if (count > capture.batch)
+            count = capture.batch;
+
+        op = gb_operation_create(capture.cport, GPIO_CAPTURE_TYPE_EVENTS,
+                                 sizeof(*req) + count * sizeof(*req->events));
+        if (!op)
+            return;
+
+        req = gb_operation_get_request_payload(op);
+        last = capture.last_cycles;
+        ext = capture.now_cycles;
+
+        for (i = 0; i < count; i++) {
+            edge = &capture.ring[(capture.tail + i) % GPIO_CAPTURE_RING];
+            ext += edge->cycles - last;
+            last = edge->cycles;
+            if (!i)
+                base = ext;
+
+            req->events[i].offset = cpu_to_le32(ext - base);
+            req->events[i].line = edge->line;
+            req->events[i].level = edge->level;
+        }
+
+        req->seq = cpu_to_le32(capture.seq);
+        req->dropped = cpu_to_le32(capture.dropped);
+        req->base = cpu_to_le64(base);
+        req->count = cpu_to_le16(count);
+        req->pad[0] = req->pad[1] = 0;
+
+        if (gb_operation_send_request(op, NULL, false)) {
+            /* Try again on the next flush */
+            gb_operation_destroy(op);
+            return;
+        }
+
+        gb_operation_destroy(op);
+        capture.tail += count;
+        capture.last_cycles = last;
+        capture.now_cycles = ext;
+        capture.events += count;
+        capture.seq++;
+    }
+
+    /* Everything before now is sent: move the clock up to now */
+    capture.now_cycles += now - capture.last_cycles;
+    capture.last_cycles = now;
+}
+
+static void gpio_capture_worker(void *arg)
+{
+    irqstate_t flags;
+    uint32_t head;
+    uint32_t now;
+
+    sem_wait(&capture.lock);
+
+    if (!capture.running) {
+        sem_post(&capture.lock);
+        return;
+    }
+
+    flags = irqsave();
+    head = capture.head;
+    now = dwt_cycles();
+    capture.kicked = false;
+    irqrestore(flags);
+
+    gpio_capture_send(head, now);
+
+    /* Unless the handler has queued the worker again meanwhile */
+    flags = irqsave();
+    if (!capture.kicked)
+        work_queue(HPWORK, &capture.work, gpio_capture_worker, NULL,
+                   capture.flush_ticks);
+    irqrestore(flags);
+
+    sem_post(&capture.lock);
+}
+
+/**
+ * @brief Release the lines; called with the lock held
+ */
+static void gpio_capture_lines_off(uint32_t mask)
+{
+    uint8_t line;
+
+    for (line = 0; line < 32; line++) {
+        if (!(mask & (1u << line)))
+            continue;
+
+        gpio_irq_mask(line);
+        gpio_irq_attach(line, NULL);
+        gpio_deactivate(line);
+    }
+}
+
+/**
+ * @brief Stop capturing and send what is left; called with the lock held
+ */
+static void gpio_capture_halt(void)
+{
+    if (!capture.running)
+        return;
+
+    gpio_capture_lines_off(capture.mask);
+    capture.running = false;
+    work_cancel(HPWORK, &capture.work);
+    gpio_capture_send(capture.head, dwt_cycles());
+}
+
+static uint8_t gpio_capture_protocol_version(struct gb_operation *operation)
+{
+    struct gpio_capture_proto_version_response *response;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    response->major = GPIO_CAPTURE_VERSION_MAJOR;
+    response->minor = GPIO_CAPTURE_VERSION_MINOR;
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t gpio_capture_configure(struct gb_operation *operation)
+{
+    struct gpio_capture_configure_request *req =
+        gb_operation_get_request_payload(operation);
+    struct gpio_capture_configure_response *response;
+    uint8_t count = gpio_line_count();
+    uint32_t lines = count >= 32 ? 0xffffffff : (1u << count) - 1;
+    uint32_t mask;
+    uint16_t batch;
+    uint16_t flush_ms;
+    uint8_t ret = GB_OP_SUCCESS;
+
+    if (gb_operation_get_request_payload_size(operation) < sizeof(*req))
+        return GB_OP_INVALID;
+
+    mask = le32_to_cpu(req->mask);
+    batch = le16_to_cpu(req->batch);
+    flush_ms = le16_to_cpu(req->flush_ms);
+
+    if (!mask || mask & ~lines || !batch || batch > GPIO_CAPTURE_MAX_BATCH ||
+        !flush_ms || flush_ms > GPIO_CAPTURE_MAX_FLUSH_MS ||
+        !req->trigger || req->trigger & ~IRQ_TYPE_EDGE_BOTH)
+        return GB_OP_INVALID;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    sem_wait(&capture.lock);
+
+    if (capture.running) {
+        ret = GB_OP_INVALID;
+        goto out;
+    }
+
+    capture.mask = mask;
+    capture.trigger = req->trigger;
+    capture.batch = batch;
+    capture.flush_ticks = MSEC2TICK(flush_ms) ? MSEC2TICK(flush_ms) : 1;
+    capture.configured = true;
+
+    response->capacity = cpu_to_le16(GPIO_CAPTURE_RING);
+    response->max_batch = cpu_to_le16(GPIO_CAPTURE_MAX_BATCH);
+
+out:
+    sem_post(&capture.lock);
+    return ret;
+}
+
+static uint8_t gpio_capture_start(struct gb_operation *operation)
+{
+    struct gpio_capture_start_response *response;
+    uint32_t active = 0;
+    uint8_t ret = GB_OP_SUCCESS;
+    uint8_t line;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    sem_wait(&capture.lock);
+
+    if (!capture.configured || capture.running) {
+        ret = GB_OP_INVALID;
+        goto out;
+    }
+
+    capture.head = capture.tail = 0;
+    capture.dropped = capture.events = capture.seq = 0;
+    capture.kicked = false;
+    capture.now_cycles = 0;
+    capture.last_cycles = dwt_cycles();
+
+    for (line = 0; line < 32; line++) {
+        if (!(capture.mask & (1u << line)))
+            continue;
+
+        if (gpio_activate(line)) {
+            gpio_capture_lines_off(active);
+            ret = GB_OP_UNKNOWN_ERROR;
+            goto out;
+        }
+        active |= 1u << line;
+
+        gpio_direction_in(line);
+        gpio_irq_mask(line);
+        gpio_irq_settriggering(line, capture.trigger);
+        gpio_irq_attach(line, gpio_capture_irq);
+    }
+
+    capture.running = true;
+    work_queue(HPWORK, &capture.work, gpio_capture_worker, NULL,
+               capture.flush_ticks);
+
+    for (line = 0; line < 32; line++) {
+        if (capture.mask & (1u << line))
+            gpio_irq_unmask(line);
+    }
+
+    response->clock_hz = cpu_to_le32(capture.clock_hz);
+
+out:
+    sem_post(&capture.lock);
+    return ret;
+}
+
+static uint8_t gpio_capture_stop(struct gb_operation *operation)
+{
+    sem_wait(&capture.lock);
+    gpio_capture_halt();
+    sem_post(&capture.lock);
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t gpio_capture_status(struct gb_operation *operation)
+{
+    struct gpio_capture_status_response *response;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    sem_wait(&capture.lock);
+    response->events = cpu_to_le32(capture.events);
+    response->dropped = cpu_to_le32(capture.dropped);
+    response->pending = cpu_to_le16(capture.head - capture.tail);
+    response->running = capture.running;
+    response->pad = 0;
+    sem_post(&capture.lock);
+
+    return GB_OP_SUCCESS;
+}
+
+static int gpio_capture_init(unsigned int cport, struct gb_bundle *bundle)
+{
+    capture.cport = cport;
+    sem_init(&capture.lock, 0, 1);
+    capture.clock_hz = dwt_clock_hz();
+
+    return 0;
+}
+
+static void gpio_capture_disconnected(unsigned int cport)
+{
+    sem_wait(&capture.lock);
+    if (capture.running) {
+        gpio_capture_lines_off(capture.mask);
+        capture.running = false;
+        work_cancel(HPWORK, &capture.work);
+    }
+    sem_post(&capture.lock);
+}
+
+static struct gb_operation_handler gpio_capture_handlers[] = {
+    GB_HANDLER(GPIO_CAPTURE_TYPE_PROTOCOL_VERSION,
+               gpio_capture_protocol_version),
+    GB_HANDLER(GPIO_CAPTURE_TYPE_CONFIGURE, gpio_capture_configure),
+    GB_HANDLER(GPIO_CAPTURE_TYPE_START, gpio_capture_start),
+    GB_HANDLER(GPIO_CAPTURE_TYPE_STOP, gpio_capture_stop),
+    GB_HANDLER(GPIO_CAPTURE_TYPE_STATUS, gpio_capture_status),
+};
+
+static struct gb_driver gpio_capture_driver = {
+    .init = gpio_capture_init,
+    .disconnected = gpio_capture_disconnected,
+    .op_handlers = gpio_capture_handlers,
+    .op_handlers_count = ARRAY_SIZE(gpio_capture_handlers),
+};
+
+/**
+ * @brief Register the capture protocol on a CPort
+ *
+ * @param cport CPort of the vendor protocol in the manifest
+ * @param bundle Bundle of the CPort
+ * @return 0 on success, negative errno on error
+ */
+int gpio_capture_register(unsigned int cport, unsigned int bundle)
+{
+    return gb_register_driver(cport, bundle, &gpio_capture_driver);
+}
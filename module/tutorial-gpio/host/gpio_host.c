@@ -0,0 +1,213 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host test of the GPIO interrupt latency harness against a simulated GPIO
+ * bank.
+ *
+ * common/gpio_latency.c is built unchanged with the stand-in headers in
+ * include/ and the simulated GPIO bank in gpio_sim.c, which also stands in
+ * for common/dwt.c:
+ *
+ *   cc -O2 -pthread -Imodule/tutorial-gpio/host/include \
+ *      -Imodule/tutorial-gpio/host -o gpio_host \
+ *      module/tutorial-gpio/host/gpio_host.c \
+ *      module/tutorial-gpio/host/gpio_sim.c \
+ *      module/common/gpio_latency.c
+ *
+ * Usage: gpio_host [-d delay_us] [-j jitter_us] [-n samples]
+ *
+ * Runs, in order:
+ * - harness: the harness's own handler on a wired input; every sample must
+ *   be recorded, none faster than the simulated delay;
+ * - driver: a stand-in HID driver calling both hooks, which unmasks its
+ *   interrupt only after a while, as if waiting for the AP; every sample
+ *   must reach the event stage, at least the driver's work after the
+ *   handler;
+ * - unwired: with no wire between the lines every sample must time out.
+ *
+ * Exits non-zero if any check fails.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <nuttx/gpio.h>
+
+#include "gpio_sim.h"
+
+#define HOST_SAMPLES        500
+#define HOST_DELAY_US       20
+#define HOST_JITTER_US      10
+/* Time the stand-in driver spends between its two hooks */
+#define HOST_WORK_NS        5000
+/* Time before the stand-in driver unmasks its interrupt */
+#define HOST_CONNECT_MS     1500
+#define HOST_UNWIRED        3
+
+#define GPIO_LATENCY_ATTACH 0x01
+
+void gpio_latency_mark(int irq);
+void gpio_latency_event(int irq);
+int gpio_latency_run(uint8_t out, uint8_t in, unsigned int samples,
+                     unsigned int gap_ms, unsigned int flags);
+uint32_t gpio_latency_stats(unsigned int stage, uint32_t *min_ns,
+                            uint32_t *max_ns);
+
+static uint32_t host_delay_ns = HOST_DELAY_US * 1000;
+
+static int host_check(bool ok, const char *what)
+{
+    printf("gpio_host: %-48s %s\n", what, ok ? "ok" : "FAILED");
+    return ok ? 0 : -1;
+}
+
+static int host_test_harness(unsigned int samples)
+{
+    uint32_t count;
+    uint32_t min;
+    int ret;
+
+    gpio_sim_connect(1, 2);
+
+    ret = gpio_latency_run(1, 2, samples, 1, GPIO_LATENCY_ATTACH);
+    count = gpio_latency_stats(0, &min, NULL);
+
+    return host_check(!ret && count == samples && min >= host_delay_ns,
+                      "harness: all samples, none below the delay");
+}
+
+static int host_driver_irq(int irq, void *context)
+{
+    gpio_latency_mark(irq);
+    gpio_sim_spin(HOST_WORK_NS);
+    gpio_latency_event(irq);
+
+    return 0;
+}
+
+static void *host_driver_connect(void *arg)
+{
+    usleep(HOST_CONNECT_MS * 1000);
+    gpio_irq_unmask(4);
+
+    return NULL;
+}
+
+static int host_test_driver(unsigned int samples)
+{
+    pthread_t connect;
+    uint32_t handler_min;
+    uint32_t event_min;
+    uint32_t handler;
+    uint32_t event;
+    int ret;
+
+    gpio_sim_connect(3, 4);
+
+    gpio_activate(4);
+    gpio_direction_in(4);
+    gpio_irq_settriggering(4, IRQ_TYPE_EDGE_BOTH);
+    gpio_irq_attach(4, host_driver_irq);
+    pthread_create(&connect, NULL, host_driver_connect, NULL);
+
+    ret = gpio_latency_run(3, 4, samples, 1, 0);
+    handler = gpio_latency_stats(0, &handler_min, NULL);
+    event = gpio_latency_stats(1, &event_min, NULL);
+
+    pthread_join(connect, NULL);
+    gpio_irq_mask(4);
+    gpio_deactivate(4);
+
+    return host_check(!ret && handler == samples && event == samples &&
+                      event_min >= handler_min + HOST_WORK_NS,
+                      "driver: all samples reach the event stage");
+}
+
+static int host_test_unwired(void)
+{
+    int ret;
+
+    ret = gpio_latency_run(5, 6, HOST_UNWIRED, 1, GPIO_LATENCY_ATTACH);
+
+    return host_check(ret == -ETIMEDOUT && !gpio_latency_stats(0, NULL, NULL),
+                      "unwired: every sample times out");
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-d delay_us] [-j jitter_us] [-n samples]\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int samples = HOST_SAMPLES;
+    uint32_t jitter_ns = HOST_JITTER_US * 1000;
+    int ret = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:j:n:")) != -1) {
+        switch (c) {
+        case 'd':
+            host_delay_ns = strtoul(optarg, NULL, 0) * 1000;
+            break;
+        case 'j':
+            jitter_ns = strtoul(optarg, NULL, 0) * 1000;
+            break;
+        case 'n':
+            samples = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (gpio_sim_init()) {
+        perror("gpio_sim");
+        return 1;
+    }
+
+    gpio_sim_set_latency(host_delay_ns, jitter_ns);
+
+    ret |= host_test_harness(samples);
+    ret |= host_test_driver(samples);
+    ret |= host_test_unwired();
+
+    gpio_sim_exit();
+
+    printf("%s\n", ret ? "FAIL" : "PASS");
+    return ret ? 1 : 0;
+}
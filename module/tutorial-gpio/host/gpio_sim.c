@@ -0,0 +1,374 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Simulated GPIO bank for the host build.
+ *
+ * gpio_sim_connect() wires an output to an input, as a jumper would.  An
+ * edge on an input whose trigger matches latches a pending interrupt;
+ * unmasked pending interrupts are delivered from a separate thread, which
+ * stands for interrupt context.  Each delivery waits until the configured
+ * latency plus a random share of the jitter has passed since the edge,
+ * so measured latencies are never below the configured delay but do
+ * include the host's own thread wake-up time.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nuttx/clock.h>
+#include <nuttx/gpio.h>
+
+#include "gpio_sim.h"
+
+#define GPIO_SIM_LINES      32
+
+struct gpio_sim_line {
+    bool active;
+    bool output;
+    bool masked;
+    uint8_t level;
+    int trigger;
+    xcpt_t isr;
+    /** Input driven by this output, or -1 */
+    int wire;
+    /** Time of the last edge, from gpio_sim_cycles() */
+    uint32_t edge;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running;
+    struct timespec start;
+    uint32_t delay_ns;
+    uint32_t jitter_ns;
+    uint32_t pending;
+    struct gpio_sim_line line[GPIO_SIM_LINES];
+} sim = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static uint64_t gpio_sim_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec - sim.start.tv_sec) * 1000000000 +
+           ts.tv_nsec - sim.start.tv_nsec;
+}
+
+/**
+ * @brief Cycle counter for the harnesses; one cycle per nanosecond
+ */
+uint32_t gpio_sim_cycles(void)
+{
+    return gpio_sim_ns();
+}
+
+/* Stand-ins for common/dwt.c */
+uint32_t dwt_cycles(void)
+{
+    return gpio_sim_cycles();
+}
+
+uint32_t dwt_cycles_per_us(void)
+{
+    return 1000;
+}
+
+uint32_t clock_systimer(void)
+{
+    return gpio_sim_ns() / 1000 / USEC_PER_TICK;
+}
+
+/**
+ * @brief Busy-wait, as code running on the module would
+ */
+void gpio_sim_spin(uint32_t ns)
+{
+    uint32_t start = gpio_sim_cycles();
+
+    while (gpio_sim_cycles() - start < ns);
+}
+
+static bool gpio_sim_valid(uint8_t which)
+{
+    return which < GPIO_SIM_LINES;
+}
+
+/* Called with the lock held */
+static void gpio_sim_drive(uint8_t which, uint8_t level)
+{
+    struct gpio_sim_line *l = &sim.line[which];
+    int edge;
+
+    level = !!level;
+    if (l->level == level)
+        return;
+
+    l->level = level;
+    l->edge = gpio_sim_cycles();
+
+    if (l->wire >= 0 && !sim.line[l->wire].output)
+        gpio_sim_drive(l->wire, level);
+
+    if (l->output)
+        return;
+
+    edge = level ? IRQ_TYPE_EDGE_RISING : IRQ_TYPE_EDGE_FALLING;
+    if (l->trigger & edge) {
+        sim.pending |= 1u << which;
+        pthread_cond_signal(&sim.cond);
+    }
+}
+
+static void *gpio_sim_irq_thread(void *arg)
+{
+    struct gpio_sim_line *l;
+    uint32_t due;
+    xcpt_t isr;
+    int which;
+
+    pthread_mutex_lock(&sim.lock);
+    while (sim.running) {
+        bool ready = false;
+
+        for (which = 0; which < GPIO_SIM_LINES; which++) {
+            if (sim.pending & (1u << which) && !sim.line[which].masked) {
+                ready = true;
+                break;
+            }
+        }
+
+        if (!ready) {
+            pthread_cond_wait(&sim.cond, &sim.lock);
+            continue;
+        }
+
+        l = &sim.line[which];
+        sim.pending &= ~(1u << which);
+        isr = l->isr;
+        due = sim.delay_ns;
+        if (sim.jitter_ns)
+            due += rand() % sim.jitter_ns;
+        due += l->edge;
+        pthread_mutex_unlock(&sim.lock);
+
+        while ((int32_t)(gpio_sim_cycles() - due) < 0);
+
+        if (isr)
+            isr(which, NULL);
+
+        pthread_mutex_lock(&sim.lock);
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    return NULL;
+}
+
+int gpio_sim_init(void)
+{
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &sim.start);
+    srand(1);
+
+    for (i = 0; i < GPIO_SIM_LINES; i++) {
+        memset(&sim.line[i], 0, sizeof(sim.line[i]));
+        sim.line[i].masked = true;
+        sim.line[i].wire = -1;
+    }
+
+    sim.running = true;
+    return -pthread_create(&sim.thread, NULL, gpio_sim_irq_thread, NULL);
+}
+
+void gpio_sim_exit(void)
+{
+    pthread_mutex_lock(&sim.lock);
+    sim.running = false;
+    pthread_cond_signal(&sim.cond);
+    pthread_mutex_unlock(&sim.lock);
+
+    pthread_join(sim.thread, NULL);
+}
+
+void gpio_sim_connect(uint8_t out, uint8_t in)
+{
+    pthread_mutex_lock(&sim.lock);
+    sim.line[out].wire = in;
+    pthread_mutex_unlock(&sim.lock);
+}
+
+void gpio_sim_set_latency(uint32_t delay_ns, uint32_t jitter_ns)
+{
+    pthread_mutex_lock(&sim.lock);
+    sim.delay_ns = delay_ns;
+    sim.jitter_ns = jitter_ns;
+    pthread_mutex_unlock(&sim.lock);
+}
+
+int gpio_activate(uint8_t which)
+{
+    if (!gpio_sim_valid(which))
+        return -EINVAL;
+
+    pthread_mutex_lock(&sim.lock);
+    sim.line[which].active = true;
+    pthread_mutex_unlock(&sim.lock);
+
+    return 0;
+}
+
+int gpio_deactivate(uint8_t which)
+{
+    if (!gpio_sim_valid(which))
+        return -EINVAL;
+
+    pthread_mutex_lock(&sim.lock);
+    sim.line[which].active = false;
+    sim.line[which].output = false;
+    pthread_mutex_unlock(&sim.lock);
+
+    return 0;
+}
+
+uint8_t gpio_line_count(void)
+{
+    return GPIO_SIM_LINES;
+}
+
+int gpio_direction_in(uint8_t which)
+{
+    if (!gpio_sim_valid(which))
+        return -EINVAL;
+
+    pthread_mutex_lock(&sim.lock);
+    sim.line[which].output = false;
+    pthread_mutex_unlock(&sim.lock);
+
+    return 0;
+}
+
+int gpio_direction_out(uint8_t which, uint8_t value)
+{
+    if (!gpio_sim_valid(which))
+        return -EINVAL;
+
+    pthread_mutex_lock(&sim.lock);
+    sim.line[which].output = true;
+    gpio_sim_drive(which, value);
+    pthread_mutex_unlock(&sim.lock);
+
+    return 0;
+}
+
+uint8_t gpio_get_value(uint8_t which)
+{
+    uint8_t level;
+
+    if (!gpio_sim_valid(which))
+        return 0;
+
+    pthread_mutex_lock(&sim.lock);
+    level = sim.line[which].level;
+    pthread_mutex_unlock(&sim.lock);
+
+    return level;
+}
+
+int gpio_set_value(uint8_t which, uint8_t value)
+{
+    if (!gpio_sim_valid(which))
+        return -EINVAL;
+
+    pthread_mutex_lock(&sim.lock);
+    if (sim.line[which].output)
+        gpio_sim_drive(which, value);
+    pthread_mutex_unlock(&sim.lock);
+
+    return 0;
+}
+
+int gpio_irq_mask(uint8_t which)
+{
+    if (!gpio_sim_valid(which))
+        return -EINVAL;
+
+    pthread_mutex_lock(&sim.lock);
+    sim.line[which].masked = true;
+    pthread_mutex_unlock(&sim.lock);
+
+    return 0;
+}
+
+int gpio_irq_unmask(uint8_t which)
+{
+    if (!gpio_sim_valid(which))
+        return -EINVAL;
+
+    pthread_mutex_lock(&sim.lock);
+    sim.line[which].masked = false;
+    pthread_cond_signal(&sim.cond);
+    pthread_mutex_unlock(&sim.lock);
+
+    return 0;
+}
+
+int gpio_irq_settriggering(uint8_t which, int trigger)
+{
+    if (!gpio_sim_valid(which))
+        return -EINVAL;
+
+    pthread_mutex_lock(&sim.lock);
+    sim.line[which].trigger = trigger;
+    sim.pending &= ~(1u << which);
+    pthread_mutex_unlock(&sim.lock);
+
+    return 0;
+}
+
+int gpio_irq_attach(uint8_t which, xcpt_t isr)
+{
+    if (!gpio_sim_valid(which))
+        return -EINVAL;
+
+    pthread_mutex_lock(&sim.lock);
+    sim.line[which].isr = isr;
+    pthread_mutex_unlock(&sim.lock);
+
+    return 0;
+}
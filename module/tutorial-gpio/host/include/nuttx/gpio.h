@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * GPIO API, implemented by the simulated GPIO bank in gpio_sim.c.
+ */
+
+#ifndef _GPIO_HOST_NUTTX_GPIO_H_
+#define _GPIO_HOST_NUTTX_GPIO_H_
+
+#include <stdint.h>
+
+#define IRQ_TYPE_EDGE_RISING    0x1
+#define IRQ_TYPE_EDGE_FALLING   0x2
+#define IRQ_TYPE_EDGE_BOTH      (IRQ_TYPE_EDGE_RISING | IRQ_TYPE_EDGE_FALLING)
+
+typedef int (*xcpt_t)(int irq, void *context);
+
+int gpio_activate(uint8_t which);
+int gpio_deactivate(uint8_t which);
+uint8_t gpio_line_count(void);
+int gpio_direction_in(uint8_t which);
+int gpio_direction_out(uint8_t which, uint8_t value);
+uint8_t gpio_get_value(uint8_t which);
+int gpio_set_value(uint8_t which, uint8_t value);
+int gpio_irq_mask(uint8_t which);
+int gpio_irq_unmask(uint8_t which);
+int gpio_irq_settriggering(uint8_t which, int trigger);
+int gpio_irq_attach(uint8_t which, xcpt_t isr);
+
+#endif /* _GPIO_HOST_NUTTX_GPIO_H_ */
@@ -1,6 +1,10 @@
 config		= config
 manifest	= manifest.mnfs
 board-files	= board.c
+board-files	+= gpio_bulk.c
+board-files	+= gpio_capture.c
+board-files	+= ../common/gpio_latency.c
+board-files	+= ../common/dwt.c
 
 vendor_id	= 0x00000000
 product_id	= 0x00000000
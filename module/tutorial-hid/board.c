@@ -35,6 +35,13 @@
 #include <nuttx/util.h>
 
 #include <syslog.h>
+#include <sched.h>
+
+/*
+ * Measure button interrupt latency once the AP has connected, with a spare
+ * GPIO20 wired to button A (GPIO18)
+ */
+/* #define GPIO_LATENCY */
 
 static struct device_resource hid_btn_resources[] = {
     {
@@ -71,6 +78,12 @@ static struct device_table hid_device_table = {
 
 extern struct device_driver hid_button_driver;
 
+#ifdef GPIO_LATENCY
+int gpio_latency_main(int argc, char *argv[]);
+
+static char *gpio_latency_argv[] = { "20", "18", "256", "20", NULL };
+#endif
+
 void ara_module_early_init(void)
 {
 }
@@ -81,4 +94,9 @@ void ara_module_init(void)
 
     device_table_register(&hid_device_table);
     device_register_driver(&hid_button_driver);
+
+#ifdef GPIO_LATENCY
+    task_create("gpio_latency", SCHED_PRIORITY_DEFAULT, 2048,
+                gpio_latency_main, gpio_latency_argv);
+#endif
 }
@@ -56,6 +56,10 @@
 // saved driver device
 static struct device *saved_dev = NULL;
 
+// interrupt latency hooks, see common/gpio_latency.c
+void gpio_latency_mark(int irq);
+void gpio_latency_event(int irq);
+
 /* HID Buttons Private Data Struct */
 struct hid_info_s {
     struct hid_descriptor *hdesc;       // HID device descriptor
@@ -119,6 +123,9 @@ int hid_btn_handle_irq_event(int irq, FAR void *context)
     struct hid_info_s *hid_info = device_get_private(saved_dev);
 
     int i = 0;
+
+    gpio_latency_mark(irq);
+
     for (i = 0; i < ARRAY_SIZE(hid_btn_desc); i++) {
 
         if (hid_btn_desc[i].gpio == irq) {
@@ -134,6 +141,7 @@ int hid_btn_handle_irq_event(int irq, FAR void *context)
             hid_btn_data.modifier = HID_KEYCODE_MODIFIER_NONE;
 
             if (hid_info->event_callback != NULL) {
+                gpio_latency_event(irq);
                 hid_info->event_callback(saved_dev,
                                         HID_INPUT_REPORT,
                                         (uint8_t*) &hid_btn_data,
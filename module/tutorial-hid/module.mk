@@ -2,6 +2,8 @@ config		= config
 manifest	= manifest.mnfs
 board-files	= board.c
 board-files	+= hid.c
+board-files	+= ../common/gpio_latency.c
+board-files	+= ../common/dwt.c
 
 vendor_id	= 0x00000000
 product_id	= 0x00000000
@@ -30,6 +30,9 @@
 
 #include <syslog.h>
 
+int i2c_batch_register(unsigned int cport, unsigned int bundle);
+int i2c_sampler_register(unsigned int cport, unsigned int bundle);
+
 void ara_module_early_init(void)
 {
 }
@@ -37,4 +40,10 @@ void ara_module_early_init(void)
 void ara_module_init(void)
 {
     lowsyslog("I2C Tutorial Module init\n");
+
+    if (i2c_batch_register(2, 2))
+        lowsyslog("i2c: failed to register batch protocol\n");
+
+    if (i2c_sampler_register(3, 3))
+        lowsyslog("i2c: failed to register sampler protocol\n");
 }
@@ -0,0 +1,594 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Batched I2C transactions over a vendor Greybus protocol.
+ *
+ * The standard Greybus I2C protocol (CONFIG_GREYBUS_I2C_PHY, CPort 1) moves
+ * one transfer per operation, so polling a sensor costs a UniPro round trip
+ * per register read.  This protocol (CPort 2) takes a whole list of
+ * operations in one request, runs them back to back on the module and
+ * returns all the data read in one response.
+ *
+ * BATCH request:
+ *
+ *   struct i2c_batch_request   header
+ *   struct i2c_batch_op        ops[count]
+ *   u8                         write data, write_len bytes per op, in order
+ *
+ * Each op is a write of write_len bytes, a read of read_len bytes, or a
+ * write followed by a read with a repeated start, to addr.  An op can be
+ * executed repeat times, delay_us apart.  With I2C_BATCH_FLAG_POLL, the
+ * repeats stop as soon as the first byte read, masked with mask, equals
+ * value (poll-until); the op fails with I2C_BATCH_STATUS_POLL_TIMEOUT if it
+ * never does.  A DELAY op just waits delay_us.
+ *
+ * BATCH response:
+ *
+ *   struct i2c_batch_response  header
+ *   u8                         data read, read_len bytes per execution, in
+ *                              order; only the last execution of poll and
+ *                              I2C_BATCH_FLAG_LAST ops
+ *
+ * Execution stops at the first failing op unless it has
+ * I2C_BATCH_FLAG_IGNORE_ERROR; completed counts the ops run to the end.
+ * The operation itself succeeds whenever the request was well formed:
+ * I2C errors are reported in status.
+ *
+ * PROFILE returns the bus profile of i2c_bus.c, optionally starting a new
+ * one.  It covers the transfers of this protocol and of the sampler only:
+ * CPort 1 traffic does not go through i2c_bus.c and is not counted.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nuttx/arch.h>
+#include <nuttx/clock.h>
+#include <nuttx/device.h>
+#include <nuttx/device_i2c.h>
+#include <nuttx/greybus/greybus.h>
+#include <nuttx/greybus/types.h>
+#include <nuttx/util.h>
+
+#define I2C_BATCH_VERSION_MAJOR     0
+#define I2C_BATCH_VERSION_MINOR     1
+
+/* Operation types */
+#define I2C_BATCH_TYPE_PROTOCOL_VERSION 0x01
+#define I2C_BATCH_TYPE_LIMITS           0x02
+#define I2C_BATCH_TYPE_BATCH            0x03
+#define I2C_BATCH_TYPE_PROFILE          0x04
+
+/* Op types */
+#define I2C_BATCH_OP_XFER           0x00
+#define I2C_BATCH_OP_DELAY          0x01
+
+/* Op flags */
+#define I2C_BATCH_FLAG_POLL         0x01
+#define I2C_BATCH_FLAG_LAST         0x02
+#define I2C_BATCH_FLAG_IGNORE_ERROR 0x04
+
+/* Batch status */
+#define I2C_BATCH_STATUS_OK             0x00
+#define I2C_BATCH_STATUS_IO             0x01
+#define I2C_BATCH_STATUS_POLL_TIMEOUT   0x02
+
+/* Limits, also reported to the AP by LIMITS */
+#define I2C_BATCH_MAX_OPS           64
+#define I2C_BATCH_MAX_READ          1024
+/* Sum of all delays in one batch, in microseconds */
+#define I2C_BATCH_MAX_DELAY_US      1000000
+/* Transfers in one batch, counting repeats */
+#define I2C_BATCH_MAX_XFERS         4096
+
+/* Time a transfer takes besides its clocks: start, stop, driver */
+#define I2C_BATCH_XFER_OVERHEAD_US  50
+
+struct i2c_batch_proto_version_response {
+    __u8 major;
+    __u8 minor;
+} __packed;
+
+struct i2c_batch_limits_response {
+    __le16 max_ops;
+    __le16 max_read;
+    __le32 max_delay_us;
+} __packed;
+
+struct i2c_batch_op {
+    __u8 type;
+    __u8 flags;
+    __le16 addr;
+    __le16 write_len;
+    __le16 read_len;
+    __le16 repeat;
+    __le16 delay_us;
+    __u8 mask;
+    __u8 value;
+    __u8 pad[2];
+} __packed;
+
+struct i2c_batch_request {
+    __le16 count;
+    __u8 pad[2];
+    struct i2c_batch_op ops[0];
+} __packed;
+
+struct i2c_batch_profile_request {
+    /** Non-zero to start a new profile after this one */
+    __u8 reset;
+} __packed;
+
+struct i2c_batch_profile_response {
+    __le32 elapsed_us;
+    __le16 count;
+    __u8 pad[2];
+    /** struct i2c_bus_profile_entry of i2c_bus.c, 20 bytes each */
+    __u8 entries[0];
+} __packed;
+
+/* Size of struct i2c_bus_profile_entry */
+#define I2C_BATCH_PROFILE_ENTRY     20
+
+struct i2c_batch_response {
+    __le16 completed;
+    __u8 status;
+    /** Index of the op that failed, when status is not OK */
+    __u8 failed;
+    __le16 read_len;
+    __u8 data[0];
+} __packed;
+
+int i2c_bus_open(void);
+void i2c_bus_close(void);
+int i2c_bus_transfer(struct device_i2c_request *msg, uint32_t count);
+uint32_t i2c_bus_hz(void);
+int i2c_bus_profile_count(void);
+int i2c_bus_profile_read(void *entries, int max, uint32_t *elapsed_us,
+                         bool reset);
+
+static bool i2c_batch_open;
+
+/**
+ * @brief Wait, busy for less than a tick
+ */
+static void i2c_batch_delay(uint32_t us)
+{
+    if (!us)
+        return;
+
+    if (us < USEC_PER_TICK)
+        up_udelay(us);
+    else
+        usleep(us);
+}
+
+/**
+ * @brief Number of executions of an op that return data
+ */
+static uint32_t i2c_batch_results(const struct i2c_batch_op *op)
+{
+    uint16_t repeat = le16_to_cpu(op->repeat);
+
+    if (op->type != I2C_BATCH_OP_XFER || !le16_to_cpu(op->read_len))
+        return 0;
+
+    if (op->flags & (I2C_BATCH_FLAG_POLL | I2C_BATCH_FLAG_LAST) || !repeat)
+        return 1;
+
+    return repeat;
+}
+
+/**
+ * @brief Longest one execution of a transfer op can take
+ */
+static uint32_t i2c_batch_xfer_us(const struct i2c_batch_op *op)
+{
+    uint64_t bytes = le16_to_cpu(op->write_len) + le16_to_cpu(op->read_len);
+    uint32_t hz = i2c_bus_hz();
+
+    /* An address byte per message; 9 clocks per byte with the ack */
+    if (op->write_len)
+        bytes++;
+    if (op->read_len)
+        bytes++;
+
+    return (bytes * 9 * USEC_PER_SEC + hz - 1) / hz +
+           I2C_BATCH_XFER_OVERHEAD_US;
+}
+
+/**
+ * @brief Check a batch request against the limits
+ *
+ * @return Bytes of data the response needs, or a negative errno
+ */
+static int i2c_batch_validate(const struct i2c_batch_request *req,
+                              size_t size)
+{
+    const struct i2c_batch_op *op;
+    uint16_t count;
+    uint32_t writes = 0;
+    uint32_t reads = 0;
+    uint32_t delay = 0;
+    uint32_t xfers = 0;
+    uint16_t repeat;
+    uint16_t i;
+
+    if (size < sizeof(*req))
+        return -EINVAL;
+
+    count = le16_to_cpu(req->count);
+    if (!count || count > I2C_BATCH_MAX_OPS ||
+        size < sizeof(*req) + count * sizeof(*op))
+        return -EINVAL;
+
+    for (i = 0; i < count; i++) {
+        op = &req->ops[i];
+        repeat = le16_to_cpu(op->repeat);
+        if (!repeat)
+            repeat = 1;
+
+        switch (op->type) {
+        case I2C_BATCH_OP_XFER:
+            if (!op->write_len && !op->read_len)
+                return -EINVAL;
+            if (op->flags & I2C_BATCH_FLAG_POLL && !op->read_len)
+                return -EINVAL;
+            writes += le16_to_cpu(op->write_len);
+            reads += i2c_batch_results(op) * le16_to_cpu(op->read_len);
+            delay += (uint32_t)(repeat - 1) * le16_to_cpu(op->delay_us);
+            xfers += repeat;
+            break;
+
+        case I2C_BATCH_OP_DELAY:
+            delay += le16_to_cpu(op->delay_us);
+            break;
+
+        default:
+            return -EINVAL;
+        }
+    }
+
+    if (size < sizeof(*req) + count * sizeof(*op) + writes)
+        return -EINVAL;
+
+    if (reads > I2C_BATCH_MAX_READ || delay > I2C_BATCH_MAX_DELAY_US ||
+        xfers > I2C_BATCH_MAX_XFERS)
+        return -E2BIG;
+
+    return reads;
+}
+
+/**
+ * @brief Run one transfer op
+ *
+ * @param op Op
+ * @param wbuf Data to write
+ * @param rbuf Where the data read goes; advanced past the op's results
+ * @return I2C_BATCH_STATUS_*
+ */
+static uint8_t i2c_batch_xfer(const struct i2c_batch_op *op, uint8_t *wbuf,
+                              uint8_t **rbuf)
+{
+    struct device_i2c_request msg[2];
+    uint16_t write_len = le16_to_cpu(op->write_len);
+    uint16_t read_len = le16_to_cpu(op->read_len);
+    uint16_t repeat = le16_to_cpu(op->repeat);
+    uint16_t delay = le16_to_cpu(op->delay_us);
+    bool keep_last = op->flags & (I2C_BATCH_FLAG_POLL | I2C_BATCH_FLAG_LAST);
+    uint8_t *out = *rbuf;
+    uint32_t n = 0;
+    uint16_t i;
+
+    if (!repeat)
+        repeat = 1;
+
+    if (write_len) {
+        msg[n].addr = le16_to_cpu(op->addr);
+        msg[n].flags = 0;
+        msg[n].buffer = wbuf;
+        msg[n].length = write_len;
+        n++;
+    }
+
+    if (read_len) {
+        msg[n].addr = le16_to_cpu(op->addr);
+        msg[n].flags = I2C_FLAG_READ;
+        msg[n].length = read_len;
+        n++;
+    }
+
+    for (i = 0; i < repeat; i++) {
+        if (i)
+            i2c_batch_delay(delay);
+
+        if (read_len)
+            msg[n - 1].buffer = out;
+
+        if (i2c_bus_transfer(msg, n))
+            return I2C_BATCH_STATUS_IO;
+
+        if (op->flags & I2C_BATCH_FLAG_POLL &&
+            (out[0] & op->mask) == op->value) {
+            *rbuf = out + read_len;
+            return I2C_BATCH_STATUS_OK;
+        }
+
+        if (!keep_last)
+            out += read_len;
+    }
+
+    if (op->flags & I2C_BATCH_FLAG_POLL)
+        return I2C_BATCH_STATUS_POLL_TIMEOUT;
+
+    *rbuf = keep_last ? out + read_len : out;
+    return I2C_BATCH_STATUS_OK;
+}
+
+static uint8_t i2c_batch_protocol_version(struct gb_operation *operation)
+{
+    struct i2c_batch_proto_version_response *response;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    response->major = I2C_BATCH_VERSION_MAJOR;
+    response->minor = I2C_BATCH_VERSION_MINOR;
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t i2c_batch_limits(struct gb_operation *operation)
+{
+    struct i2c_batch_limits_response *response;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    response->max_ops = cpu_to_le16(I2C_BATCH_MAX_OPS);
+    response->max_read = cpu_to_le16(I2C_BATCH_MAX_READ);
+    response->max_delay_us = cpu_to_le32(I2C_BATCH_MAX_DELAY_US);
+
+    return GB_OP_SUCCESS;
+}
+
+/**
+ * @brief Run a validated batch
+ *
+ * @param req Batch
+ * @param result Filled with the outcome; the data read goes to data
+ * @param data Room for the data read, as returned by i2c_batch_validate()
+ */
+static void i2c_batch_execute(const struct i2c_batch_request *req,
+                              struct i2c_batch_response *result,
+                              uint8_t *data)
+{
+    const struct i2c_batch_op *op;
+    uint16_t count = le16_to_cpu(req->count);
+    uint8_t *wbuf = (uint8_t *)&req->ops[count];
+    uint8_t *rbuf = data;
+    uint8_t status;
+    uint16_t i;
+
+    result->status = I2C_BATCH_STATUS_OK;
+    result->failed = 0;
+
+    for (i = 0; i < count; i++) {
+        op = &req->ops[i];
+
+        if (op->type == I2C_BATCH_OP_DELAY) {
+            i2c_batch_delay(le16_to_cpu(op->delay_us));
+            continue;
+        }
+
+        status = i2c_batch_xfer(op, wbuf, &rbuf);
+        wbuf += le16_to_cpu(op->write_len);
+
+        if (status == I2C_BATCH_STATUS_OK)
+            continue;
+
+        /* Keep the response layout: a failed op still takes its space */
+        if (result->status == I2C_BATCH_STATUS_OK) {
+            result->status = status;
+            result->failed = i;
+        }
+
+        if (!(op->flags & I2C_BATCH_FLAG_IGNORE_ERROR))
+            break;
+
+        rbuf += i2c_batch_results(op) * le16_to_cpu(op->read_len);
+    }
+
+    result->completed = cpu_to_le16(i);
+    result->read_len = cpu_to_le16(rbuf - data);
+}
+
+static uint8_t i2c_batch_run(struct gb_operation *operation)
+{
+    struct i2c_batch_request *req = gb_operation_get_request_payload(operation);
+    struct i2c_batch_response *response;
+    size_t size = gb_operation_get_request_payload_size(operation);
+    int reads;
+
+    reads = i2c_batch_validate(req, size);
+    if (reads < 0)
+        return GB_OP_INVALID;
+
+    if (!i2c_batch_open)
+        return GB_OP_UNKNOWN_ERROR;
+
+    response = gb_operation_alloc_response(operation,
+                                           sizeof(*response) + reads);
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    i2c_batch_execute(req, response, response->data);
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t i2c_batch_profile(struct gb_operation *operation)
+{
+    struct i2c_batch_profile_request *req =
+        gb_operation_get_request_payload(operation);
+    struct i2c_batch_profile_response *response;
+    uint32_t elapsed;
+    int count;
+
+    if (gb_operation_get_request_payload_size(operation) < sizeof(*req))
+        return GB_OP_INVALID;
+
+    count = i2c_bus_profile_count();
+    response = gb_operation_alloc_response(operation, sizeof(*response) +
+                                           count * I2C_BATCH_PROFILE_ENTRY);
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    count = i2c_bus_profile_read(response->entries, count, &elapsed,
+                                 req->reset);
+    response->elapsed_us = cpu_to_le32(elapsed);
+    response->count = cpu_to_le16(count);
+
+    return GB_OP_SUCCESS;
+}
+
+static int i2c_batch_init(unsigned int cport, struct gb_bundle *bundle)
+{
+    int ret;
+
+    ret = i2c_bus_open();
+    if (ret)
+        return ret;
+
+    i2c_batch_open = true;
+    return 0;
+}
+
+static void i2c_batch_exit(unsigned int cport, struct gb_bundle *bundle)
+{
+    i2c_batch_open = false;
+    i2c_bus_close();
+}
+
+/**
+ * @brief Check a batch built by another module component
+ *
+ * Scripts use the BATCH request layout.  They are run periodically and
+ * must not sleep: DELAY ops, and repeat delays of a tick or more, are
+ * refused.
+ *
+ * @param script Script
+ * @param size Script size
+ * @param worst_us Filled with the longest the script can take to run
+ * @return Bytes the script reads, or a negative errno
+ */
+int i2c_batch_script_check(const void *script, size_t size,
+                           uint32_t *worst_us)
+{
+    const struct i2c_batch_request *req = script;
+    const struct i2c_batch_op *op;
+    uint64_t worst = 0;
+    uint16_t repeat;
+    uint16_t delay;
+    uint16_t i;
+    int reads;
+
+    reads = i2c_batch_validate(req, size);
+    if (reads < 0)
+        return reads;
+
+    for (i = 0; i < le16_to_cpu(req->count); i++) {
+        op = &req->ops[i];
+        repeat = le16_to_cpu(op->repeat);
+        delay = le16_to_cpu(op->delay_us);
+
+        if (op->type != I2C_BATCH_OP_XFER || delay >= USEC_PER_TICK)
+            return -EINVAL;
+
+        if (!repeat)
+            repeat = 1;
+
+        worst += (uint64_t)repeat * i2c_batch_xfer_us(op) +
+                 (uint64_t)(repeat - 1) * delay;
+    }
+
+    *worst_us = worst > UINT32_MAX ? UINT32_MAX : worst;
+    return reads;
+}
+
+/**
+ * @brief Run a script checked with i2c_batch_script_check()
+ *
+ * @param script Script
+ * @param data Room for the data read
+ * @return I2C_BATCH_STATUS_*, or I2C_BATCH_STATUS_IO if the bus is not open
+ */
+uint8_t i2c_batch_script_run(const void *script, uint8_t *data)
+{
+    struct i2c_batch_response result;
+
+    if (!i2c_batch_open)
+        return I2C_BATCH_STATUS_IO;
+
+    i2c_batch_execute(script, &result, data);
+
+    return result.status;
+}
+
+static struct gb_operation_handler i2c_batch_handlers[] = {
+    GB_HANDLER(I2C_BATCH_TYPE_PROTOCOL_VERSION, i2c_batch_protocol_version),
+    GB_HANDLER(I2C_BATCH_TYPE_LIMITS, i2c_batch_limits),
+    GB_HANDLER(I2C_BATCH_TYPE_BATCH, i2c_batch_run),
+    GB_HANDLER(I2C_BATCH_TYPE_PROFILE, i2c_batch_profile),
+};
+
+static struct gb_driver i2c_batch_driver = {
+    .init = i2c_batch_init,
+    .exit = i2c_batch_exit,
+    .op_handlers = i2c_batch_handlers,
+    .op_handlers_count = ARRAY_SIZE(i2c_batch_handlers),
+};
+
+/**
+ * @brief Register the batch protocol on a CPort
+ *
+ * @param cport CPort of the vendor protocol in the manifest
+ * @param bundle Bundle of the CPort
+ * @return 0 on success, negative errno on error
+ */
+int i2c_batch_register(unsigned int cport, unsigned int bundle)
+{
+    return gb_register_driver(cport, bundle, &i2c_batch_driver);
+}
@@ -0,0 +1,305 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Shared I2C bus access for the module protocols, with a bus profiler.
+ *
+ * Every transfer of the batch and sampler protocols goes through
+ * i2c_bus_transfer(), which records per address the transfers, bytes,
+ * failed transfers (mostly NACKs) and the time the bus was busy.
+ *
+ * Only these protocols are profiled.  The standard Greybus I2C protocol
+ * (CONFIG_GREYBUS_I2C_PHY, CPort 1) calls the device-layer driver directly,
+ * so its traffic shares the bus without showing up here.
+ *
+ * The bus runs at the build-time speed, CONFIG_TSB_I2C_SPEED_*: the
+ * device-layer driver has no call to change its clock.
+ */
+
+#include <errno.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <nuttx/config.h>
+#include <nuttx/clock.h>
+#include <nuttx/device.h>
+#include <nuttx/device_i2c.h>
+#include <nuttx/greybus/types.h>
+#include <nuttx/util.h>
+
+#ifdef CONFIG_TSB_I2C_SPEED_FAST
+#define I2C_BUS_HZ                  400000
+#else
+#define I2C_BUS_HZ                  100000
+#endif
+
+/* I2C bus used by the module protocols */
+#define I2C_BUS_NUM                 0
+
+/* Addresses tracked; the rest share the last entry */
+#define I2C_BUS_MAX_DEVICES         16
+#define I2C_BUS_ADDR_OTHER          0xffff
+
+/**
+ * @brief Profile entry, as sent to the AP
+ */
+struct i2c_bus_profile_entry {
+    __le16 addr;
+    __u8 pad[2];
+    __le32 transfers;
+    __le32 bytes;
+    __le32 errors;
+    __le32 busy_us;
+} __packed;
+
+struct i2c_bus_device {
+    uint16_t addr;
+    uint32_t transfers;
+    uint32_t bytes;
+    uint32_t errors;
+    uint64_t busy_cycles;
+};
+
+static struct {
+    sem_t lock;
+    struct device *dev;
+    unsigned int users;
+
+    struct i2c_bus_device devices[I2C_BUS_MAX_DEVICES];
+    unsigned int count;
+    uint32_t start_tick;
+    uint32_t cycles_per_us;
+} bus;
+
+/* Cycle counter, see common/dwt.c */
+uint32_t dwt_cycles(void);
+uint32_t dwt_cycles_per_us(void);
+
+/**
+ * @brief Entry of an address, created on first use
+ */
+static struct i2c_bus_device *i2c_bus_device(uint16_t addr)
+{
+    struct i2c_bus_device *d;
+    unsigned int i;
+
+    for (i = 0; i < bus.count; i++) {
+        if (bus.devices[i].addr == addr)
+            return &bus.devices[i];
+    }
+
+    /* The last entry is kept for the addresses that do not fit */
+    if (bus.count >= I2C_BUS_MAX_DEVICES - 1 && addr != I2C_BUS_ADDR_OTHER)
+        return i2c_bus_device(I2C_BUS_ADDR_OTHER);
+
+    d = &bus.devices[bus.count++];
+    memset(d, 0, sizeof(*d));
+    d->addr = addr;
+
+    return d;
+}
+
+/**
+ * @brief Transfer on the shared bus
+ *
+ * All messages are accounted to the address of the first one.
+ *
+ * @param msg Messages
+ * @param count Number of messages
+ * @return 0 on success, negative errno on error
+ */
+int i2c_bus_transfer(struct device_i2c_request *msg, uint32_t count)
+{
+    struct i2c_bus_device *d;
+    uint32_t start;
+    uint32_t i;
+    int ret;
+
+    if (!bus.dev || !count)
+        return -ENODEV;
+
+    sem_wait(&bus.lock);
+
+    d = i2c_bus_device(msg[0].addr);
+
+    start = dwt_cycles();
+    ret = device_i2c_transfer(bus.dev, msg, count);
+    d->busy_cycles += dwt_cycles() - start;
+
+    d->transfers++;
+    if (ret) {
+        d->errors++;
+        ret = -EIO;
+    } else {
+        for (i = 0; i < count; i++)
+            d->bytes += msg[i].length;
+    }
+
+    sem_post(&bus.lock);
+
+    return ret;
+}
+
+/**
+ * @brief Bus clock, in Hz
+ */
+uint32_t i2c_bus_hz(void)
+{
+    return I2C_BUS_HZ;
+}
+
+/**
+ * @brief Number of profile entries
+ */
+int i2c_bus_profile_count(void)
+{
+    return bus.count;
+}
+
+/**
+ * @brief Copy the profile out in wire format
+ *
+ * @param entries Room for i2c_bus_profile_count() entries
+ * @param max Number of entries that fit
+ * @param elapsed_us Time since the profile was reset
+ * @param reset Start a new profile afterwards
+ * @return Number of entries copied
+ */
+int i2c_bus_profile_read(void *entries, int max, uint32_t *elapsed_us,
+                         bool reset)
+{
+    struct i2c_bus_profile_entry *e = entries;
+    struct i2c_bus_device *d;
+    int i;
+
+    sem_wait(&bus.lock);
+
+    for (i = 0; i < bus.count && i < max; i++) {
+        d = &bus.devices[i];
+        e[i].addr = cpu_to_le16(d->addr);
+        e[i].pad[0] = e[i].pad[1] = 0;
+        e[i].transfers = cpu_to_le32(d->transfers);
+        e[i].bytes = cpu_to_le32(d->bytes);
+        e[i].errors = cpu_to_le32(d->errors);
+        e[i].busy_us = cpu_to_le32((uint32_t)(d->busy_cycles /
+                                              bus.cycles_per_us));
+    }
+
+    *elapsed_us = (clock_systimer() - bus.start_tick) * USEC_PER_TICK;
+
+    if (reset) {
+        for (i = 0; i < bus.count; i++) {
+            d = &bus.devices[i];
+            d->transfers = d->bytes = d->errors = d->busy_cycles = 0;
+        }
+        bus.start_tick = clock_systimer();
+    }
+
+    sem_post(&bus.lock);
+
+    return i;
+}
+
+/**
+ * @brief Print the profile, busiest device first
+ */
+void i2c_bus_report(void)
+{
+    bool done[I2C_BUS_MAX_DEVICES] = { false };
+    struct i2c_bus_device *d;
+    uint32_t elapsed_ms;
+    uint32_t busy_ms;
+    unsigned int i;
+    unsigned int j;
+    int best;
+
+    sem_wait(&bus.lock);
+
+    elapsed_ms = (clock_systimer() - bus.start_tick) * USEC_PER_TICK / 1000;
+    lowsyslog("i2c_bus: profile over %u ms, bus at %u Hz\n", elapsed_ms,
+              I2C_BUS_HZ);
+
+    for (i = 0; i < bus.count; i++) {
+        best = -1;
+        for (j = 0; j < bus.count; j++) {
+            if (!done[j] && (best < 0 || bus.devices[j].busy_cycles >
+                                         bus.devices[best].busy_cycles))
+                best = j;
+        }
+        done[best] = true;
+
+        d = &bus.devices[best];
+        busy_ms = d->busy_cycles / bus.cycles_per_us / 1000;
+        lowsyslog("i2c_bus: 0x%02x: %u transfers, %u bytes, %u errors, "
+                  "busy %u ms (%u%%)\n", d->addr, d->transfers, d->bytes,
+                  d->errors, busy_ms,
+                  elapsed_ms ? busy_ms * 100 / elapsed_ms : 0);
+    }
+
+    sem_post(&bus.lock);
+}
+
+/**
+ * @brief Open the bus for one more user
+ *
+ * @return 0 on success, -ENODEV if the I2C device cannot be opened
+ */
+int i2c_bus_open(void)
+{
+    if (!bus.users) {
+        sem_init(&bus.lock, 0, 1);
+
+        bus.dev = device_open(DEVICE_TYPE_I2C_HW, I2C_BUS_NUM);
+        if (!bus.dev)
+            return -ENODEV;
+
+        bus.count = 0;
+        bus.cycles_per_us = dwt_cycles_per_us();
+        bus.start_tick = clock_systimer();
+    }
+
+    bus.users++;
+    return 0;
+}
+
+/**
+ * @brief Drop one user, closing the bus after the last one
+ */
+void i2c_bus_close(void)
+{
+    if (!bus.users || --bus.users)
+        return;
+
+    i2c_bus_report();
+    device_close(bus.dev);
+    bus.dev = NULL;
+}
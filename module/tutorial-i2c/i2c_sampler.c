@@ -0,0 +1,519 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Periodic I2C sensor sampler, streamed to the AP over a vendor Greybus
+ * protocol (CPort 3).
+ *
+ * The AP sends a register read script, in the BATCH request layout of
+ * i2c_batch.c, with a sampling period and a batch size.  Once started, the
+ * module runs the script every period from its own task and stores each
+ * result, with a microsecond timestamp and the script status, in a ring.
+ * Samples go to the AP in SAMPLES requests of batch records, so the AP
+ * wakes once per batch instead of once per sample.  When the AP falls
+ * behind, the oldest samples are dropped and counted.
+ *
+ * Scripts cannot sleep (no DELAY op) and must be able to finish within the
+ * period; CONFIGURE refuses the others.  The task sleeps on the 10 ms
+ * system tick, so the shortest period is one tick.  A sampler that falls
+ * further behind than I2C_SAMPLER_MAX_CATCHUP samples skips ahead and counts
+ * the periods missed.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <nuttx/clock.h>
+#include <nuttx/greybus/greybus.h>
+#include <nuttx/greybus/types.h>
+#include <nuttx/util.h>
+
+#define I2C_SAMPLER_VERSION_MAJOR   0
+#define I2C_SAMPLER_VERSION_MINOR   1
+
+/* Operation types */
+#define I2C_SAMPLER_TYPE_PROTOCOL_VERSION   0x01
+#define I2C_SAMPLER_TYPE_CONFIGURE          0x02
+#define I2C_SAMPLER_TYPE_START              0x03
+#define I2C_SAMPLER_TYPE_STOP               0x04
+#define I2C_SAMPLER_TYPE_STATUS             0x05
+#define I2C_SAMPLER_TYPE_SAMPLES            0x06
+
+#define I2C_SAMPLER_RING            8192
+#define I2C_SAMPLER_MAX_SCRIPT      256
+#define I2C_SAMPLER_MAX_SAMPLE      64
+#define I2C_SAMPLER_MIN_PERIOD_US   USEC_PER_TICK
+#define I2C_SAMPLER_MAX_PERIOD_US   10000000
+
+/* Largest SAMPLES payload */
+#define I2C_SAMPLER_MAX_PAYLOAD     1024
+
+/* Samples taken back to back before skipping ahead */
+#define I2C_SAMPLER_MAX_CATCHUP     2
+
+#define I2C_SAMPLER_STACK           2048
+
+struct i2c_sampler_proto_version_response {
+    __u8 major;
+    __u8 minor;
+} __packed;
+
+struct i2c_sampler_configure_request {
+    __le32 period_us;
+    /** Samples per SAMPLES request */
+    __le16 batch;
+    __u8 pad[2];
+    /** BATCH request of i2c_batch.c */
+    __u8 script[0];
+} __packed;
+
+struct i2c_sampler_configure_response {
+    __le16 sample_size;
+    /** Samples the ring holds */
+    __le16 capacity;
+} __packed;
+
+struct i2c_sampler_status_response {
+    __le32 samples;
+    __le32 dropped;
+    __le32 missed;
+    __le32 errors;
+    __le16 pending;
+    __u8 running;
+    __u8 pad;
+} __packed;
+
+struct i2c_sampler_record {
+    /** Low 32 bits of the module microsecond clock */
+    __le32 timestamp;
+    /** I2C_BATCH_STATUS_* of the script */
+    __u8 status;
+    __u8 pad[3];
+    __u8 data[0];
+} __packed;
+
+struct i2c_sampler_samples_request {
+    __le16 count;
+    __le16 record_size;
+    /** Samples dropped so far because the ring was full */
+    __le32 dropped;
+    __u8 records[0];
+} __packed;
+
+int i2c_batch_script_check(const void *script, size_t size,
+                           uint32_t *worst_us);
+uint8_t i2c_batch_script_run(const void *script, uint8_t *data);
+
+/* Cycle counter, for timestamps; see common/dwt.c */
+uint32_t dwt_cycles(void);
+uint32_t dwt_cycles_per_us(void);
+
+/**
+ * @brief Sampler state
+ */
+static struct {
+    sem_t lock;
+    /** Posted to get the task to look at running again */
+    sem_t wake;
+    unsigned int cport;
+
+    uint8_t script[I2C_SAMPLER_MAX_SCRIPT];
+    bool configured;
+    bool running;
+    uint16_t sample_size;
+    uint32_t period_us;
+    uint16_t batch;
+
+    uint8_t ring[I2C_SAMPLER_RING];
+    uint16_t record_size;
+    uint32_t capacity;
+    /** Records stored and sent, free running */
+    uint32_t head;
+    uint32_t tail;
+
+    uint64_t next_us;
+
+    uint32_t cycles_per_us;
+    uint32_t last_cycles;
+    uint64_t now_us;
+
+    uint32_t samples;
+    uint32_t dropped;
+    uint32_t missed;
+    uint32_t errors;
+} sampler;
+
+/**
+ * @brief Microsecond clock, extended past the cycle counter wrap
+ *
+ * Called at least once per period while sampling, well within a wrap.
+ */
+static uint64_t i2c_sampler_now(void)
+{
+    uint32_t delta = (dwt_cycles() - sampler.last_cycles) /
+                     sampler.cycles_per_us;
+
+    sampler.last_cycles += delta * sampler.cycles_per_us;
+    sampler.now_us += delta;
+
+    return sampler.now_us;
+}
+
+static struct i2c_sampler_record *i2c_sampler_slot(uint32_t index)
+{
+    return (struct i2c_sampler_record *)
+           (sampler.ring + (index % sampler.capacity) * sampler.record_size);
+}
+
+/**
+ * @brief Run the script once and store the result
+ */
+static void i2c_sampler_take(void)
+{
+    struct i2c_sampler_record *rec;
+
+    if (sampler.head - sampler.tail == sampler.capacity) {
+        sampler.tail++;
+        sampler.dropped++;
+    }
+
+    rec = i2c_sampler_slot(sampler.head);
+    rec->timestamp = cpu_to_le32((uint32_t)i2c_sampler_now());
+    rec->status = i2c_batch_script_run(sampler.script, rec->data);
+    if (rec->status)
+        sampler.errors++;
+
+    sampler.head++;
+    sampler.samples++;
+}
+
+/**
+ * @brief Stream stored samples to the AP
+ *
+ * @param flush Send everything, not only full batches
+ */
+static void i2c_sampler_send(bool flush)
+{
+    struct i2c_sampler_samples_request *req;
+    struct gb_operation *op;
+    uint32_t pending;
+    uint32_t count;
+    uint32_t i;
+
+    while ((pending = sampler.head - sampler.tail) &&
+           (flush || pending >= sampler.batch)) {
+        count = pending < sampler.batch ? pending : sampler.batch;
+
+        op = gb_operation_create(sampler.cport, I2C_SAMPLER_TYPE_SAMPLES,
+                                 sizeof(*req) + count * sampler.record_size);
+        if (!op)
+            return;
+
+        req = gb_operation_get_request_payload(op);
+        req->count = cpu_to_le16(count);
+        req->record_size = cpu_to_le16(sampler.record_size);
+        req->dropped = cpu_to_le32(sampler.dropped);
+
+        for (i = 0; i < count; i++)
+            memcpy(req->records + i * sampler.record_size,
+                   i2c_sampler_slot(sampler.tail + i), sampler.record_size);
+
+        if (gb_operation_send_request(op, NULL, false)) {
+            /* Try again on the next period */
+            gb_operation_destroy(op);
+            return;
+        }
+
+        gb_operation_destroy(op);
+        sampler.tail += count;
+    }
+}
+
+/**
+ * @brief Take the samples due and send full batches; called with the lock held
+ *
+ * @return Microseconds until the next sample is due
+ */
+static uint32_t i2c_sampler_poll(void)
+{
+    uint64_t now;
+    uint32_t late;
+    int n = 0;
+
+    now = i2c_sampler_now();
+    while ((int64_t)(now - sampler.next_us) >= 0) {
+        if (n++ == I2C_SAMPLER_MAX_CATCHUP) {
+            late = (now - sampler.next_us) / sampler.period_us + 1;
+            sampler.missed += late;
+            sampler.next_us += (uint64_t)late * sampler.period_us;
+            break;
+        }
+
+        i2c_sampler_take();
+        sampler.next_us += sampler.period_us;
+        now = i2c_sampler_now();
+    }
+
+    i2c_sampler_send(false);
+
+    return sampler.next_us - now;
+}
+
+/**
+ * @brief Sleep for us microseconds, or until woken
+ */
+static void i2c_sampler_sleep(uint32_t us)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (us % USEC_PER_SEC) * 1000;
+    ts.tv_sec += us / USEC_PER_SEC + ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+
+    sem_timedwait(&sampler.wake, &ts);
+}
+
+static int i2c_sampler_main(int argc, char *argv[])
+{
+    uint32_t us;
+
+    for (;;) {
+        sem_wait(&sampler.lock);
+        us = sampler.running ? i2c_sampler_poll() : 0;
+        sem_post(&sampler.lock);
+
+        if (us)
+            i2c_sampler_sleep(us);
+        else
+            sem_wait(&sampler.wake);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Stop sampling and send what is left; called with the lock held
+ */
+static void i2c_sampler_halt(void)
+{
+    if (!sampler.running)
+        return;
+
+    sampler.running = false;
+    sem_post(&sampler.wake);
+    i2c_sampler_send(true);
+}
+
+static uint8_t i2c_sampler_protocol_version(struct gb_operation *operation)
+{
+    struct i2c_sampler_proto_version_response *response;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    response->major = I2C_SAMPLER_VERSION_MAJOR;
+    response->minor = I2C_SAMPLER_VERSION_MINOR;
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t i2c_sampler_configure(struct gb_operation *operation)
+{
+    struct i2c_sampler_configure_request *req =
+        gb_operation_get_request_payload(operation);
+    struct i2c_sampler_configure_response *response;
+    size_t size = gb_operation_get_request_payload_size(operation);
+    uint32_t period;
+    uint32_t worst;
+    uint32_t max_batch;
+    uint16_t batch;
+    int sample_size;
+    uint8_t ret = GB_OP_SUCCESS;
+
+    if (size < sizeof(*req) || size - sizeof(*req) > I2C_SAMPLER_MAX_SCRIPT)
+        return GB_OP_INVALID;
+
+    size -= sizeof(*req);
+    period = le32_to_cpu(req->period_us);
+    batch = le16_to_cpu(req->batch);
+
+    sample_size = i2c_batch_script_check(req->script, size, &worst);
+    if (sample_size < 0 || sample_size > I2C_SAMPLER_MAX_SAMPLE ||
+        period < I2C_SAMPLER_MIN_PERIOD_US ||
+        period > I2C_SAMPLER_MAX_PERIOD_US || worst > period)
+        return GB_OP_INVALID;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    sem_wait(&sampler.lock);
+
+    if (sampler.running) {
+        ret = GB_OP_INVALID;
+        goto out;
+    }
+
+    memcpy(sampler.script, req->script, size);
+    sampler.sample_size = sample_size;
+    sampler.period_us = period;
+
+    /* Records stay word aligned in the ring */
+    sampler.record_size = (sizeof(struct i2c_sampler_record) + sample_size +
+                           3) & ~3;
+    sampler.capacity = I2C_SAMPLER_RING / sampler.record_size;
+
+    /* A batch fits in one message and leaves half the ring to fill */
+    max_batch = (I2C_SAMPLER_MAX_PAYLOAD -
+                 sizeof(struct i2c_sampler_samples_request)) /
+                sampler.record_size;
+    if (max_batch > sampler.capacity / 2)
+        max_batch = sampler.capacity / 2;
+    sampler.batch = batch && batch < max_batch ? batch : max_batch;
+
+    sampler.configured = true;
+
+    response->sample_size = cpu_to_le16(sample_size);
+    response->capacity = cpu_to_le16(sampler.capacity);
+
+out:
+    sem_post(&sampler.lock);
+    return ret;
+}
+
+static uint8_t i2c_sampler_start(struct gb_operation *operation)
+{
+    uint8_t ret = GB_OP_SUCCESS;
+
+    sem_wait(&sampler.lock);
+
+    if (!sampler.configured || sampler.running) {
+        ret = GB_OP_INVALID;
+        goto out;
+    }
+
+    sampler.head = sampler.tail = 0;
+    sampler.samples = sampler.dropped = 0;
+    sampler.missed = sampler.errors = 0;
+    sampler.next_us = i2c_sampler_now();
+    sampler.running = true;
+    sem_post(&sampler.wake);
+
+out:
+    sem_post(&sampler.lock);
+    return ret;
+}
+
+static uint8_t i2c_sampler_stop(struct gb_operation *operation)
+{
+    sem_wait(&sampler.lock);
+    i2c_sampler_halt();
+    sem_post(&sampler.lock);
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t i2c_sampler_status(struct gb_operation *operation)
+{
+    struct i2c_sampler_status_response *response;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    sem_wait(&sampler.lock);
+    response->samples = cpu_to_le32(sampler.samples);
+    response->dropped = cpu_to_le32(sampler.dropped);
+    response->missed = cpu_to_le32(sampler.missed);
+    response->errors = cpu_to_le32(sampler.errors);
+    response->pending = cpu_to_le16(sampler.head - sampler.tail);
+    response->running = sampler.running;
+    response->pad = 0;
+    sem_post(&sampler.lock);
+
+    return GB_OP_SUCCESS;
+}
+
+static int i2c_sampler_init(unsigned int cport, struct gb_bundle *bundle)
+{
+    sampler.cport = cport;
+    sem_init(&sampler.lock, 0, 1);
+    sem_init(&sampler.wake, 0, 0);
+    sampler.cycles_per_us = dwt_cycles_per_us();
+    sampler.last_cycles = dwt_cycles();
+
+    if (task_create("i2c_sampler", SCHED_PRIORITY_DEFAULT, I2C_SAMPLER_STACK,
+                    i2c_sampler_main, NULL) < 0)
+        return -ENOMEM;
+
+    return 0;
+}
+
+static void i2c_sampler_disconnected(unsigned int cport)
+{
+    sem_wait(&sampler.lock);
+    sampler.running = false;
+    sem_post(&sampler.wake);
+    sem_post(&sampler.lock);
+}
+
+static struct gb_operation_handler i2c_sampler_handlers[] = {
+    GB_HANDLER(I2C_SAMPLER_TYPE_PROTOCOL_VERSION,
+               i2c_sampler_protocol_version),
+    GB_HANDLER(I2C_SAMPLER_TYPE_CONFIGURE, i2c_sampler_configure),
+    GB_HANDLER(I2C_SAMPLER_TYPE_START, i2c_sampler_start),
+    GB_HANDLER(I2C_SAMPLER_TYPE_STOP, i2c_sampler_stop),
+    GB_HANDLER(I2C_SAMPLER_TYPE_STATUS, i2c_sampler_status),
+};
+
+static struct gb_driver i2c_sampler_driver = {
+    .init = i2c_sampler_init,
+    .disconnected = i2c_sampler_disconnected,
+    .op_handlers = i2c_sampler_handlers,
+    .op_handlers_count = ARRAY_SIZE(i2c_sampler_handlers),
+};
+
+/**
+ * @brief Register the sampler protocol on a CPort
+ *
+ * @param cport CPort of the vendor protocol in the manifest
+ * @param bundle Bundle of the CPort
+ * @return 0 on success, negative errno on error
+ */
+int i2c_sampler_register(unsigned int cport, unsigned int bundle)
+{
+    return gb_register_driver(cport, bundle, &i2c_sampler_driver);
+}
@@ -1,6 +1,10 @@
 config		= config
 manifest	= manifest.mnfs
 board-files	= board.c
+board-files	+= i2c_batch.c
+board-files	+= i2c_sampler.c
+board-files	+= i2c_bus.c
+board-files	+= ../common/dwt.c
 
 vendor_id	= 0x00000000
 product_id	= 0x00000000
@@ -27,6 +27,13 @@
  */
 
 #include <syslog.h>
+#include <sched.h>
+
+/* Run the loopback throughput benchmark at boot */
+/* #define UART_BENCH */
+
+int uart_gb_register(unsigned int cport, unsigned int bundle);
+int uart_bench_main(int argc, char *argv[]);
 
 void ara_module_early_init(void)
 {
@@ -35,4 +42,12 @@ void ara_module_early_init(void)
 void ara_module_init(void)
 {
     lowsyslog("UART Example Module init\n");
+
+    if (uart_gb_register(1, 1))
+        lowsyslog("uart: failed to register Greybus driver\n");
+
+#ifdef UART_BENCH
+    task_create("uart_bench", SCHED_PRIORITY_DEFAULT, 2048, uart_bench_main,
+                NULL);
+#endif
 }
@@ -0,0 +1,84 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Subset of the NuttX UART device interface used by the module data path,
+ * implemented on a pseudo-terminal by ../uart_pty.c.
+ */
+
+#ifndef _UART_HOST_NUTTX_DEVICE_UART_H_
+#define _UART_HOST_NUTTX_DEVICE_UART_H_
+
+#include <stdint.h>
+
+#include <nuttx/device.h>
+
+#define NO_PARITY               0
+#define ODD_PARITY              1
+#define EVEN_PARITY             2
+
+#define ONE_STOP_BIT            0
+#define TWO_STOP_BITS           2
+
+#define MCR_DTR                 (1 << 0)
+#define MCR_RTS                 (1 << 1)
+#define MCR_LPBK                (1 << 4)
+
+#define MSR_DCTS                (1 << 0)
+#define MSR_DDSR                (1 << 1)
+#define MSR_TERI                (1 << 2)
+#define MSR_DDCD                (1 << 3)
+#define MSR_CTS                 (1 << 4)
+#define MSR_DSR                 (1 << 5)
+#define MSR_RI                  (1 << 6)
+#define MSR_DCD                 (1 << 7)
+
+#define LSR_OE                  (1 << 1)
+#define LSR_PE                  (1 << 2)
+#define LSR_FE                  (1 << 3)
+#define LSR_BI                  (1 << 4)
+
+int device_uart_set_configuration(struct device *dev, int baud, int parity,
+                                  int databits, int stopbit, int flow);
+int device_uart_set_modem_ctrl(struct device *dev, uint8_t *modem_ctrl);
+int device_uart_get_modem_status(struct device *dev, uint8_t *modem_status);
+int device_uart_set_break(struct device *dev, uint8_t break_on);
+int device_uart_attach_ms_callback(struct device *dev,
+                                   void (*callback)(uint8_t ms));
+int device_uart_start_transmitter(struct device *dev, uint8_t *buffer,
+                                  int length, void *dma, int *sent,
+                                  void (*callback)(uint8_t *buffer, int length,
+                                                   int error));
+int device_uart_stop_transmitter(struct device *dev);
+int device_uart_start_receiver(struct device *dev, uint8_t *buffer,
+                               int length, void *dma, int *got,
+                               void (*callback)(uint8_t *buffer, int length,
+                                                int error));
+int device_uart_stop_receiver(struct device *dev);
+
+#endif /* _UART_HOST_NUTTX_DEVICE_UART_H_ */
@@ -0,0 +1,626 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host test of the UART module data path against a pseudo-terminal.
+ *
+ * uart_buf.c and uart_bench.c are built unchanged with the stand-in headers
+ * in include/ and the pty-backed UART in uart_pty.c, which also stands in
+ * for common/dwt.c:
+ *
+ *   cc -O2 -pthread -DUART_BENCH_MS=500 \
+ *      -Imodule/tutorial-uart/host/include -Imodule/tutorial-uart/host \
+ *      -o uart_host module/tutorial-uart/host/uart_host.c \
+ *      module/tutorial-uart/host/uart_pty.c \
+ *      module/tutorial-uart/uart_buf.c module/tutorial-uart/uart_bench.c
+ *
+ * Usage: uart_host [-c every] [test|bench|jumper]
+ *
+ * "bench" runs the on-module loopback benchmark in internal loopback,
+ * "jumper" with the far end of the pty echoing everything back.  -c flips
+ * a bit in every Nth received byte, which the benchmark must report.
+ *
+ * "test", the default, runs in order:
+ * - bulk: a long transfer must arrive intact in large deliveries;
+ * - interactive: single keystrokes right after the bulk transfer must be
+ *   delivered within a few ticks, i.e. the batch timer has come back down;
+ * - flow: with RTS/CTS on, a sink that stops accepting data makes RTS drop
+ *   and nothing is lost; without flow control the same run overruns;
+ * - cts: transmission waits for CTS;
+ * - flush: flushing drops queued transmit data, returning it through
+ *   tx_done, and received data not yet delivered; a CTS change is reported
+ *   through the modem status callback.
+ *
+ * Exits non-zero if any check or benchmark run fails.  Everything runs in
+ * real time, about 10 s each.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nuttx/device_uart.h>
+
+#include "uart_pty.h"
+
+#define HOST_RX_MAX         (256 * 1024)
+#define HOST_BULK_BYTES     (128 * 1024)
+#define HOST_FLOW_BYTES     (32 * 1024)
+#define HOST_KEYS           20
+#define HOST_TX_BYTES       2048
+
+int uart_buf_open(int (*rx_sink)(const uint8_t *data, size_t len,
+                                 uint8_t flags),
+                  void (*tx_done)(size_t len));
+void uart_buf_close(void);
+void uart_buf_flush(bool rx, bool tx);
+void uart_buf_set_ms_callback(void (*ms_change)(uint8_t msr));
+size_t uart_buf_write(const uint8_t *data, size_t len);
+int uart_buf_set_config(int baud, int parity, int databits, int stopbits,
+                        int flow);
+int uart_buf_set_modem_ctrl(uint8_t mcr);
+void uart_buf_report(void);
+int uart_bench_main(int argc, char *argv[]);
+
+static struct {
+    pthread_mutex_t lock;
+    uint8_t data[HOST_RX_MAX];
+    uint64_t when[HOST_RX_MAX];
+    size_t len;
+    uint32_t deliveries;
+    volatile bool busy;
+} sink = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct {
+    const uint8_t *data;
+    size_t len;
+} writer;
+
+/* Transmit completions and modem status changes seen by the flush test */
+static volatile size_t host_tx_done_bytes;
+static volatile uint8_t host_msr;
+static volatile uint32_t host_ms_changes;
+
+static uint64_t host_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void host_sleep_ms(unsigned int ms)
+{
+    usleep(ms * 1000);
+}
+
+static int host_sink(const uint8_t *data, size_t len, uint8_t flags)
+{
+    uint64_t now = host_us();
+    size_t i;
+
+    if (sink.busy)
+        return -EAGAIN;
+
+    pthread_mutex_lock(&sink.lock);
+    for (i = 0; i < len && sink.len < HOST_RX_MAX; i++) {
+        sink.when[sink.len] = now;
+        sink.data[sink.len++] = data[i];
+    }
+    sink.deliveries++;
+    pthread_mutex_unlock(&sink.lock);
+
+    return 0;
+}
+
+static void host_tx_done(size_t len)
+{
+    host_tx_done_bytes += len;
+}
+
+static void host_ms_change(uint8_t msr)
+{
+    host_msr = msr;
+    host_ms_changes++;
+}
+
+static size_t host_received(void)
+{
+    size_t len;
+
+    pthread_mutex_lock(&sink.lock);
+    len = sink.len;
+    pthread_mutex_unlock(&sink.lock);
+
+    return len;
+}
+
+static int host_open(int baud, bool flow)
+{
+    int ret;
+
+    pthread_mutex_lock(&sink.lock);
+    sink.len = 0;
+    sink.deliveries = 0;
+    sink.busy = false;
+    pthread_mutex_unlock(&sink.lock);
+
+    host_tx_done_bytes = 0;
+    ret = uart_buf_open(host_sink, host_tx_done);
+    if (!ret)
+        ret = uart_buf_set_config(baud, NO_PARITY, 8, ONE_STOP_BIT, flow);
+    if (ret)
+        fprintf(stderr, "cannot open the data path: %d\n", ret);
+
+    return ret;
+}
+
+static void host_close(void)
+{
+    uart_buf_report();
+    uart_buf_close();
+}
+
+static void host_pattern(uint8_t *buf, size_t len, uint32_t seed)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+}
+
+static void *host_writer(void *arg)
+{
+    const uint8_t *data = writer.data;
+    size_t len = writer.len;
+    ssize_t n;
+
+    while (len) {
+        n = write(uart_pty_fd(), data, len);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Wait until the sink holds len bytes
+ *
+ * @return 0 once it does, -1 on timeout
+ */
+static int host_wait_rx(size_t len, unsigned int timeout_ms)
+{
+    uint64_t end = host_us() + timeout_ms * 1000ULL;
+
+    while (host_received() < len) {
+        if (host_us() > end)
+            return -1;
+        host_sleep_ms(5);
+    }
+
+    return 0;
+}
+
+static int host_check_rx(const char *name, const uint8_t *ref, size_t len)
+{
+    size_t got = host_received();
+
+    if (got != len || memcmp(sink.data, ref, len)) {
+        fprintf(stderr, "%s: received %zu of %zu bytes%s\n", name, got, len,
+                got == len ? ", data differs" : "");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int host_bulk(void)
+{
+    static uint8_t ref[HOST_BULK_BYTES];
+    pthread_t thread;
+    uint64_t start;
+    size_t avg;
+    int ret;
+
+    ret = host_open(921600, false);
+    if (ret)
+        return ret;
+
+    host_pattern(ref, sizeof(ref), 1);
+    writer.data = ref;
+    writer.len = sizeof(ref);
+
+    start = host_us();
+    pthread_create(&thread, NULL, host_writer, NULL);
+    host_wait_rx(sizeof(ref), 5000);
+    pthread_join(thread, NULL);
+
+    ret = host_check_rx("bulk", ref, sizeof(ref));
+    avg = sink.deliveries ? host_received() / sink.deliveries : 0;
+    printf("bulk: %zu bytes in %llu ms, %u deliveries, %zu bytes each\n",
+           host_received(), (unsigned long long)(host_us() - start) / 1000,
+           sink.deliveries, avg);
+
+    if (!ret && avg < 256) {
+        fprintf(stderr, "bulk: deliveries too small\n");
+        ret = -1;
+    }
+
+    /* Keep the data path open: the next test starts from the bulk timer */
+    return ret;
+}
+
+static int host_interactive(void)
+{
+    uint64_t sent[HOST_KEYS];
+    uint64_t lat[HOST_KEYS];
+    uint64_t tmp;
+    size_t base = host_received();
+    uint8_t key;
+    int ret = 0;
+    int i;
+    int j;
+
+    uart_buf_set_config(115200, NO_PARITY, 8, ONE_STOP_BIT, 0);
+
+    for (i = 0; i < HOST_KEYS; i++) {
+        key = 'a' + i;
+        sent[i] = host_us();
+        if (write(uart_pty_fd(), &key, 1) != 1)
+            return -1;
+        if (host_wait_rx(base + i + 1, 1000)) {
+            fprintf(stderr, "interactive: keystroke %d lost\n", i);
+            return -1;
+        }
+        lat[i] = sink.when[base + i] - sent[i];
+        host_sleep_ms(50);
+    }
+
+    /* Sort for the median */
+    for (i = 1; i < HOST_KEYS; i++) {
+        for (j = i; j > 0 && lat[j - 1] > lat[j]; j--) {
+            tmp = lat[j];
+            lat[j] = lat[j - 1];
+            lat[j - 1] = tmp;
+        }
+    }
+
+    printf("interactive: keystroke latency p50 %llu ms, max %llu ms\n",
+           (unsigned long long)lat[HOST_KEYS / 2] / 1000,
+           (unsigned long long)lat[HOST_KEYS - 1] / 1000);
+
+    /* Two ticks of idle detection plus a tick of scheduling slack */
+    if (lat[HOST_KEYS / 2] > 30000) {
+        fprintf(stderr, "interactive: batch timer did not come down\n");
+        ret = -1;
+    }
+
+    host_close();
+    return ret;
+}
+
+/**
+ * @brief Stall the sink for a second during a transfer
+ */
+static int host_flow(bool flow)
+{
+    static uint8_t ref[HOST_FLOW_BYTES];
+    const char *name = flow ? "flow" : "no-flow";
+    uint32_t drops = uart_pty_rts_drops();
+    uint32_t overruns = uart_pty_overruns();
+    pthread_t thread;
+    bool rts_low;
+    int ret;
+
+    ret = host_open(921600, flow);
+    if (ret)
+        return ret;
+
+    host_pattern(ref, sizeof(ref), 2);
+    writer.data = ref;
+    writer.len = sizeof(ref);
+
+    sink.busy = true;
+    pthread_create(&thread, NULL, host_writer, NULL);
+    host_sleep_ms(1000);
+    rts_low = !(uart_pty_mcr() & MCR_RTS);
+    sink.busy = false;
+
+    if (flow) {
+        host_wait_rx(sizeof(ref), 5000);
+        pthread_join(thread, NULL);
+    } else {
+        /* Bytes are dropped, so the writer finishes but the sink falls short */
+        pthread_join(thread, NULL);
+        host_sleep_ms(500);
+    }
+
+    drops = uart_pty_rts_drops() - drops;
+    overruns = uart_pty_overruns() - overruns;
+    printf("%s: %zu of %zu bytes, %u RTS drops, %u bytes overrun\n", name,
+           host_received(), sizeof(ref), drops, overruns);
+
+    if (flow) {
+        ret = host_check_rx(name, ref, sizeof(ref));
+        if (!rts_low || !drops || overruns) {
+            fprintf(stderr, "%s: RTS did not hold off the sender\n", name);
+            ret = -1;
+        }
+        if (!(uart_pty_mcr() & MCR_RTS)) {
+            fprintf(stderr, "%s: RTS not raised again\n", name);
+            ret = -1;
+        }
+    } else if (!overruns || host_received() == sizeof(ref)) {
+        fprintf(stderr, "%s: expected an overrun\n", name);
+        ret = -1;
+    }
+
+    host_close();
+    return ret;
+}
+
+static int host_cts(void)
+{
+    static uint8_t ref[HOST_TX_BYTES];
+    static uint8_t buf[HOST_TX_BYTES];
+    struct pollfd pfd = { .fd = uart_pty_fd(), .events = POLLIN };
+    uint64_t end;
+    size_t len = 0;
+    ssize_t n;
+    int ret;
+
+    ret = host_open(921600, true);
+    if (ret)
+        return ret;
+
+    host_pattern(ref, sizeof(ref), 3);
+
+    uart_pty_set_cts(false);
+    uart_buf_write(ref, sizeof(ref));
+
+    if (poll(&pfd, 1, 200) > 0) {
+        fprintf(stderr, "cts: data sent with CTS low\n");
+        ret = -1;
+    }
+
+    uart_pty_set_cts(true);
+
+    end = host_us() + 1000000;
+    while (len < sizeof(buf) && host_us() < end) {
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        n = read(uart_pty_fd(), buf + len, sizeof(buf) - len);
+        if (n > 0)
+            len += n;
+    }
+
+    printf("cts: %zu of %zu bytes after CTS\n", len, sizeof(buf));
+    if (len != sizeof(buf) || memcmp(buf, ref, len)) {
+        fprintf(stderr, "cts: transmit data lost or corrupted\n");
+        ret = -1;
+    }
+
+    host_close();
+    return ret;
+}
+
+static int host_flush(void)
+{
+    static uint8_t ref[HOST_TX_BYTES];
+    struct pollfd pfd = { .fd = uart_pty_fd(), .events = POLLIN };
+    uint8_t buf[64];
+    int ret;
+
+    ret = host_open(115200, true);
+    if (ret)
+        return ret;
+
+    uart_buf_set_ms_callback(host_ms_change);
+    host_pattern(ref, sizeof(ref), 4);
+
+    /* Transmit: held back by CTS, then dropped */
+    uart_pty_set_cts(false);
+    uart_buf_write(ref, sizeof(ref));
+    host_sleep_ms(50);
+    uart_buf_flush(false, true);
+    uart_pty_set_cts(true);
+    host_sleep_ms(100);
+
+    if (poll(&pfd, 1, 100) > 0) {
+        fprintf(stderr, "flush: flushed transmit data was sent\n");
+        ret = -1;
+    }
+    if (host_tx_done_bytes != sizeof(ref)) {
+        fprintf(stderr, "flush: %zu of %zu transmit bytes returned\n",
+                (size_t)host_tx_done_bytes, sizeof(ref));
+        ret = -1;
+    }
+    if (host_ms_changes != 2 || !(host_msr & MSR_DCTS) ||
+        !(host_msr & MSR_CTS)) {
+        fprintf(stderr, "flush: %u modem status changes, last 0x%02x\n",
+                host_ms_changes, host_msr);
+        ret = -1;
+    }
+
+    /* Receive: held back by the sink, then dropped */
+    sink.busy = true;
+    if (write(uart_pty_fd(), ref, 1000) != 1000)
+        ret = -1;
+    host_sleep_ms(200);
+    uart_buf_flush(true, false);
+    sink.busy = false;
+    host_sleep_ms(100);
+
+    memcpy(buf, "after", 5);
+    if (write(uart_pty_fd(), buf, 5) != 5)
+        ret = -1;
+    host_wait_rx(5, 1000);
+    host_sleep_ms(100);
+
+    printf("flush: %zu transmit bytes returned, %zu bytes received after "
+           "flushing 1000, %u modem status changes\n",
+           (size_t)host_tx_done_bytes, host_received(), host_ms_changes);
+    if (host_check_rx("flush", buf, 5))
+        ret = -1;
+
+    uart_buf_set_ms_callback(NULL);
+    host_close();
+    return ret;
+}
+
+/**
+ * @brief Far end of a TX-RX jumper: send everything back
+ */
+static void *host_echo(void *arg)
+{
+    struct pollfd pfd = { .fd = uart_pty_fd(), .events = POLLIN };
+    volatile bool *running = arg;
+    uint8_t buf[1024];
+    ssize_t n;
+    ssize_t w;
+    ssize_t off;
+
+    while (*running) {
+        if (poll(&pfd, 1, 10) <= 0)
+            continue;
+
+        n = read(uart_pty_fd(), buf, sizeof(buf));
+        for (off = 0; n > 0 && off < n; off += w) {
+            w = write(uart_pty_fd(), buf + off, n - off);
+            if (w < 0)
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+static int host_bench(bool jumper)
+{
+    char *argv[] = { "uart_bench", jumper ? "jumper" : NULL, NULL };
+    volatile bool running = true;
+    pthread_t thread;
+    int ret;
+
+    if (jumper)
+        pthread_create(&thread, NULL, host_echo, (void *)&running);
+
+    ret = uart_bench_main(jumper ? 2 : 1, argv);
+
+    if (jumper) {
+        running = false;
+        pthread_join(thread, NULL);
+    }
+
+    return ret;
+}
+
+static int host_test(void)
+{
+    int ret;
+
+    ret = host_bulk();
+    if (ret)
+        host_close();
+    else
+        ret = host_interactive();
+    if (host_flow(true))
+        ret = -1;
+    if (host_flow(false))
+        ret = -1;
+    if (host_cts())
+        ret = -1;
+    if (host_flush())
+        ret = -1;
+
+    return ret;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-c every] [test|bench|jumper]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *cmd = "test";
+    int ret;
+    int c;
+
+    while ((c = getopt(argc, argv, "c:")) != -1) {
+        switch (c) {
+        case 'c':
+            uart_pty_set_corrupt(strtoul(optarg, NULL, 0));
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc)
+        cmd = argv[optind];
+
+    if (uart_pty_init()) {
+        perror("pty");
+        return 1;
+    }
+
+    if (!strcmp(cmd, "test")) {
+        ret = host_test();
+    } else if (!strcmp(cmd, "bench") || !strcmp(cmd, "jumper")) {
+        ret = host_bench(!strcmp(cmd, "jumper"));
+    } else {
+        usage(argv[0]);
+        ret = -1;
+    }
+
+    uart_pty_exit();
+
+    printf("%s\n", ret ? "FAIL" : "PASS");
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,590 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * UART stand-in for the host build of the UART module data path.
+ *
+ * The "line" is a pseudo-terminal: the test writes to and reads from the
+ * master side, the stand-in works the slave side.  A thread moves bytes
+ * once a millisecond at the configured baud rate (10 bits per character)
+ * through a 16-byte receive FIFO, like the GPBridge UART:
+ *
+ * - without flow control, bytes that find the FIFO full are dropped and
+ *   reported as an overrun;
+ * - with flow control, the far end is taken to honour RTS: nothing is read
+ *   from the pty while RTS is low or the FIFO is full, so the writer blocks
+ *   instead.  Transmission pauses while CTS (set by the test) is low.
+ *
+ * With MCR_LPBK set, transmitted bytes go straight back into the receive
+ * FIFO instead of the pty.  uart_pty_set_corrupt() flips a bit in every
+ * Nth received byte, to check that errors are caught.
+ *
+ * Completion callbacks run on that thread holding the irqsave() lock, as
+ * they would in interrupt context.  The thread also runs the work queue.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nuttx/clock.h>
+#include <nuttx/device.h>
+#include <nuttx/device_uart.h>
+#include <nuttx/wqueue.h>
+
+#include <arch/irq.h>
+
+#include "uart_pty.h"
+
+#define UART_PTY_FIFO   16
+
+typedef void (*uart_pty_cb)(uint8_t *buffer, int length, int error);
+
+struct uart_pty_xfer {
+    bool armed;
+    uint8_t *buf;
+    int len;
+    int done;
+    int *count;
+    uart_pty_cb callback;
+};
+
+static struct {
+    int master;
+    int slave;
+    pthread_t thread;
+    volatile bool running;
+    struct timespec start;
+
+    struct device dev;
+    int baud;
+    bool flow;
+    uint8_t mcr;
+    volatile bool cts;
+    void (*ms_callback)(uint8_t msr);
+
+    uint8_t fifo[UART_PTY_FIFO];
+    int fifo_n;
+    uint8_t lsr;
+    double rx_credit;
+    double tx_credit;
+    struct uart_pty_xfer rx;
+    struct uart_pty_xfer tx;
+
+    uint32_t corrupt_every;
+    uint32_t corrupt_count;
+
+    uint32_t rts_drops;
+    uint32_t overruns;
+
+    pthread_mutex_t wq_lock;
+    struct work_s *wq;
+} pty;
+
+static pthread_mutex_t uart_pty_irq = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+irqstate_t irqsave(void)
+{
+    pthread_mutex_lock(&uart_pty_irq);
+    return 0;
+}
+
+void irqrestore(irqstate_t flags)
+{
+    pthread_mutex_unlock(&uart_pty_irq);
+}
+
+static uint64_t uart_pty_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec - pty.start.tv_sec) * 1000000 +
+           (ts.tv_nsec - pty.start.tv_nsec) / 1000;
+}
+
+/* Stand-ins for common/dwt.c: one cycle per microsecond */
+uint32_t dwt_cycles(void)
+{
+    return uart_pty_us();
+}
+
+uint32_t dwt_cycles_per_us(void)
+{
+    return 1;
+}
+
+uint32_t clock_systimer(void)
+{
+    return uart_pty_us() / USEC_PER_TICK;
+}
+
+int work_queue(int qid, struct work_s *work, worker_t worker, void *arg,
+               uint32_t delay)
+{
+    pthread_mutex_lock(&pty.wq_lock);
+    work->worker = worker;
+    work->arg = arg;
+    work->due = clock_systimer() + delay;
+    if (!work->queued) {
+        work->queued = true;
+        work->next = pty.wq;
+        pty.wq = work;
+    }
+    pthread_mutex_unlock(&pty.wq_lock);
+
+    return 0;
+}
+
+int work_cancel(int qid, struct work_s *work)
+{
+    struct work_s **w;
+
+    pthread_mutex_lock(&pty.wq_lock);
+    for (w = &pty.wq; *w; w = &(*w)->next) {
+        if (*w == work) {
+            *w = work->next;
+            work->queued = false;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pty.wq_lock);
+
+    return 0;
+}
+
+/**
+ * @brief Run one due work item, if any
+ */
+static bool uart_pty_run_work(void)
+{
+    uint32_t now = clock_systimer();
+    struct work_s **w;
+    struct work_s *work = NULL;
+
+    pthread_mutex_lock(&pty.wq_lock);
+    for (w = &pty.wq; *w; w = &(*w)->next) {
+        if ((int32_t)(now - (*w)->due) >= 0) {
+            work = *w;
+            *w = work->next;
+            work->queued = false;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pty.wq_lock);
+
+    if (!work)
+        return false;
+
+    work->worker(work->arg);
+    return true;
+}
+
+/**
+ * @brief Complete a transfer; called with the irq lock held
+ */
+static void uart_pty_complete(struct uart_pty_xfer *xfer, uint8_t error)
+{
+    uart_pty_cb callback = xfer->callback;
+
+    xfer->armed = false;
+    if (callback)
+        callback(xfer->buf, xfer->done, error);
+}
+
+/**
+ * @brief Move FIFO contents to the armed receive buffer
+ */
+static void uart_pty_drain(void)
+{
+    uint8_t lsr;
+    int n;
+
+    if (!pty.rx.armed || !pty.fifo_n)
+        return;
+
+    n = pty.rx.len - pty.rx.done;
+    if (n > pty.fifo_n)
+        n = pty.fifo_n;
+
+    memcpy(pty.rx.buf + pty.rx.done, pty.fifo, n);
+    memmove(pty.fifo, pty.fifo + n, pty.fifo_n - n);
+    pty.fifo_n -= n;
+    pty.rx.done += n;
+    if (pty.rx.count)
+        *pty.rx.count = pty.rx.done;
+
+    if (pty.rx.done == pty.rx.len) {
+        lsr = pty.lsr;
+        pty.lsr = 0;
+        uart_pty_complete(&pty.rx, lsr);
+    }
+}
+
+/**
+ * @brief Bytes arriving on the line
+ */
+static void uart_pty_line_in(const uint8_t *data, int len)
+{
+    uint8_t b;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        b = data[i];
+        if (pty.corrupt_every && ++pty.corrupt_count == pty.corrupt_every) {
+            pty.corrupt_count = 0;
+            b ^= 0x10;
+        }
+
+        if (pty.fifo_n == UART_PTY_FIFO) {
+            pty.lsr |= LSR_OE;
+            pty.overruns++;
+            continue;
+        }
+        pty.fifo[pty.fifo_n++] = b;
+        uart_pty_drain();
+    }
+}
+
+static void uart_pty_receive(double elapsed)
+{
+    uint8_t tmp[1024];
+    int want;
+    int got;
+
+    if (pty.mcr & MCR_LPBK) {
+        uart_pty_drain();
+        return;
+    }
+
+    pty.rx_credit += elapsed * pty.baud / 10;
+    if (pty.rx_credit > sizeof(tmp))
+        pty.rx_credit = sizeof(tmp);
+
+    want = pty.rx_credit;
+    if (pty.flow) {
+        if (!(pty.mcr & MCR_RTS))
+            want = 0;
+        else if (want > UART_PTY_FIFO - pty.fifo_n)
+            want = UART_PTY_FIFO - pty.fifo_n;
+    }
+
+    got = want ? read(pty.slave, tmp, want) : 0;
+    if (got <= 0) {
+        /* Nothing on the line: do not bank time for a later burst */
+        if (got < 0 || want)
+            pty.rx_credit = 0;
+        got = 0;
+    }
+    pty.rx_credit -= got;
+
+    uart_pty_line_in(tmp, got);
+    uart_pty_drain();
+}
+
+static void uart_pty_transmit(double elapsed)
+{
+    int want;
+    int sent;
+
+    if (!pty.tx.armed || (pty.flow && !pty.cts)) {
+        pty.tx_credit = 0;
+        return;
+    }
+
+    pty.tx_credit += elapsed * pty.baud / 10;
+    want = pty.tx_credit;
+    if (want > pty.tx.len - pty.tx.done)
+        want = pty.tx.len - pty.tx.done;
+    if (!want)
+        return;
+
+    if (pty.mcr & MCR_LPBK) {
+        uart_pty_line_in(pty.tx.buf + pty.tx.done, want);
+        sent = want;
+    } else {
+        sent = write(pty.slave, pty.tx.buf + pty.tx.done, want);
+        if (sent <= 0)
+            return;
+    }
+
+    pty.tx_credit -= sent;
+    pty.tx.done += sent;
+    if (pty.tx.count)
+        *pty.tx.count = pty.tx.done;
+
+    if (pty.tx.done == pty.tx.len)
+        uart_pty_complete(&pty.tx, 0);
+}
+
+static void *uart_pty_thread(void *arg)
+{
+    struct timespec tick = { 0, 1000000 };
+    uint64_t last = uart_pty_us();
+    uint64_t now;
+    double elapsed;
+
+    while (pty.running) {
+        nanosleep(&tick, NULL);
+
+        now = uart_pty_us();
+        elapsed = (now - last) / 1e6;
+        last = now;
+
+        irqsave();
+        uart_pty_receive(elapsed);
+        uart_pty_transmit(elapsed);
+        irqrestore(0);
+
+        while (uart_pty_run_work())
+            ;
+    }
+
+    return NULL;
+}
+
+struct device *device_open(const char *type, unsigned int id)
+{
+    irqsave();
+    pty.dev.type = type;
+    pty.dev.id = id;
+    pty.baud = 115200;
+    pty.flow = false;
+    pty.mcr = 0;
+    pty.fifo_n = 0;
+    pty.lsr = 0;
+    memset(&pty.rx, 0, sizeof(pty.rx));
+    memset(&pty.tx, 0, sizeof(pty.tx));
+    irqrestore(0);
+
+    return &pty.dev;
+}
+
+void device_close(struct device *dev)
+{
+}
+
+int device_uart_set_configuration(struct device *dev, int baud, int parity,
+                                  int databits, int stopbit, int flow)
+{
+    irqsave();
+    pty.baud = baud;
+    pty.flow = flow;
+    irqrestore(0);
+
+    return 0;
+}
+
+int device_uart_set_modem_ctrl(struct device *dev, uint8_t *modem_ctrl)
+{
+    irqsave();
+    if ((pty.mcr & MCR_RTS) && !(*modem_ctrl & MCR_RTS))
+        pty.rts_drops++;
+    pty.mcr = *modem_ctrl;
+    irqrestore(0);
+
+    return 0;
+}
+
+int device_uart_get_modem_status(struct device *dev, uint8_t *modem_status)
+{
+    *modem_status = pty.cts ? MSR_CTS : 0;
+    return 0;
+}
+
+int device_uart_attach_ms_callback(struct device *dev,
+                                   void (*callback)(uint8_t ms))
+{
+    irqsave();
+    pty.ms_callback = callback;
+    irqrestore(0);
+
+    return 0;
+}
+
+int device_uart_set_break(struct device *dev, uint8_t break_on)
+{
+    if (break_on)
+        tcsendbreak(pty.slave, 0);
+    return 0;
+}
+
+static int uart_pty_start(struct uart_pty_xfer *xfer, uint8_t *buffer,
+                          int length, int *count, uart_pty_cb callback)
+{
+    int ret = 0;
+
+    irqsave();
+    if (xfer->armed) {
+        ret = -EBUSY;
+    } else {
+        xfer->armed = true;
+        xfer->buf = buffer;
+        xfer->len = length;
+        xfer->done = 0;
+        xfer->count = count;
+        xfer->callback = callback;
+        if (count)
+            *count = 0;
+    }
+    irqrestore(0);
+
+    return ret;
+}
+
+static int uart_pty_stop(struct uart_pty_xfer *xfer)
+{
+    irqsave();
+    if (xfer->armed)
+        uart_pty_complete(xfer, 0);
+    irqrestore(0);
+
+    return 0;
+}
+
+int device_uart_start_transmitter(struct device *dev, uint8_t *buffer,
+                                  int length, void *dma, int *sent,
+                                  uart_pty_cb callback)
+{
+    return uart_pty_start(&pty.tx, buffer, length, sent, callback);
+}
+
+int device_uart_stop_transmitter(struct device *dev)
+{
+    irqsave();
+    pty.tx.armed = false;
+    irqrestore(0);
+
+    return 0;
+}
+
+int device_uart_start_receiver(struct device *dev, uint8_t *buffer,
+                               int length, void *dma, int *got,
+                               uart_pty_cb callback)
+{
+    return uart_pty_start(&pty.rx, buffer, length, got, callback);
+}
+
+int device_uart_stop_receiver(struct device *dev)
+{
+    return uart_pty_stop(&pty.rx);
+}
+
+/**
+ * @brief Master side of the pty, for the test
+ */
+int uart_pty_fd(void)
+{
+    return pty.master;
+}
+
+void uart_pty_set_cts(bool cts)
+{
+    irqsave();
+    if (pty.cts != cts) {
+        pty.cts = cts;
+        /* The modem status interrupt */
+        if (pty.ms_callback)
+            pty.ms_callback(MSR_DCTS | (cts ? MSR_CTS : 0));
+    }
+    irqrestore(0);
+}
+
+void uart_pty_set_corrupt(uint32_t every)
+{
+    irqsave();
+    pty.corrupt_every = every;
+    pty.corrupt_count = 0;
+    irqrestore(0);
+}
+
+uint8_t uart_pty_mcr(void)
+{
+    return pty.mcr;
+}
+
+uint32_t uart_pty_rts_drops(void)
+{
+    return pty.rts_drops;
+}
+
+uint32_t uart_pty_overruns(void)
+{
+    return pty.overruns;
+}
+
+/**
+ * @brief Open the pty pair and start the stand-in thread
+ *
+ * @return 0 on success, -1 on error
+ */
+int uart_pty_init(void)
+{
+    struct termios tio;
+
+    clock_gettime(CLOCK_MONOTONIC, &pty.start);
+    pthread_mutex_init(&pty.wq_lock, NULL);
+    pty.cts = true;
+
+    pty.master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (pty.master < 0 || grantpt(pty.master) || unlockpt(pty.master))
+        return -1;
+
+    pty.slave = open(ptsname(pty.master), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (pty.slave < 0)
+        return -1;
+
+    /* A raw line on both ends: no echo, no line editing, no CR/LF mapping */
+    tcgetattr(pty.slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(pty.slave, TCSANOW, &tio);
+    tcgetattr(pty.master, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(pty.master, TCSANOW, &tio);
+
+    pty.running = true;
+    if (pthread_create(&pty.thread, NULL, uart_pty_thread, NULL))
+        return -1;
+
+    return 0;
+}
+
+void uart_pty_exit(void)
+{
+    pty.running = false;
+    pthread_join(pty.thread, NULL);
+    close(pty.slave);
+    close(pty.master);
+}
@@ -1,6 +1,10 @@
 config		= config
 manifest	= manifest.mnfs
 board-files	= board.c
+board-files	+= uart_buf.c
+board-files	+= uart_gb.c
+board-files	+= uart_bench.c
+board-files	+= ../common/dwt.c
 
 vendor_id	= 0x00000000
 product_id	= 0x00000000
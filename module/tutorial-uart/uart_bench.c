@@ -0,0 +1,514 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Loopback stress and throughput benchmark for the buffered UART data path.
+ *
+ * The UART is put in internal loopback, or left alone with TX jumpered to RX
+ * ("uart_bench jumper"), and fed continuously with 64-byte frames: magic,
+ * sequence number, send time, a payload derived from the sequence number
+ * and a CRC-32 over all of it.  Everything coming back is reframed and
+ * checked.  For each baud rate the benchmark reports:
+ *
+ * - received bytes per second, as a share of the line rate;
+ * - CPU load, measured as the time taken away from a lowest-priority
+ *   spinner task (target builds only);
+ * - frames received, CRC errors, frames lost (sequence gaps), bytes skipped
+ *   to find the next frame, and line status errors;
+ * - round-trip latency of single frames sent on an idle line, which
+ *   includes the receive idle timer.
+ *
+ * uart_bench_main() returns non-zero if any run saw an error.  Built with
+ * the host stand-ins (UART_HOST), the same code runs against the simulated
+ * UART in host/uart_pty.c.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <nuttx/config.h>
+#include <nuttx/clock.h>
+#include <nuttx/device.h>
+#include <nuttx/device_uart.h>
+#include <nuttx/util.h>
+
+/* Length of each throughput run */
+#ifndef UART_BENCH_MS
+#define UART_BENCH_MS           2000
+#endif
+
+#define UART_BENCH_FRAME        64
+#define UART_BENCH_HEADER       8
+#define UART_BENCH_MAGIC0       0xa5
+#define UART_BENCH_MAGIC1       0x5a
+
+/* Single frames timed on an idle line after each run */
+#define UART_BENCH_PINGS        16
+
+static const int uart_bench_bauds[] = {
+    115200, 230400, 460800, 921600, 1000000, 2000000, 3000000,
+};
+
+int uart_buf_open(int (*rx_sink)(const uint8_t *data, size_t len,
+                                 uint8_t flags),
+                  void (*tx_done)(size_t len));
+void uart_buf_close(void);
+size_t uart_buf_write(const uint8_t *data, size_t len);
+size_t uart_buf_write_space(void);
+int uart_buf_set_config(int baud, int parity, int databits, int stopbits,
+                        int flow);
+int uart_buf_set_modem_ctrl(uint8_t mcr);
+void uart_buf_report(void);
+
+/* Cycle counter, see common/dwt.c; host builds count microseconds */
+uint32_t dwt_cycles(void);
+uint32_t dwt_cycles_per_us(void);
+
+/**
+ * @brief Counters of one run, updated from the receive sink
+ */
+struct uart_bench_stats {
+    uint32_t rx_bytes;
+    uint32_t frames;
+    uint32_t crc_errors;
+    uint32_t lost;
+    uint32_t skipped;
+    uint32_t line_errors;
+    uint32_t pings;
+    uint32_t lat_min;
+    uint32_t lat_max;
+    uint32_t lat_sum;
+};
+
+static struct {
+    volatile bool feeding;
+    volatile bool ping;
+    uint32_t cycles_per_us;
+    size_t tx_ring;
+    uint32_t tx_bytes;
+    uint16_t tx_seq;
+
+    uint8_t frame[UART_BENCH_FRAME];
+    size_t frame_len;
+    bool rx_synced;
+    uint16_t rx_seq;
+    /** Frames failing the CRC since the last good one */
+    uint16_t rx_bad;
+
+    struct uart_bench_stats st;
+} bench;
+
+static uint32_t uart_bench_crc_table[256];
+
+#ifndef UART_HOST
+static volatile uint32_t uart_bench_spins;
+
+static int uart_bench_spinner(int argc, char *argv[])
+{
+    for (;;)
+        uart_bench_spins++;
+
+    return 0;
+}
+
+/**
+ * @brief Spinner iterations over one run with the UART quiet
+ */
+static uint32_t uart_bench_idle_spins(void)
+{
+    uint32_t start = uart_bench_spins;
+
+    usleep(UART_BENCH_MS * 1000);
+
+    return uart_bench_spins - start;
+}
+#endif
+
+static void uart_bench_crc_init(void)
+{
+    uint32_t c;
+    int i;
+    int j;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++)
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        uart_bench_crc_table[i] = c;
+    }
+}
+
+/**
+ * @brief CRC-32 (IEEE 802.3)
+ */
+static uint32_t uart_bench_crc(const uint8_t *data, size_t len)
+{
+    uint32_t crc = 0xffffffff;
+
+    while (len--)
+        crc = uart_bench_crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+static void uart_bench_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t uart_bench_get32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * @brief Build the next frame and queue it
+ *
+ * @return 0 if queued, -ENOSPC if the transmit ring has no room for it
+ */
+static int uart_bench_send(void)
+{
+    uint8_t frame[UART_BENCH_FRAME];
+    uint32_t x = bench.tx_seq * 2654435761u;
+    size_t i;
+
+    if (uart_buf_write_space() < sizeof(frame))
+        return -ENOSPC;
+
+    frame[0] = UART_BENCH_MAGIC0;
+    frame[1] = UART_BENCH_MAGIC1;
+    frame[2] = bench.tx_seq;
+    frame[3] = bench.tx_seq >> 8;
+    uart_bench_put32(frame + 4, dwt_cycles());
+
+    for (i = UART_BENCH_HEADER; i < sizeof(frame) - 4; i++) {
+        x = x * 1103515245 + 12345;
+        frame[i] = x >> 24;
+    }
+
+    uart_bench_put32(frame + sizeof(frame) - 4,
+                     uart_bench_crc(frame, sizeof(frame) - 4));
+
+    uart_buf_write(frame, sizeof(frame));
+    bench.tx_seq++;
+    bench.tx_bytes += sizeof(frame);
+
+    return 0;
+}
+
+/**
+ * @brief Check a complete frame
+ */
+static void uart_bench_frame(void)
+{
+    const uint8_t *f = bench.frame;
+    uint32_t lat;
+    uint16_t seq;
+    uint16_t gap;
+
+    if (uart_bench_crc(f, UART_BENCH_FRAME - 4) !=
+        uart_bench_get32(f + UART_BENCH_FRAME - 4)) {
+        bench.st.crc_errors++;
+        bench.rx_bad++;
+        return;
+    }
+
+    /* Frames that failed the CRC are in the gap but already counted */
+    seq = f[2] | f[3] << 8;
+    gap = seq - bench.rx_seq;
+    if (bench.rx_synced && gap > bench.rx_bad)
+        bench.st.lost += gap - bench.rx_bad;
+    bench.rx_seq = seq + 1;
+    bench.rx_bad = 0;
+    bench.rx_synced = true;
+    bench.st.frames++;
+
+    if (!bench.ping)
+        return;
+
+    lat = (dwt_cycles() - uart_bench_get32(f + 4)) /
+          bench.cycles_per_us;
+    if (!bench.st.pings || lat < bench.st.lat_min)
+        bench.st.lat_min = lat;
+    if (lat > bench.st.lat_max)
+        bench.st.lat_max = lat;
+    bench.st.lat_sum += lat;
+    bench.st.pings++;
+}
+
+/**
+ * @brief Reassemble frames from received data
+ *
+ * Bytes that do not start a frame are skipped until the next magic.
+ */
+static int uart_bench_sink(const uint8_t *data, size_t len, uint8_t flags)
+{
+    size_t n;
+    uint8_t b;
+
+    bench.st.rx_bytes += len;
+    if (flags)
+        bench.st.line_errors++;
+
+    while (len) {
+        if (bench.frame_len < 2) {
+            b = *data++;
+            len--;
+
+            if (b == (bench.frame_len ? UART_BENCH_MAGIC1 :
+                                        UART_BENCH_MAGIC0)) {
+                bench.frame[bench.frame_len++] = b;
+                continue;
+            }
+
+            bench.st.skipped += bench.frame_len + 1;
+            bench.frame_len = 0;
+            if (b == UART_BENCH_MAGIC0) {
+                bench.frame[bench.frame_len++] = b;
+                bench.st.skipped--;
+            }
+            continue;
+        }
+
+        n = UART_BENCH_FRAME - bench.frame_len;
+        if (n > len)
+            n = len;
+
+        memcpy(bench.frame + bench.frame_len, data, n);
+        bench.frame_len += n;
+        data += n;
+        len -= n;
+
+        if (bench.frame_len == UART_BENCH_FRAME) {
+            uart_bench_frame();
+            bench.frame_len = 0;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Keep the transmit ring full during a throughput run
+ */
+static void uart_bench_fill(size_t len)
+{
+    if (!bench.feeding)
+        return;
+
+    while (!uart_bench_send())
+        ;
+}
+
+/**
+ * @brief Wait for everything sent to be sent and received
+ */
+static void uart_bench_drain(void)
+{
+    uint32_t start = clock_systimer();
+
+    while (uart_buf_write_space() < bench.tx_ring &&
+           clock_systimer() - start < MSEC2TICK(2000))
+        usleep(10000);
+
+    /* Lost bytes never arrive: give up after a second */
+    start = clock_systimer();
+    while (bench.st.rx_bytes < bench.tx_bytes &&
+           clock_systimer() - start < MSEC2TICK(1000))
+        usleep(10000);
+}
+
+/**
+ * @brief Time single frames on an otherwise idle line
+ */
+static void uart_bench_pings(void)
+{
+    uint32_t start;
+    uint32_t got;
+    int i;
+
+    bench.ping = true;
+
+    for (i = 0; i < UART_BENCH_PINGS; i++) {
+        got = bench.st.frames;
+        if (uart_bench_send())
+            break;
+
+        start = clock_systimer();
+        while (bench.st.frames == got &&
+               clock_systimer() - start < MSEC2TICK(500))
+            usleep(1000);
+    }
+
+    bench.ping = false;
+}
+
+/**
+ * @brief Run one baud rate
+ *
+ * @return Number of errors seen
+ */
+static uint32_t uart_bench_run(int baud, uint32_t idle)
+{
+    struct uart_bench_stats *st = &bench.st;
+    uint32_t start_tick;
+    uint32_t missing;
+    uint32_t errors;
+    uint32_t rx;
+    uint32_t ms;
+    uint32_t bps;
+    uint32_t load = 0;
+#ifndef UART_HOST
+    uint32_t spins;
+#endif
+
+    if (uart_buf_set_config(baud, NO_PARITY, 8, ONE_STOP_BIT, 0)) {
+        printf("uart_bench: %7d baud: not supported\n", baud);
+        return 0;
+    }
+
+    memset(st, 0, sizeof(*st));
+    bench.tx_bytes = 0;
+    bench.frame_len = 0;
+    bench.rx_synced = false;
+    bench.rx_bad = 0;
+
+    start_tick = clock_systimer();
+#ifndef UART_HOST
+    spins = uart_bench_spins;
+#endif
+
+    bench.feeding = true;
+    uart_bench_fill(0);
+    usleep(UART_BENCH_MS * 1000);
+
+    rx = st->rx_bytes;
+    ms = (clock_systimer() - start_tick) * USEC_PER_TICK / 1000;
+#ifndef UART_HOST
+    spins = uart_bench_spins - spins;
+    load = spins < idle ? 100 - (uint32_t)((uint64_t)spins * 100 / idle) : 0;
+#endif
+
+    bench.feeding = false;
+    uart_bench_drain();
+    uart_bench_pings();
+    uart_bench_drain();
+
+    bps = ms ? (uint32_t)((uint64_t)rx * 1000 / ms) : 0;
+    missing = 0;
+    if (st->rx_bytes < bench.tx_bytes)
+        missing = (bench.tx_bytes - st->rx_bytes) / UART_BENCH_FRAME;
+    errors = st->crc_errors + st->lost + st->line_errors + missing;
+
+    printf("uart_bench: %7d baud: %7u bytes/s (%3u%% of line) cpu %3u%%\n",
+           baud, bps, (uint32_t)((uint64_t)bps * 1000 / baud), load);
+    printf("uart_bench:   frames %u, crc errors %u, lost %u, missing %u, "
+           "skipped %u bytes, line errors %u\n", st->frames, st->crc_errors,
+           st->lost, missing, st->skipped, st->line_errors);
+    if (st->pings)
+        printf("uart_bench:   latency min %u avg %u max %u us over %u frames\n",
+               st->lat_min, st->lat_sum / st->pings, st->lat_max, st->pings);
+
+    return errors;
+}
+
+/**
+ * @brief Loopback benchmark entry point
+ *
+ * @param argc Argument count
+ * @param argv "jumper" as the first argument keeps internal loopback off,
+ *             for a TX-RX jumper on the connector
+ * @return 0 if all runs were error free
+ */
+int uart_bench_main(int argc, char *argv[])
+{
+    bool jumper = argc > 1 && argv && argv[1] && !strcmp(argv[1], "jumper");
+    uint32_t errors = 0;
+    uint32_t idle = 0;
+    uint8_t mcr = MCR_DTR | MCR_RTS;
+    size_t i;
+    int ret;
+#ifndef UART_HOST
+    pid_t spinner;
+#endif
+
+    memset(&bench, 0, sizeof(bench));
+    uart_bench_crc_init();
+    bench.cycles_per_us = dwt_cycles_per_us();
+
+#ifndef UART_HOST
+    spinner = task_create("uart_spin", SCHED_PRIORITY_MIN, 512,
+                          uart_bench_spinner, NULL);
+    if (spinner < 0)
+        return -1;
+
+    idle = uart_bench_idle_spins();
+#endif
+
+    ret = uart_buf_open(uart_bench_sink, uart_bench_fill);
+    if (ret) {
+        printf("uart_bench: cannot open UART: %d\n", ret);
+        goto out;
+    }
+
+    bench.tx_ring = uart_buf_write_space();
+
+    if (!jumper)
+        mcr |= MCR_LPBK;
+    uart_buf_set_modem_ctrl(mcr);
+
+    printf("uart_bench: %s loopback, %u ms per run\n",
+           jumper ? "external" : "internal", UART_BENCH_MS);
+
+    for (i = 0; i < ARRAY_SIZE(uart_bench_bauds); i++)
+        errors += uart_bench_run(uart_bench_bauds[i], idle);
+
+    uart_buf_set_modem_ctrl(MCR_DTR | MCR_RTS);
+
+    uart_buf_report();
+    uart_buf_close();
+
+    printf("uart_bench: %u errors\n", errors);
+    if (errors)
+        ret = -EIO;
+
+out:
+#ifndef UART_HOST
+    task_delete(spinner);
+#endif
+    return ret;
+}
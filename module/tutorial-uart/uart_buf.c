@@ -0,0 +1,756 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Buffered UART data path for the UART module.
+ *
+ * Receive data lands in a circular buffer, one large chunk at a time, so
+ * the UART driver completes a receive every UART_BUF_RX_CHUNK bytes instead
+ * of handing over a few bytes per interrupt.  Each chunk is re-armed from
+ * the completion callback so nothing is lost between chunks.  When the line
+ * goes idle with a chunk partly filled, the receive is stopped to flush it.
+ * Received data goes to a sink in batches of up to UART_BUF_BATCH bytes,
+ * from the high-priority work queue.
+ *
+ * How long a partly filled chunk may sit before it is flushed adapts to the
+ * traffic: a short delivery (keystrokes, short messages) brings the hold
+ * straight down to a few character times, long ones (bulk transfers)
+ * stretch it up to UART_BUF_HOLD_MAX ticks so bursts with small gaps still
+ * travel together.  The hold counts from the last time the chunk was seen
+ * to grow; the line is checked every few character times (at least a tick),
+ * so a chunk is flushed at most that much after its hold has run out.
+ *
+ * With hardware flow control on, the driver handles RTS/CTS against its
+ * FIFO, and RTS is also dropped while the receive ring is backed up because
+ * the sink (the AP) is not keeping up, instead of stalling the receiver and
+ * overrunning the FIFO.
+ *
+ * Transmit data is queued in a second circular buffer and sent in the
+ * largest contiguous pieces available; completed bytes are reported back
+ * from the work queue (the Greybus UART protocol returns them as credits).
+ * Flushing drops what is queued in either direction; dropped transmit
+ * bytes are reported like sent ones so the credits stay balanced.
+ *
+ * Modem status changes are also passed on from the work queue.
+ *
+ * The UART driver moves the data on its FIFO interrupt path, one
+ * completion per chunk: the module uses no DMA channel and CONFIG_ARCH_DMA
+ * is off.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <nuttx/config.h>
+#include <nuttx/clock.h>
+#include <nuttx/device.h>
+#include <nuttx/device_uart.h>
+#include <nuttx/wqueue.h>
+
+#include <arch/irq.h>
+
+#ifdef CONFIG_MM_BUFRAM_ALLOCATOR
+#include <nuttx/bufram.h>
+#else
+#include <stdlib.h>
+#endif
+
+#define UART_BUF_RX_RING        4096
+#define UART_BUF_RX_CHUNK       256
+#define UART_BUF_TX_RING        4096
+
+/* Largest piece of received data handed to the sink at once */
+#define UART_BUF_BATCH          1024
+
+/* Shortest idle time that flushes a partly filled chunk, in character times */
+#define UART_BUF_IDLE_CHARS     32
+
+/* Longest idle time that flushes a partly filled chunk, in ticks */
+#define UART_BUF_HOLD_MAX       8
+
+/* Receive ring levels that drop and raise RTS with flow control on */
+#define UART_BUF_RTS_OFF        (UART_BUF_RX_RING - 4 * UART_BUF_RX_CHUNK)
+#define UART_BUF_RTS_ON         (UART_BUF_RX_RING / 4)
+
+/**
+ * @brief Buffered UART state
+ */
+struct uart_buf {
+    struct device *dev;
+    bool open;
+    uint32_t baud;
+    /** Hardware flow control is on */
+    bool flow;
+    /** Modem control lines as last set by the user */
+    uint8_t mcr;
+    /** RTS is held low because the receive ring is backed up */
+    bool rts_throttled;
+
+    /** Consumer of received data, called from the work queue */
+    int (*rx_sink)(const uint8_t *data, size_t len, uint8_t flags);
+    /** Notified of transmitted bytes, called from the work queue */
+    void (*tx_done)(size_t len);
+    /** Notified of modem status changes, called from the work queue */
+    void (*ms_change)(uint8_t msr);
+
+    uint8_t *rx_ring;
+    /** Bytes received and delivered, free running */
+    volatile uint32_t rx_head;
+    uint32_t rx_tail;
+    /** A receive is armed on the ring */
+    volatile bool rx_armed;
+    /** Receiving stopped because the ring is full */
+    volatile bool rx_stalled;
+    /** Bytes of the armed chunk received so far, as reported by the driver */
+    int rx_got;
+    /** rx_got at the last idle check, and the tick it was first seen at */
+    int rx_idle_got;
+    uint32_t rx_idle_since;
+    /** Line status errors since the last delivery (LSR bits) */
+    volatile uint8_t rx_errors;
+    /** Drop undelivered data on the next worker run */
+    volatile bool rx_flush;
+
+    uint8_t *tx_ring;
+    uint32_t tx_head;
+    volatile uint32_t tx_tail;
+    volatile bool tx_busy;
+    /** Bytes of the transmit in progress sent so far */
+    int tx_sent;
+    /** Transmitted bytes not yet reported through tx_done */
+    volatile uint32_t tx_done_pending;
+
+    /** Modem status bits accumulated since the worker last ran */
+    volatile uint8_t msr;
+    volatile bool msr_changed;
+
+    struct work_s work;
+    volatile bool work_pending;
+    struct work_s idle_work;
+    /** Current idle flush timer, between idle_min_ticks and HOLD_MAX */
+    uint32_t idle_ticks;
+    uint32_t idle_min_ticks;
+
+    /** Counters */
+    uint32_t rx_bytes;
+    uint32_t rx_batches;
+    uint32_t rx_idle_flushes;
+    uint32_t rx_stalls;
+    uint32_t rx_line_errors;
+    uint32_t rx_throttles;
+    uint32_t tx_bytes;
+};
+
+static struct uart_buf uart_buf;
+
+static void uart_buf_rx_arm(void);
+static void uart_buf_tx_kick(void);
+
+static void *uart_buf_alloc(size_t size)
+{
+#ifdef CONFIG_MM_BUFRAM_ALLOCATOR
+    return bufram_alloc(size);
+#else
+    return malloc(size);
+#endif
+}
+
+static void uart_buf_free(void *buf)
+{
+#ifdef CONFIG_MM_BUFRAM_ALLOCATOR
+    bufram_free(buf);
+#else
+    free(buf);
+#endif
+}
+
+static void uart_buf_worker(void *arg);
+
+/**
+ * @brief Schedule the worker, if it is not already pending
+ */
+static void uart_buf_kick_worker(void)
+{
+    irqstate_t flags;
+
+    flags = irqsave();
+    if (!uart_buf.work_pending) {
+        uart_buf.work_pending = true;
+        work_queue(HPWORK, &uart_buf.work, uart_buf_worker, NULL, 0);
+    }
+    irqrestore(flags);
+}
+
+/**
+ * @brief Receive completion: chunk full, or receive stopped on idle
+ */
+static void uart_buf_rx_callback(uint8_t *buffer, int length, int error)
+{
+    uart_buf.rx_armed = false;
+
+    if (length > 0) {
+        uart_buf.rx_head += length;
+        uart_buf.rx_bytes += length;
+    }
+
+    if (error) {
+        uart_buf.rx_errors |= error;
+        uart_buf.rx_line_errors++;
+    }
+
+    if (uart_buf.open)
+        uart_buf_rx_arm();
+
+    /* Full chunks are batched; anything shorter is an idle flush */
+    if (uart_buf.rx_head - uart_buf.rx_tail >= UART_BUF_BATCH ||
+        length < UART_BUF_RX_CHUNK || uart_buf.rx_stalled)
+        uart_buf_kick_worker();
+}
+
+/**
+ * @brief Arm a receive on the next free, contiguous part of the ring
+ *
+ * Called with interrupts disabled or from the receive callback.
+ */
+static void uart_buf_rx_arm(void)
+{
+    uint32_t used = uart_buf.rx_head - uart_buf.rx_tail;
+    uint32_t off = uart_buf.rx_head % UART_BUF_RX_RING;
+    uint32_t len = UART_BUF_RX_CHUNK - off % UART_BUF_RX_CHUNK;
+
+    if (uart_buf.rx_armed)
+        return;
+
+    if (len > UART_BUF_RX_RING - used)
+        len = UART_BUF_RX_RING - used;
+
+    if (!len) {
+        if (!uart_buf.rx_stalled)
+            uart_buf.rx_stalls++;
+        uart_buf.rx_stalled = true;
+        return;
+    }
+
+    uart_buf.rx_stalled = false;
+    uart_buf.rx_got = 0;
+    uart_buf.rx_idle_got = 0;
+    uart_buf.rx_idle_since = clock_systimer();
+    uart_buf.rx_armed = true;
+
+    if (device_uart_start_receiver(uart_buf.dev, uart_buf.rx_ring + off, len,
+                                   NULL, &uart_buf.rx_got,
+                                   uart_buf_rx_callback)) {
+        uart_buf.rx_armed = false;
+    }
+}
+
+/**
+ * @brief Transmit completion
+ */
+static void uart_buf_tx_callback(uint8_t *buffer, int length, int error)
+{
+    if (length > 0) {
+        uart_buf.tx_tail += length;
+        uart_buf.tx_bytes += length;
+        uart_buf.tx_done_pending += length;
+    }
+
+    uart_buf.tx_busy = false;
+    uart_buf_tx_kick();
+
+    if (uart_buf.tx_done)
+        uart_buf_kick_worker();
+}
+
+/**
+ * @brief Start sending the next contiguous part of the transmit ring
+ */
+static void uart_buf_tx_kick(void)
+{
+    uint32_t used = uart_buf.tx_head - uart_buf.tx_tail;
+    uint32_t off = uart_buf.tx_tail % UART_BUF_TX_RING;
+    uint32_t len = UART_BUF_TX_RING - off;
+    irqstate_t flags;
+
+    flags = irqsave();
+
+    if (uart_buf.tx_busy || !used) {
+        irqrestore(flags);
+        return;
+    }
+
+    if (len > used)
+        len = used;
+
+    uart_buf.tx_busy = true;
+    uart_buf.tx_sent = 0;
+    irqrestore(flags);
+
+    if (device_uart_start_transmitter(uart_buf.dev, uart_buf.tx_ring + off,
+                                      len, NULL, &uart_buf.tx_sent,
+                                      uart_buf_tx_callback))
+        uart_buf.tx_busy = false;
+}
+
+/**
+ * @brief Modem status interrupt
+ */
+static void uart_buf_ms_callback(uint8_t msr)
+{
+    /* Keep the delta bits of every change until the worker runs */
+    uart_buf.msr = (uart_buf.msr & (MSR_DCTS | MSR_DDSR | MSR_TERI |
+                                    MSR_DDCD)) | msr;
+    uart_buf.msr_changed = true;
+
+    if (uart_buf.ms_change)
+        uart_buf_kick_worker();
+}
+
+/**
+ * @brief Drive RTS from the receive ring level
+ *
+ * Only with flow control on; the user's own RTS setting still wins when it
+ * is low.
+ */
+static void uart_buf_rts_update(void)
+{
+    uint32_t used = uart_buf.rx_head - uart_buf.rx_tail;
+    bool throttle = uart_buf.rts_throttled;
+    uint8_t mcr;
+
+    if (!uart_buf.flow)
+        throttle = false;
+    else if (used >= UART_BUF_RTS_OFF)
+        throttle = true;
+    else if (used <= UART_BUF_RTS_ON)
+        throttle = false;
+
+    if (throttle == uart_buf.rts_throttled)
+        return;
+
+    uart_buf.rts_throttled = throttle;
+    if (throttle)
+        uart_buf.rx_throttles++;
+
+    mcr = uart_buf.mcr;
+    if (throttle)
+        mcr &= ~MCR_RTS;
+    device_uart_set_modem_ctrl(uart_buf.dev, &mcr);
+}
+
+/**
+ * @brief Adapt the idle flush timer to the size of the last delivery
+ *
+ * A short delivery drops it straight to the minimum, even right after bulk
+ * traffic, so the next keystroke or message goes out quickly; bulk traffic
+ * stretches it one tick at a time.
+ */
+static void uart_buf_hold_update(uint32_t delivered)
+{
+    if (delivered < UART_BUF_BATCH / 8)
+        uart_buf.idle_ticks = uart_buf.idle_min_ticks;
+    else if (delivered >= UART_BUF_BATCH / 2 &&
+             uart_buf.idle_ticks < UART_BUF_HOLD_MAX)
+        uart_buf.idle_ticks++;
+}
+
+/**
+ * @brief Deliver received data in batches and report transmitted bytes
+ */
+static void uart_buf_worker(void *arg)
+{
+    uint32_t avail;
+    uint32_t off;
+    uint32_t len;
+    uint32_t done;
+    uint32_t delivered = 0;
+    uint8_t errors;
+    uint8_t msr = 0;
+    bool ms = false;
+    irqstate_t flags;
+
+    flags = irqsave();
+    uart_buf.work_pending = false;
+    done = uart_buf.tx_done_pending;
+    uart_buf.tx_done_pending = 0;
+    if (uart_buf.msr_changed) {
+        ms = true;
+        msr = uart_buf.msr;
+        uart_buf.msr = 0;
+        uart_buf.msr_changed = false;
+    }
+    if (uart_buf.rx_flush) {
+        uart_buf.rx_tail = uart_buf.rx_head;
+        uart_buf.rx_errors = 0;
+        uart_buf.rx_flush = false;
+    }
+    irqrestore(flags);
+
+    if (done && uart_buf.tx_done)
+        uart_buf.tx_done(done);
+
+    if (ms && uart_buf.ms_change)
+        uart_buf.ms_change(msr);
+
+    while ((avail = uart_buf.rx_head - uart_buf.rx_tail)) {
+        off = uart_buf.rx_tail % UART_BUF_RX_RING;
+        len = UART_BUF_RX_RING - off;
+        if (len > avail)
+            len = avail;
+        if (len > UART_BUF_BATCH)
+            len = UART_BUF_BATCH;
+
+        flags = irqsave();
+        errors = uart_buf.rx_errors;
+        uart_buf.rx_errors = 0;
+        irqrestore(flags);
+
+        /* The sink is busy: retry on the next idle tick */
+        if (uart_buf.rx_sink &&
+            uart_buf.rx_sink(uart_buf.rx_ring + off, len, errors)) {
+            uart_buf.rx_errors |= errors;
+            break;
+        }
+
+        uart_buf.rx_tail += len;
+        uart_buf.rx_batches++;
+        delivered += len;
+    }
+
+    if (delivered)
+        uart_buf_hold_update(delivered);
+
+    uart_buf_rts_update();
+
+    /* Room again after a full ring */
+    flags = irqsave();
+    if (uart_buf.rx_stalled && uart_buf.open)
+        uart_buf_rx_arm();
+    irqrestore(flags);
+}
+
+/**
+ * @brief Idle line check: flush a chunk that has not grown for the hold time
+ */
+static void uart_buf_idle_worker(void *arg)
+{
+    uint32_t now = clock_systimer();
+    bool flush = false;
+    irqstate_t flags;
+
+    if (!uart_buf.open)
+        return;
+
+    flags = irqsave();
+    if (uart_buf.rx_got != uart_buf.rx_idle_got) {
+        uart_buf.rx_idle_got = uart_buf.rx_got;
+        uart_buf.rx_idle_since = now;
+    } else if (uart_buf.rx_armed && uart_buf.rx_got > 0 &&
+               now - uart_buf.rx_idle_since >= uart_buf.idle_ticks) {
+        flush = true;
+    } else if (!uart_buf.rx_got &&
+               now - uart_buf.rx_idle_since >= UART_BUF_HOLD_MAX) {
+        /* A quiet line ends the burst: answer the next message quickly */
+        uart_buf.idle_ticks = uart_buf.idle_min_ticks;
+    }
+    irqrestore(flags);
+
+    /* Stopping completes the receive with what it has got so far */
+    if (flush) {
+        uart_buf.rx_idle_flushes++;
+        device_uart_stop_receiver(uart_buf.dev);
+    }
+
+    if (uart_buf.rx_head != uart_buf.rx_tail)
+        uart_buf_kick_worker();
+
+    work_queue(HPWORK, &uart_buf.idle_work, uart_buf_idle_worker, NULL,
+               uart_buf.idle_min_ticks);
+}
+
+/**
+ * @brief Queue data for transmission
+ *
+ * @param data Data
+ * @param len Length
+ * @return Number of bytes queued, which is less than len if the transmit
+ *         ring is full
+ */
+size_t uart_buf_write(const uint8_t *data, size_t len)
+{
+    uint32_t space = UART_BUF_TX_RING - (uart_buf.tx_head - uart_buf.tx_tail);
+    uint32_t off;
+    uint32_t n;
+    size_t queued;
+
+    if (!uart_buf.open)
+        return 0;
+
+    if (len > space)
+        len = space;
+    queued = len;
+
+    while (len) {
+        off = uart_buf.tx_head % UART_BUF_TX_RING;
+        n = UART_BUF_TX_RING - off;
+        if (n > len)
+            n = len;
+
+        memcpy(uart_buf.tx_ring + off, data, n);
+        uart_buf.tx_head += n;
+        data += n;
+        len -= n;
+    }
+
+    uart_buf_tx_kick();
+
+    return queued;
+}
+
+/**
+ * @brief Drop queued data
+ *
+ * Receive data not yet handed to the sink is dropped, including what the
+ * armed chunk holds.  Queued transmit data is dropped after the piece being
+ * sent is stopped; it is reported through tx_done as if it had been sent.
+ *
+ * @param rx Drop received data
+ * @param tx Drop data waiting to be sent
+ */
+void uart_buf_flush(bool rx, bool tx)
+{
+    irqstate_t flags;
+    uint32_t dropped;
+
+    if (!uart_buf.open)
+        return;
+
+    if (tx) {
+        device_uart_stop_transmitter(uart_buf.dev);
+
+        flags = irqsave();
+        if (uart_buf.tx_busy) {
+            /* The stopped transmit does not complete: account for it here */
+            if (uart_buf.tx_sent > 0)
+                uart_buf.tx_bytes += uart_buf.tx_sent;
+            uart_buf.tx_busy = false;
+        }
+        dropped = uart_buf.tx_head - uart_buf.tx_tail;
+        uart_buf.tx_tail = uart_buf.tx_head;
+        uart_buf.tx_done_pending += dropped;
+        irqrestore(flags);
+    }
+
+    if (rx) {
+        /* Stopping completes the armed chunk, the worker drops the lot */
+        device_uart_stop_receiver(uart_buf.dev);
+        uart_buf.rx_flush = true;
+    }
+
+    uart_buf_kick_worker();
+}
+
+/**
+ * @brief Modem status change notification
+ *
+ * @param ms_change Called from the work queue with the MSR bits, delta bits
+ *                  included, after any change; NULL to stop
+ */
+void uart_buf_set_ms_callback(void (*ms_change)(uint8_t msr))
+{
+    uart_buf.ms_change = ms_change;
+}
+
+/**
+ * @brief Space left in the transmit ring
+ */
+size_t uart_buf_write_space(void)
+{
+    return UART_BUF_TX_RING - (uart_buf.tx_head - uart_buf.tx_tail);
+}
+
+/**
+ * @brief Change the line settings
+ *
+ * Parameters are those of device_uart_set_configuration().
+ */
+int uart_buf_set_config(int baud, int parity, int databits, int stopbits,
+                        int flow)
+{
+    uint32_t ticks;
+    int ret;
+
+    if (baud <= 0)
+        return -EINVAL;
+
+    ret = device_uart_set_configuration(uart_buf.dev, baud, parity, databits,
+                                        stopbits, flow);
+    if (ret)
+        return ret;
+
+    /* 10 bits per character */
+    uart_buf.baud = baud;
+    ticks = (UART_BUF_IDLE_CHARS * 10 * 1000000 / baud + USEC_PER_TICK - 1) /
+            USEC_PER_TICK;
+    uart_buf.idle_min_ticks = ticks ? ticks : 1;
+    if (uart_buf.idle_min_ticks > UART_BUF_HOLD_MAX)
+        uart_buf.idle_min_ticks = UART_BUF_HOLD_MAX;
+    uart_buf.idle_ticks = uart_buf.idle_min_ticks;
+
+    uart_buf.flow = !!flow;
+    uart_buf_rts_update();
+
+    return 0;
+}
+
+/**
+ * @brief Set the modem control lines
+ *
+ * RTS stays low while the receive ring is backed up with flow control on,
+ * and follows mcr again once it drains.
+ *
+ * @param mcr MCR_* bits
+ * @return 0 on success, negative errno on error
+ */
+int uart_buf_set_modem_ctrl(uint8_t mcr)
+{
+    uart_buf.mcr = mcr;
+    if (uart_buf.rts_throttled)
+        mcr &= ~MCR_RTS;
+
+    return device_uart_set_modem_ctrl(uart_buf.dev, &mcr);
+}
+
+/**
+ * @brief UART device, for break and line status
+ */
+struct device *uart_buf_device(void)
+{
+    return uart_buf.dev;
+}
+
+/**
+ * @brief Print the data path counters
+ */
+void uart_buf_report(void)
+{
+    lowsyslog("uart_buf: rx %u bytes in %u batches, %u idle flushes, "
+              "%u stalls, %u throttles, %u line errors, hold %u ticks; "
+              "tx %u bytes\n",
+              uart_buf.rx_bytes, uart_buf.rx_batches, uart_buf.rx_idle_flushes,
+              uart_buf.rx_stalls, uart_buf.rx_throttles,
+              uart_buf.rx_line_errors, uart_buf.idle_ticks, uart_buf.tx_bytes);
+}
+
+/**
+ * @brief Open the UART and start receiving
+ *
+ * @param rx_sink Consumer of received data; returns 0 once it has taken the
+ *                data, or an error to be called again later with it
+ * @param tx_done Notified of transmitted bytes, may be NULL
+ * @return 0 on success, negative errno on error
+ */
+int uart_buf_open(int (*rx_sink)(const uint8_t *data, size_t len,
+                                 uint8_t flags),
+                  void (*tx_done)(size_t len))
+{
+    irqstate_t flags;
+    int ret;
+
+    if (uart_buf.open)
+        return -EBUSY;
+
+    memset(&uart_buf, 0, sizeof(uart_buf));
+
+    uart_buf.dev = device_open(DEVICE_TYPE_UART_HW, 0);
+    if (!uart_buf.dev)
+        return -ENODEV;
+
+    uart_buf.rx_ring = uart_buf_alloc(UART_BUF_RX_RING);
+    uart_buf.tx_ring = uart_buf_alloc(UART_BUF_TX_RING);
+    if (!uart_buf.rx_ring || !uart_buf.tx_ring) {
+        ret = -ENOMEM;
+        goto err;
+    }
+
+    ret = uart_buf_set_config(115200, NO_PARITY, 8, ONE_STOP_BIT, 0);
+    if (ret)
+        goto err;
+
+    ret = uart_buf_set_modem_ctrl(MCR_DTR | MCR_RTS);
+    if (ret)
+        goto err;
+
+    uart_buf.rx_sink = rx_sink;
+    uart_buf.tx_done = tx_done;
+    uart_buf.open = true;
+
+    device_uart_attach_ms_callback(uart_buf.dev, uart_buf_ms_callback);
+
+    flags = irqsave();
+    uart_buf_rx_arm();
+    irqrestore(flags);
+
+    work_queue(HPWORK, &uart_buf.idle_work, uart_buf_idle_worker, NULL,
+               uart_buf.idle_min_ticks);
+
+    return 0;
+
+err:
+    if (uart_buf.rx_ring)
+        uart_buf_free(uart_buf.rx_ring);
+    if (uart_buf.tx_ring)
+        uart_buf_free(uart_buf.tx_ring);
+    device_close(uart_buf.dev);
+    return ret;
+}
+
+/**
+ * @brief Stop the data path and close the UART
+ */
+void uart_buf_close(void)
+{
+    if (!uart_buf.open)
+        return;
+
+    uart_buf.open = false;
+
+    work_cancel(HPWORK, &uart_buf.idle_work);
+    device_uart_attach_ms_callback(uart_buf.dev, NULL);
+    device_uart_stop_receiver(uart_buf.dev);
+    device_uart_stop_transmitter(uart_buf.dev);
+    work_cancel(HPWORK, &uart_buf.work);
+
+    uart_buf_free(uart_buf.rx_ring);
+    uart_buf_free(uart_buf.tx_ring);
+    device_close(uart_buf.dev);
+}
@@ -0,0 +1,427 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Greybus UART protocol for the UART module, on top of the buffered data
+ * path in uart_buf.c.
+ *
+ * Received data goes to the AP in RECEIVE_DATA requests of up to
+ * UART_BUF_BATCH bytes, instead of one request per driver completion.
+ * Transmit data from SEND_DATA requests is queued in the transmit ring and
+ * its space is returned to the AP with RECEIVE_CREDITS once sent.  Modem
+ * status changes go to the AP in SERIAL_STATE requests.
+ *
+ * This replaces the NuttX Greybus UART PHY (CONFIG_GREYBUS_UART_PHY), which
+ * must be disabled in the module configuration.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <nuttx/device.h>
+#include <nuttx/device_uart.h>
+#include <nuttx/greybus/greybus.h>
+#include <nuttx/greybus/types.h>
+#include <nuttx/util.h>
+
+#include <arch/irq.h>
+
+#define GB_UART_VERSION_MAJOR               0
+#define GB_UART_VERSION_MINOR               1
+
+/* Greybus UART operation types */
+#define GB_UART_TYPE_PROTOCOL_VERSION       0x01
+#define GB_UART_TYPE_SEND_DATA              0x02
+#define GB_UART_TYPE_RECEIVE_DATA           0x03
+#define GB_UART_TYPE_SET_LINE_CODING        0x04
+#define GB_UART_TYPE_SET_CONTROL_LINE_STATE 0x05
+#define GB_UART_TYPE_SEND_BREAK             0x06
+#define GB_UART_TYPE_SERIAL_STATE           0x07
+#define GB_UART_TYPE_RECEIVE_CREDITS        0x08
+#define GB_UART_TYPE_FLUSH_FIFOS            0x09
+
+#define GB_UART_RECV_FLAG_FRAMING           0x01
+#define GB_UART_RECV_FLAG_PARITY            0x02
+#define GB_UART_RECV_FLAG_OVERRUN           0x04
+#define GB_UART_RECV_FLAG_BREAK             0x08
+
+#define GB_UART_CTRL_DTR                    0x01
+#define GB_UART_CTRL_RTS                    0x02
+
+/* SERIAL_STATE control bits */
+#define GB_UART_CTRL_DCD                    0x01
+#define GB_UART_CTRL_DSR                    0x02
+#define GB_UART_CTRL_RI                     0x04
+
+#define GB_SERIAL_AUTO_RTSCTS_EN            0x01
+
+#define GB_SERIAL_FLAG_FLUSH_TRANSMITTER    0x01
+#define GB_SERIAL_FLAG_FLUSH_RECEIVER       0x02
+
+/* Credits granted to the AP for SEND_DATA: the transmit ring size */
+#define GB_UART_TX_CREDITS                  4096
+
+/* Return credits once this many have piled up, or when the ring drains */
+#define GB_UART_CREDIT_BATCH                256
+
+struct gb_uart_proto_version_response {
+    __u8 major;
+    __u8 minor;
+} __packed;
+
+struct gb_uart_send_data_request {
+    __le16 size;
+    __u8 data[0];
+} __packed;
+
+struct gb_uart_recv_data_request {
+    __le16 size;
+    __u8 flags;
+    __u8 data[0];
+} __packed;
+
+struct gb_uart_receive_credits_request {
+    __le16 count;
+} __packed;
+
+struct gb_uart_set_line_coding_request {
+    __le32 rate;
+    __u8 format;
+    __u8 parity;
+    __u8 data_bits;
+    __u8 flow_control;
+} __packed;
+
+struct gb_uart_set_control_line_state_request {
+    __u8 control;
+} __packed;
+
+struct gb_uart_set_break_request {
+    __u8 state;
+} __packed;
+
+struct gb_uart_serial_flush_request {
+    __u8 flags;
+} __packed;
+
+struct gb_uart_serial_state_request {
+    __u8 control;
+} __packed;
+
+int uart_buf_open(int (*rx_sink)(const uint8_t *data, size_t len,
+                                 uint8_t flags),
+                  void (*tx_done)(size_t len));
+void uart_buf_close(void);
+void uart_buf_flush(bool rx, bool tx);
+void uart_buf_set_ms_callback(void (*ms_change)(uint8_t msr));
+size_t uart_buf_write(const uint8_t *data, size_t len);
+size_t uart_buf_write_space(void);
+int uart_buf_set_config(int baud, int parity, int databits, int stopbits,
+                        int flow);
+int uart_buf_set_modem_ctrl(uint8_t mcr);
+struct device *uart_buf_device(void);
+void uart_buf_report(void);
+
+static unsigned int uart_gb_cport;
+static uint32_t uart_gb_credits;
+
+/**
+ * @brief Translate line status bits into RECEIVE_DATA flags
+ */
+static uint8_t uart_gb_recv_flags(uint8_t lsr)
+{
+    uint8_t flags = 0;
+
+    if (lsr & LSR_FE)
+        flags |= GB_UART_RECV_FLAG_FRAMING;
+    if (lsr & LSR_PE)
+        flags |= GB_UART_RECV_FLAG_PARITY;
+    if (lsr & LSR_OE)
+        flags |= GB_UART_RECV_FLAG_OVERRUN;
+    if (lsr & LSR_BI)
+        flags |= GB_UART_RECV_FLAG_BREAK;
+
+    return flags;
+}
+
+/**
+ * @brief Send a batch of received data to the AP
+ */
+static int uart_gb_rx_sink(const uint8_t *data, size_t len, uint8_t lsr)
+{
+    struct gb_uart_recv_data_request *req;
+    struct gb_operation *op;
+    int ret;
+
+    op = gb_operation_create(uart_gb_cport, GB_UART_TYPE_RECEIVE_DATA,
+                             sizeof(*req) + len);
+    if (!op)
+        return -ENOMEM;
+
+    req = gb_operation_get_request_payload(op);
+    req->size = cpu_to_le16(len);
+    req->flags = uart_gb_recv_flags(lsr);
+    memcpy(req->data, data, len);
+
+    ret = gb_operation_send_request(op, NULL, false);
+    gb_operation_destroy(op);
+
+    return ret;
+}
+
+/**
+ * @brief Return transmit ring space to the AP
+ */
+static void uart_gb_tx_done(size_t len)
+{
+    struct gb_uart_receive_credits_request *req;
+    struct gb_operation *op;
+
+    uart_gb_credits += len;
+
+    if (uart_gb_credits < GB_UART_CREDIT_BATCH &&
+        uart_buf_write_space() < GB_UART_TX_CREDITS)
+        return;
+
+    op = gb_operation_create(uart_gb_cport, GB_UART_TYPE_RECEIVE_CREDITS,
+                             sizeof(*req));
+    if (!op)
+        return;
+
+    req = gb_operation_get_request_payload(op);
+    req->count = cpu_to_le16(uart_gb_credits);
+
+    if (!gb_operation_send_request(op, NULL, false))
+        uart_gb_credits = 0;
+
+    gb_operation_destroy(op);
+}
+
+/**
+ * @brief Report a modem status change to the AP
+ *
+ * The protocol has no CTS bit: a CTS change still sends the current state
+ * of the other lines, and the transmitter itself follows CTS when hardware
+ * flow control is on.
+ */
+static void uart_gb_ms_change(uint8_t msr)
+{
+    struct gb_uart_serial_state_request *req;
+    struct gb_operation *op;
+    uint8_t control = 0;
+
+    if (msr & MSR_DCD)
+        control |= GB_UART_CTRL_DCD;
+    if (msr & MSR_DSR)
+        control |= GB_UART_CTRL_DSR;
+    if (msr & MSR_RI)
+        control |= GB_UART_CTRL_RI;
+
+    op = gb_operation_create(uart_gb_cport, GB_UART_TYPE_SERIAL_STATE,
+                             sizeof(*req));
+    if (!op)
+        return;
+
+    req = gb_operation_get_request_payload(op);
+    req->control = control;
+    gb_operation_send_request(op, NULL, false);
+    gb_operation_destroy(op);
+}
+
+static uint8_t uart_gb_protocol_version(struct gb_operation *operation)
+{
+    struct gb_uart_proto_version_response *response;
+
+    response = gb_operation_alloc_response(operation, sizeof(*response));
+    if (!response)
+        return GB_OP_NO_MEMORY;
+
+    response->major = GB_UART_VERSION_MAJOR;
+    response->minor = GB_UART_VERSION_MINOR;
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t uart_gb_send_data(struct gb_operation *operation)
+{
+    struct gb_uart_send_data_request *req =
+        gb_operation_get_request_payload(operation);
+    uint16_t size;
+
+    if (gb_operation_get_request_payload_size(operation) < sizeof(*req))
+        return GB_OP_INVALID;
+
+    size = le16_to_cpu(req->size);
+    if (gb_operation_get_request_payload_size(operation) <
+        sizeof(*req) + size)
+        return GB_OP_INVALID;
+
+    /* The AP never has more credits than the ring has space */
+    if (uart_buf_write(req->data, size) != size)
+        return GB_OP_NO_MEMORY;
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t uart_gb_set_line_coding(struct gb_operation *operation)
+{
+    struct gb_uart_set_line_coding_request *req =
+        gb_operation_get_request_payload(operation);
+
+    if (gb_operation_get_request_payload_size(operation) < sizeof(*req))
+        return GB_OP_INVALID;
+
+    if (uart_buf_set_config(le32_to_cpu(req->rate), req->parity,
+                            req->data_bits, req->format,
+                            req->flow_control & GB_SERIAL_AUTO_RTSCTS_EN))
+        return GB_OP_INVALID;
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t uart_gb_set_control_line_state(struct gb_operation *operation)
+{
+    struct gb_uart_set_control_line_state_request *req =
+        gb_operation_get_request_payload(operation);
+    uint8_t mcr = 0;
+
+    if (gb_operation_get_request_payload_size(operation) < sizeof(*req))
+        return GB_OP_INVALID;
+
+    if (req->control & GB_UART_CTRL_DTR)
+        mcr |= MCR_DTR;
+    if (req->control & GB_UART_CTRL_RTS)
+        mcr |= MCR_RTS;
+
+    if (uart_buf_set_modem_ctrl(mcr))
+        return GB_OP_UNKNOWN_ERROR;
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t uart_gb_send_break(struct gb_operation *operation)
+{
+    struct gb_uart_set_break_request *req =
+        gb_operation_get_request_payload(operation);
+
+    if (gb_operation_get_request_payload_size(operation) < sizeof(*req))
+        return GB_OP_INVALID;
+
+    if (device_uart_set_break(uart_buf_device(), !!req->state))
+        return GB_OP_UNKNOWN_ERROR;
+
+    return GB_OP_SUCCESS;
+}
+
+static uint8_t uart_gb_flush_fifos(struct gb_operation *operation)
+{
+    struct gb_uart_serial_flush_request *req =
+        gb_operation_get_request_payload(operation);
+
+    if (gb_operation_get_request_payload_size(operation) < sizeof(*req))
+        return GB_OP_INVALID;
+
+    /* Dropped transmit data comes back to the AP as credits */
+    uart_buf_flush(req->flags & GB_SERIAL_FLAG_FLUSH_RECEIVER,
+                   req->flags & GB_SERIAL_FLAG_FLUSH_TRANSMITTER);
+
+    return GB_OP_SUCCESS;
+}
+
+static int uart_gb_init(unsigned int cport, struct gb_bundle *bundle)
+{
+    uart_gb_cport = cport;
+    return 0;
+}
+
+static void uart_gb_connected(unsigned int cport)
+{
+    struct gb_uart_receive_credits_request *req;
+    struct gb_operation *op;
+    int ret;
+
+    ret = uart_buf_open(uart_gb_rx_sink, uart_gb_tx_done);
+    if (ret) {
+        lowsyslog("uart_gb: cannot open UART: %d\n", ret);
+        return;
+    }
+
+    uart_gb_credits = 0;
+    uart_buf_set_ms_callback(uart_gb_ms_change);
+
+    /* Hand the whole transmit ring to the AP */
+    op = gb_operation_create(cport, GB_UART_TYPE_RECEIVE_CREDITS,
+                             sizeof(*req));
+    if (!op)
+        return;
+
+    req = gb_operation_get_request_payload(op);
+    req->count = cpu_to_le16(GB_UART_TX_CREDITS);
+    gb_operation_send_request(op, NULL, false);
+    gb_operation_destroy(op);
+}
+
+static void uart_gb_disconnected(unsigned int cport)
+{
+    uart_buf_report();
+    uart_buf_close();
+}
+
+static struct gb_operation_handler uart_gb_handlers[] = {
+    GB_HANDLER(GB_UART_TYPE_PROTOCOL_VERSION, uart_gb_protocol_version),
+    GB_HANDLER(GB_UART_TYPE_SEND_DATA, uart_gb_send_data),
+    GB_HANDLER(GB_UART_TYPE_SET_LINE_CODING, uart_gb_set_line_coding),
+    GB_HANDLER(GB_UART_TYPE_SET_CONTROL_LINE_STATE,
+               uart_gb_set_control_line_state),
+    GB_HANDLER(GB_UART_TYPE_SEND_BREAK, uart_gb_send_break),
+    GB_HANDLER(GB_UART_TYPE_FLUSH_FIFOS, uart_gb_flush_fifos),
+};
+
+static struct gb_driver uart_gb_driver = {
+    .init = uart_gb_init,
+    .connected = uart_gb_connected,
+    .disconnected = uart_gb_disconnected,
+    .op_handlers = uart_gb_handlers,
+    .op_handlers_count = ARRAY_SIZE(uart_gb_handlers),
+};
+
+/**
+ * @brief Register the UART protocol on a CPort
+ *
+ * @param cport CPort of the UART protocol in the manifest
+ * @param bundle Bundle of the CPort
+ * @return 0 on success, negative errno on error
+ */
+int uart_gb_register(unsigned int cport, unsigned int bundle)
+{
+    return gb_register_driver(cport, bundle, &uart_gb_driver);
+}
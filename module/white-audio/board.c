@@ -30,6 +30,7 @@
 
 #include <syslog.h>
 #include <errno.h>
+#include <sched.h>
 #include <nuttx/util.h>
 #include <nuttx/device.h>
 #include <nuttx/device_table.h>
@@ -38,7 +39,28 @@
 #include <nuttx/ara/audio_board.h>
 
 extern struct device_driver audio_board_driver;
-extern struct device_driver rt5647_codec;
+extern int codec_pm_register(void);
+
+/*
+ * Uncomment to run the sample-rate converter benchmark on the console at
+ * boot.
+ */
+/* #define WHITE_AUDIO_SRC_BENCH */
+
+/*
+ * Uncomment to measure the round-trip latency through I2S and the codec at
+ * boot.  Needs the headset output looped back to the microphone input, and
+ * keeps the audio bundle busy until the measurement completes.
+ */
+/* #define WHITE_AUDIO_LATENCY */
+
+#ifdef WHITE_AUDIO_SRC_BENCH
+extern int resampler_bench_main(int argc, char *argv[]);
+#endif
+
+#ifdef WHITE_AUDIO_LATENCY
+extern int audio_latency_main(int argc, char *argv[]);
+#endif
 
 static struct audio_board_dai white_audio_dais_bundle_0[] = {
     {
@@ -104,5 +126,17 @@ void ara_module_init(void)
     device_table_register(&white_audio_device_table);
 
     device_register_driver(&audio_board_driver);
-    device_register_driver(&rt5647_codec);
+
+    /* rt5647 driver, wrapped with autosuspend and fast resume */
+    codec_pm_register();
+
+#ifdef WHITE_AUDIO_SRC_BENCH
+    task_create("src_bench", SCHED_PRIORITY_DEFAULT, 2048,
+                resampler_bench_main, NULL);
+#endif
+
+#ifdef WHITE_AUDIO_LATENCY
+    task_create("audio_latency", SCHED_PRIORITY_DEFAULT, 2048,
+                audio_latency_main, NULL);
+#endif
 }
@@ -0,0 +1,662 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Runtime power management for the white-audio RT5647 codec.
+ *
+ * The NuttX rt5647 driver powers the codec up when the device is opened and
+ * leaves it up until it is closed.  This file wraps that driver: all of its
+ * operations are passed through unchanged, while the stream start and stop
+ * hooks drive a small power state machine:
+ *
+ *  ACTIVE   fully powered, as left by the driver
+ *  STANDBY  power-control registers cleared, the rest of the register file
+ *           kept by the codec and mirrored in a cache on the bridge
+ *  OFF      codec reset; only the cache still holds its configuration
+ *
+ * With no stream running, the codec drops to STANDBY after
+ * CODEC_PM_AUTOSUSPEND_MS and to OFF after a further CODEC_PM_OFF_MS.
+ * Starting a stream resumes it: from STANDBY by restoring the power
+ * registers, from OFF by replaying the cache first.  Either way this is a
+ * few dozen I2C writes, against the full cold initialization sequence of
+ * the driver and its pop-suppression delays.
+ *
+ * Configuration operations landing while the codec is OFF bring it back to
+ * STANDBY first, so that their register writes are not lost to the reset.
+ * Since they reach the codec directly, the cache is read again just before
+ * each reset, and any power bits they set in STANDBY are kept for the next
+ * power-up.  Widget operations change the power registers themselves and
+ * therefore resume the codec to ACTIVE.
+ */
+
+#include <errno.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <nuttx/clock.h>
+#include <nuttx/device.h>
+#include <nuttx/device_codec.h>
+#include <nuttx/device_i2c.h>
+#include <nuttx/util.h>
+#include <nuttx/wqueue.h>
+
+#define CODEC_PM_AUTOSUSPEND_MS     2000
+#define CODEC_PM_OFF_MS             60000
+
+/* VREF settling time after the analog power bits come back */
+#define CODEC_PM_VREF_SETTLE_US     10000
+
+#define CODEC_PM_I2C_BUS            0
+
+/* RT5647 registers */
+#define RT5647_RESET                0x00
+#define RT5647_PWR_DIG1             0x61
+#define RT5647_PWR_DIG2             0x62
+#define RT5647_PWR_ANLG1            0x63
+#define RT5647_PWR_ANLG2            0x64
+#define RT5647_PWR_MIXER            0x65
+#define RT5647_PWR_VOL              0x66
+
+enum codec_pm_state {
+    CODEC_PM_OFF,
+    CODEC_PM_STANDBY,
+    CODEC_PM_ACTIVE,
+};
+
+/**
+ * @brief Range of codec registers saved in the cache
+ */
+struct codec_pm_range {
+    uint8_t first;
+    uint8_t last;
+};
+
+/*
+ * Configuration registers replayed after a reset: volumes, mixers, digital
+ * interfaces, clocking, PLL, de-pop, EQ/ALC and GPIO setup.  Status,
+ * interrupt and ID registers are left out, and so are the power-control
+ * registers, which have their own save/restore sequence.
+ */
+static const struct codec_pm_range codec_pm_ranges[] = {
+    { 0x01, 0x0f },
+    { 0x14, 0x14 },
+    { 0x19, 0x20 },
+    { 0x27, 0x2f },
+    { 0x31, 0x31 },
+    { 0x3b, 0x56 },
+    { 0x70, 0x77 },
+    { 0x80, 0x93 },
+    { 0xb0, 0xb7 },
+    { 0xc0, 0xc2 },
+    { 0xfa, 0xfc },
+};
+
+/* Power-control registers, in power-up order */
+static const uint8_t codec_pm_power_regs[] = {
+    RT5647_PWR_DIG1,
+    RT5647_PWR_DIG2,
+    RT5647_PWR_ANLG1,
+    RT5647_PWR_ANLG2,
+    RT5647_PWR_MIXER,
+    RT5647_PWR_VOL,
+};
+
+#define CODEC_PM_CACHE_SIZE         0x100
+
+/**
+ * @brief Power management state of the codec
+ */
+struct codec_pm_info {
+    struct device *i2c;
+    uint16_t i2c_addr;
+    enum codec_pm_state state;
+    /** Number of running streams (TX and RX on every DAI) */
+    unsigned int streams;
+    /** Whether the register cache holds a valid snapshot */
+    bool cache_valid;
+    sem_t lock;
+    struct work_s work;
+    uint16_t cache[CODEC_PM_CACHE_SIZE];
+    uint16_t power[ARRAY_SIZE(codec_pm_power_regs)];
+};
+
+extern struct device_driver rt5647_codec;
+
+static struct codec_pm_info codec_pm_info;
+static struct device_codec_type_ops codec_pm_type_ops;
+static struct device_driver_ops codec_pm_driver_ops;
+
+static const struct device_codec_type_ops *codec_ops;
+
+static void codec_pm_work(void *arg);
+
+static int codec_pm_read(struct codec_pm_info *info, uint8_t reg,
+                         uint16_t *value)
+{
+    uint8_t buf[2];
+    struct device_i2c_request msg[] = {
+        {
+            .addr = info->i2c_addr,
+            .flags = 0,
+            .buffer = &reg,
+            .length = 1,
+        }, {
+            .addr = info->i2c_addr,
+            .flags = I2C_FLAG_READ,
+            .buffer = buf,
+            .length = 2,
+        },
+    };
+    int ret;
+
+    ret = device_i2c_transfer(info->i2c, msg, ARRAY_SIZE(msg));
+    if (ret)
+        return -EIO;
+
+    *value = (buf[0] << 8) | buf[1];
+    return 0;
+}
+
+static int codec_pm_write(struct codec_pm_info *info, uint8_t reg,
+                          uint16_t value)
+{
+    uint8_t buf[3] = { reg, value >> 8, value & 0xff };
+    struct device_i2c_request msg[] = {
+        {
+            .addr = info->i2c_addr,
+            .flags = 0,
+            .buffer = buf,
+            .length = 3,
+        },
+    };
+
+    return device_i2c_transfer(info->i2c, msg, 1) ? -EIO : 0;
+}
+
+/**
+ * @brief Re-arm or cancel the autosuspend timer for the current state
+ */
+static void codec_pm_schedule(struct codec_pm_info *info)
+{
+    work_cancel(HPWORK, &info->work);
+
+    if (info->streams)
+        return;
+
+    if (info->state == CODEC_PM_ACTIVE) {
+        work_queue(HPWORK, &info->work, codec_pm_work, info,
+                   MSEC2TICK(CODEC_PM_AUTOSUSPEND_MS));
+    } else if (info->state == CODEC_PM_STANDBY) {
+        work_queue(HPWORK, &info->work, codec_pm_work, info,
+                   MSEC2TICK(CODEC_PM_OFF_MS));
+    }
+}
+
+/**
+ * @brief Read the configuration registers into the cache
+ */
+static int codec_pm_snapshot(struct codec_pm_info *info)
+{
+    const struct codec_pm_range *range;
+    unsigned int reg;
+    int ret;
+
+    info->cache_valid = false;
+
+    for (range = codec_pm_ranges;
+         range < codec_pm_ranges + ARRAY_SIZE(codec_pm_ranges); range++) {
+        for (reg = range->first; reg <= range->last; reg++) {
+            ret = codec_pm_read(info, reg, &info->cache[reg]);
+            if (ret)
+                return ret;
+        }
+    }
+
+    info->cache_valid = true;
+    return 0;
+}
+
+/**
+ * @brief Add the power bits set since STANDBY to the saved ones
+ *
+ * Configuration operations run in STANDBY and may power up blocks they
+ * need, such as the PLL.  Those bits are merged into the saved power state
+ * so that neither the reset nor the next power-up drops them.
+ */
+static int codec_pm_merge_power(struct codec_pm_info *info)
+{
+    uint16_t value;
+    int i;
+    int ret;
+
+    for (i = 0; i < ARRAY_SIZE(codec_pm_power_regs); i++) {
+        ret = codec_pm_read(info, codec_pm_power_regs[i], &value);
+        if (ret)
+            return ret;
+        info->power[i] |= value;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Clear the power-control registers, outputs first
+ */
+static int codec_pm_power_down(struct codec_pm_info *info)
+{
+    int i;
+    int ret;
+
+    /* Outputs first, digital core last */
+    for (i = ARRAY_SIZE(codec_pm_power_regs) - 1; i >= 0; i--) {
+        ret = codec_pm_write(info, codec_pm_power_regs[i], 0);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief ACTIVE -> STANDBY: snapshot the registers and cut the power bits
+ */
+static int codec_pm_suspend(struct codec_pm_info *info)
+{
+    int i;
+    int ret;
+
+    for (i = 0; i < ARRAY_SIZE(codec_pm_power_regs); i++) {
+        ret = codec_pm_read(info, codec_pm_power_regs[i], &info->power[i]);
+        if (ret)
+            return ret;
+    }
+
+    ret = codec_pm_snapshot(info);
+    if (ret)
+        return ret;
+
+    ret = codec_pm_power_down(info);
+    if (ret)
+        return ret;
+
+    info->state = CODEC_PM_STANDBY;
+    return 0;
+}
+
+/**
+ * @brief STANDBY -> OFF: reset the codec, the cache keeps its setup
+ *
+ * Configuration operations may have written to the codec since the last
+ * snapshot, so the cache and the power bits are refreshed first.
+ */
+static int codec_pm_power_off(struct codec_pm_info *info)
+{
+    int ret;
+
+    ret = codec_pm_merge_power(info);
+    if (ret)
+        return ret;
+
+    ret = codec_pm_snapshot(info);
+    if (ret)
+        return ret;
+
+    ret = codec_pm_write(info, RT5647_RESET, 0);
+    if (ret)
+        return ret;
+
+    info->state = CODEC_PM_OFF;
+    return 0;
+}
+
+/**
+ * @brief OFF -> STANDBY: replay the cached configuration
+ *
+ * The power-control registers are cleared afterwards, whatever their reset
+ * values, so that STANDBY looks the same whichever way it is entered.
+ */
+static int codec_pm_restore(struct codec_pm_info *info)
+{
+    const struct codec_pm_range *range;
+    unsigned int reg;
+    int ret;
+
+    if (!info->cache_valid)
+        return -ENODATA;
+
+    for (range = codec_pm_ranges;
+         range < codec_pm_ranges + ARRAY_SIZE(codec_pm_ranges); range++) {
+        for (reg = range->first; reg <= range->last; reg++) {
+            ret = codec_pm_write(info, reg, info->cache[reg]);
+            if (ret)
+                return ret;
+        }
+    }
+
+    ret = codec_pm_power_down(info);
+    if (ret)
+        return ret;
+
+    info->state = CODEC_PM_STANDBY;
+    return 0;
+}
+
+/**
+ * @brief STANDBY -> ACTIVE: restore the power bits in power-up order
+ */
+static int codec_pm_power_on(struct codec_pm_info *info)
+{
+    int i;
+    int ret;
+
+    ret = codec_pm_merge_power(info);
+    if (ret)
+        return ret;
+
+    for (i = 0; i < ARRAY_SIZE(codec_pm_power_regs); i++) {
+        ret = codec_pm_write(info, codec_pm_power_regs[i], info->power[i]);
+        if (ret)
+            return ret;
+
+        /* Let VREF settle before the output stages come up */
+        if (codec_pm_power_regs[i] == RT5647_PWR_ANLG1)
+            usleep(CODEC_PM_VREF_SETTLE_US);
+    }
+
+    info->state = CODEC_PM_ACTIVE;
+    return 0;
+}
+
+/**
+ * @brief Bring the codec up to at least the given state
+ *
+ * Must be called with the lock held.
+ */
+static int codec_pm_resume(struct codec_pm_info *info,
+                           enum codec_pm_state state)
+{
+    int ret = 0;
+
+    if (info->state == CODEC_PM_OFF && state >= CODEC_PM_STANDBY) {
+        ret = codec_pm_restore(info);
+        if (ret)
+            goto out;
+    }
+
+    if (info->state == CODEC_PM_STANDBY && state == CODEC_PM_ACTIVE)
+        ret = codec_pm_power_on(info);
+
+out:
+    if (ret)
+        lowsyslog("codec_pm: resume failed: %d\n", ret);
+    codec_pm_schedule(info);
+    return ret;
+}
+
+static void codec_pm_work(void *arg)
+{
+    struct codec_pm_info *info = arg;
+    int ret = 0;
+
+    while (sem_wait(&info->lock) < 0);
+
+    if (info->streams)
+        goto out;
+
+    if (info->state == CODEC_PM_ACTIVE) {
+        ret = codec_pm_suspend(info);
+        if (ret)
+            info->cache_valid = false;
+    } else if (info->state == CODEC_PM_STANDBY) {
+        ret = codec_pm_power_off(info);
+    }
+
+    if (ret) {
+        /* Leave the timer disarmed, the next stream start retries */
+        lowsyslog("codec_pm: suspend failed: %d\n", ret);
+        goto out;
+    }
+
+    codec_pm_schedule(info);
+
+out:
+    sem_post(&info->lock);
+}
+
+/**
+ * @brief Resume before a configuration or widget operation
+ */
+static int codec_pm_get(enum codec_pm_state state)
+{
+    struct codec_pm_info *info = &codec_pm_info;
+    int ret;
+
+    while (sem_wait(&info->lock) < 0);
+    ret = codec_pm_resume(info, state);
+    sem_post(&info->lock);
+
+    return ret;
+}
+
+/**
+ * @brief Account a stream start or stop
+ *
+ * @param start true for a start, false for a stop
+ * @param ret Result of the wrapped operation
+ */
+static int codec_pm_stream(bool start, int ret)
+{
+    struct codec_pm_info *info = &codec_pm_info;
+
+    if (ret)
+        return ret;
+
+    while (sem_wait(&info->lock) < 0);
+    if (start) {
+        info->streams++;
+    } else if (info->streams) {
+        info->streams--;
+    }
+    codec_pm_schedule(info);
+    sem_post(&info->lock);
+
+    return 0;
+}
+
+static int codec_pm_set_config(struct device *dev, unsigned int dai_idx,
+                               uint8_t clk_role, struct device_codec_pcm *pcm,
+                               struct device_codec_dai *dai)
+{
+    int ret = codec_pm_get(CODEC_PM_STANDBY);
+
+    if (ret)
+        return ret;
+
+    return codec_ops->set_config(dev, dai_idx, clk_role, pcm, dai);
+}
+
+static int codec_pm_set_control(struct device *dev, uint8_t control_id,
+                                uint8_t index,
+                                struct gb_audio_ctl_elem_value *value)
+{
+    int ret = codec_pm_get(CODEC_PM_STANDBY);
+
+    if (ret)
+        return ret;
+
+    return codec_ops->set_control(dev, control_id, index, value);
+}
+
+static int codec_pm_enable_widget(struct device *dev, uint8_t widget_id)
+{
+    int ret = codec_pm_get(CODEC_PM_ACTIVE);
+
+    if (ret)
+        return ret;
+
+    return codec_ops->enable_widget(dev, widget_id);
+}
+
+static int codec_pm_disable_widget(struct device *dev, uint8_t widget_id)
+{
+    int ret = codec_pm_get(CODEC_PM_ACTIVE);
+
+    if (ret)
+        return ret;
+
+    return codec_ops->disable_widget(dev, widget_id);
+}
+
+static int codec_pm_start_tx(struct device *dev, uint32_t dai_idx)
+{
+    int ret = codec_pm_get(CODEC_PM_ACTIVE);
+
+    if (ret)
+        return ret;
+
+    return codec_pm_stream(true, codec_ops->start_tx(dev, dai_idx));
+}
+
+static int codec_pm_stop_tx(struct device *dev, uint32_t dai_idx)
+{
+    return codec_pm_stream(false, codec_ops->stop_tx(dev, dai_idx));
+}
+
+static int codec_pm_start_rx(struct device *dev, uint32_t dai_idx)
+{
+    int ret = codec_pm_get(CODEC_PM_ACTIVE);
+
+    if (ret)
+        return ret;
+
+    return codec_pm_stream(true, codec_ops->start_rx(dev, dai_idx));
+}
+
+static int codec_pm_stop_rx(struct device *dev, uint32_t dai_idx)
+{
+    return codec_pm_stream(false, codec_ops->stop_rx(dev, dai_idx));
+}
+
+static int codec_pm_open(struct device *dev)
+{
+    struct codec_pm_info *info = &codec_pm_info;
+    struct device_resource *r;
+    int ret;
+
+    r = device_resource_get_by_name(dev, DEVICE_RESOURCE_TYPE_I2C_ADDR,
+                                    "rt5647_i2c_addr");
+    if (!r)
+        return -EINVAL;
+
+    info->i2c = device_open(DEVICE_TYPE_I2C_HW, CODEC_PM_I2C_BUS);
+    if (!info->i2c)
+        return -EIO;
+
+    info->i2c_addr = r->start;
+
+    ret = rt5647_codec.ops->open(dev);
+    if (ret) {
+        device_close(info->i2c);
+        return ret;
+    }
+
+    while (sem_wait(&info->lock) < 0);
+    info->state = CODEC_PM_ACTIVE;
+    info->streams = 0;
+    info->cache_valid = false;
+    codec_pm_schedule(info);
+    sem_post(&info->lock);
+
+    return 0;
+}
+
+static void codec_pm_close(struct device *dev)
+{
+    struct codec_pm_info *info = &codec_pm_info;
+
+    while (sem_wait(&info->lock) < 0);
+
+    /* Give the driver back the codec in the state it left it in */
+    if (info->state != CODEC_PM_ACTIVE)
+        codec_pm_resume(info, CODEC_PM_ACTIVE);
+    work_cancel(HPWORK, &info->work);
+    info->state = CODEC_PM_OFF;
+    info->cache_valid = false;
+    sem_post(&info->lock);
+
+    rt5647_codec.ops->close(dev);
+    device_close(info->i2c);
+}
+
+/**
+ * @brief Power-managed RT5647 driver
+ *
+ * Registered in place of rt5647_codec.  Operations that are not wrapped
+ * are taken from the NuttX driver as they are.
+ */
+struct device_driver rt5647_codec_pm = {
+    .type   = DEVICE_TYPE_CODEC_HW,
+    .ops    = &codec_pm_driver_ops,
+};
+
+/**
+ * @brief Build the wrapped driver and register it
+ *
+ * @return 0 on success, negative errno on error
+ */
+int codec_pm_register(void)
+{
+    codec_ops = rt5647_codec.ops->type_ops;
+
+    codec_pm_type_ops = *codec_ops;
+    codec_pm_type_ops.set_config = codec_pm_set_config;
+    codec_pm_type_ops.set_control = codec_pm_set_control;
+    codec_pm_type_ops.enable_widget = codec_pm_enable_widget;
+    codec_pm_type_ops.disable_widget = codec_pm_disable_widget;
+    codec_pm_type_ops.start_tx = codec_pm_start_tx;
+    codec_pm_type_ops.stop_tx = codec_pm_stop_tx;
+    codec_pm_type_ops.start_rx = codec_pm_start_rx;
+    codec_pm_type_ops.stop_rx = codec_pm_stop_rx;
+
+    codec_pm_driver_ops = *rt5647_codec.ops;
+    codec_pm_driver_ops.open = codec_pm_open;
+    codec_pm_driver_ops.close = codec_pm_close;
+    codec_pm_driver_ops.type_ops = &codec_pm_type_ops;
+
+    rt5647_codec_pm.name = rt5647_codec.name;
+    rt5647_codec_pm.desc = rt5647_codec.desc;
+
+    sem_init(&codec_pm_info.lock, 0, 1);
+    codec_pm_info.state = CODEC_PM_OFF;
+
+    return device_register_driver(&rt5647_codec_pm);
+}
@@ -0,0 +1,218 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Clock drift compensation for the white-audio playback path.
+ *
+ * The AP produces samples on its own clock while the codec consumes them on
+ * the I2S clock, so a buffer between the two slowly fills up or drains at a
+ * rate set by the clock mismatch, typically tens of ppm.  The controller
+ * below watches the buffer fill level and trims the sample-rate converter
+ * ratio so that the converter consumes input exactly as fast as it arrives,
+ * which holds the fill level on its target and lets the buffer stay small.
+ *
+ * The fill level is low-pass filtered to remove the saw-tooth that packet
+ * delivery adds, then fed to a critically damped PI controller.  In steady
+ * state the integral term equals the clock mismatch, which is reported as
+ * the drift estimate.
+ *
+ * Nothing here depends on NuttX beyond zalloc(): the controller is fed
+ * buffer levels and frame counts, so it runs unchanged against a simulated
+ * stream.  The module itself has no caller yet, as the Greybus audio data
+ * path lives in NuttX, so it is not in the module build: host/audio_host.c
+ * drives it from a simulated stream.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <nuttx/kmalloc.h>
+
+/* Fill level filter: EMA with a weight of 1 / 2^DRIFT_FILTER_SHIFT */
+#define DRIFT_FILTER_SHIFT      4
+
+/*
+ * Controller gains.  A fill error of one frame corrects the ratio by
+ * DRIFT_KP ppb, giving a time constant of 1 / (KP * rate) ~= 10 s at
+ * 48 kHz.  KI = KP^2 * rate / 4 makes the loop critically damped; it is
+ * expressed per second of integrated error.
+ */
+#define DRIFT_KP_PPB            2000
+#define DRIFT_KI_PPB            48
+
+struct resampler;
+
+void resampler_set_trim(struct resampler *rs, int32_t trim_ppb);
+
+/**
+ * @brief Drift controller state
+ */
+struct drift_ctl {
+    /** Converter whose ratio is trimmed, may be NULL */
+    struct resampler *rs;
+    /** Nominal input rate, in Hz */
+    uint32_t rate;
+    /** Fill level to hold, in Q8 frames */
+    int32_t target_q8;
+    /** Filtered fill level, in Q8 frames */
+    int32_t fill_q8;
+    /** Integrated fill error, in Q8 frame-frames */
+    int64_t integ_q8;
+    /** Trim currently applied and its bound, in ppb */
+    int32_t trim_ppb;
+    int32_t max_ppb;
+    /** Drift estimate (integral term), in ppb */
+    int32_t drift_ppb;
+    /** Number of updates since the last reset */
+    uint32_t updates;
+};
+
+/**
+ * @brief Restart the estimation, e.g. after an xrun or a stream restart
+ *
+ * The last drift estimate is kept as a starting point: the clocks are
+ * still the same ones.
+ *
+ * @param dc Drift controller
+ */
+void drift_reset(struct drift_ctl *dc)
+{
+    dc->fill_q8 = dc->target_q8;
+    dc->updates = 0;
+
+    /* Preload the integrator with the current estimate */
+    dc->integ_q8 = ((int64_t)dc->drift_ppb * dc->rate << 8) / DRIFT_KI_PPB;
+}
+
+/**
+ * @brief Allocate a drift controller
+ *
+ * @param rs Converter to trim, or NULL to only estimate
+ * @param rate Nominal input rate, in Hz
+ * @param target_fill Buffer level to hold, in frames
+ * @param max_ppm Largest correction applied, in ppm
+ * @return The controller, or NULL on allocation failure
+ */
+struct drift_ctl *drift_alloc(struct resampler *rs, uint32_t rate,
+                              uint32_t target_fill, uint32_t max_ppm)
+{
+    struct drift_ctl *dc;
+
+    if (!rate)
+        return NULL;
+
+    dc = zalloc(sizeof(*dc));
+    if (!dc)
+        return NULL;
+
+    dc->rs = rs;
+    dc->rate = rate;
+    dc->target_q8 = target_fill << 8;
+    dc->max_ppb = max_ppm * 1000;
+    drift_reset(dc);
+
+    return dc;
+}
+
+/**
+ * @brief Release a drift controller
+ *
+ * @param dc Drift controller
+ */
+void drift_free(struct drift_ctl *dc)
+{
+    free(dc);
+}
+
+/**
+ * @brief Feed one buffer level observation
+ *
+ * Call at a regular point of the stream, for instance from the playback
+ * completion callback, with the number of frames buffered ahead of the
+ * converter.
+ *
+ * @param dc Drift controller
+ * @param fill Frames currently buffered, including the frames the converter
+ *             has read ahead (resampler_get_buffered())
+ * @param elapsed Frames consumed since the previous call
+ * @return Trim applied to the converter, in ppb
+ */
+int32_t drift_update(struct drift_ctl *dc, uint32_t fill, uint32_t elapsed)
+{
+    int64_t integ;
+    int32_t err_q8;
+    int32_t prop;
+    int32_t drift;
+    int32_t trim;
+
+    dc->fill_q8 += (((int32_t)fill << 8) - dc->fill_q8) >> DRIFT_FILTER_SHIFT;
+    dc->updates++;
+
+    /* Let the filter settle before acting on it */
+    if (dc->updates < (1 << DRIFT_FILTER_SHIFT))
+        return dc->trim_ppb;
+
+    err_q8 = dc->fill_q8 - dc->target_q8;
+    prop = ((int64_t)DRIFT_KP_PPB * err_q8) >> 8;
+
+    integ = dc->integ_q8 + (int64_t)err_q8 * elapsed;
+    drift = ((int64_t)DRIFT_KI_PPB * integ / dc->rate) >> 8;
+
+    trim = prop + drift;
+    if (trim > dc->max_ppb) {
+        trim = dc->max_ppb;
+    } else if (trim < -dc->max_ppb) {
+        trim = -dc->max_ppb;
+    } else {
+        /*
+         * Only integrate while not saturated, so the loop does not wind up;
+         * the estimate follows the integral that was kept
+         */
+        dc->integ_q8 = integ;
+        dc->drift_ppb = drift;
+    }
+
+    if (trim != dc->trim_ppb) {
+        dc->trim_ppb = trim;
+        if (dc->rs)
+            resampler_set_trim(dc->rs, trim);
+    }
+
+    return trim;
+}
+
+/**
+ * @brief Current estimate of the clock mismatch
+ *
+ * @param dc Drift controller
+ * @return Input clock faster than output clock by this much, in ppb
+ */
+int32_t drift_get_estimate(struct drift_ctl *dc)
+{
+    return dc->drift_ppb;
+}
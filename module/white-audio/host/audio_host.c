@@ -0,0 +1,477 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host build of the white-audio module tools.
+ *
+ * The sample-rate converter, its benchmark and the drift controller are
+ * built unchanged with the stand-in headers in include/, and with the
+ * stand-ins for common/dwt.c below:
+ *
+ *   cc -O2 -Imodule/white-audio/host/include -o audio_host \
+ *      module/white-audio/host/audio_host.c \
+ *      module/white-audio/resampler.c module/white-audio/resampler_bench.c \
+ *      module/white-audio/drift.c -lm
+ *
+ * Usage: audio_host src
+ *        audio_host bench
+ *        audio_host drift [ppm [seconds]]
+ *
+ * "src" converts a two-tone stereo signal for every supported rate pair,
+ * both with the fixed-point converter and with a double precision
+ * reference of the same filter, and fails if they differ by more than
+ * SRC_MIN_SNR_DB.  It also checks that a ratio trim changes the output
+ * rate by the requested amount and that out of range trims are clamped.
+ * "bench" runs the on-module benchmark, timed with the host clock.
+ * "drift" simulates a playback stream whose producer clock runs off by a
+ * given number of ppm (-250, 30 and 100 by default), with the drift
+ * controller trimming the converter from the buffer level.  It fails on an
+ * xrun, if the buffer strays more than DRIFT_MAX_ERROR frames from its
+ * target once settled, or if the drift estimate averaged over the settled
+ * part of the run is more than 1 ppm off.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nuttx/util.h>
+
+/* Filter geometry, as in resampler.c */
+#define SRC_ZERO_CROSSINGS  8
+#define SRC_CUTOFF          0.9
+
+/* Signal: two tones well inside the passband of every pair */
+#define SRC_TONE1_HZ        440.0
+#define SRC_TONE2_HZ        3000.0
+#define SRC_AMPLITUDE       12000.0
+
+#define SRC_SECONDS         1
+#define SRC_BLOCK           100     /* input frames per call */
+
+/* Fixed-point output against the reference, signal to error ratio */
+#define SRC_MIN_SNR_DB      60.0
+
+/* Output frames ignored at each end, where the filter sees silence */
+#define SRC_EDGE            64
+
+/* Drift simulation: 48 kHz stereo, 1 ms packets, 5 ms I2S periods */
+#define DRIFT_RATE          48000
+#define DRIFT_PACKET        48
+#define DRIFT_PERIOD        240
+#define DRIFT_TARGET        480
+#define DRIFT_FIFO          4096
+#define DRIFT_MAX_PPM       500
+#define DRIFT_SECONDS       900
+#define DRIFT_SETTLE_S      300
+#define DRIFT_MAX_ERROR     96
+
+struct resampler;
+
+struct resampler *resampler_alloc(uint32_t in_rate, uint32_t out_rate,
+                                  uint8_t channels);
+void resampler_free(struct resampler *rs);
+void resampler_set_trim(struct resampler *rs, int32_t trim_ppb);
+uint32_t resampler_get_buffered(struct resampler *rs);
+size_t resampler_process(struct resampler *rs, const int16_t *in,
+                         size_t in_frames, size_t *in_used, int16_t *out,
+                         size_t out_frames);
+int resampler_bench_main(int argc, char *argv[]);
+
+struct drift_ctl;
+
+struct drift_ctl *drift_alloc(struct resampler *rs, uint32_t rate,
+                              uint32_t target_fill, uint32_t max_ppm);
+void drift_free(struct drift_ctl *dc);
+int32_t drift_update(struct drift_ctl *dc, uint32_t fill, uint32_t elapsed);
+int32_t drift_get_estimate(struct drift_ctl *dc);
+
+static const uint32_t src_rates[][2] = {
+    { 44100, 48000 },
+    { 48000, 44100 },
+    { 16000, 48000 },
+    { 48000, 16000 },
+    { 32000, 48000 },
+    { 48000, 32000 },
+    { 16000, 32000 },
+    { 32000, 16000 },
+};
+
+/* Stand-ins for common/dwt.c: nanoseconds of the host monotonic clock */
+void dwt_enable(void)
+{
+}
+
+uint32_t dwt_cycles(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static double src_signal(uint32_t rate, size_t frame, int ch)
+{
+    double t = (double)frame / rate;
+    double v = sin(2 * M_PI * SRC_TONE1_HZ * t) +
+               0.5 * sin(2 * M_PI * SRC_TONE2_HZ * t + ch);
+
+    return SRC_AMPLITUDE * v / 1.5;
+}
+
+/**
+ * @brief Windowed sinc of the prototype filter
+ *
+ * @param t Distance in zero crossings
+ */
+static double src_kernel(double t)
+{
+    double w;
+
+    if (fabs(t) >= SRC_ZERO_CROSSINGS)
+        return 0;
+    if (t == 0)
+        return 1;
+
+    w = 0.42 + 0.5 * cos(M_PI * t / SRC_ZERO_CROSSINGS) +
+        0.08 * cos(2 * M_PI * t / SRC_ZERO_CROSSINGS);
+
+    return sin(M_PI * t) / (M_PI * t) * w;
+}
+
+/**
+ * @brief Reference output frame
+ *
+ * Output frame n is the input signal band-limited by the prototype filter
+ * and sampled at input time n * in_rate / out_rate, which is where the
+ * fixed-point converter places it.
+ */
+static double src_reference(const int16_t *in, size_t in_frames, int ch,
+                            uint32_t in_rate, uint32_t out_rate, size_t n)
+{
+    double cutoff = SRC_CUTOFF;
+    double t = (double)n * in_rate / out_rate;
+    double span;
+    double acc = 0;
+    long k;
+
+    if (out_rate < in_rate)
+        cutoff = SRC_CUTOFF * out_rate / in_rate;
+    span = SRC_ZERO_CROSSINGS / cutoff;
+
+    for (k = (long)ceil(t - span); k <= (long)floor(t + span); k++) {
+        if (k < 0 || k >= (long)in_frames)
+            continue;
+        acc += in[2 * k + ch] * cutoff * src_kernel((k - t) * cutoff);
+    }
+
+    return acc;
+}
+
+/**
+ * @brief Feed a whole input buffer through the converter in blocks
+ *
+ * @return Number of output frames produced
+ */
+static size_t src_convert(struct resampler *rs, const int16_t *in,
+                          size_t in_frames, int16_t *out, size_t out_frames)
+{
+    size_t consumed = 0;
+    size_t produced = 0;
+    size_t used;
+    size_t n;
+
+    while (consumed < in_frames && produced < out_frames) {
+        n = in_frames - consumed;
+        if (n > SRC_BLOCK)
+            n = SRC_BLOCK;
+        produced += resampler_process(rs, in + 2 * consumed, n, &used,
+                                      out + 2 * produced,
+                                      out_frames - produced);
+        consumed += used;
+    }
+
+    return produced;
+}
+
+/**
+ * @brief Compare one rate pair against the reference
+ *
+ * @return true if the fixed-point output is close enough
+ */
+static bool src_compare(uint32_t in_rate, uint32_t out_rate)
+{
+    size_t in_frames = in_rate * SRC_SECONDS;
+    size_t out_cap = out_rate * SRC_SECONDS + 1;
+    struct resampler *rs;
+    int16_t *in, *out;
+    double sig = 0, err = 0, max_err = 0;
+    double snr;
+    size_t produced;
+    size_t i;
+    int ch;
+
+    in = malloc(2 * in_frames * sizeof(*in));
+    out = malloc(2 * out_cap * sizeof(*out));
+    rs = resampler_alloc(in_rate, out_rate, 2);
+    if (!in || !out || !rs) {
+        printf("src: %5u -> %5u Hz: cannot allocate\n", in_rate, out_rate);
+        return false;
+    }
+
+    for (i = 0; i < in_frames; i++) {
+        for (ch = 0; ch < 2; ch++)
+            in[2 * i + ch] = lrint(src_signal(in_rate, i, ch));
+    }
+
+    produced = src_convert(rs, in, in_frames, out, out_cap);
+
+    for (i = SRC_EDGE; i + SRC_EDGE < produced; i++) {
+        for (ch = 0; ch < 2; ch++) {
+            double ref = src_reference(in, in_frames, ch, in_rate, out_rate,
+                                       i);
+            double e = out[2 * i + ch] - ref;
+
+            sig += ref * ref;
+            err += e * e;
+            if (fabs(e) > max_err)
+                max_err = fabs(e);
+        }
+    }
+
+    snr = err > 0 ? 10 * log10(sig / err) : INFINITY;
+    printf("src: %5u -> %5u Hz: %zu frames, SNR %.1f dB, max error %.1f LSB"
+           "%s\n", in_rate, out_rate, produced, snr, max_err,
+           snr < SRC_MIN_SNR_DB ? " FAIL" : "");
+
+    resampler_free(rs);
+    free(out);
+    free(in);
+
+    return snr >= SRC_MIN_SNR_DB;
+}
+
+/**
+ * @brief Output frames for one second of 48 kHz input with a given trim
+ */
+static size_t src_trimmed(int32_t trim_ppb, int16_t *in, int16_t *out,
+                          size_t out_cap)
+{
+    struct resampler *rs = resampler_alloc(48000, 48000, 2);
+    size_t produced;
+
+    if (!rs)
+        return 0;
+
+    resampler_set_trim(rs, trim_ppb);
+    produced = src_convert(rs, in, 48000, out, out_cap);
+    resampler_free(rs);
+
+    return produced;
+}
+
+/**
+ * @brief Check the ratio trim: +0.1% consumes input 0.1% faster, and
+ *        trims beyond the supported range are clamped
+ */
+static bool src_trim(void)
+{
+    static int16_t in[2 * 48000];
+    static int16_t out[2 * 50000];
+    size_t nominal, faster, clamped;
+    bool ok;
+
+    nominal = src_trimmed(0, in, out, ARRAY_SIZE(out) / 2);
+    faster = src_trimmed(1000000, in, out, ARRAY_SIZE(out) / 2);
+    clamped = src_trimmed(INT32_MAX, in, out, ARRAY_SIZE(out) / 2);
+
+    /* nominal / 1.001 and nominal / 1.01 output frames, within one frame */
+    ok = labs((long)faster - lrint(nominal / 1.001)) <= 1 &&
+         labs((long)clamped - lrint(nominal / 1.01)) <= 1;
+    printf("src: trim: %zu frames nominal, %zu at +1000 ppm, %zu at INT32_MAX"
+           "%s\n", nominal, faster, clamped, ok ? "" : " FAIL");
+
+    return ok;
+}
+
+static int src_check(void)
+{
+    bool ok = true;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(src_rates); i++)
+        ok &= src_compare(src_rates[i][0], src_rates[i][1]);
+    ok &= src_trim();
+
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Simulate one playback stream with a drifting producer clock
+ *
+ * The producer delivers DRIFT_PACKET frames per millisecond of its own
+ * clock into a buffer.  Every I2S period the converter turns buffered
+ * frames into DRIFT_PERIOD output frames, and the controller is fed the
+ * buffer level, including the frames the converter has already read ahead.
+ *
+ * The estimate is averaged rather than sampled at the end: packets arrive
+ * in whole DRIFT_PACKET steps, so at a few ppm the integral term carries a
+ * slow saw-tooth with a period of minutes.
+ *
+ * @param ppm Producer clock faster than the I2S clock by this much
+ * @param seconds Simulated stream length
+ * @return true if the stream stayed healthy and the drift was found
+ */
+static bool drift_run(double ppm, unsigned seconds)
+{
+    static int16_t fifo[2 * DRIFT_FIFO];
+    static int16_t out[2 * DRIFT_PERIOD];
+    struct resampler *rs;
+    struct drift_ctl *dc;
+    uint64_t periods = (uint64_t)seconds * DRIFT_RATE / DRIFT_PERIOD;
+    uint64_t settle = (uint64_t)DRIFT_SETTLE_S * DRIFT_RATE / DRIFT_PERIOD;
+    double produced = 0;
+    double est_sum = 0, err_sum = 0;
+    double estimate, mean_err;
+    uint64_t samples = 0;
+    uint64_t p;
+    uint32_t fill = DRIFT_TARGET;
+    uint32_t level;
+    uint32_t sent = 0;
+    uint32_t xruns = 0;
+    int32_t lo = 0, hi = 0;
+    size_t used;
+    size_t n;
+    bool ok;
+
+    rs = resampler_alloc(DRIFT_RATE, DRIFT_RATE, 2);
+    dc = drift_alloc(rs, DRIFT_RATE, DRIFT_TARGET, DRIFT_MAX_PPM);
+    if (!rs || !dc) {
+        printf("drift: cannot allocate\n");
+        return false;
+    }
+
+    memset(fifo, 0, sizeof(fifo));
+
+    for (p = 0; p < periods; p++) {
+        /* Packets the producer has delivered by the end of this period */
+        produced += DRIFT_PERIOD * (1 + ppm / 1e6);
+        while (sent + DRIFT_PACKET <= produced) {
+            if (fill + DRIFT_PACKET > DRIFT_FIFO) {
+                xruns++;
+            } else {
+                for (n = 0; n < DRIFT_PACKET; n++) {
+                    fifo[2 * (fill + n)] = sent + n;
+                    fifo[2 * (fill + n) + 1] = -(sent + n);
+                }
+                fill += DRIFT_PACKET;
+            }
+            sent += DRIFT_PACKET;
+        }
+
+        n = resampler_process(rs, fifo, fill, &used, out, DRIFT_PERIOD);
+        if (n < DRIFT_PERIOD)
+            xruns++;
+        fill -= used;
+        memmove(fifo, fifo + 2 * used, 2 * fill * sizeof(*fifo));
+
+        level = fill + resampler_get_buffered(rs);
+        drift_update(dc, level, DRIFT_PERIOD);
+
+        if (p >= settle) {
+            int32_t err = (int32_t)level - DRIFT_TARGET;
+
+            if (err < lo)
+                lo = err;
+            if (err > hi)
+                hi = err;
+            err_sum += err;
+            est_sum += drift_get_estimate(dc);
+            samples++;
+        }
+    }
+
+    estimate = est_sum / samples / 1000;
+    mean_err = err_sum / samples;
+    ok = !xruns && fabs(estimate - ppm) <= 1 && fabs(mean_err) <= 1 &&
+         -lo <= DRIFT_MAX_ERROR && hi <= DRIFT_MAX_ERROR;
+    printf("drift: %+.1f ppm over %u s: estimate %+.3f ppm, fill %+.1f "
+           "(%+d..%+d) frames from target, %u xruns%s\n", ppm, seconds,
+           estimate, mean_err, lo, hi, xruns, ok ? "" : " FAIL");
+
+    drift_free(dc);
+    resampler_free(rs);
+
+    return ok;
+}
+
+static int drift_check(int argc, char *argv[])
+{
+    static const double defaults[] = { -250, 30, 100 };
+    unsigned seconds = DRIFT_SECONDS;
+    bool ok = true;
+    int i;
+
+    if (argc > 0) {
+        if (argc > 1)
+            seconds = strtoul(argv[1], NULL, 0);
+        if (seconds <= DRIFT_SETTLE_S) {
+            fprintf(stderr, "drift: run longer than %u s\n", DRIFT_SETTLE_S);
+            return -1;
+        }
+        return drift_run(strtod(argv[0], NULL), seconds) ? 0 : -1;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(defaults); i++)
+        ok &= drift_run(defaults[i], seconds);
+
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    if (argc == 2 && !strcmp(argv[1], "src")) {
+        ret = src_check();
+    } else if (argc == 2 && !strcmp(argv[1], "bench")) {
+        ret = resampler_bench_main(0, NULL);
+    } else if (argc >= 2 && argc <= 4 && !strcmp(argv[1], "drift")) {
+        ret = drift_check(argc - 2, argv + 2);
+    } else {
+        fprintf(stderr, "usage: %s {src|bench|drift [ppm [seconds]]}\n",
+                argv[0]);
+        return 1;
+    }
+
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,604 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Round-trip audio latency measurement for the white-audio module.
+ *
+ * The bridge plays a stream of silence carrying a short full-scale burst
+ * (the marker) every LAT_MARKER_PERIOD frames and records the capture
+ * stream at the same time.  The playback output must be looped back to the
+ * capture input, either with a cable from the headset output to the
+ * microphone input or through the codec's analog loopback.
+ *
+ * The cycle counter is sampled when a marker is written to the playback
+ * ring and when the capture callback hands over the buffer that contains
+ * it, so the measured time covers the playback ring, I2S, the codec DAC
+ * and ADC and the capture ring: everything the Greybus audio path adds on
+ * the module side.  The cycle counter rate comes from common/dwt.c, which
+ * measures it against the system timer.
+ *
+ * The report gives the latency distribution and its drift, that is the
+ * slope of latency against elapsed time.  A non-zero drift means the
+ * playback and capture paths run off different clocks or a ring is slowly
+ * filling up.
+ */
+
+#include <errno.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nuttx/clock.h>
+#include <nuttx/device.h>
+#include <nuttx/device_codec.h>
+#include <nuttx/device_i2s.h>
+#include <nuttx/ring_buf.h>
+#include <nuttx/util.h>
+
+#define LAT_RATE                48000
+#define LAT_CHANNELS            2
+#define LAT_FRAME_SIZE          (LAT_CHANNELS * sizeof(int16_t))
+
+/* Ring geometry: 8 entries of 5 ms each */
+#define LAT_RB_ENTRIES          8
+#define LAT_RB_FRAMES           240
+#define LAT_RB_SIZE             (LAT_RB_FRAMES * LAT_FRAME_SIZE)
+
+/* One marker every 200 ms, 1 ms long */
+#define LAT_MARKER_PERIOD       (LAT_RATE / 5)
+#define LAT_MARKER_LEN          48
+#define LAT_MARKER_LEVEL        30000
+
+/* Capture level that counts as the start of a marker */
+#define LAT_DETECT_LEVEL        (LAT_MARKER_LEVEL / 8)
+
+/* Histogram: 250 us buckets up to 64 ms, last bucket catches overflow */
+#define LAT_HIST_BUCKET_US      250
+#define LAT_HIST_BUCKETS        256
+
+#define LAT_DEFAULT_MARKERS     300
+
+/* Give up when no marker comes back for 10 marker periods */
+#define LAT_TIMEOUT_MS          2000
+
+#define LAT_CODEC_DAI           0
+
+/**
+ * @brief Latency measurement state
+ */
+struct lat_info {
+    struct device *i2s;
+    struct device *codec;
+    struct ring_buf *tx_rb;
+    struct ring_buf *rx_rb;
+
+    /** Core cycles per microsecond, from calibration */
+    uint32_t cycles_per_us;
+    /** Cycle counter extended to 64 bits */
+    uint64_t cycles;
+    uint32_t cycles_last;
+
+    /** Playback frames written so far, used to place markers */
+    uint32_t tx_frames;
+    /** Cycle stamps of the last markers written, indexed by sequence */
+    uint64_t tx_stamp[4];
+    uint32_t tx_seq;
+
+    /** Capture frames below the detection level since the last marker */
+    uint32_t rx_quiet;
+
+    uint32_t wanted;
+    uint32_t xruns;
+    sem_t done;
+    bool done_posted;
+
+    /** Statistics, in microseconds */
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    /** Least-squares accumulators for latency against elapsed time */
+    uint64_t t0;
+    int64_t sx, sy, sxx, sxy;
+    uint16_t hist[LAT_HIST_BUCKETS];
+};
+
+static struct lat_info lat_info;
+
+/* Cycle counter, see common/dwt.c */
+uint32_t dwt_cycles(void);
+uint32_t dwt_cycles_per_us(void);
+
+/**
+ * @brief Read the cycle counter, extended to 64 bits
+ *
+ * Must be called at least once per counter wrap, which the ring callbacks
+ * guarantee at any realistic core clock.
+ */
+static uint64_t lat_cycles(struct lat_info *info)
+{
+    uint32_t now = dwt_cycles();
+
+    info->cycles += now - info->cycles_last;
+    info->cycles_last = now;
+
+    return info->cycles;
+}
+
+/**
+ * @brief Account one latency sample
+ *
+ * @param info Measurement state
+ * @param when Cycle stamp of the detection
+ * @param us Measured latency
+ */
+static void lat_record(struct lat_info *info, uint64_t when, uint32_t us)
+{
+    int64_t x;
+    uint32_t bucket;
+
+    if (!info->count) {
+        info->t0 = when;
+        info->min = us;
+        info->max = us;
+    }
+
+    info->count++;
+    info->sum += us;
+    if (us < info->min)
+        info->min = us;
+    if (us > info->max)
+        info->max = us;
+
+    bucket = us / LAT_HIST_BUCKET_US;
+    if (bucket >= LAT_HIST_BUCKETS)
+        bucket = LAT_HIST_BUCKETS - 1;
+    info->hist[bucket]++;
+
+    /* elapsed time in milliseconds keeps the sums within 64 bits */
+    x = (when - info->t0) / info->cycles_per_us / 1000;
+    info->sx += x;
+    info->sy += us;
+    info->sxx += x * x;
+    info->sxy += x * us;
+}
+
+/**
+ * @brief Fill one playback buffer, inserting a marker when one is due
+ */
+static void lat_fill_tx(struct lat_info *info, struct ring_buf *rb)
+{
+    int16_t *buf = ring_buf_get_tail(rb);
+    uint32_t pos;
+    uint32_t i;
+    int16_t v;
+
+    memset(buf, 0, LAT_RB_SIZE);
+
+    for (i = 0; i < LAT_RB_FRAMES; i++) {
+        pos = (info->tx_frames + i) % LAT_MARKER_PERIOD;
+        if (pos >= LAT_MARKER_LEN)
+            continue;
+
+        if (!pos) {
+            info->tx_stamp[info->tx_seq % ARRAY_SIZE(info->tx_stamp)] =
+                lat_cycles(info);
+            info->tx_seq++;
+        }
+
+        /* square wave at a quarter of the sample rate */
+        v = (pos & 2) ? -LAT_MARKER_LEVEL : LAT_MARKER_LEVEL;
+        buf[LAT_CHANNELS * i] = v;
+        buf[LAT_CHANNELS * i + 1] = v;
+    }
+
+    info->tx_frames += LAT_RB_FRAMES;
+    ring_buf_put(rb, LAT_RB_SIZE);
+}
+
+/**
+ * @brief Find the marker a detection belongs to
+ *
+ * Markers are LAT_MARKER_PERIOD frames apart, so as long as the round trip
+ * is shorter than that, the detection matches the last marker written
+ * before it.  Working from the stamps rather than counting detections keeps
+ * a missed marker from shifting every later measurement.
+ *
+ * @return Cycle stamp of the marker, or 0 if none was written yet
+ */
+static uint64_t lat_find_marker(struct lat_info *info, uint64_t detect)
+{
+    uint64_t stamp;
+    uint32_t seq;
+
+    for (seq = info->tx_seq; seq-- > 0 &&
+         info->tx_seq - seq <= ARRAY_SIZE(info->tx_stamp); ) {
+        stamp = info->tx_stamp[seq % ARRAY_SIZE(info->tx_stamp)];
+        if (stamp <= detect)
+            return stamp;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Look for a marker in one capture buffer
+ */
+static void lat_scan_rx(struct lat_info *info, struct ring_buf *rb)
+{
+    int16_t *buf = ring_buf_get_head(rb);
+    uint32_t frames = ring_buf_len(rb) / LAT_FRAME_SIZE;
+    uint64_t now = lat_cycles(info);
+    uint64_t detect;
+    uint64_t sent;
+    uint32_t i;
+    int16_t v;
+
+    for (i = 0; i < frames; i++) {
+        v = buf[LAT_CHANNELS * i];
+        if (v > -LAT_DETECT_LEVEL && v < LAT_DETECT_LEVEL) {
+            info->rx_quiet++;
+            continue;
+        }
+
+        /* Only the leading edge of a burst counts */
+        if (info->rx_quiet < LAT_MARKER_PERIOD / 2) {
+            info->rx_quiet = 0;
+            continue;
+        }
+        info->rx_quiet = 0;
+
+        /* The callback runs when the last frame of the buffer arrived */
+        detect = now - (uint64_t)(frames - i) * info->cycles_per_us *
+                       1000000 / LAT_RATE;
+        sent = lat_find_marker(info, detect);
+        if (!sent)
+            continue;
+
+        lat_record(info, detect,
+                   (uint32_t)((detect - sent) / info->cycles_per_us));
+    }
+}
+
+static void lat_i2s_callback(struct ring_buf *rb, enum device_i2s_event event,
+                             void *arg)
+{
+    struct lat_info *info = arg;
+
+    switch (event) {
+    case DEVICE_I2S_EVENT_TX_COMPLETE:
+        while (ring_buf_is_producers(info->tx_rb)) {
+            ring_buf_reset(info->tx_rb);
+            lat_fill_tx(info, info->tx_rb);
+            ring_buf_pass(info->tx_rb);
+            info->tx_rb = ring_buf_get_next(info->tx_rb);
+        }
+        break;
+    case DEVICE_I2S_EVENT_RX_COMPLETE:
+        while (ring_buf_is_consumers(info->rx_rb)) {
+            lat_scan_rx(info, info->rx_rb);
+            ring_buf_reset(info->rx_rb);
+            ring_buf_pass(info->rx_rb);
+            info->rx_rb = ring_buf_get_next(info->rx_rb);
+        }
+        if (info->count >= info->wanted && !info->done_posted) {
+            info->done_posted = true;
+            sem_post(&info->done);
+        }
+        break;
+    case DEVICE_I2S_EVENT_UNDERRUN:
+    case DEVICE_I2S_EVENT_OVERRUN:
+        info->xruns++;
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Wait for all the markers to come back
+ *
+ * @param info Measurement state
+ * @return 0 when they did, -ETIMEDOUT if none came back for LAT_TIMEOUT_MS
+ */
+static int lat_wait(struct lat_info *info)
+{
+    struct timespec ts;
+    uint32_t count;
+
+    do {
+        count = info->count;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (LAT_TIMEOUT_MS % 1000) * 1000000;
+        ts.tv_sec += LAT_TIMEOUT_MS / 1000 + ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+
+        while (sem_timedwait(&info->done, &ts)) {
+            if (errno != EINTR)
+                break;
+        }
+        if (info->done_posted)
+            return 0;
+    } while (info->count != count);
+
+    return -ETIMEDOUT;
+}
+
+/**
+ * @brief Value under which a given share of the samples fall
+ *
+ * @param info Measurement state
+ * @param permille Share of the samples, in 1/1000
+ * @return Upper edge of the matching histogram bucket, in microseconds
+ */
+static uint32_t lat_percentile(struct lat_info *info, uint32_t permille)
+{
+    uint32_t target = (info->count * permille + 999) / 1000;
+    uint32_t seen = 0;
+    int i;
+
+    for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+        seen += info->hist[i];
+        if (seen >= target)
+            break;
+    }
+
+    return (i + 1) * LAT_HIST_BUCKET_US;
+}
+
+static void lat_report(struct lat_info *info)
+{
+    int64_t n = info->count;
+    int64_t den;
+    int64_t drift = 0;
+    int i;
+
+    if (!info->count) {
+        printf("audio_latency: no marker detected, check the loopback\n");
+        return;
+    }
+
+    /* slope in us per ms, scaled to ppm (us per s) */
+    den = n * info->sxx - info->sx * info->sx;
+    if (den)
+        drift = (n * info->sxy - info->sx * info->sy) * 1000 / den;
+
+    printf("audio_latency: %u markers, %u xruns\n", info->count, info->xruns);
+    printf("audio_latency: min %u us, avg %u us, max %u us\n", info->min,
+           (uint32_t)(info->sum / info->count), info->max);
+    printf("audio_latency: p50 < %u us, p90 < %u us, p99 < %u us\n",
+           lat_percentile(info, 500), lat_percentile(info, 900),
+           lat_percentile(info, 990));
+    printf("audio_latency: drift %d ppm\n", (int)drift);
+
+    for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+        if (info->hist[i]) {
+            printf("  %6u us: %u\n", i * LAT_HIST_BUCKET_US, info->hist[i]);
+        }
+    }
+}
+
+static int lat_alloc_callback(struct ring_buf *rb, void *arg)
+{
+    memset(ring_buf_get_buf(rb), 0, LAT_RB_SIZE);
+    return 0;
+}
+
+/**
+ * @brief Configure the codec and the bridge I2S controller
+ *
+ * The codec drives the I2S clocks, as it does for Greybus audio.
+ */
+static int lat_configure(struct lat_info *info)
+{
+    struct device_codec_pcm codec_pcm = {
+        .format     = DEVICE_CODEC_FORMAT_S16_LE,
+        .rate       = DEVICE_CODEC_RATE_48000,
+        .channels   = LAT_CHANNELS,
+        .sig_bits   = 16,
+    };
+    struct device_codec_dai codec_dai = {
+        .mclk_freq          = 12288000,
+        .protocol           = DEVICE_CODEC_PROTOCOL_I2S,
+        .wclk_polarity      = DEVICE_CODEC_POLARITY_NORMAL,
+        .wclk_change_edge   = DEVICE_CODEC_EDGE_FALLING,
+        .data_rx_edge       = DEVICE_CODEC_EDGE_RISING,
+        .data_tx_edge       = DEVICE_CODEC_EDGE_FALLING,
+    };
+    struct device_i2s_pcm i2s_pcm = {
+        .format     = DEVICE_I2S_PCM_FMT_16,
+        .rate       = DEVICE_I2S_PCM_RATE_48000,
+        .channels   = LAT_CHANNELS,
+    };
+    struct device_i2s_dai i2s_dai = {
+        .mclk_freq          = 12288000,
+        .protocol           = DEVICE_I2S_PROTOCOL_I2S,
+        .wclk_polarity      = DEVICE_I2S_POLARITY_NORMAL,
+        .wclk_change_edge   = DEVICE_I2S_EDGE_FALLING,
+        .data_rx_edge       = DEVICE_I2S_EDGE_RISING,
+        .data_tx_edge       = DEVICE_I2S_EDGE_FALLING,
+    };
+    int ret;
+
+    ret = device_codec_set_config(info->codec, LAT_CODEC_DAI,
+                                  DEVICE_CODEC_ROLE_MASTER, &codec_pcm,
+                                  &codec_dai);
+    if (ret)
+        return ret;
+
+    return device_i2s_set_config(info->i2s, DEVICE_I2S_ROLE_SLAVE, &i2s_pcm,
+                                 &i2s_dai);
+}
+
+static int lat_start(struct lat_info *info)
+{
+    int i;
+    int ret;
+
+    /* Queue the whole playback ring before the clocks start */
+    for (i = 0; i < LAT_RB_ENTRIES; i++) {
+        lat_fill_tx(info, info->tx_rb);
+        ring_buf_pass(info->tx_rb);
+        info->tx_rb = ring_buf_get_next(info->tx_rb);
+    }
+
+    ret = device_i2s_prepare_transmitter(info->i2s, info->tx_rb,
+                                         lat_i2s_callback, info);
+    if (ret)
+        return ret;
+
+    ret = device_i2s_prepare_receiver(info->i2s, info->rx_rb,
+                                      lat_i2s_callback, info);
+    if (ret)
+        goto err_shutdown_tx;
+
+    ret = device_codec_start_rx(info->codec, LAT_CODEC_DAI);
+    if (ret)
+        goto err_shutdown_rx;
+
+    ret = device_codec_start_tx(info->codec, LAT_CODEC_DAI);
+    if (ret)
+        goto err_stop_codec_rx;
+
+    ret = device_i2s_start_receiver(info->i2s);
+    if (ret)
+        goto err_stop_codec_tx;
+
+    ret = device_i2s_start_transmitter(info->i2s);
+    if (ret)
+        goto err_stop_rx;
+
+    return 0;
+
+err_stop_rx:
+    device_i2s_stop_receiver(info->i2s);
+err_stop_codec_tx:
+    device_codec_stop_tx(info->codec, LAT_CODEC_DAI);
+err_stop_codec_rx:
+    device_codec_stop_rx(info->codec, LAT_CODEC_DAI);
+err_shutdown_rx:
+    device_i2s_shutdown_receiver(info->i2s);
+err_shutdown_tx:
+    device_i2s_shutdown_transmitter(info->i2s);
+    return ret;
+}
+
+static void lat_stop(struct lat_info *info)
+{
+    device_i2s_stop_transmitter(info->i2s);
+    device_i2s_stop_receiver(info->i2s);
+    device_codec_stop_tx(info->codec, LAT_CODEC_DAI);
+    device_codec_stop_rx(info->codec, LAT_CODEC_DAI);
+    device_i2s_shutdown_transmitter(info->i2s);
+    device_i2s_shutdown_receiver(info->i2s);
+}
+
+/**
+ * @brief Run the latency measurement
+ *
+ * Usage: audio_latency [markers]
+ *
+ * The Greybus audio bundle must be idle: the measurement takes the codec
+ * and the I2S controller for itself.
+ */
+int audio_latency_main(int argc, char *argv[])
+{
+    struct lat_info *info = &lat_info;
+    int ret;
+
+    memset(info, 0, sizeof(*info));
+    info->wanted = argc > 1 ? atoi(argv[1]) : LAT_DEFAULT_MARKERS;
+    info->rx_quiet = LAT_MARKER_PERIOD;
+    sem_init(&info->done, 0, 0);
+
+    info->cycles_per_us = dwt_cycles_per_us();
+    info->cycles_last = dwt_cycles();
+    printf("audio_latency: core clock %u MHz, %u markers\n",
+           info->cycles_per_us, info->wanted);
+
+    info->codec = device_open(DEVICE_TYPE_CODEC_HW, 0);
+    if (!info->codec) {
+        printf("audio_latency: cannot open codec\n");
+        return -ENODEV;
+    }
+
+    info->i2s = device_open(DEVICE_TYPE_I2S_HW, 0);
+    if (!info->i2s) {
+        printf("audio_latency: cannot open I2S\n");
+        ret = -ENODEV;
+        goto err_close_codec;
+    }
+
+    info->tx_rb = ring_buf_alloc_ring(LAT_RB_ENTRIES, 0, LAT_RB_SIZE, 0,
+                                      lat_alloc_callback, NULL, NULL);
+    info->rx_rb = ring_buf_alloc_ring(LAT_RB_ENTRIES, 0, LAT_RB_SIZE, 0,
+                                      lat_alloc_callback, NULL, NULL);
+    if (!info->tx_rb || !info->rx_rb) {
+        ret = -ENOMEM;
+        goto err_free_rings;
+    }
+
+    ret = lat_configure(info);
+    if (ret) {
+        printf("audio_latency: configuration failed: %d\n", ret);
+        goto err_free_rings;
+    }
+
+    ret = lat_start(info);
+    if (ret) {
+        printf("audio_latency: cannot start streams: %d\n", ret);
+        goto err_free_rings;
+    }
+
+    ret = lat_wait(info);
+
+    lat_stop(info);
+    if (ret) {
+        printf("audio_latency: timed out with %u of %u markers, %u xruns\n",
+               info->count, info->wanted, info->xruns);
+    }
+    lat_report(info);
+
+err_free_rings:
+    if (info->rx_rb)
+        ring_buf_free_ring(info->rx_rb, NULL, NULL);
+    if (info->tx_rb)
+        ring_buf_free_ring(info->tx_rb, NULL, NULL);
+    device_close(info->i2s);
+err_close_codec:
+    device_close(info->codec);
+    sem_destroy(&info->done);
+
+    return ret;
+}
@@ -1,6 +1,11 @@
 config		= config
 manifest	= manifest.mnfs
 board-files	= board.c
+board-files	+= resampler.c
+board-files	+= resampler_bench.c
+board-files	+= latency.c
+board-files	+= codec_pm.c
+board-files	+= ../common/dwt.c
 
 vendor_id	= 0xfffe0001
 product_id	= 0xffed0012
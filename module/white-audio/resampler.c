@@ -0,0 +1,486 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Fixed-point polyphase sample-rate converter for the white-audio data path.
+ *
+ * The converter evaluates a Blackman-windowed sinc for every output frame,
+ * picking coefficients out of a single prototype table with linear
+ * interpolation between phases.  The same kernel therefore serves any
+ * in/out rate pair (44.1 <-> 48 kHz, 16/32 kHz voice) without storing one
+ * coefficient bank per ratio, and the ratio may be trimmed at run time.
+ *
+ * Samples are signed 16-bit, interleaved, up to RS_MAX_CHANNELS channels.
+ * When the core implements the DSP extension (Cortex-M4 and up) the inner
+ * product uses SMLAD; the GPBridge Cortex-M3 falls back to plain 32-bit MACs.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nuttx/kmalloc.h>
+
+#if defined(__ARM_FEATURE_DSP) || defined(__ARM_FEATURE_SAT)
+#include <arm_acle.h>
+#endif
+
+#define RS_MAX_CHANNELS     2
+
+/* Prototype filter: zero crossings on each side and phases per crossing */
+#define RS_ZERO_CROSSINGS   8
+#define RS_PHASES           64
+#define RS_TABLE_LEN        (RS_ZERO_CROSSINGS * RS_PHASES)
+
+/* Passband edge, in Q15 of the lower of the two Nyquist frequencies */
+#define RS_CUTOFF_Q15       29491   /* 0.9 */
+
+/* Worst case is 48 kHz -> 16 kHz: 2 * 8 / (0.9 / 3) taps, rounded up */
+#define RS_MAX_TAPS         56
+
+/* Input frames buffered per channel on top of the filter history */
+#define RS_BLOCK_FRAMES     64
+#define RS_HIST_LEN         (RS_MAX_TAPS + RS_BLOCK_FRAMES)
+
+/* Largest ratio trim, in ppb (1%); keeps step * trim within 64 bits */
+#define RS_MAX_TRIM_PPB     10000000
+
+/**
+ * @brief Right half of the prototype low-pass filter, in Q15
+ *
+ * h[i] = sinc(i / RS_PHASES) * blackman(i / RS_PHASES), for
+ * i = 0 .. RS_TABLE_LEN, with the window spanning +/- RS_ZERO_CROSSINGS.
+ * One extra zero entry lets the interpolation read h[i + 1] unconditionally.
+ */
+static const int16_t rs_sinc_table[RS_TABLE_LEN + 2] = {
+     32767,  32753,  32712,  32644,  32549,  32426,  32277,  32102,
+     31900,  31672,  31418,  31140,  30836,  30508,  30157,  29782,
+     29384,  28965,  28524,  28062,  27580,  27079,  26560,  26023,
+     25469,  24899,  24313,  23714,  23101,  22475,  21838,  21190,
+     20533,  19867,  19193,  18512,  17825,  17134,  16439,  15741,
+     15041,  14340,  13640,  12940,  12242,  11547,  10856,  10170,
+      9489,   8815,   8148,   7489,   6840,   6200,   5570,   4952,
+      4345,   3752,   3171,   2605,   2053,   1516,    994,    489,
+         0,   -472,   -927,  -1364,  -1783,  -2183,  -2566,  -2929,
+     -3274,  -3599,  -3906,  -4193,  -4461,  -4710,  -4940,  -5150,
+     -5342,  -5515,  -5669,  -5804,  -5921,  -6021,  -6102,  -6166,
+     -6213,  -6244,  -6258,  -6256,  -6238,  -6206,  -6159,  -6098,
+     -6024,  -5937,  -5837,  -5725,  -5603,  -5469,  -5325,  -5172,
+     -5010,  -4839,  -4661,  -4476,  -4284,  -4086,  -3884,  -3676,
+     -3465,  -3250,  -3032,  -2812,  -2591,  -2368,  -2145,  -1922,
+     -1699,  -1478,  -1258,  -1041,   -826,   -613,   -405,   -200,
+         0,    196,    386,    571,    751,    924,   1091,   1251,
+      1405,   1551,   1691,   1822,   1947,   2063,   2172,   2273,
+      2365,   2450,   2527,   2595,   2656,   2708,   2753,   2789,
+      2818,   2839,   2853,   2859,   2858,   2849,   2834,   2812,
+      2783,   2748,   2707,   2661,   2608,   2550,   2487,   2419,
+      2347,   2270,   2190,   2105,   2018,   1927,   1834,   1738,
+      1639,   1539,   1437,   1334,   1230,   1126,   1020,    915,
+       809,    704,    600,    496,    394,    293,    193,     96,
+         0,    -94,   -185,   -273,   -359,   -442,   -522,   -599,
+      -673,   -743,   -809,   -872,   -932,   -987,  -1039,  -1087,
+     -1132,  -1172,  -1208,  -1241,  -1269,  -1294,  -1314,  -1331,
+     -1345,  -1354,  -1360,  -1362,  -1361,  -1356,  -1348,  -1336,
+     -1322,  -1305,  -1284,  -1261,  -1235,  -1207,  -1176,  -1143,
+     -1108,  -1071,  -1032,   -991,   -949,   -906,   -861,   -815,
+      -768,   -720,   -672,   -623,   -574,   -524,   -475,   -425,
+      -376,   -327,   -278,   -230,   -182,   -135,    -89,    -44,
+         0,     43,     85,    125,    164,    202,    238,    273,
+       306,    337,    367,    395,    421,    445,    468,    489,
+       508,    525,    540,    554,    565,    575,    584,    590,
+       595,    598,    599,    599,    598,    594,    590,    584,
+       576,    567,    557,    546,    534,    521,    506,    491,
+       475,    458,    440,    422,    403,    384,    364,    344,
+       323,    303,    282,    261,    239,    218,    197,    176,
+       155,    135,    114,     94,     75,     55,     36,     18,
+         0,    -17,    -34,    -50,    -66,    -81,    -95,   -108,
+      -121,   -133,   -144,   -155,   -165,   -174,   -182,   -190,
+      -196,   -202,   -208,   -212,   -216,   -219,   -222,   -223,
+      -225,   -225,   -225,   -224,   -223,   -221,   -218,   -215,
+      -212,   -208,   -203,   -199,   -193,   -188,   -182,   -176,
+      -169,   -163,   -156,   -149,   -142,   -134,   -127,   -119,
+      -112,   -104,    -97,    -89,    -81,    -74,    -66,    -59,
+       -52,    -45,    -38,    -31,    -24,    -18,    -12,     -6,
+         0,      6,     11,     16,     21,     25,     30,     34,
+        37,     41,     44,     47,     50,     52,     54,     56,
+        58,     59,     61,     61,     62,     63,     63,     63,
+        63,     63,     62,     61,     61,     60,     59,     57,
+        56,     55,     53,     51,     50,     48,     46,     44,
+        42,     40,     38,     36,     34,     32,     30,     28,
+        26,     24,     22,     20,     18,     16,     14,     13,
+        11,      9,      8,      6,      5,      4,      2,      1,
+         0,     -1,     -2,     -3,     -4,     -4,     -5,     -6,
+        -6,     -7,     -7,     -7,     -8,     -8,     -8,     -8,
+        -8,     -8,     -8,     -8,     -8,     -8,     -8,     -7,
+        -7,     -7,     -7,     -6,     -6,     -6,     -6,     -5,
+        -5,     -5,     -4,     -4,     -4,     -3,     -3,     -3,
+        -2,     -2,     -2,     -2,     -2,     -1,     -1,     -1,
+        -1,     -1,     -1,      0,      0,      0,      0,      0,
+         0,      0,      0,      0,      0,      0,      0,      0,
+         0,      0,
+};
+
+/**
+ * @brief Resampler state
+ */
+struct resampler {
+    /** Number of interleaved channels */
+    uint8_t channels;
+    /** Number of filter taps used for the current ratio */
+    uint8_t taps;
+    /** Nominal input and output rates, in Hz */
+    uint32_t in_rate;
+    uint32_t out_rate;
+    /** Input samples advanced per output frame: integer and Q32 fraction */
+    uint32_t step_int;
+    uint32_t step_frac;
+    /** Cutoff relative to the input Nyquist frequency, in Q15 */
+    int32_t cutoff;
+    /** Table index increment per tap, in Q16 table entries */
+    int32_t table_step;
+    /** Position of the next output frame: history index and Q32 fraction */
+    uint32_t pos;
+    uint32_t frac;
+    /** Number of valid frames in the history buffers */
+    uint32_t fill;
+    /** Scratch coefficient vector, recomputed for every output frame */
+    int16_t coef[RS_MAX_TAPS] __attribute__((aligned(4)));
+    /** De-interleaved input history, one line per channel */
+    int16_t hist[RS_MAX_CHANNELS][RS_HIST_LEN] __attribute__((aligned(4)));
+};
+
+static inline int16_t rs_sat16(int32_t v)
+{
+#if defined(__ARM_FEATURE_SAT)
+    return __ssat(v, 16);
+#else
+    if (v > INT16_MAX)
+        return INT16_MAX;
+    if (v < INT16_MIN)
+        return INT16_MIN;
+    return v;
+#endif
+}
+
+/**
+ * @brief Compute the input step for a given ratio and trim
+ *
+ * @param rs Resampler state
+ * @param trim_ppb Ratio correction in parts per billion (positive consumes
+ *                 input faster), clamped to +/- RS_MAX_TRIM_PPB
+ */
+static void rs_set_step(struct resampler *rs, int32_t trim_ppb)
+{
+    uint64_t step;
+
+    if (trim_ppb > RS_MAX_TRIM_PPB) {
+        trim_ppb = RS_MAX_TRIM_PPB;
+    } else if (trim_ppb < -RS_MAX_TRIM_PPB) {
+        trim_ppb = -RS_MAX_TRIM_PPB;
+    }
+
+    /* step = in_rate / out_rate, in Q32 */
+    step = ((uint64_t)rs->in_rate << 32) / rs->out_rate;
+    step += (int64_t)step * trim_ppb / 1000000000;
+
+    rs->step_int = step >> 32;
+    rs->step_frac = (uint32_t)step;
+}
+
+/**
+ * @brief Fill the coefficient vector for the current fractional position
+ *
+ * Tap j weighs history sample pos + j, which sits (j - taps / 2 + 1 - frac)
+ * input periods away from the output instant.
+ *
+ * @param rs Resampler state
+ */
+static void rs_compute_coefs(struct resampler *rs)
+{
+    int64_t t;
+    int32_t u;
+    int32_t idx;
+    int32_t i;
+    int32_t f;
+    int32_t h;
+    int j;
+
+    /* Distance of tap 0, in Q16 table entries (signed) */
+    t = -((int64_t)(rs->taps / 2 - 1) << 16) - (rs->frac >> 16);
+    u = (int32_t)((t * rs->table_step) >> 16);
+
+    for (j = 0; j < rs->taps; j++, u += rs->table_step) {
+        idx = u < 0 ? -u : u;
+        if (idx >= (RS_TABLE_LEN << 16)) {
+            rs->coef[j] = 0;
+            continue;
+        }
+
+        i = idx >> 16;
+        f = (idx & 0xffff) >> 1;
+        h = rs_sinc_table[i] +
+            (((rs_sinc_table[i + 1] - rs_sinc_table[i]) * f) >> 15);
+
+        /* Scale by the cutoff to keep unity gain at DC */
+        rs->coef[j] = (h * rs->cutoff) >> 15;
+    }
+}
+
+/**
+ * @brief Inner product of the coefficient vector and one history line
+ *
+ * @param coef Coefficients, Q15
+ * @param x Input samples, Q15
+ * @param taps Number of taps (even)
+ * @return Output sample, saturated to 16 bits
+ */
+static inline int16_t rs_dot(const int16_t *coef, const int16_t *x, int taps)
+{
+    int32_t acc = 1 << 14;
+
+#if defined(__ARM_FEATURE_DSP)
+    const int16_t *end = coef + taps;
+    uint32_t c, s;
+
+    /* history lines are only half-word aligned, so load pairs by memcpy */
+    while (coef < end) {
+        memcpy(&c, coef, sizeof(c));
+        memcpy(&s, x, sizeof(s));
+        acc = __smlad(c, s, acc);
+        coef += 2;
+        x += 2;
+    }
+#else
+    int j;
+
+    for (j = 0; j < taps; j += 2) {
+        acc += coef[j] * x[j];
+        acc += coef[j + 1] * x[j + 1];
+    }
+#endif
+
+    return rs_sat16(acc >> 15);
+}
+
+/**
+ * @brief Move the unread history back to the start of the buffers and
+ *        append as many input frames as fit
+ *
+ * @param rs Resampler state
+ * @param in Interleaved input frames
+ * @param frames Number of frames available in @a in
+ * @return Number of input frames consumed
+ */
+static size_t rs_refill(struct resampler *rs, const int16_t *in, size_t frames)
+{
+    uint32_t keep;
+    size_t n;
+    size_t i;
+    int ch;
+
+    if (rs->pos > 0) {
+        keep = rs->fill > rs->pos ? rs->fill - rs->pos : 0;
+        for (ch = 0; ch < rs->channels; ch++) {
+            memmove(rs->hist[ch], &rs->hist[ch][rs->pos],
+                    keep * sizeof(int16_t));
+        }
+        rs->pos = rs->pos > rs->fill ? rs->pos - rs->fill : 0;
+        rs->fill = keep;
+    }
+
+    n = RS_HIST_LEN - rs->fill;
+    if (n > frames)
+        n = frames;
+
+    if (rs->channels == 2) {
+        for (i = 0; i < n; i++) {
+            rs->hist[0][rs->fill + i] = in[2 * i];
+            rs->hist[1][rs->fill + i] = in[2 * i + 1];
+        }
+    } else {
+        memcpy(&rs->hist[0][rs->fill], in, n * sizeof(int16_t));
+    }
+    rs->fill += n;
+
+    return n;
+}
+
+/**
+ * @brief Drop all buffered audio, keeping the configured ratio
+ *
+ * The history is primed with taps / 2 - 1 frames of silence so the first
+ * output frame lines up with the first input frame.
+ *
+ * @param rs Resampler state
+ */
+void resampler_reset(struct resampler *rs)
+{
+    memset(rs->hist, 0, sizeof(rs->hist));
+    rs->pos = 0;
+    rs->frac = 0;
+    rs->fill = rs->taps / 2 - 1;
+}
+
+/**
+ * @brief Trim the conversion ratio around its nominal value
+ *
+ * Used to track a clock that drifts with respect to the nominal rates; the
+ * filter itself is left untouched, only the input step changes.
+ *
+ * @param rs Resampler state
+ * @param trim_ppb Correction in parts per billion, up to +/- 1%
+ */
+void resampler_set_trim(struct resampler *rs, int32_t trim_ppb)
+{
+    rs_set_step(rs, trim_ppb);
+}
+
+/**
+ * @brief Input frames held by the converter that have not been used yet
+ *
+ * The converter reads ahead of its output position in blocks, so callers
+ * measuring how much input is queued must add this to their own buffer.
+ *
+ * @param rs Resampler state
+ * @return Number of input frames buffered past the next output position
+ */
+uint32_t resampler_get_buffered(struct resampler *rs)
+{
+    return rs->fill > rs->pos ? rs->fill - rs->pos : 0;
+}
+
+/**
+ * @brief Allocate a resampler for a given rate pair
+ *
+ * @param in_rate Input sample rate, in Hz
+ * @param out_rate Output sample rate, in Hz
+ * @param channels Number of interleaved channels (1 or 2)
+ * @return The resampler, or NULL if the parameters are not supported or
+ *         memory is exhausted
+ */
+struct resampler *resampler_alloc(uint32_t in_rate, uint32_t out_rate,
+                                  uint8_t channels)
+{
+    struct resampler *rs;
+    uint32_t taps;
+
+    if (!in_rate || !out_rate || !channels || channels > RS_MAX_CHANNELS)
+        return NULL;
+
+    /* Keep the ratio within what RS_MAX_TAPS was sized for */
+    if (in_rate > 3 * out_rate || out_rate > 3 * in_rate)
+        return NULL;
+
+    rs = zalloc(sizeof(*rs));
+    if (!rs)
+        return NULL;
+
+    rs->channels = channels;
+    rs->in_rate = in_rate;
+    rs->out_rate = out_rate;
+
+    /* When decimating, stretch the filter to band-limit to the output */
+    if (out_rate < in_rate) {
+        rs->cutoff = (int32_t)(((uint64_t)RS_CUTOFF_Q15 * out_rate) / in_rate);
+    } else {
+        rs->cutoff = RS_CUTOFF_Q15;
+    }
+    rs->table_step = (rs->cutoff * RS_PHASES) << 1;
+
+    /* 2 * RS_ZERO_CROSSINGS / cutoff taps, rounded up to an even count */
+    taps = ((2 * RS_ZERO_CROSSINGS << 15) + rs->cutoff - 1) / rs->cutoff;
+    taps = (taps + 1) & ~1;
+    rs->taps = taps > RS_MAX_TAPS ? RS_MAX_TAPS : taps;
+
+    rs_set_step(rs, 0);
+    resampler_reset(rs);
+
+    return rs;
+}
+
+/**
+ * @brief Release a resampler
+ *
+ * @param rs Resampler state
+ */
+void resampler_free(struct resampler *rs)
+{
+    free(rs);
+}
+
+/**
+ * @brief Convert a block of interleaved frames
+ *
+ * Runs until either the output buffer is full or the input is exhausted.
+ * Input that could not be consumed yet is reported through @a in_used so
+ * the caller can present it again with the next block.
+ *
+ * @param rs Resampler state
+ * @param in Interleaved input frames
+ * @param in_frames Number of frames in @a in
+ * @param in_used Returns the number of input frames consumed
+ * @param out Interleaved output buffer
+ * @param out_frames Capacity of @a out, in frames
+ * @return Number of output frames produced
+ */
+size_t resampler_process(struct resampler *rs, const int16_t *in,
+                         size_t in_frames, size_t *in_used, int16_t *out,
+                         size_t out_frames)
+{
+    size_t consumed = 0;
+    size_t produced = 0;
+    uint32_t frac;
+    int ch;
+
+    while (produced < out_frames) {
+        if (rs->pos + rs->taps > rs->fill) {
+            if (consumed == in_frames)
+                break;
+            consumed += rs_refill(rs, in + consumed * rs->channels,
+                                  in_frames - consumed);
+            continue;
+        }
+
+        rs_compute_coefs(rs);
+        for (ch = 0; ch < rs->channels; ch++) {
+            *out++ = rs_dot(rs->coef, &rs->hist[ch][rs->pos], rs->taps);
+        }
+        produced++;
+
+        frac = rs->frac + rs->step_frac;
+        rs->pos += rs->step_int + (frac < rs->frac);
+        rs->frac = frac;
+    }
+
+    if (in_used)
+        *in_used = consumed;
+
+    return produced;
+}
@@ -0,0 +1,157 @@
+/**
+ * Copyright (c) 2016 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Throughput benchmark for the white-audio sample-rate converter.
+ *
+ * Converts a synthetic stereo stream for each supported rate pair and
+ * reports the cost in core cycles per output frame, together with the
+ * core clock that real-time conversion of that pair would consume.
+ *
+ * Host builds (WHITE_AUDIO_HOST, see host/audio_host.c) count nanoseconds
+ * instead of cycles, so the clock figure reads as host CPU time per second
+ * of audio, in ms.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#include <nuttx/config.h>
+#include <nuttx/util.h>
+
+#define SRC_BENCH_SECONDS       2
+#define SRC_BENCH_BLOCK         128     /* input frames per call */
+
+struct resampler;
+
+struct resampler *resampler_alloc(uint32_t in_rate, uint32_t out_rate,
+                                  uint8_t channels);
+void resampler_free(struct resampler *rs);
+size_t resampler_process(struct resampler *rs, const int16_t *in,
+                         size_t in_frames, size_t *in_used, int16_t *out,
+                         size_t out_frames);
+
+/* Cycle counter, see common/dwt.c; host builds count nanoseconds */
+void dwt_enable(void);
+uint32_t dwt_cycles(void);
+
+static const uint32_t src_bench_rates[][2] = {
+    { 44100, 48000 },
+    { 48000, 44100 },
+    { 16000, 48000 },
+    { 48000, 16000 },
+    { 32000, 48000 },
+    { 48000, 32000 },
+};
+
+static int16_t src_bench_in[2 * SRC_BENCH_BLOCK];
+static int16_t src_bench_out[2 * 3 * SRC_BENCH_BLOCK];
+
+/**
+ * @brief Fill the input block with a triangle wave
+ *
+ * Only the amount of work matters here, so a cheap signal that exercises
+ * the full sample range will do.
+ */
+static void src_bench_fill(void)
+{
+    int16_t v = 0;
+    int i;
+
+    for (i = 0; i < SRC_BENCH_BLOCK; i++) {
+        v += 1024;
+        src_bench_in[2 * i] = v;
+        src_bench_in[2 * i + 1] = -v;
+    }
+}
+
+/**
+ * @brief Run one rate pair
+ *
+ * @param in_rate Input rate, in Hz
+ * @param out_rate Output rate, in Hz
+ * @return 0 on success, -1 if the resampler could not be allocated
+ */
+static int src_bench_run(uint32_t in_rate, uint32_t out_rate)
+{
+    struct resampler *rs;
+    uint64_t cycles = 0;
+    uint32_t frames_in = 0;
+    uint32_t frames_out = 0;
+    uint32_t total = in_rate * SRC_BENCH_SECONDS;
+    uint32_t start;
+    uint32_t per_frame;
+    size_t used;
+    size_t offset;
+
+    rs = resampler_alloc(in_rate, out_rate, 2);
+    if (!rs) {
+        printf("src_bench: cannot allocate %u -> %u\n", in_rate, out_rate);
+        return -1;
+    }
+
+    while (frames_in < total) {
+        offset = 0;
+        while (offset < SRC_BENCH_BLOCK) {
+            start = dwt_cycles();
+            frames_out += resampler_process(rs, &src_bench_in[2 * offset],
+                                            SRC_BENCH_BLOCK - offset, &used,
+                                            src_bench_out,
+                                            3 * SRC_BENCH_BLOCK);
+            cycles += dwt_cycles() - start;
+            offset += used;
+        }
+        frames_in += SRC_BENCH_BLOCK;
+    }
+
+    per_frame = frames_out ? cycles / frames_out : 0;
+    printf("src_bench: %5u -> %5u Hz: %u frames, %u cycles/frame, "
+           "%u.%02u MHz at real time\n", in_rate, out_rate, frames_out,
+           per_frame, per_frame * out_rate / 1000000,
+           (per_frame * out_rate / 10000) % 100);
+
+    resampler_free(rs);
+    return 0;
+}
+
+int resampler_bench_main(int argc, char *argv[])
+{
+    int ret = 0;
+    int i;
+
+    dwt_enable();
+    src_bench_fill();
+
+    for (i = 0; i < ARRAY_SIZE(src_bench_rates); i++) {
+        if (src_bench_run(src_bench_rates[i][0], src_bench_rates[i][1]))
+            ret = -1;
+    }
+
+    return ret;
+}
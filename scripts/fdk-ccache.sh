@@ -0,0 +1,197 @@
+#!/bin/bash
+# Copyright (c) 2016 Google, Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+# 1. Redistributions of source code must retain the above copyright notice,
+# this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+# this list of conditions and the following disclaimer in the documentation
+# and/or other materials provided with the distribution.
+# 3. Neither the name of the copyright holder nor the names of its
+# contributors may be used to endorse or promote products derived from this
+# software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+# EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+# PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+# OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+# WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+# OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+# ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+# Object cache for the NuttX builds of 'fdk.sh -c'.
+#
+# Make.defs puts this script in front of the compiler. Compilations of a
+# single source file to an object are looked up in a content-addressed cache,
+# keyed by:
+#   - the preprocessed source, with the target build directory
+#     (FDK_CCACHE_BASEDIR) replaced by a fixed string, so that the same source
+#     built for two targets gives the same key;
+#   - the compiler flags, except those that only affect preprocessing
+#     (-I, -D, -U, ...), which the preprocessed source already reflects;
+#   - the toolchain: compiler driver, cc1 and as binaries.
+# Everything else (dependency generation, preprocessing, linking, ...) runs
+# the compiler directly.
+#
+# Objects taken from the cache, and the compiler warnings replayed with them,
+# may carry the paths of the target they were first built for (debug
+# information, __FILE__ strings).
+#
+# usage: fdk-ccache.sh <compiler> <arguments>...
+#
+# environment:
+#   FDK_CCACHE_DIR      cache directory (the compiler runs directly if unset)
+#   FDK_CCACHE_BASEDIR  target build directory
+#   FDK_CCACHE_LOG      file to which a 'hit' or 'miss' line is appended per
+#                       cached compilation
+
+set -o pipefail
+
+CC_CMD="${1}"
+shift
+
+CACHE_DIR="${FDK_CCACHE_DIR}"
+
+function run_compiler()
+{
+    exec ${CC_CMD} "$@"
+}
+
+function toolchain_hash()
+# prints the hash of the toolchain, computed once per compiler binary
+{
+    local driver=$(command -v ${CC_CMD}) || return 1
+    local id=$(echo "${driver} $(stat -Lc '%s %Y' "${driver}")" | sha1sum)
+    local file="${CACHE_DIR}/toolchain/${id%% *}"
+
+    if [[ ! -r ${file} ]]; then
+        mkdir -p "${CACHE_DIR}/toolchain" || return 1
+        local cc1=$(command -v $(${CC_CMD} -print-prog-name=cc1))
+        local as=$(command -v $(${CC_CMD} -print-prog-name=as))
+        {
+            ${CC_CMD} -v 2>&1
+            sha1sum "${driver}" ${cc1} ${as}
+        } | sha1sum | cut -d ' ' -f 1 > "${file}.$$" || {
+            rm -f "${file}.$$"
+            return 1
+        }
+        mv "${file}.$$" "${file}"
+    fi
+    cat "${file}"
+}
+
+[[ -z ${CACHE_DIR} ]] && run_compiler "$@"
+
+# Sort the arguments out
+args=("$@")
+key_args=()
+pp_args=()
+compile=false
+src=
+obj=
+for ((i = 0; i < ${#args[@]}; i++)); do
+    a="${args[i]}"
+    case "${a}" in
+        -c)
+            compile=true
+            continue
+            ;;
+        -o)
+            obj="${args[++i]}"
+            continue
+            ;;
+        -o*)
+            obj="${a#-o}"
+            continue
+            ;;
+        -M*|-Wp,-M*|-E|-S|-|*.s)
+            # dependency files, preprocessing, assembly output: not cached;
+            # neither are plain assembly sources, which -E prints nothing of
+            run_compiler "$@"
+            ;;
+        -I|-D|-U|-include|-imacros|-isystem|-iquote|-idirafter)
+            pp_args+=("${a}" "${args[++i]}")
+            continue
+            ;;
+        -I*|-D*|-U*)
+            ;;
+        -*)
+            key_args+=("${a}")
+            ;;
+        *.c|*.S)
+            [[ -n ${src} ]] && run_compiler "$@"
+            src="${a}"
+            ;;
+        *)
+            key_args+=("${a}")
+            ;;
+    esac
+    pp_args+=("${a}")
+done
+
+if ! ${compile} || [[ -z ${src} || -z ${obj} ]]; then
+    run_compiler "$@"
+fi
+
+# Compute the key
+toolchain=$(toolchain_hash) || run_compiler "$@"
+key=$(
+    {
+        echo "${toolchain}"
+        printf '%s\n' "${key_args[@]}"
+        if [[ -n ${FDK_CCACHE_BASEDIR} ]]; then
+            # literal replacement: the path may hold regex characters
+            ${CC_CMD} -E "${pp_args[@]}" | awk '
+                BEGIN { dir = ENVIRON["FDK_CCACHE_BASEDIR"] }
+                {
+                    out = ""
+                    while ((i = index($0, dir)) > 0) {
+                        out = out substr($0, 1, i - 1) "@BASEDIR@"
+                        $0 = substr($0, i + length(dir))
+                    }
+                    print out $0
+                }'
+        else
+            ${CC_CMD} -E "${pp_args[@]}"
+        fi
+    } 2>/dev/null | sha1sum | cut -d ' ' -f 1
+) || run_compiler "$@"
+
+entry="${CACHE_DIR}/${key:0:2}/${key:2}"
+
+function log()
+{
+    [[ -n ${FDK_CCACHE_LOG} ]] && echo "${1} ${src}" >> "${FDK_CCACHE_LOG}"
+}
+
+# Hit: reuse the object and replay the warnings
+if [[ -r ${entry}.o ]] && cp "${entry}.o" "${obj}"; then
+    [[ -s ${entry}.stderr ]] && cat "${entry}.stderr" >&2
+    log "hit"
+    exit 0
+fi
+
+# Miss: compile, then store the object and the warnings
+stderr=$(mktemp) || run_compiler "$@"
+${CC_CMD} "$@" 2> "${stderr}"
+ret=${?}
+cat "${stderr}" >&2
+
+if [[ ${ret} -eq 0 ]]; then
+    mkdir -p "${entry%/*}" && \
+        cp "${obj}" "${entry}.o.$$" && \
+        cp "${stderr}" "${entry}.stderr" && \
+        mv "${entry}.o.$$" "${entry}.o"
+    rm -f "${entry}.o.$$"
+    log "miss"
+fi
+
+rm -f "${stderr}"
+exit ${ret}
@@ -46,7 +46,7 @@ function _fdk()
     cur="${COMP_WORDS[COMP_CWORD]}"
     prev="${COMP_WORDS[COMP_CWORD - 1]}"
 
-    opts="-h -v -n -b -k"
+    opts="-h -v -n -b -k -j -l -i -c"
     cmds=("clean" "build" "menuconfig" "updateconfig" "s1boot" "nuttx_configure")
     specials=("all" "all-frame" "all-module")
 
@@ -59,6 +59,10 @@ function _fdk()
             COMPREPLY=($(compgen -d -- ${cur}))
             return
             ;;
+        -j)
+            COMPREPLY=($(compgen -W "$(nproc 2>/dev/null)" -- ${cur}))
+            return
+            ;;
     esac
 
     if [[ "${cur}" == -* ]]; then
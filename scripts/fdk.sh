@@ -55,6 +55,11 @@ TARGETS=
 
 DRY_RUN=false
 KEEP_INTER=false
+JOBS=1
+SHARE_TREE=false
+INCREMENTAL=false
+BOOTROM_TOOLS_READY=false
+CCACHE=false
 
 ### Usage
 
@@ -77,6 +82,13 @@ Options:
     -n              Dry-run (print the commands that would be executed)
     -b <dir>        Specify a build directory ('${BUILD_DIR_NAME}' by default)
     -k              Keep intermediary firmware binary files
+    -j <N>          Build up to N targets at the same time (1 by default)
+    -l              Link the NuttX sources of each target to a shared pristine
+                    copy instead of copying them
+    -i              Incremental build: reuse the build tree of the previous
+                    build, copying only the target files that changed
+    -c              Cache the compiled objects in '<build dir>/.ccache' and
+                    reuse them across targets and builds
 
 Commands:
 
@@ -110,7 +122,10 @@ Targets:
         $ ./${script_name} menuconfig path/to/module.mk
         $ ./${script_name} build path/to/module.mk
 
-    Multiple targets can be provided to the same command.
+    Multiple targets can be provided to the same command. With '-j', the
+    commands 'build' and 's1boot' process several targets at the same time;
+    the output of each target is printed once all are done, in the order of
+    the command line, followed by a summary of the targets that failed.
 
     For the commands 'build' and 'updateconfig', it is possible to specify one
     of the following special target:
@@ -291,6 +306,11 @@ function read_target_mk()
 
     [[ -n "${CONFIG_FILE}" ]] || \
         die "'config' is not defined. Please correct your mk target file."
+
+    # board files are copied side by side, see _nuttx_export_vars
+    local duplicates=$(printf '%s\n' "${BOARD_FILES[@]##*/}" | sort | uniq -d)
+    [[ -z "${duplicates}" ]] || \
+        die "Board files share a file name: ${duplicates//$'\n'/ }"
 }
 
 ### Build dir management
@@ -346,32 +366,67 @@ function echo_build_dir()
 
 ### Bootrom tools
 
-function _bootrom_tools_compile()
-# 1: bootrom component to compile
+function _source_state()
+# 1: source directory
+# prints what its build output depends on: location, commit, local changes
+# and the contents of untracked files, or the contents of all its files
+# outside of git
 {
-    local bootrom_srcdir=$(cd ${BOOTROM_DIR} >/dev/null && pwd)
-    local bootrom_tools_srcdir=$(cd ${BOOTROM_TOOLS_DIR} >/dev/null && pwd)
-    run_log 2 make BOOTROM_SRCDIR=${bootrom_srcdir} \
-        TOPDIR=${bootrom_tools_srcdir} \
-        COMMONDIR=${bootrom_tools_srcdir}/src/common \
-        -C ${bootrom_tools_srcdir}/src/${1} || \
-        die "Could not compile ${bootrom_tools_srcdir}/src/${1}"
+    (cd ${1} >/dev/null && pwd)
+    if git -C ${1} rev-parse HEAD; then
+        git -C ${1} diff HEAD
+        git -C ${1} ls-files -z --others --exclude-standard | \
+            (cd ${1} && xargs -0 -r sha1sum)
+    else
+        (cd ${1} && find . -type f -exec sha1sum {} + | sort)
+    fi
 }
 
-function bootrom_tools_compile_create_tftf()
+function _bootrom_tools_version()
+# prints a hash of the sources the bootrom tools are built from, in
+# bootrom-tools and bootrom
 {
-    echo_log 1 "# Compiling create-tftf"
-
-    _bootrom_tools_compile "common"
-    _bootrom_tools_compile "create-tftf"
+    local dir
+    for dir in ${BOOTROM_TOOLS_DIR} ${BOOTROM_DIR}; do
+        _source_state ${dir}
+    done 2>/dev/null | sha1sum | cut -d ' ' -f 1
 }
 
-function bootrom_tools_compile_create_ffff()
+function _bootrom_tools_compile()
+# 1: bootrom component to compile
 {
-    echo_log 1 "# Compiling create-ffff"
+    local bootrom_srcdir=$(cd ${BOOTROM_DIR} >/dev/null && pwd)
+    local bootrom_tools_topdir=$(cd ${BOOTROM_TOOLS_BUILD_DIR} >/dev/null && pwd)
+    run_log 2 make BOOTROM_SRCDIR=${bootrom_srcdir} \
+        TOPDIR=${bootrom_tools_topdir} \
+        COMMONDIR=${bootrom_tools_topdir}/src/common \
+        -C ${bootrom_tools_topdir}/src/${1} || \
+        die "Could not compile ${BOOTROM_TOOLS_DIR}/src/${1}"
+}
 
-    _bootrom_tools_compile "common"
-    _bootrom_tools_compile "create-ffff"
+function bootrom_tools_compile()
+# Builds create-tftf and create-ffff in a copy of the bootrom-tools sources in
+# the build directory, shared by all the targets and images. They are built
+# once per session at most, and again only when the sources change.
+{
+    BOOTROM_TOOLS_BUILD_DIR="${BUILD_DIR_NAME}/.bootrom-tools"
+    ${BOOTROM_TOOLS_READY} && return
+
+    local stamp="${BOOTROM_TOOLS_BUILD_DIR}/.stamp"
+    local version=$(_bootrom_tools_version)
+
+    if [[ ! -r ${stamp} || "$(cat ${stamp})" != "${version}" ]]; then
+        echo_log 1 "# Compiling create-tftf and create-ffff in ${BOOTROM_TOOLS_BUILD_DIR}"
+        echo_remove_dir "${BOOTROM_TOOLS_BUILD_DIR}"
+        # timestamps are kept for make to see what is already up to date
+        run_log 2 cp -a ${BOOTROM_TOOLS_DIR} ${BOOTROM_TOOLS_BUILD_DIR} || \
+            die "Cannot copy ${BOOTROM_TOOLS_DIR} to ${BOOTROM_TOOLS_BUILD_DIR}"
+        _bootrom_tools_compile "common"
+        _bootrom_tools_compile "create-tftf"
+        _bootrom_tools_compile "create-ffff"
+        ${DRY_RUN} || echo "${version}" > "${stamp}"
+    fi
+    BOOTROM_TOOLS_READY=true
 }
 
 ### NuttX
@@ -387,55 +442,208 @@ function nuttx_configure()
         die "Could not install ${CONFIG_FILE}"
 }
 
-function nuttx_prepare()
+function _nuttx_tree_version()
+# prints a hash of the NuttX sources
 {
-    # Create directory hierarchy
-    BUILD_DIR_NUTTX="${BUILD_DIR_PATH}/nuttx"
-    echo_build_dir "${BUILD_DIR_NUTTX}"
+    _source_state ${NUTTX_DIR} 2>/dev/null | sha1sum | cut -d ' ' -f 1
+}
 
-    BUILD_DIR_OUT="${BUILD_DIR_PATH}/out"
-    echo_build_dir "${BUILD_DIR_OUT}"
+function nuttx_shared_tree()
+# Prepares a pristine, cleaned copy of the NuttX sources in the build
+# directory, which the targets then link to instead of copying the sources.
+# It is made again only when the sources change.
+{
+    NUTTX_SHARED_DIR="${BUILD_DIR_NAME}/.nuttx-src"
+    local stamp="${NUTTX_SHARED_DIR}/.stamp"
+    local version=${NUTTX_TREE_VERSION}
+
+    if [[ ! -r ${stamp} || "$(cat ${stamp})" != "${version}" ]]; then
+        echo_log 0 "### Preparing shared NuttX sources in ${NUTTX_SHARED_DIR}"
+        echo_remove_dir "${NUTTX_SHARED_DIR}"
+        _mk_dir "${NUTTX_SHARED_DIR}"
+        run_log 2 cp -r ${NUTTX_DIR}/nuttx ${NUTTX_DIR}/apps ${NUTTX_DIR}/misc \
+            ${NUTTX_SHARED_DIR} || die "Cannot copy ${NUTTX_DIR} to ${NUTTX_SHARED_DIR}"
+        run_log 2 make -C ${NUTTX_SHARED_DIR}/nuttx distclean || \
+            die "NuttX cleaning failed"
+        ${DRY_RUN} || echo "${version}" > "${stamp}"
+    fi
+
+    # Copy-on-write clones where the filesystem supports them, hard links
+    # otherwise. Hard links are safe because the NuttX build only creates
+    # or replaces files, and the shared copy holds no build output.
+    NUTTX_SHARED_CP="cp -rl"
+    if ! ${DRY_RUN} && \
+        cp --reflink=always "${stamp}" "${stamp}.reflink" 2>/dev/null; then
+        NUTTX_SHARED_CP="cp -r --reflink=always"
+    fi
+    rm -f "${stamp}.reflink"
+    echo_log 1 "# Sharing NuttX sources with '${NUTTX_SHARED_CP}'"
+}
 
+function _nuttx_inputs()
+# prints the target files the NuttX build of the target is made from
+{
+    echo "${FDK_DIR}/scripts/Make.defs"
+    echo "${CONFIG_FILE[@]/#/${TARGET_BASE}/}"
     if [[ -n ${MANIFEST_FILE} ]]; then
-        BUILD_DIR_MANIFEST="${BUILD_DIR_PATH}/manifest"
-        echo_build_dir "${BUILD_DIR_MANIFEST}"
+        echo "${MANIFEST_FILE/#/${TARGET_BASE}/}"
     fi
     if [[ -n ${BOARD_FILES} ]]; then
-        BUILD_DIR_MODULE="${BUILD_DIR_PATH}/module"
-        echo_build_dir "${BUILD_DIR_MODULE}"
+        printf '%s\n' "${BOARD_FILES[@]/#/${TARGET_BASE}/}"
     fi
+}
 
-    # Copy NuttX source code and user-specified code
-    echo_log 1 "# Copying NuttX files"
-    run_log 2 cp -r ${NUTTX_DIR}/nuttx ${BUILD_DIR_NUTTX}/nuttx || \
-        die "Cannot copy ${NUTTX_DIR}/nuttx directory"
-    run_log 2 cp -r ${NUTTX_DIR}/apps ${BUILD_DIR_NUTTX}/apps || \
-        die "Cannot copy ${NUTTX_DIR}/apps directory"
-    run_log 2 cp -r ${NUTTX_DIR}/misc ${BUILD_DIR_NUTTX}/misc || \
-        die "Cannot copy ${NUTTX_DIR}/misc directory"
+function _input_changed()
+# 1: path of a target file
+# returns 0 if its content changed since it was last copied, 1 otherwise
+{
+    ! grep -Fqx "$(sha1sum "${1}")" "${BUILD_DIR_NUTTX}/.inputs" 2>/dev/null
+}
 
+function _nuttx_tree_stamp()
+# prints what the NuttX sources of the build tree were copied from
+{
+    if ${SHARE_TREE}; then
+        echo "shared ${NUTTX_TREE_VERSION}"
+    else
+        echo "copy ${NUTTX_TREE_VERSION}"
+    fi
+}
+
+function nuttx_copy_target_files()
+{
     if [[ -n ${MANIFEST_FILE} ]]; then
+        echo_build_dir "${BUILD_DIR_MANIFEST}"
         echo_log 1 "# Copying manifest file"
         run_log 2 cp "${MANIFEST_FILE/#/${TARGET_BASE}/}" ${BUILD_DIR_MANIFEST} || \
             die "Cannot copy manifest file"
     fi
     if [[ -n ${BOARD_FILES} ]]; then
+        echo_build_dir "${BUILD_DIR_MODULE}"
         echo_log 1 "# Copying board-specific files"
         run_log 2 cp "${BOARD_FILES[@]/#/${TARGET_BASE}/}" ${BUILD_DIR_MODULE} || \
             die "Cannot boards-specific files"
     fi
+}
+
+function nuttx_record_inputs()
+# Records the NuttX sources and the content of the target files the build
+# tree was prepared from, for incremental builds
+{
+    ${DRY_RUN} && return
+    [[ -z ${NUTTX_TREE_VERSION} ]] && return
+
+    _nuttx_tree_stamp > "${BUILD_DIR_NUTTX}/.stamp"
+    sha1sum $(_nuttx_inputs) > "${BUILD_DIR_NUTTX}/.inputs" || \
+        die "Cannot hash the target files"
+}
+
+function nuttx_update()
+# Brings an existing build tree up to date with the target files: only the
+# files whose content changed are copied, so that make, which tracks the
+# dependencies of every object, rebuilds only what depends on them
+# returns 1 if the build tree cannot be reused
+{
+    [[ -d "${BUILD_DIR_NUTTX}/nuttx" ]] || return 1
+    [[ "$(cat "${BUILD_DIR_NUTTX}/.stamp" 2>/dev/null)" == \
+        "$(_nuttx_tree_stamp)" ]] || return 1
+    [[ -r "${BUILD_DIR_NUTTX}/.inputs" ]] || return 1
+
+    echo_log 1 "# Updating ${BUILD_DIR_NUTTX}"
 
-    # Clean NuttX
-    echo_log 1 "# Cleaning NuttX directory"
     local make_args=""
     if [[ ${VERBOSITY} -gt 2 ]]; then
         make_args="V=1"
     fi
-    run_log 2 make -C ${BUILD_DIR_NUTTX}/nuttx ${make_args} distclean || \
-        die "NuttX cleaning failed"
+
+    # A new configuration or set of board files can change which objects
+    # make up the image: objects are rebuilt from scratch, the NuttX
+    # sources are kept
+    local inputs=$(_nuttx_inputs)
+    if [[ "$(cut -d ' ' -f 3- "${BUILD_DIR_NUTTX}/.inputs")" != "${inputs}" ]] || \
+        _input_changed "${FDK_DIR}/scripts/Make.defs" || \
+        _input_changed "${CONFIG_FILE[@]/#/${TARGET_BASE}/}"; then
+        echo_log 1 "# Configuration changed, cleaning NuttX objects"
+        run_log 2 make -C ${BUILD_DIR_NUTTX}/nuttx ${make_args} clean || \
+            die "NuttX cleaning failed"
+        nuttx_configure "${BUILD_DIR_NUTTX}"
+        nuttx_copy_target_files
+        return 0
+    fi
+
+    local f
+    if [[ -n ${MANIFEST_FILE} ]]; then
+        f="${MANIFEST_FILE/#/${TARGET_BASE}/}"
+        if _input_changed "${f}"; then
+            echo_log 1 "# Copying changed ${f}"
+            run_log 2 cp "${f}" ${BUILD_DIR_MANIFEST} || \
+                die "Cannot copy manifest file"
+        fi
+    fi
+    if [[ -n ${BOARD_FILES} ]]; then
+        for f in "${BOARD_FILES[@]/#/${TARGET_BASE}/}"; do
+            if _input_changed "${f}"; then
+                echo_log 1 "# Copying changed ${f}"
+                run_log 2 cp "${f}" ${BUILD_DIR_MODULE} || \
+                    die "Cannot copy ${f}"
+            fi
+        done
+    fi
+    return 0
+}
+
+function nuttx_prepare()
+{
+    # Create directory hierarchy
+    BUILD_DIR_NUTTX="${BUILD_DIR_PATH}/nuttx"
+    BUILD_DIR_OUT="${BUILD_DIR_PATH}/out"
+    echo_build_dir "${BUILD_DIR_OUT}"
+
+    if [[ -n ${MANIFEST_FILE} ]]; then
+        BUILD_DIR_MANIFEST="${BUILD_DIR_PATH}/manifest"
+    fi
+    if [[ -n ${BOARD_FILES} ]]; then
+        BUILD_DIR_MODULE="${BUILD_DIR_PATH}/module"
+    fi
+
+    if ${INCREMENTAL} && nuttx_update; then
+        nuttx_record_inputs
+        return
+    fi
+
+    echo_build_dir "${BUILD_DIR_NUTTX}"
+
+    # Copy NuttX source code and user-specified code
+    local nuttx_src="${NUTTX_DIR}"
+    local nuttx_cp="cp -r"
+    if ${SHARE_TREE}; then
+        nuttx_src="${NUTTX_SHARED_DIR}"
+        nuttx_cp="${NUTTX_SHARED_CP}"
+    fi
+    echo_log 1 "# Copying NuttX files"
+    run_log 2 ${nuttx_cp} ${nuttx_src}/nuttx ${BUILD_DIR_NUTTX}/nuttx || \
+        die "Cannot copy ${nuttx_src}/nuttx directory"
+    run_log 2 ${nuttx_cp} ${nuttx_src}/apps ${BUILD_DIR_NUTTX}/apps || \
+        die "Cannot copy ${nuttx_src}/apps directory"
+    run_log 2 ${nuttx_cp} ${nuttx_src}/misc ${BUILD_DIR_NUTTX}/misc || \
+        die "Cannot copy ${nuttx_src}/misc directory"
+
+    nuttx_copy_target_files
+
+    # Clean NuttX, unless linked to the shared copy, which already is
+    if ! ${SHARE_TREE}; then
+        echo_log 1 "# Cleaning NuttX directory"
+        local make_args=""
+        if [[ ${VERBOSITY} -gt 2 ]]; then
+            make_args="V=1"
+        fi
+        run_log 2 make -C ${BUILD_DIR_NUTTX}/nuttx ${make_args} distclean || \
+            die "NuttX cleaning failed"
+    fi
 
     # Install the various files necessary for building
     nuttx_configure "${BUILD_DIR_NUTTX}"
+    nuttx_record_inputs
 }
 
 function nuttx_clean()
@@ -495,8 +703,33 @@ function _nuttx_export_vars()
     fi
     if [[ -n ${BOARD_FILES} ]]; then
         local pwd_module=$(cd ${BUILD_DIR_MODULE} >/dev/null && pwd)
-        export OOT_BOARD="${BOARD_FILES[@]/#/${pwd_module}/}"
+        # board files are copied side by side, whatever their path in the
+        # target directory (e.g. ../common/file.c)
+        local board_files=("${BOARD_FILES[@]##*/}")
+        export OOT_BOARD="${board_files[@]/#/${pwd_module}/}"
     fi
+    if ${CCACHE}; then
+        _export_ccache
+    fi
+}
+
+function _export_ccache()
+# sets up the object cache wrapper used by Make.defs
+{
+    local cache_dir="${FDK_CCACHE_DIR:-${BUILD_DIR_NAME}/.ccache}"
+    _mk_dir "${cache_dir}"
+
+    export FDK_CCACHE="${SCRIPT_PATH}/fdk-ccache.sh"
+    export FDK_CCACHE_DIR=$(cd "${cache_dir}" >/dev/null && pwd)
+    export FDK_CCACHE_BASEDIR=$(cd ${BUILD_DIR_PATH} >/dev/null && pwd)
+    export FDK_CCACHE_LOG="${FDK_CCACHE_BASEDIR}/ccache.log"
+}
+
+function _ccache_report()
+{
+    local hits=$(grep -c '^hit ' "${FDK_CCACHE_LOG}" 2>/dev/null)
+    local misses=$(grep -c '^miss ' "${FDK_CCACHE_LOG}" 2>/dev/null)
+    echo_log 1 "# Object cache: ${hits:-0} hits, ${misses:-0} misses"
 }
 
 function nuttx_make()
@@ -507,8 +740,14 @@ function nuttx_make()
     if [[ ${VERBOSITY} -gt 2 ]]; then
         make_args="V=1"
     fi
+    if ${CCACHE}; then
+        rm -f "${FDK_CCACHE_LOG}"
+    fi
     run_log 2 make -C ${BUILD_DIR_NUTTX}/nuttx -r -f Makefile.unix ${make_args} || \
         die "NuttX compilation failed"
+    if ${CCACHE}; then
+        _ccache_report
+    fi
 }
 
 function _nuttx_get_config()
@@ -625,7 +864,7 @@ function _create_nuttx_tftf()
 # 4: extra arguments to the create-tftf command
 {
     echo_log 1 "# Create TFTF image from ${1} to ${2}"
-    run_log 2 ${BOOTROM_TOOLS_DIR}/bin/create-tftf \
+    run_log 2 ${BOOTROM_TOOLS_BUILD_DIR}/bin/create-tftf \
         --verbose \
         --type s2fw \
         --name "${TARGET_NAME}" \
@@ -643,7 +882,7 @@ function _create_nuttx_ffff()
 # 2: path of output ffff binary
 {
     echo_log 1 "# Create FFFF image from ${1} to ${2}"
-    run_log 2 ${BOOTROM_TOOLS_DIR}/bin/create-ffff \
+    run_log 2 ${BOOTROM_TOOLS_BUILD_DIR}/bin/create-ffff \
         --verbose \
         --name "${TARGET_NAME}" \
         --header-size 0x1000 \
@@ -775,8 +1014,7 @@ function nuttx_image_create()
                             local nuttx_elf="${BUILD_DIR_OUT}/nuttx.elf"
                             local nuttx_ffff="${BUILD_DIR_OUT}/nuttx-${TARGET_NAME}-${VERSION_CUR}.ffff"
                             nuttx_copy_binary "nuttx" "${nuttx_elf}"
-                            bootrom_tools_compile_create_tftf
-                            bootrom_tools_compile_create_ffff
+                            bootrom_tools_compile
                             create_nuttx_ffff_frame "${nuttx_elf}" "${nuttx_ffff}"
                             truncate_binary_file "${nuttx_ffff}"
                             rm_binary_file "${nuttx_elf}"
@@ -791,13 +1029,13 @@ function nuttx_image_create()
         local nuttx_elf="${BUILD_DIR_OUT}/nuttx.elf"
         local nuttx_tftf nuttx_ffff
         nuttx_copy_binary "nuttx" "${nuttx_elf}"
+        bootrom_tools_compile
 
         # Module firmware (ES2, ES3)
         for VERSION_CUR in ${VERSION[@]}; do
             case "${VERSION_CUR}" in
                 es2)
                     for TYPE_CUR in ${TYPE[@]}; do
-                        bootrom_tools_compile_create_tftf
                         create_nuttx_tftf_module "${nuttx_elf}" nuttx_tftf
                         image_congrats "Module ES2" "${nuttx_tftf}"
                         nuttx_tftf=
@@ -805,8 +1043,6 @@ function nuttx_image_create()
                     ;;
                 es3)
                     for TYPE_CUR in ${TYPE[@]}; do
-                        bootrom_tools_compile_create_tftf
-                        bootrom_tools_compile_create_ffff
                         create_nuttx_tftf_module "${nuttx_elf}" nuttx_tftf
                         image_congrats "Module ES3" "${nuttx_tftf}"
                         create_nuttx_ffff_module "${nuttx_elf}" nuttx_ffff "${nuttx_tftf}"
@@ -955,7 +1191,7 @@ function cmd_nuttx_configure()
 function parse_cmdline()
 {
     # parse the options first
-    while getopts ":hvb:nj:k" arg; do
+    while getopts ":hvb:nj:klic" arg; do
         case ${arg} in
             h)
                 usage | more -df >&2
@@ -973,6 +1209,20 @@ function parse_cmdline()
             k)
                 KEEP_INTER=true
                 ;;
+            j)
+                [[ "${OPTARG}" =~ ^[1-9][0-9]*$ ]] || \
+                    die "Option -j expects a positive number of jobs"
+                JOBS=${OPTARG}
+                ;;
+            l)
+                SHARE_TREE=true
+                ;;
+            i)
+                INCREMENTAL=true
+                ;;
+            c)
+                CCACHE=true
+                ;;
             :)
                 die "Option -${OPTARG} requires an argument"
                 ;;
@@ -1019,34 +1269,119 @@ function parse_cmdline()
     [[ -z ${TARGETS[@]} ]] && die "Expecting at least a target..."
 }
 
+function run_target()
+# runs CMD on TARGET
+{
+    TARGET_BASE=$(dirname "${TARGET}")
+    TARGET_NAME=$(basename "${TARGET_BASE}")
+    case ${CMD} in
+        clean)
+            cmd_clean
+            ;;
+        build)
+            cmd_build
+            ;;
+        menuconfig)
+            cmd_menuconfig
+            ;;
+        updateconfig)
+            cmd_updateconfig
+            ;;
+        s1boot)
+            cmd_s1boot
+            ;;
+        s2boot)
+            die "Unimplemented"
+            ;;
+        nuttx_configure)
+            cmd_nuttx_configure
+            ;;
+    esac
+}
+
+function run_command_parallel()
+{
+    # each target builds in its own directory; 'die' only ends the subshell
+    # of its target
+    local job_dir
+    job_dir=$(mktemp -d) || die "Cannot create a temporary directory"
+
+    local targets=() pids=() status=() failed=()
+    local i
+
+    for TARGET in "${TARGETS[@]}"; do
+        if list_contains "${TARGET}" "${targets[@]}"; then
+            echo_log 0 "Warning: ${TARGET} listed twice, building it once"
+            continue
+        fi
+        targets+=("${TARGET}")
+    done
+
+    echo_log 0 "### Running ${CMD} on ${#targets[@]} targets, ${JOBS} at a time"
+
+    for i in "${!targets[@]}"; do
+        while [[ $(jobs -pr | wc -l) -ge ${JOBS} ]]; do
+            wait -n
+        done
+        TARGET="${targets[i]}"
+        ( run_target ) < /dev/null > "${job_dir}/${i}.out" 2>&1 &
+        pids[i]=${!}
+    done
+
+    for i in "${!targets[@]}"; do
+        wait ${pids[i]}
+        status[i]=${?}
+    done
+
+    # print the outputs and the summary in the order of the command line
+    for i in "${!targets[@]}"; do
+        cat "${job_dir}/${i}.out"
+    done
+    rm -rf "${job_dir}"
+
+    echo "### Summary"
+    for i in "${!targets[@]}"; do
+        if [[ ${status[i]} -eq 0 ]]; then
+            echo "    ok      ${targets[i]}"
+        else
+            echo "    FAILED  ${targets[i]}" \
+                "(see ${BUILD_DIR_NAME}/$(dirname "${targets[i]}")/build.log)"
+            failed+=("${targets[i]}")
+        fi
+    done
+
+    [[ ${#failed[@]} -eq 0 ]] || \
+        die "${#failed[@]} of ${#targets[@]} targets failed"
+}
+
 function run_command()
 {
+    # the NuttX sources are checked, and the shared copy is prepared, once
+    # before any target uses them
+    if ${SHARE_TREE} || ${INCREMENTAL}; then
+        NUTTX_TREE_VERSION=$(_nuttx_tree_version)
+    fi
+    if ${SHARE_TREE} && \
+        list_contains "${CMD}" "build" "menuconfig" "updateconfig"; then
+        build_topdir true
+        nuttx_shared_tree
+    fi
+
+    # interactive commands and commands sharing the NuttX source directory
+    # always run one target at a time
+    if [[ ${JOBS} -gt 1 && ${#TARGETS[@]} -gt 1 ]] && \
+        list_contains "${CMD}" "build" "s1boot"; then
+        # the jobs then find the bootrom tools ready
+        if [[ "${CMD}" == "build" && -d ${BOOTROM_TOOLS_DIR} ]]; then
+            build_topdir true
+            bootrom_tools_compile
+        fi
+        run_command_parallel
+        return
+    fi
+
     for TARGET in "${TARGETS[@]}"; do
-        TARGET_BASE=$(dirname "${TARGET}")
-        TARGET_NAME=$(basename "${TARGET_BASE}")
-        case ${CMD} in
-            clean)
-                cmd_clean
-                ;;
-            build)
-                cmd_build
-                ;;
-            menuconfig)
-                cmd_menuconfig
-                ;;
-            updateconfig)
-                cmd_updateconfig
-                ;;
-            s1boot)
-                cmd_s1boot
-                ;;
-            s2boot)
-                die "Unimplemented"
-                ;;
-            nuttx_configure)
-                cmd_nuttx_configure
-                ;;
-        esac
+        run_target
     done
 }
 